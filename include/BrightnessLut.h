@@ -0,0 +1,55 @@
+#pragma once
+#include <array>
+#include "Hal.h"
+
+// Luminosità percepita 0-100 -> duty, calcolata in compilazione per ogni risoluzione del LEDC.
+// La curva è la lightness CIE 1931 (L*): uguali passi percentuali appaiono uguali all'occhio.
+// I valori sono in duty fine, con 4 bit frazionari sotto l'LSB: il LEDC li usa per il
+// dithering in hardware (vedi hal::pwmSetDutyFine), senza dithering si arrotonda all'intero.
+namespace BrightnessLut {
+
+constexpr uint8_t FRACTION_BITS = 4;
+constexpr size_t LEVELS = 101;
+
+constexpr double luminance(double lightness) {
+    if (lightness <= 8.0) {
+        return lightness / 903.3;
+    }
+    double t = (lightness + 16.0) / 116.0;
+    return t * t * t;
+}
+
+template <ledc_timer_bit_t BITS>
+constexpr std::array<uint32_t, LEVELS> build() {
+    std::array<uint32_t, LEVELS> table{};
+    constexpr double fullScale = static_cast<double>(((1u << BITS) - 1) << FRACTION_BITS);
+    for (size_t level = 0; level < LEVELS; ++level) {
+        table[level] = static_cast<uint32_t>(luminance(static_cast<double>(level)) * fullScale + 0.5);
+    }
+    return table;
+}
+
+template <ledc_timer_bit_t BITS>
+inline constexpr std::array<uint32_t, LEVELS> table = build<BITS>();
+
+static_assert(table<LEDC_TIMER_10_BIT>[0] == 0, "livello 0 deve essere spento");
+static_assert(table<LEDC_TIMER_10_BIT>[100] == 1023u << FRACTION_BITS, "livello 100 deve essere il duty massimo");
+static_assert(table<LEDC_TIMER_10_BIT>[1] > 0, "il primo livello deve restare acceso con il dithering");
+
+// La risoluzione del LedController è scelta a runtime: si prende la tabella una volta sola
+inline const uint32_t* forResolution(ledc_timer_bit_t bits) {
+    switch (bits) {
+    case LEDC_TIMER_8_BIT: return table<LEDC_TIMER_8_BIT>.data();
+    case LEDC_TIMER_9_BIT: return table<LEDC_TIMER_9_BIT>.data();
+    case LEDC_TIMER_10_BIT: return table<LEDC_TIMER_10_BIT>.data();
+    case LEDC_TIMER_11_BIT: return table<LEDC_TIMER_11_BIT>.data();
+    case LEDC_TIMER_12_BIT: return table<LEDC_TIMER_12_BIT>.data();
+    case LEDC_TIMER_13_BIT: return table<LEDC_TIMER_13_BIT>.data();
+    case LEDC_TIMER_14_BIT: return table<LEDC_TIMER_14_BIT>.data();
+    case LEDC_TIMER_15_BIT: return table<LEDC_TIMER_15_BIT>.data();
+    case LEDC_TIMER_16_BIT: return table<LEDC_TIMER_16_BIT>.data();
+    default: return nullptr;  // risoluzioni troppo basse per una curva percettiva
+    }
+}
+
+}  // namespace BrightnessLut
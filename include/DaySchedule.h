@@ -0,0 +1,41 @@
+#pragma once
+#include <stdint.h>
+
+// Calcolo di giorno/notte senza dipendenze dall'hardware né dal fuso di sistema,
+// per poterlo verificare su host con qualsiasi data.
+
+// Impostazioni dell'orario salvate in NVS
+struct TimeSettings {
+    static const uint8_t VERSION = 1;
+
+    uint8_t version;
+    bool hasLocation;       // con la posizione la notte va dal tramonto all'alba
+    uint16_t nightStartMin; // senza posizione: orari fissi, in minuti locali dalla mezzanotte
+    uint16_t nightEndMin;
+    int32_t utcOffsetSec;   // offset del fuso all'ultimo lookup, ora legale compresa
+    float latitude;
+    float longitude;
+
+    static TimeSettings defaults();
+};
+
+// Stato attuale e istante UTC del prossimo cambio
+struct DayNight {
+    bool night;
+    uint32_t nextChange;
+};
+
+// Alba e tramonto in minuti UTC dalla mezzanotte UTC del giorno (possono uscire da 0-1439)
+struct SunTimes {
+    bool valid;  // false nei giorni senza alba o senza tramonto, oltre i circoli polari
+    int32_t sunriseMin;
+    int32_t sunsetMin;
+};
+
+int32_t daysFromCivil(int32_t year, uint32_t month, uint32_t day);
+void civilFromDays(int32_t days, int32_t& year, uint32_t& month, uint32_t& day);
+
+// Algoritmo NOAA semplificato, precisione di un paio di minuti alle nostre latitudini
+SunTimes sunTimes(int32_t days, float latitude, float longitude);
+
+DayNight computeDayNight(uint32_t utcNow, const TimeSettings& settings);
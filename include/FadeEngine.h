@@ -0,0 +1,94 @@
+#pragma once
+#include <atomic>
+#include "Hal.h"
+
+// Curve di fade; le non lineari sono spezzate in segmenti lineari eseguiti dal fade hardware
+enum class FadeCurve : uint8_t {
+    LINEAR,
+    EXPONENTIAL,
+    EASE_IN_OUT,
+};
+
+// Scheduler di fade persistente per uno o più canali: un solo timer riusato per tutti i fade
+// e tutti i canali, con annullamento, cambio di destinazione in corsa e duty reale sempre
+// disponibile. I duty sono fini (4 bit frazionari, vedi BrightnessLut).
+// Con un canale i fade sono eseguiti dal fade hardware; con più canali, o con il dithering
+// nella zona bassa, si procede a frame software: a ogni frame i duty di tutti i canali sono
+// calcolati sullo stesso istante e applicati insieme, così i canali non si sfasano mai.
+class FadeEngine {
+public:
+    using Callback = void (*)(void* arg);
+    // Inoltro dello scatto del timer al task proprietario; generation identifica il fade
+    using TimerHook = void (*)(void* arg, uint32_t generation);
+
+    static const uint8_t MAX_CHANNELS = 4;
+    static const uint8_t MAX_SEGMENTS = 8;
+    static const uint16_t KNOT_ONE = 4096;      // Q12: 1.0
+    static const uint32_t MIN_SEGMENT_MS = 20;   // sotto questa durata la curva degrada a lineare
+    static const uint8_t FRACTION_BITS = 4;
+    static const uint32_t DITHER_BELOW_DUTY = 128;  // sopra, un LSB è sotto l'1% e non si vede
+    static const uint32_t FRAME_MS = 10;
+
+    explicit FadeEngine(ledc_channel_t channel);
+    FadeEngine(const ledc_channel_t* channels, uint8_t count);
+    // Con un hook il timer non tocca il fade: lo scatto va consegnato a handleTimer
+    void begin(Callback onComplete = nullptr, void* arg = nullptr, TimerHook hook = nullptr);
+    // Uno scatto di un fade già sostituito (generazione diversa) viene ignorato
+    void handleTimer(uint32_t generation);
+    void setDithering(bool enabled) { dithering = enabled; }
+
+    // Parte dai duty attuali, anche se un altro fade è in corso; un duty per canale
+    void start(const uint32_t* targetFineDuties, uint32_t durationMs, FadeCurve curve = FadeCurve::LINEAR);
+    void set(const uint32_t* fineDuties);
+    // Scorciatoie per un solo canale
+    void start(uint32_t targetFineDuty, uint32_t durationMs, FadeCurve curve = FadeCurve::LINEAR);
+    void set(uint32_t fineDuty);
+    void cancel();  // Congela i duty dove si trovano
+
+    // Calcola e applica il frame attuale; la chiama il timer nei fade a frame
+    void renderFrame();
+
+    uint8_t getChannelCount() const { return count; }
+    uint32_t currentFineDuty(uint8_t index = 0) const;
+    uint32_t currentDuty(uint8_t index = 0) const { return currentFineDuty(index) >> FRACTION_BITS; }
+    uint32_t getTargetDuty(uint8_t index = 0) const { return toDuty[index] >> FRACTION_BITS; }
+    bool isActive() const { return active; }
+    uint32_t getStartCount() const { return starts; }  // fade avviati, esclusi i set
+    uint64_t getStartUs() const { return startUs; }
+    uint32_t getDurationMs() const { return segmentMs * segments; }
+    // Curva eseguita davvero: sotto MIN_SEGMENT_MS per segmento diventa lineare
+    FadeCurve getCurve() const { return curve; }
+    uint32_t getSegmentMs() const { return segmentMs; }
+
+    // Posizione sulla curva (Q12) a elapsedUs dall'inizio del fade: serve anche a chi legge lo
+    // stato pubblicato da un altro task, senza toccare il fade
+    static uint32_t knotAt(FadeCurve curve, uint32_t segmentMs, uint64_t elapsedUs);
+
+private:
+    static void onTimer(void* arg);
+    void startSegment();
+    void output(const uint32_t* fineDuties);
+    void finish();
+    static const uint16_t* knotsOf(FadeCurve curve, uint8_t& segmentCount);
+    uint32_t currentKnot() const;
+    uint32_t dutyAtKnot(uint8_t index, uint32_t knot) const;
+
+    ledc_channel_t channels[MAX_CHANNELS];
+    uint8_t count;
+    hal::Timer timer;
+    Callback onComplete;
+    void* onCompleteArg;
+    TimerHook timerHook;
+    std::atomic<uint32_t> generation;  // letta dal task del timer
+    uint32_t fromDuty[MAX_CHANNELS];
+    uint32_t toDuty[MAX_CHANNELS];
+    uint64_t startUs;
+    uint32_t segmentMs;
+    FadeCurve curve;
+    uint8_t segments;
+    uint8_t segment;
+    bool stepped;  // fade a frame software con duty fini
+    bool dithering;
+    volatile bool active;
+    uint32_t starts;
+};
@@ -0,0 +1,88 @@
+#pragma once
+#include "Hal.h"
+#include "LD2410Parser.h"
+
+// Soglie di energia per gate del LD2410 (0-100): sopra, il gate vede un bersaglio
+struct GateThresholds {
+    uint8_t moving[LD2410Frame::GATES];
+    uint8_t stationary[LD2410Frame::GATES];
+};
+
+// Media e varianza in streaming (Welford): memoria fissa, nessun campione conservato
+struct RunningStats {
+    uint32_t count;
+    float mean;
+    float m2;    // somma dei quadrati degli scarti dalla media
+    uint8_t max;
+
+    void reset();
+    void add(uint8_t sample);
+    // Variante esponenziale per il fondo: peso 1/2^shift al nuovo campione, count resta fermo.
+    // Il campione è limitato a limit; il massimo segue solo i campioni sotto il limite
+    void track(uint8_t sample, uint8_t limit, uint8_t shift);
+    float variance() const { return count > 1 ? m2 / (count - 1) : 0.0f; }
+};
+
+// Soglie e fondo in NVS come blob versionato: dopo un riavvio il fondo riprende dall'ultimo salvataggio
+struct GateCalibration {
+    static const uint8_t VERSION = 1;
+
+    uint8_t version;
+    uint8_t reserved[3];
+    GateThresholds thresholds;
+    RunningStats moving[LD2410Frame::GATES];
+    RunningStats stationary[LD2410Frame::GATES];
+};
+
+// Calibrazione delle soglie per gate dalle energie dei frame engineering. In una finestra a
+// stanza vuota raccoglie media, varianza e massimo di ogni gate e ne ricava le soglie: sopra il
+// fondo di ventilatori, tende e climatizzatore, che altrimenti svegliano la lampada da SLEEP.
+// Dopo la calibrazione, a lampada spenta, il fondo continua a seguire la stanza lentamente:
+// i campioni sono limitati alla soglia corrente, così chi entra non alza il fondo di colpo, e il
+// massimo scende di un'unità ogni 2^TRACK_SHIFT frame se la sorgente che l'ha fissato sparisce.
+// Da un solo task: quello del radar.
+class GateCalibrator {
+public:
+    static const uint8_t GATES = LD2410Frame::GATES;
+    static const uint32_t MIN_FRAMES = 300;           // 30 s di frame engineering a 10 frame/s
+    static const uint8_t MARGIN = 5;
+    static const uint8_t SIGMAS = 1;                  // margine in più sui gate rumorosi, in deviazioni standard
+    static const uint8_t MIN_THRESHOLD = 10;
+    static const uint8_t MAX_THRESHOLD = 100;         // gate di fatto escluso
+    static const uint8_t TRACK_SHIFT = 12;            // fondo con costante di tempo ~7 min a 10 frame/s
+    static const uint32_t TRACK_CHECK_FRAMES = 36000;  // soglie ricalcolate al massimo una volta all'ora
+    static const uint8_t TRACK_MIN_STEP = 3;           // sotto questo scarto non si riscrive il radar
+
+    GateCalibrator();
+
+    // Calibrazione da NVS; false se non ce n'è e restano le soglie di fabbrica
+    bool begin(const char* settingsKey);
+    // La stanza resta vuota per durationMs: statistiche da zero
+    void start(uint32_t durationMs);
+    bool isCalibrating() const { return calibrating; }
+    bool isCalibrated() const { return calibrated; }
+
+    // Un frame engineering; background se la lampada è spenta di notte e il fondo può seguire la stanza
+    void update(const LD2410Frame& frame, bool background, uint32_t nowMs);
+    // Soglie nuove da scrivere sul radar (fine calibrazione o fondo cambiato); false se nessuna
+    bool takeThresholds(GateThresholds& out);
+    const GateThresholds& getThresholds() const { return data.thresholds; }
+    const RunningStats& getMovingStats(uint8_t gate) const { return data.moving[gate]; }
+    const RunningStats& getStationaryStats(uint8_t gate) const { return data.stationary[gate]; }
+
+    // Il massimo visto più il margine, allargato di SIGMAS deviazioni standard
+    static uint8_t thresholdFor(const RunningStats& stats);
+
+private:
+    void derive(GateThresholds& out) const;
+    void persist();
+
+    GateCalibration data;
+    const char* settingsKey;
+    uint32_t startMs;
+    uint32_t durationMs;
+    uint32_t trackedFrames;
+    bool calibrating;
+    bool calibrated;
+    bool pending;
+};
@@ -0,0 +1,442 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// Hardware abstraction layer: orologi, canale PWM, timer, UART, flash, rete, impostazioni e log.
+// Su ESP32 delega ad Arduino/ESP-IDF, con SMARTLAMP_NATIVE gira su Linux
+// con un orologio virtuale che avanza solo quando lo chiede il chiamante.
+
+#ifdef SMARTLAMP_NATIVE
+// Tipi LEDC equivalenti a quelli di driver/ledc.h, per compilare le stesse classi su host
+typedef enum {
+    LEDC_CHANNEL_0 = 0,
+    LEDC_CHANNEL_1,
+    LEDC_CHANNEL_2,
+    LEDC_CHANNEL_3,
+    LEDC_CHANNEL_4,
+    LEDC_CHANNEL_5,
+    LEDC_CHANNEL_6,
+    LEDC_CHANNEL_7,
+    LEDC_CHANNEL_MAX,
+} ledc_channel_t;
+
+typedef enum {
+    LEDC_TIMER_0 = 0,
+    LEDC_TIMER_1,
+    LEDC_TIMER_2,
+    LEDC_TIMER_3,
+    LEDC_TIMER_MAX,
+} ledc_timer_t;
+
+typedef enum {
+    LEDC_TIMER_1_BIT = 1,
+    LEDC_TIMER_2_BIT,
+    LEDC_TIMER_3_BIT,
+    LEDC_TIMER_4_BIT,
+    LEDC_TIMER_5_BIT,
+    LEDC_TIMER_6_BIT,
+    LEDC_TIMER_7_BIT,
+    LEDC_TIMER_8_BIT,
+    LEDC_TIMER_9_BIT,
+    LEDC_TIMER_10_BIT,
+    LEDC_TIMER_11_BIT,
+    LEDC_TIMER_12_BIT,
+    LEDC_TIMER_13_BIT,
+    LEDC_TIMER_14_BIT,
+    LEDC_TIMER_15_BIT,
+    LEDC_TIMER_16_BIT,
+    LEDC_TIMER_BIT_MAX,
+} ledc_timer_bit_t;
+
+#ifndef IRAM_ATTR
+#define IRAM_ATTR
+#endif
+
+#include <mutex>
+#else
+#include <Arduino.h>
+#include "driver/ledc.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "esp_pm.h"
+#endif
+
+namespace hal {
+
+// Orologio
+uint32_t millis();
+uint64_t micros();
+void delay(uint32_t ms);
+// Contatore di cicli della CPU per i tratti brevi di codice; si riavvolge in ~18 s a 240 MHz
+uint32_t cycles();
+uint32_t cyclesPerUs();
+
+// Task e memoria, letti dalle metriche
+using TaskHandle = void*;
+TaskHandle currentTask();
+uint32_t taskStackFree(TaskHandle task);  // minimo storico di stack libero, in byte
+// Tempo di CPU totale del task dai run-time stats di FreeRTOS, in µs (si riavvolge); false se non
+// sono attivi nella configurazione del core
+bool taskRunTimeUs(TaskHandle task, uint32_t& us);
+uint32_t heapFree();
+uint32_t heapMinFree();  // minimo storico dall'avvio
+uint32_t heapLargestFree();  // blocco libero più grande: scende con la frammentazione
+
+// Canale PWM (LEDC high speed); hpoint sposta l'inizio dell'impulso nel periodo
+void pwmBegin(uint8_t pin, ledc_channel_t channel, ledc_timer_t timer, uint32_t freq, ledc_timer_bit_t resolution,
+              uint32_t hpoint = 0);
+void pwmSetDuty(ledc_channel_t channel, uint32_t duty);
+void pwmFadeTo(ledc_channel_t channel, uint32_t duty, uint32_t durationMs);
+uint32_t pwmGetDuty(ledc_channel_t channel);
+// Duty con 4 bit frazionari: il LEDC allunga l'impulso di un ciclo in frac periodi su 16,
+// un dithering in hardware che porta la risoluzione effettiva a 14 bit con timer a 10 bit
+void pwmSetDutyFine(ledc_channel_t channel, uint32_t fineDuty);
+// Duty fini di più canali applicati insieme: prima tutti i registri, poi tutti gli aggiornamenti
+void pwmSetDutiesFine(const ledc_channel_t* channels, const uint32_t* fineDuties, uint8_t count);
+
+#ifdef SMARTLAMP_NATIVE
+namespace native {
+    uint64_t nextTimerDeadline();
+}
+#endif
+
+// Timer one-shot/periodico, creato una volta e riusato
+class Timer {
+public:
+    using Callback = void (*)(void* arg);
+
+    Timer();
+    ~Timer();
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+
+    bool create(Callback callback, void* arg, const char* name);
+    void startOnce(uint64_t timeoutUs);
+    void startPeriodic(uint64_t periodUs);
+    void stop();
+    bool isActive() const;
+
+private:
+#ifdef SMARTLAMP_NATIVE
+    friend void fireNativeTimers(uint64_t untilUs);
+    friend uint64_t native::nextTimerDeadline();
+    Callback callback;
+    void* arg;
+    uint64_t deadlineUs;
+    uint64_t periodUs;
+    bool active;
+    Timer* next;
+#else
+    esp_timer_handle_t handle;
+#endif
+};
+
+// Sorgente di byte UART. Su ESP32 usa il driver IDF con la coda eventi: il FIFO rx
+// e il timeout di linea inattiva svegliano chi attende a fine frame, senza polling.
+class Uart {
+public:
+    explicit Uart(uint8_t port);
+    void begin(uint32_t baud, int rxPin = -1, int txPin = -1);
+    size_t available();
+    int read();
+    size_t read(uint8_t* dst, size_t len);
+    size_t write(const uint8_t* data, size_t len);
+    // Attende byte ricevuti o un overrun; false al timeout
+    bool waitForData(uint32_t timeoutMs);
+    // Ricezione sospesa: i byte in arrivo vengono scartati senza interrupt, e chi attende resta fermo.
+    // Alla ripresa il buffer riparte vuoto
+    void setRxEnabled(bool enabled);
+    uint32_t getOverruns() const { return overruns; }
+#ifdef SMARTLAMP_NATIVE
+    // Accoda byte come se arrivassero dal filo
+    size_t inject(const uint8_t* data, size_t len);
+#endif
+
+private:
+    uint8_t port;
+    uint32_t overruns;
+#ifdef SMARTLAMP_NATIVE
+    static const size_t BUFFER_SIZE = 4096;
+    uint8_t buffer[BUFFER_SIZE];
+    size_t head;
+    size_t tail;
+    bool rxEnabled;
+#else
+    QueueHandle_t eventQueue;
+#endif
+};
+
+// Coda di elementi a dimensione fissa, senza heap. Su ESP32 è una coda FreeRTOS statica;
+// su host non blocca mai (è il chiamante a far avanzare l'orologio virtuale) ed è protetta
+// da un mutex, per i test con più thread.
+template <typename T, size_t N>
+class Queue {
+public:
+    static const uint32_t WAIT_FOREVER = UINT32_MAX;
+
+    Queue();
+    Queue(const Queue&) = delete;
+    Queue& operator=(const Queue&) = delete;
+
+    bool send(const T& item);  // Non bloccante: false se la coda è piena
+    bool sendFromIsr(const T& item);  // Come send, da una routine di interrupt
+    bool receive(T& item, uint32_t timeoutMs);
+    size_t size() const;
+
+private:
+#ifdef SMARTLAMP_NATIVE
+    T items[N];
+    size_t head;
+    size_t count;
+    mutable std::mutex mutex;
+#else
+    StaticQueue_t control;
+    uint8_t storage[N * sizeof(T)];
+    QueueHandle_t handle;
+#endif
+};
+
+#ifdef SMARTLAMP_NATIVE
+template <typename T, size_t N>
+Queue<T, N>::Queue() : head(0), count(0) {}
+
+template <typename T, size_t N>
+bool Queue<T, N>::send(const T& item) {
+    std::lock_guard<std::mutex> guard(mutex);
+    if (count == N) {
+        return false;
+    }
+    items[(head + count) % N] = item;
+    ++count;
+    return true;
+}
+
+template <typename T, size_t N>
+bool Queue<T, N>::sendFromIsr(const T& item) {
+    return send(item);
+}
+
+template <typename T, size_t N>
+bool Queue<T, N>::receive(T& item, uint32_t) {
+    std::lock_guard<std::mutex> guard(mutex);
+    if (count == 0) {
+        return false;
+    }
+    item = items[head];
+    head = (head + 1) % N;
+    --count;
+    return true;
+}
+
+template <typename T, size_t N>
+size_t Queue<T, N>::size() const {
+    std::lock_guard<std::mutex> guard(mutex);
+    return count;
+}
+#else
+template <typename T, size_t N>
+Queue<T, N>::Queue() {
+    handle = xQueueCreateStatic(N, sizeof(T), storage, &control);
+}
+
+template <typename T, size_t N>
+bool Queue<T, N>::send(const T& item) {
+    return xQueueSend(handle, &item, 0) == pdTRUE;
+}
+
+template <typename T, size_t N>
+bool Queue<T, N>::sendFromIsr(const T& item) {
+    BaseType_t woken = pdFALSE;
+    bool sent = xQueueSendFromISR(handle, &item, &woken) == pdTRUE;
+    if (woken == pdTRUE) {
+        portYIELD_FROM_ISR();
+    }
+    return sent;
+}
+
+template <typename T, size_t N>
+bool Queue<T, N>::receive(T& item, uint32_t timeoutMs) {
+    TickType_t ticks = timeoutMs == WAIT_FOREVER ? portMAX_DELAY : pdMS_TO_TICKS(timeoutMs);
+    return xQueueReceive(handle, &item, ticks) == pdTRUE;
+}
+
+template <typename T, size_t N>
+size_t Queue<T, N>::size() const {
+    return uxQueueMessagesWaiting(handle);
+}
+#endif
+
+// Sezione critica breve, valida tra i due core e dai callback dei timer
+class SpinLock {
+public:
+    SpinLock();
+    void lock();
+    void unlock();
+
+private:
+#ifdef SMARTLAMP_NATIVE
+    volatile bool locked;
+#else
+    portMUX_TYPE mux;
+#endif
+};
+
+class LockGuard {
+public:
+    explicit LockGuard(SpinLock& lock) : lock(lock) { lock.lock(); }
+    ~LockGuard() { lock.unlock(); }
+    LockGuard(const LockGuard&) = delete;
+    LockGuard& operator=(const LockGuard&) = delete;
+
+private:
+    SpinLock& lock;
+};
+
+// Partizione dati in flash usata senza filesystem. La scrittura segue la semantica NOR:
+// può solo portare bit da 1 a 0, per tornare a 0xFF serve cancellare il settore.
+class Partition {
+public:
+    static const size_t SECTOR_SIZE = 4096;
+
+    Partition();
+    // Una finestra della partizione, allineata ai settori: gli offset partono da offset.
+    // length 0 arriva fino alla fine, così più registri si dividono la stessa partizione
+    bool open(const char* label, size_t offset = 0, size_t length = 0);
+    size_t size() const;
+    bool read(size_t offset, void* dst, size_t len) const;
+    bool write(size_t offset, const void* src, size_t len);
+    bool eraseSector(size_t offset);
+#ifdef SMARTLAMP_NATIVE
+    // Su host la partizione è un'immagine in memoria, caricabile da un dump della flash
+    static const size_t NATIVE_SIZE = 0x20000;
+    bool loadImage(const char* path);
+    bool saveImage(const char* path) const;
+    // Interruzione dell'alimentazione: dopo operations scritture o cancellazioni le successive si
+    // perdono e falliscono, UINT32_MAX per nessuna. Le operazioni si contano da open
+    void cutPowerAfter(uint32_t operations) { powerLeft = operations; }
+    uint32_t getOperations() const { return operations; }
+#endif
+
+private:
+    size_t base;
+    size_t length;
+#ifdef SMARTLAMP_NATIVE
+    bool powered();
+
+    uint32_t operations;
+    uint32_t powerLeft;
+    uint8_t image[NATIVE_SIZE];
+#else
+    const esp_partition_t* partition;
+#endif
+};
+
+// Gestione dell'energia di ESP-IDF: frequenza dinamica tra minMhz e maxMhz e, se richiesto, light
+// sleep automatico quando tutti i task sono fermi. false se il firmware non la supporta affatto;
+// lightSleepEnabled dice se c'è anche il light sleep, che richiede il tickless idle di FreeRTOS
+bool powerConfigure(uint32_t maxMhz, uint32_t minMhz, bool lightSleep, bool& lightSleepEnabled);
+
+// Finché un lock è tenuto la gestione dell'energia non scende sotto il suo livello
+class PowerLock {
+public:
+    enum Type : uint8_t {
+        CPU_MAX,         // frequenza massima
+        NO_LIGHT_SLEEP,  // niente light sleep automatico
+    };
+
+    PowerLock();
+    ~PowerLock();
+    PowerLock(const PowerLock&) = delete;
+    PowerLock& operator=(const PowerLock&) = delete;
+    bool create(Type type, const char* name);
+    void acquire();
+    void release();
+    bool isHeld() const { return held; }
+
+private:
+    bool held;
+#ifndef SMARTLAMP_NATIVE
+    esp_pm_lock_handle_t handle;
+#endif
+};
+
+// Pin di risveglio, es. l'uscita OUT del radar: quando è armato il livello alto sveglia dal light
+// sleep e chiama onWake in interrupt, una volta sola; poi va riarmato
+void wakePinBegin(uint8_t pin, void (*onWake)());
+void wakePinArm(bool armed);
+
+// Causa dell'ultimo reset; dopo un'accensione la memoria RTC non contiene nulla di valido
+enum class ResetReason : uint8_t {
+    POWER_ON,
+    SOFTWARE,   // esp_restart, anche a fine OTA
+    BROWNOUT,
+    WATCHDOG,
+    PANIC,
+    OTHER,
+};
+ResetReason resetReason();
+
+// Piccola area in RTC slow memory: sopravvive ai reset e ai brown-out, non allo spegnimento.
+// La lettura fallisce dopo un'accensione
+static const size_t RETAINED_SIZE = 32;
+bool retainedRead(void* dst, size_t len);
+void retainedWrite(const void* src, size_t len);
+
+// Orologio di sistema UTC in secondi. Su ESP32 lo mantiene l'RTC anche dopo un reset
+// software o il deep sleep; finché non viene impostato vale pochi secondi dal 1970.
+uint32_t epochNow();
+// Imposta l'orologio di sistema, es. dall'ultimo valore conservato prima di un reset
+void setEpoch(uint32_t epoch);
+// Sincronizzazione SNTP in background; onSync viene chiamata dal task di rete a ogni aggiornamento
+void startSntp(const char* server, void (*onSync)());
+
+// GET HTTP bloccante con timeout: ritorna lo status, negativo se la rete non risponde.
+// Il corpo viene troncato a capacity - 1 byte e terminato con zero.
+int httpGet(const char* url, char* body, size_t capacity, uint32_t timeoutMs);
+
+// Impostazioni persistenti in NVS, come blob binari; la lettura fallisce se la dimensione è cambiata
+bool settingsRead(const char* key, void* dst, size_t len);
+bool settingsWrite(const char* key, const void* src, size_t len);
+
+// FNV-1a dei primi len byte: il controllo dei blob versionati in NVS e in RTC
+inline uint32_t checksum(const void* data, size_t len) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Uscita del log già formattato (Serial su ESP32, stderr su host); la chiama solo il drain di Log
+void logWrite(const char* text, size_t len);
+
+#ifdef SMARTLAMP_NATIVE
+namespace native {
+    // Controllo dell'orologio virtuale: avanzando si eseguono i timer scaduti
+    void setTime(uint64_t us);
+    void advance(uint64_t us);
+    uint64_t nextTimerDeadline();  // UINT64_MAX se nessun timer è attivo
+    void setLogEnabled(bool enabled);
+    uint32_t pwmGetDutyFine(ledc_channel_t channel);
+    uint32_t pwmGetHpoint(ledc_channel_t channel);
+
+    // Orologio di sistema: da qui in poi avanza con quello virtuale
+    void setEpoch(uint32_t epoch);
+    // Simula la risposta SNTP: imposta l'orologio e chiama il callback di startSntp
+    void syncSntp(uint32_t epoch);
+    // Sostituto locale del server HTTP; nullptr = rete assente
+    using HttpHandler = int (*)(const char* url, char* body, size_t capacity);
+    void setHttpHandler(HttpHandler handler);
+    void clearSettings();
+    // Livello del pin di risveglio: se è armato e va alto chiama subito onWake
+    void setWakePin(bool high);
+    bool isWakePinArmed();
+    // Lock di energia tenuti al momento
+    uint32_t powerLocksHeld();
+    // Riavvio simulato: la memoria RTC resta, tranne che all'accensione dove diventa casuale
+    void simulateReset(ResetReason reason);
+}
+#endif
+
+}  // namespace hal
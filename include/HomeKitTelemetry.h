@@ -0,0 +1,81 @@
+#pragma once
+#include <atomic>
+#include "Hal.h"
+
+// Ultimi valori pubblicati per una lampada
+struct TelemetryValues {
+    bool on;
+    uint8_t level;  // 0-100; a luce spenta resta l'ultimo livello acceso, come fa HomeKit
+    bool occupied;
+};
+
+struct TelemetryStats {
+    uint32_t changes;        // cambi pubblicati dall'automazione
+    uint32_t notifications;  // caratteristiche notificate a HomeKit
+    uint32_t deferred;       // poll in cui un cambio ha atteso l'intervallo minimo o un gettone
+};
+
+// Stato della lampada e occupazione verso HomeKit. La macchina a stati pubblica solo le
+// destinazioni dei fade e l'occupazione vista dalle regole, in una parola atomica per lampada;
+// il task di HomeSpan le legge a intervalli e notifica solo ciò che è cambiato. Un cambio
+// annullato prima dell'invio non parte (vince l'ultimo valore), ogni caratteristica aspetta un
+// intervallo minimo dalla notifica precedente e un secchiello di gettoni limita il totale: un
+// radar rumoroso o una raffica di transizioni non inondano le notifiche HAP né il task di poll.
+// Nel bridge i gettoni girano a turno tra le lampade in attesa, così le prime non affamano le altre.
+// Pubblicazione da un solo task per lampada, poll e supersede solo dal task di HomeSpan.
+class HomeKitTelemetry {
+public:
+    static const uint8_t MAX_LAMPS = 16;
+    enum Channel : uint8_t { POWER = 1, LEVEL = 2, OCCUPANCY = 4 };
+    static const uint32_t POLL_MS = 100;                  // ritardo massimo aggiunto a una notifica
+    static const uint32_t MIN_INTERVAL_MS = 2000;         // tra due notifiche della stessa caratteristica
+    static const uint32_t OCCUPANCY_INTERVAL_MS = 10000;  // l'occupazione dal radar è la più nervosa
+    static const uint8_t BURST = 8;
+    static const uint32_t REFILL_MS = 3000;               // a regime 20 notifiche/min per tutte le lampade
+
+    static HomeKitTelemetry& getInstance() {
+        static HomeKitTelemetry instance;
+        return instance;
+    }
+
+    // Lato automazione: level 0 spegne e lascia il livello com'era
+    void publishLevel(uint8_t lamp, uint8_t level);
+    void publishOccupancy(uint8_t lamp, bool occupied);
+
+    // Lato HomeSpan: dei canali richiesti, quelli da notificare ora; out riceve i valori correnti
+    uint8_t poll(uint8_t lamp, uint8_t channels, uint32_t nowMs, TelemetryValues& out);
+    // Un controller ha scritto questi canali: i cambi dell'automazione ancora in attesa non partono
+    void supersede(uint8_t lamp, uint8_t channels);
+
+    TelemetryStats getStats() const;
+    void resetStats();
+
+private:
+    // Parola pubblicata: livello nei bit 0-6, poi acceso, occupato e i canali già pubblicati
+    static const uint16_t LEVEL_MASK = 0x7F;
+    static const uint16_t ON_BIT = 1 << 7;
+    static const uint16_t OCCUPIED_BIT = 1 << 8;
+    static const uint8_t KNOWN_SHIFT = 9;
+
+    HomeKitTelemetry();
+    HomeKitTelemetry(const HomeKitTelemetry&) = delete;
+    HomeKitTelemetry& operator=(const HomeKitTelemetry&) = delete;
+
+    void store(uint8_t lamp, uint16_t word);
+    bool takeToken(uint8_t lamp, uint32_t nowMs);
+    static uint16_t fieldMask(uint8_t channel);
+
+    std::atomic<uint16_t> published[MAX_LAMPS];
+    std::atomic<uint32_t> changes;
+
+    // Stato del task di HomeSpan
+    uint16_t sent[MAX_LAMPS];  // stesso formato di published: valori e canali già notificati
+    uint32_t lastSentMs[MAX_LAMPS][3];
+    uint8_t tokens;
+    uint32_t refillMs;
+    uint16_t starvedLamps;  // lampade con un cambio fermo per mancanza di gettoni
+    uint8_t lastServed;     // ultima lampada che ha avuto un gettone
+    bool started;
+    std::atomic<uint32_t> notifications;
+    std::atomic<uint32_t> deferred;
+};
@@ -2,17 +2,23 @@
 #include "HomeSpan.h"
 #include "LedController.h"
 #include "MotionSensor.h"  // Include your custom MotionSensor class
+#include "ResumeState.h"
 
 class SmartLamp : public Service::LightBulb {
 private:
     LedController& ledController;
     SpanCharacteristic *power;
     SpanCharacteristic *level;
+    SpanCharacteristic *colorTemperature;  // solo per le lampade CCT
     uint8_t newBrightness;
+    uint8_t lamp;  // indice nel LampBank in modalità bridge, 0 per la lampada singola
+    uint32_t lastPollMs;
 
 public:
-    SmartLamp(LedController& controller);
+    SmartLamp(LedController& controller, uint8_t brightness = ResumeState::DEFAULT_BRIGHTNESS, uint8_t lamp = 0);
     boolean update() override;
+    // Riporta su HomeKit accensione e livello decisi dall'automazione
+    void loop() override;
     uint8_t getNewBrightness() const { return newBrightness; }
 };
 
@@ -20,13 +26,31 @@ class AutoModeSwitch : public Service::Switch {
 private:
     SpanCharacteristic *power;
     bool isOnAutoMode;
+    uint8_t lamp;
 
 public:
-    AutoModeSwitch(bool initialState = false);
+    AutoModeSwitch(bool initialState = false, uint8_t lamp = 0);
     boolean update() override;
     bool getIsOnAutoMode() const { return isOnAutoMode; }
     void activateAutoMode();
 };
 
-void setupHomeSpan(LedController& ledController, SmartLamp*& smartLamp, AutoModeSwitch*& autoModeSwitch);
+// Occupazione vista dalle regole della lampada: movimento o presenza nelle sue zone
+class LampOccupancySensor : public Service::OccupancySensor {
+private:
+    SpanCharacteristic *occupied;
+    uint8_t lamp;
+    uint32_t lastPollMs;
+
+public:
+    explicit LampOccupancySensor(uint8_t lamp = 0);
+    void loop() override;
+};
+
+// resumed: impostazioni riprese al boot, da cui partono le caratteristiche HomeKit
+void setupHomeSpan(LedController& ledController, SmartLamp*& smartLamp, AutoModeSwitch*& autoModeSwitch,
+                   const ResumeRecord& resumed);
 
+// Bridge: un accessorio per lampada, ognuno con luce, interruttore della modalità auto e occupazione.
+// Gli eventi portano l'indice della lampada nel LampBank
+void setupHomeSpanBridge(LedController* const* leds, uint8_t count);
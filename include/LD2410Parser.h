@@ -0,0 +1,80 @@
+#pragma once
+#include "Hal.h"
+
+// Frame di report del radar LD2410 (modalità base e engineering) già decodificato
+struct LD2410Frame {
+    static const uint8_t GATES = 9;
+
+    bool engineering;
+    uint8_t targetState;  // bit 0 bersaglio in movimento, bit 1 bersaglio fermo
+    uint16_t movingDistance;
+    uint8_t movingEnergy;
+    uint16_t stationaryDistance;
+    uint8_t stationaryEnergy;
+    uint16_t detectionDistance;
+    // Solo in modalità engineering
+    uint8_t maxMovingGate;
+    uint8_t maxStationaryGate;
+    uint8_t movingGateEnergy[GATES];
+    uint8_t stationaryGateEnergy[GATES];
+    uint8_t lightLevel;
+    uint8_t outPin;
+};
+
+struct LD2410Stats {
+    uint32_t bytes;
+    uint32_t frames;
+    uint32_t engineeringFrames;
+    uint32_t ackFrames;
+    uint32_t tailErrors;    // tail o marker interni (0xAA/0x55/0x00) non validi
+    uint32_t lengthErrors;  // lunghezza dichiarata fuori dai limiti
+    uint32_t skippedBytes;  // byte scartati per risincronizzarsi sull'header
+    uint32_t overruns;      // FIFO o ring pieni, byte persi
+};
+
+// Parser incrementale su un ring buffer: il driver UART scrive direttamente nel ring
+// e i campi vengono letti dal ring senza copiare il frame in un buffer intermedio.
+class LD2410Parser {
+public:
+    static const size_t RING_SIZE = 512;  // potenza di 2
+    static const size_t MAX_PAYLOAD = 64;
+
+    LD2410Parser();
+
+    // Porzione contigua libera del ring, da riempire e poi confermare con commit()
+    uint8_t* writeSpan(size_t& len);
+    void commit(size_t len);
+    size_t push(const uint8_t* data, size_t len);
+
+    // Decodifica il prossimo frame completo; false se servono altri byte
+    bool next(LD2410Frame& frame);
+    void reset();
+    void noteOverrun();
+    const LD2410Stats& getStats() const { return stats; }
+
+    // Codifica un frame di report, usato dagli strumenti host per generare flussi di prova
+    static size_t encode(const LD2410Frame& frame, uint8_t* out, size_t capacity);
+    // Codifica un comando di configurazione verso il radar; 0 se non sta in capacity
+    static size_t encodeCommand(uint16_t command, const uint8_t* value, size_t valueLen, uint8_t* out, size_t capacity);
+
+    // Comandi del protocollo seriale del LD2410
+    static const uint16_t CMD_ENABLE_CONFIG = 0x00FF;
+    static const uint16_t CMD_END_CONFIG = 0x00FE;
+    static const uint16_t CMD_ENGINEERING_ON = 0x0062;
+    static const uint16_t CMD_ENGINEERING_OFF = 0x0063;
+    // Sensibilità di un gate: parole 0x0000 gate, 0x0001 soglia in movimento, 0x0002 da fermo
+    static const uint16_t CMD_SET_GATE_SENSITIVITY = 0x0064;
+
+private:
+    static const size_t RING_MASK = RING_SIZE - 1;
+
+    uint8_t at(size_t offset) const { return ring[(tail + offset) & RING_MASK]; }
+    uint16_t le16(size_t offset) const { return at(offset) | (at(offset + 1) << 8); }
+    bool matches(const uint8_t* marker, size_t offset) const;
+    bool decodeReport(size_t length, LD2410Frame& frame) const;
+
+    uint8_t ring[RING_SIZE];
+    size_t head;  // indici liberi di crescere, mascherati all'accesso
+    size_t tail;
+    LD2410Stats stats;
+};
@@ -0,0 +1,64 @@
+#pragma once
+#include "Hal.h"
+#include "LedController.h"
+#include "LampStateTable.h"
+#include "LampEvents.h"
+
+// Più lampade indipendenti sulla stessa scheda (bridge HomeKit): una macchina a stati per lampada,
+// con le stesse regole di LampStateMachine. I campi stanno per colonne (struct-of-arrays), così un
+// passo valuta tutte le lampade in un solo ciclo su array contigui; le transizioni, rare, si
+// applicano dopo. I radar sono colonne a parte: una lampada legge il suo o quello di un'altra.
+// Preaccensione, ripresa al boot e parcheggio restano della lampada singola.
+class LampBank {
+public:
+    static const uint8_t MAX_LAMPS = 16;   // bitmap delle transizioni in 32 bit, canali LEDC permettendo
+    static const uint8_t MAX_SENSORS = 4;
+
+    LampBank();
+
+    // Aggiunge una lampada pilotata da led e comandata dal radar sensor; presenceZones come in
+    // LampStateMachine::setPresenceZones. Restituisce l'indice, -1 se il banco è pieno
+    int addLamp(LedController& led, uint8_t sensor, uint8_t presenceZones = 0);
+    uint8_t size() const { return count; }
+
+    // Gli eventi usano LampEvent::target: lampada per HomeKit, radar per i frame
+    void applyEvent(const LampEvent& event);
+    // Un passo su tutte le lampade; bitmap di quelle che hanno cambiato stato
+    uint32_t evaluate();
+    // Il più vicino dei timeout delle lampade, UINT32_MAX se nessuno
+    uint32_t msUntilTimeout() const;
+
+    LampState getState(uint8_t lamp) const { return state[lamp]; }
+    uint8_t getMaxBrightness(uint8_t lamp) const { return maxBrightness[lamp]; }
+    bool isAutoMode(uint8_t lamp) const { return autoMode[lamp]; }
+    uint8_t getSensor(uint8_t lamp) const { return sensorOf[lamp]; }
+    bool isOccupied(uint8_t lamp) const { return movement[sensorOf[lamp]] || zonePresence(lamp); }
+
+private:
+    // Presenza del radar della lampada, limitata alle sue zone
+    bool zonePresence(uint8_t lamp) const {
+        uint8_t sensor = sensorOf[lamp];
+        return presence[sensor] &&
+               (presenceZones[lamp] == 0 || !zonesValid[sensor] || (zones[sensor] & presenceZones[lamp]) != 0);
+    }
+    // Azione di ingresso comune (StateEntry), transizione compresa nella trace
+    void enterState(uint8_t lamp, LampState from, LampState to, int32_t minute);
+
+    uint8_t count;
+
+    // Colonne per lampada
+    LampState state[MAX_LAMPS];
+    uint32_t stateStart[MAX_LAMPS];
+    uint32_t stateDuration[MAX_LAMPS];
+    uint8_t maxBrightness[MAX_LAMPS];
+    bool autoMode[MAX_LAMPS];
+    uint8_t sensorOf[MAX_LAMPS];
+    uint8_t presenceZones[MAX_LAMPS];
+    LedController* leds[MAX_LAMPS];
+
+    // Colonne per radar: ultimo frame ricevuto
+    bool movement[MAX_SENSORS];
+    bool presence[MAX_SENSORS];
+    uint8_t zones[MAX_SENSORS];
+    bool zonesValid[MAX_SENSORS];
+};
@@ -0,0 +1,44 @@
+#pragma once
+#include "Hal.h"
+#include "LampStateMachine.h"
+#include "LampEvents.h"
+#include "PowerManager.h"
+#include "ResumeState.h"
+
+// Statistiche del task di controllo, per confrontare il ciclo a eventi con il vecchio polling
+struct LampLoopStats {
+    uint32_t wakeups;
+    uint32_t events;
+    uint32_t transitions;
+    uint64_t busyUs;          // tempo passato a elaborare, escluso l'attesa in coda
+    uint32_t lastLatencyUs;   // dal frame del sensore all'avvio del fade
+    uint32_t maxLatencyUs;
+};
+
+// Corpo del task di controllo: si blocca sulla coda eventi fino al prossimo evento
+// o al prossimo timeout di stato, invece di svegliarsi a ogni tick
+class LampControlTask {
+public:
+    using ActiveFn = bool (*)();
+
+    // Intervallo massimo di attesa, per ricontrollare la condizione di attivazione (notte)
+    static const uint32_t ACTIVE_RECHECK_MS = 60000;
+
+    LampControlTask(LampStateMachine& lamp, ActiveFn isActive);
+    // Con un power manager il task si parcheggia nelle pause e smette di ricontrollare ogni minuto
+    void setPowerManager(PowerManager* manager) { power = manager; }
+    // Con lo stato di ripresa il task si sveglia anche per il salvataggio in NVS rimasto in sospeso
+    void setResumeState(ResumeState* state) { resume = state; }
+
+    void runOnce();
+    uint32_t nextTimeoutMs() const;
+    const LampLoopStats& getStats() const { return stats; }
+    void resetStats();
+
+private:
+    LampStateMachine& lamp;
+    ActiveFn isActive;
+    PowerManager* power;
+    ResumeState* resume;
+    LampLoopStats stats;
+};
@@ -0,0 +1,43 @@
+#pragma once
+#include "Hal.h"
+
+// Eventi che svegliano il task di controllo della lampada
+enum class LampEventType : uint8_t {
+    SENSOR_FRAME,       // Nuova lettura del radar con esito diverso dalla precedente
+    BRIGHTNESS_CHANGED, // Scrittura HomeKit sul livello di luminosità
+    AUTO_MODE_CHANGED,  // Scrittura HomeKit sull'interruttore della modalità automatica
+    NIGHT_CHANGED,      // Passaggio giorno/notte calcolato da TimeService
+    SENSOR_WAKE,        // Fronte sul pin OUT del radar mentre il controllo era parcheggiato
+};
+
+struct LampEvent {
+    LampEventType type;
+    uint8_t target;        // con più lampade (LampBank): lampada per HomeKit, radar per i frame
+    uint32_t timestampUs;  // hal::micros() al momento del post, per misurare la latenza
+    union {
+        struct {
+            bool movement;
+            bool presence;
+            uint16_t movementDistance;
+            uint16_t stationaryDistance;
+            uint8_t zones;    // bitmap di ZoneOccupancy
+            bool zonesValid;  // false senza frame engineering o senza zone configurate
+        } sensor;
+        uint8_t brightness;
+        bool autoMode;
+        bool night;
+    };
+
+    static LampEvent sensorFrame(bool movement, bool presence, uint16_t movementDistance, uint16_t stationaryDistance,
+                                 uint8_t zones = 0, bool zonesValid = false, uint8_t sensor = 0);
+    static LampEvent brightnessChanged(uint8_t brightness, uint8_t lamp = 0);
+    static LampEvent autoModeChanged(bool autoMode, uint8_t lamp = 0);
+    static LampEvent nightChanged(bool night);
+    static LampEvent sensorWake();
+};
+
+// Coda unica verso il task di controllo; post è non bloccante e sicuro da qualsiasi task
+bool postLampEvent(const LampEvent& event);
+bool postLampEventFromIsr(const LampEvent& event);
+bool waitLampEvent(LampEvent& event, uint32_t timeoutMs);
+uint32_t droppedLampEvents();
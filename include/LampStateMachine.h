@@ -1,18 +1,10 @@
 #pragma once
-#include <Arduino.h>
+#include "Hal.h"
 #include "LedController.h"
 #include "MotionSensor.h"
-#include <functional>
-#include <array>
-
-enum class LampState {
-    OFF,
-    FULL_ON,
-    RELAXATION,
-    SLEEP,
-    SUDDEN_MOVEMENT,
-    STATE_COUNT
-};
+#include "LampStateTable.h"
+#include "LampEvents.h"
+#include "OccupancyLearner.h"
 
 class LampStateMachine {
 private:
@@ -20,11 +12,15 @@ private:
     LedController& ledController;
     MotionSensor& motionSensor;
     uint8_t maxBrightness;
-    unsigned long stateStartTime;
-    unsigned long stateDuration;
-    unsigned long lastMovementTime;
-    unsigned long lastPresenceTime;
-    unsigned long debounceDelay;
+    uint32_t stateStartTime;
+    uint32_t stateDuration;
+    // Ultimi ingressi ricevuti dagli eventi
+    bool movement;
+    bool presence;
+    bool autoMode;
+    uint8_t presenceZones;  // 0: la presenza conta ovunque
+    OccupancyLearner* learner;  // nullptr: niente preaccensione né timeout adattivi
+    bool prewarmed;             // in OFF con la luce bassa in attesa di un arrivo
 
     // Costruttore privato per il pattern Singleton
     LampStateMachine(LedController& led, MotionSensor& motion);
@@ -34,19 +30,13 @@ private:
     LampStateMachine& operator=(const LampStateMachine&) = delete;
 
     void setState(LampState newState);
+    // La presenza da fermo conta solo se una delle zone scelte è occupata
+    bool inPresenceZones(bool presence, uint8_t zones, bool zonesValid) const;
 
-    // Funzioni di transizione
-    void transitionToOff();
-    void transitionToFullOn();
-    void transitionToRelaxation();
-    void transitionToSleep();
-    void transitionToSuddenMovement();
-
-    // Tabella di transizione degli stati
-    using StateTransitionRule = std::function<LampState(bool isMovement, bool isPresence, bool stateTimedOut)>;
-    std::array<StateTransitionRule, static_cast<size_t>(LampState::STATE_COUNT)> stateTransitionRules;
-
-    void initializeStateTransitionRules();
+    // Azione di ingresso comune (StateEntry) e timeout dello stato, accorciato o allungato dal learner
+    void enterState(LampState from, LampState to);
+    // In OFF accende piano la luce se l'apprendimento prevede un arrivo, la spegne quando non più
+    void updatePrewarm(int32_t weekMinute);
 
 public:
     // Metodo statico per ottenere l'istanza Singleton
@@ -56,5 +46,30 @@ public:
     }
 
     void update(uint8_t maxBrightness, bool IsOnAutoMode);
+
+    // Al boot, prima del task di controllo: riparte dallo stato salvato e riaccende subito il LED.
+    // Finché il radar non manda il primo frame la presenza si assume vera, come prima del reset
+    void resume(LampState state, uint8_t brightness, bool autoMode);
+
+    // Percorso a eventi: applyEvent aggiorna gli ingressi, evaluate applica le regole
+    // e restituisce true se lo stato è cambiato
+    void applyEvent(const LampEvent& event);
+    bool evaluate();
+    // Millisecondi al prossimo timeout che può cambiare l'esito delle regole, UINT32_MAX se nessuno
+    uint32_t msUntilTimeout() const;
+    // In OFF con l'apprendimento attivo: millisecondi alla prossima valutazione che serve al learner,
+    // la fine del quarto d'ora (un quarto d'ora senza nessuno fa scendere i contatori) o l'inizio di
+    // una preaccensione. UINT32_MAX altrimenti. Da parcheggiati è l'unico risveglio a orario
+    uint32_t msUntilLearnerCheck() const;
+    // Zone di ZoneOccupancy (bitmap) in cui la presenza tiene accesa la lampada, es. la scrivania
+    // e non la porta; finché il radar non manda frame engineering la presenza conta ovunque
+    void setPresenceZones(uint8_t mask) { presenceZones = mask; }
+    // Storico dell'occupazione da aggiornare a ogni valutazione e da cui leggere le previsioni
+    void setLearner(OccupancyLearner* occupancy) { learner = occupancy; }
+    bool isPrewarmed() const { return prewarmed; }
     LampState getCurrentState() const { return currentState; }
+    uint8_t getMaxBrightness() const { return maxBrightness; }
+    bool isAutoMode() const { return autoMode; }
+    // Movimento o presenza nelle zone, come la vedono le regole
+    bool isOccupied() const { return movement || presence; }
 };
\ No newline at end of file
@@ -0,0 +1,121 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <array>
+
+enum class LampState : uint8_t {
+    OFF,
+    FULL_ON,
+    RELAXATION,
+    SLEEP,
+    SUDDEN_MOVEMENT,
+    STATE_COUNT
+};
+
+// Tabella degli stati risolta a compile time: regole, azioni di ingresso e timeout
+// sono dati costanti, la macchina a stati fa solo indicizzazioni in flash.
+namespace LampStateTable {
+
+constexpr size_t STATE_COUNT = static_cast<size_t>(LampState::STATE_COUNT);
+constexpr uint32_t NO_TIMEOUT = UINT32_MAX;
+
+// Ingressi di una regola compattati in 3 bit: movimento, presenza, timeout
+constexpr size_t INPUT_MOVEMENT = 1 << 0;
+constexpr size_t INPUT_PRESENCE = 1 << 1;
+constexpr size_t INPUT_TIMED_OUT = 1 << 2;
+constexpr size_t INPUT_COMBINATIONS = 1 << 3;
+
+constexpr size_t inputIndex(bool isMovement, bool isPresence, bool stateTimedOut) {
+    return (isMovement ? INPUT_MOVEMENT : 0) | (isPresence ? INPUT_PRESENCE : 0) | (stateTimedOut ? INPUT_TIMED_OUT : 0);
+}
+
+using Rule = LampState (*)(bool isMovement, bool isPresence, bool stateTimedOut);
+
+// Azione di ingresso: luminosità come frazione del duty del livello impostato da HomeKit,
+// durata del fade e timeout dello stato
+struct StateConfig {
+    LampState state;
+    uint8_t brightnessNum;
+    uint8_t brightnessDen;
+    uint16_t fadeDuration;  // ms
+    uint32_t duration;      // ms, NO_TIMEOUT se lo stato non scade
+    Rule rule;
+};
+
+constexpr LampState offRule(bool isMovement, bool isPresence, bool) {
+    return (isMovement || isPresence) ? LampState::FULL_ON : LampState::OFF;
+}
+
+constexpr LampState fullOnRule(bool isMovement, bool isPresence, bool stateTimedOut) {
+    if ((!isPresence && !isMovement) && stateTimedOut) return LampState::OFF;
+    if (!isMovement && stateTimedOut) return LampState::RELAXATION;
+    return LampState::FULL_ON;
+}
+
+constexpr LampState relaxationRule(bool isMovement, bool isPresence, bool stateTimedOut) {
+    if ((!isPresence && !isMovement) && stateTimedOut) return LampState::OFF;
+    if (isMovement && stateTimedOut) return LampState::FULL_ON;
+    if ((isPresence && !isMovement) && stateTimedOut) return LampState::SLEEP;
+    return LampState::RELAXATION;
+}
+
+constexpr LampState sleepRule(bool isMovement, bool isPresence, bool) {
+    if (!isPresence && !isMovement) return LampState::OFF;
+    if (isMovement) return LampState::SUDDEN_MOVEMENT;
+    return LampState::SLEEP;
+}
+
+constexpr LampState suddenMovementRule(bool isMovement, bool isPresence, bool stateTimedOut) {
+    if ((!isPresence && !isMovement) && stateTimedOut) return LampState::OFF;
+    if (isPresence && stateTimedOut) return LampState::SLEEP;
+    if (isMovement) return LampState::SUDDEN_MOVEMENT;
+    if (!isMovement && stateTimedOut) return LampState::RELAXATION;
+    return LampState::SLEEP;
+}
+
+inline constexpr std::array<StateConfig, STATE_COUNT> states = {{
+    {LampState::OFF,             0, 1, 2000, 0,              offRule},
+    {LampState::FULL_ON,         1, 1, 1000, 5 * 60 * 1000,  fullOnRule},          // 5 minuti
+    {LampState::RELAXATION,      1, 2, 2000, 15 * 60 * 1000, relaxationRule},      // 15 minuti, metà del duty
+    {LampState::SLEEP,           1, 8, 3000, NO_TIMEOUT,     sleepRule},           // 1/8 del duty, nessun timeout
+    {LampState::SUDDEN_MOVEMENT, 1, 2, 1000, 30 * 1000,      suddenMovementRule},  // 30 secondi
+}};
+
+// Controllo statico: ogni stato ha la sua riga, nell'ordine dell'enum, con una regola valida
+constexpr bool everyStateHasRule() {
+    for (size_t i = 0; i < STATE_COUNT; ++i) {
+        if (static_cast<size_t>(states[i].state) != i || states[i].rule == nullptr || states[i].brightnessDen == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+static_assert(everyStateHasRule(), "LampStateTable::states deve avere una riga valida per ogni LampState");
+
+// Le regole vengono valutate a compile time per tutte le 8 combinazioni di ingresso
+using TransitionTable = std::array<std::array<LampState, INPUT_COMBINATIONS>, STATE_COUNT>;
+
+constexpr TransitionTable buildTransitions() {
+    TransitionTable table{};
+    for (size_t s = 0; s < STATE_COUNT; ++s) {
+        for (size_t in = 0; in < INPUT_COMBINATIONS; ++in) {
+            table[s][in] = states[s].rule((in & INPUT_MOVEMENT) != 0, (in & INPUT_PRESENCE) != 0, (in & INPUT_TIMED_OUT) != 0);
+        }
+    }
+    return table;
+}
+
+inline constexpr TransitionTable transitions = buildTransitions();
+
+constexpr LampState next(LampState state, bool isMovement, bool isPresence, bool stateTimedOut) {
+    return transitions[static_cast<size_t>(state)][inputIndex(isMovement, isPresence, stateTimedOut)];
+}
+
+constexpr const StateConfig& config(LampState state) {
+    return states[static_cast<size_t>(state)];
+}
+
+static_assert(next(LampState::OFF, true, false, false) == LampState::FULL_ON, "OFF deve accendersi al movimento");
+static_assert(next(LampState::SLEEP, false, false, false) == LampState::OFF, "SLEEP deve spegnersi senza presenza");
+
+}  // namespace LampStateTable
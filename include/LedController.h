@@ -1,65 +1,204 @@
 #pragma once
-#include <Arduino.h>
-#include "driver/ledc.h"
-#include "HomeSpan.h"
-#include "TimeUtils.h"
+#include "Hal.h"
+#include "FadeEngine.h"
+#include "BrightnessLut.h"
+#include "LockFreeQueue.h"
 
+// Canali della lampada, nell'ordine dei pin
+enum class LedLayout : uint8_t {
+    MONO,  // un canale
+    CCT,   // bianco caldo, bianco freddo
+    RGBW,  // rosso, verde, blu, bianco
+};
+
+enum class LedCommandType : uint8_t {
+    SET_LEVEL,
+    FADE_TO_LEVEL,
+    REQUEST_LEVEL,
+    SET_BRIGHTNESS,
+    FADE_TO,
+    CANCEL_FADE,
+    COLOR_TEMPERATURE,
+    CHANNEL_MIX,
+    DITHERING,
+    START_BLINK,
+    STOP_BLINK,
+};
+
+struct LedCommand {
+    LedCommandType type;
+    FadeCurve curve;
+    uint16_t value;          // livello, duty, mired o flag secondo il tipo
+    uint16_t scaleQ8;        // FADE_TO_LEVEL: frazione del duty del livello, Q8
+    uint32_t duration;       // ms, o periodo del lampeggio
+    uint32_t submitCycles;   // hal::cycles() all'invio, per la latenza
+    uint16_t mix[FadeEngine::MAX_CHANNELS];
+};
+
+// Stato pubblicato dal task proprietario dopo ogni giro di comandi
+struct LedState {
+    uint32_t publishedUs;       // hal::micros() troncato, alla pubblicazione
+    uint32_t fadeStartUs;
+    uint32_t fadeEndUs;
+    uint32_t segmentMs;         // segmenti della curva del fade in corso
+    uint16_t brightness;        // canale più acceso alla pubblicazione
+    uint16_t endBrightness;     // canale più acceso a fine fade
+    uint16_t targetBrightness;  // destinazione prima del mix tra i canali
+    uint16_t colorTemperature;
+    uint16_t channels[FadeEngine::MAX_CHANNELS];  // duty per canale alla pubblicazione
+    uint32_t fadeCount;
+    uint32_t commands;          // comandi applicati
+    FadeCurve curve;            // curva eseguita dal fade in corso
+    bool fading;
+    bool blinking;
+
+    // Interpolazione verso la fine del fade lungo la sua curva, come il fade hardware
+    uint16_t brightnessAt(uint32_t nowUs) const;
+};
+
+// Il LED ha un solo proprietario: il task che chiama process(). Gli altri task (macchina a stati,
+// HomeSpan) e i timer del fade e del lampeggio non toccano mai lo stato: inviano comandi su code
+// lock-free e leggono l'ultimo LedState pubblicato. Sull'host, senza task proprietario, i comandi
+// sono applicati subito da chi li invia.
 class LedController {
+public:
+    static const uint8_t MAX_CHANNELS = FadeEngine::MAX_CHANNELS;
+    static const uint16_t MIX_ONE = 4096;       // Q12: canale al 100% del livello
+    static const uint16_t WARM_MIRED = 370;     // 2700 K, striscia calda
+    static const uint16_t COOL_MIRED = 154;     // 6500 K, striscia fredda
+    static const uint16_t DEFAULT_MIRED = 250;  // 4000 K
+    static const uint16_t SCALE_ONE = 256;      // Q8: tutto il duty del livello
+    static const size_t COMMAND_QUEUE_SIZE = 16;
+    static const size_t TIMER_QUEUE_SIZE = 8;
+
 private:
-    uint8_t pin;
-    ledc_channel_t channel;
+    enum class TimerSource : uint8_t { FADE, BLINK };
+    struct TimerEvent {
+        TimerSource source;
+        uint32_t generation;
+    };
+
+    LedLayout layout;
+    uint8_t channelCount;
+    uint8_t pins[MAX_CHANNELS];
+    ledc_channel_t channels[MAX_CHANNELS];
     ledc_timer_t timer;
     uint32_t freq;
     ledc_timer_bit_t resolution;
     uint32_t maxDuty;
-    uint16_t currentBrightness;
-    uint16_t targetBrightness;
-    bool isFading;
+    const uint32_t* levels;  // BrightnessLut della risoluzione scelta
+
+    // Stato del proprietario: lo toccano solo process() e i metodi apply
+    uint16_t mix[MAX_CHANNELS];  // quota del livello per canale, Q12
+    uint16_t colorTemperature;   // mired, solo CCT
+    uint32_t targetFine;         // duty fine prima del mix tra i canali
     bool isBlinking;
     uint32_t blinkDuration;
-    esp_timer_handle_t blinkTimer;
-    static void IRAM_ATTR onFadeEnd(void* arg);
-    static void IRAM_ATTR onBlinkTimer(void* arg);
-    uint32_t calculateDuty(uint16_t brightness) const;
+    FadeEngine fade;
+    hal::Timer blinkTimer;
+    hal::PowerLock outputLock;  // tenuto finché il LED è acceso, in fade o lampeggia
+    bool coalescing;         // il fade in corso è partito da una REQUEST_LEVEL
+    int16_t pendingLevel;    // ultima richiesta arrivata durante quel fade, -1 se nessuna
+    uint32_t pendingDuration;
+    uint32_t appliedCommands;
+    bool inlineProcessing;
+    bool processing;
+
+    // Confini tra i contesti: più produttori di comandi, il solo task esp_timer per gli scatti
+    MpscQueue<LedCommand, COMMAND_QUEUE_SIZE> commands;
+    SpscQueue<TimerEvent, TIMER_QUEUE_SIZE> timerEvents;
+    hal::Queue<uint8_t, 1> wakeups;
+    hal::Queue<uint8_t, 1>* wake;  // wakeups, o la coda comune se un task serve più LED
+    Snapshot<LedState> snapshot;
+    std::atomic<uint32_t> droppedCommands;
+
+    static void onBlinkTimer(void* arg);
+    static void onFadeTimer(void* arg, uint32_t generation);
+    static void onFadeComplete(void* arg);
+    bool submit(LedCommand command);
+    void postTimerEvent(const TimerEvent& event);
+    void apply(const LedCommand& command);
+    void handleTimerEvent(const TimerEvent& event);
+    void drain();
+    void publish();
+
+    void applyLevel(uint8_t level, uint32_t duration, FadeCurve curve, uint16_t scaleQ8);
+    void applyRequest(uint8_t level, uint32_t duration);
+    void applyFadeTo(uint16_t duty, uint32_t duration, FadeCurve curve);
+    void applyCancel();
+    void applyMix(const uint16_t* weights, uint32_t duration);
+    void applyStartBlink(uint32_t blinkDur);
+    void applyStopBlink();
+    void endCoalescing();
+    void updateCctMix(uint16_t mired);
+    void mixTargets(uint32_t fineDuty, uint32_t* targets) const;
+    void applyTarget(uint32_t fineDuty, uint32_t duration, FadeCurve curve);
+    uint16_t currentBrightness() const;
 
 public:
     LedController(uint8_t pin, ledc_channel_t channel, ledc_timer_t timer, uint32_t freq, ledc_timer_bit_t resolution);
+    // Un pin per canale secondo il layout; i canali LEDC sono consecutivi da firstChannel
+    LedController(LedLayout layout, const uint8_t* pins, ledc_channel_t firstChannel, ledc_timer_t timer, uint32_t freq,
+                  ledc_timer_bit_t resolution);
+    // Configura i canali; va chiamato prima di avviare il task proprietario
     void begin();
-    void setBrightness(uint16_t brightness);
-    void startFadeIn(uint32_t duration);
-    void startFadeOut(uint32_t duration);
-    void startFadeTo(uint16_t targetBrightness, uint32_t duration);
-    bool isStillFading() const { return isFading; }
-    uint16_t getCurrentBrightness() const { return currentBrightness; }
+
+    // Corpo del task proprietario: attende fino a timeoutMs un comando o uno scatto dei timer,
+    // poi applica tutto ciò che è in coda e pubblica il nuovo stato
+    void process(uint32_t timeoutMs = 0);
+    // Più LED con un solo task proprietario (bridge con più lampade): tutti svegliano la stessa
+    // coda e processAll li svuota tutti a ogni risveglio. Va impostata prima di begin()
+    void shareWakeups(hal::Queue<uint8_t, 1>& queue) { wake = &queue; }
+    static void processAll(hal::Queue<uint8_t, 1>& queue, LedController* const* leds, size_t count, uint32_t timeoutMs);
+    // Solo host: false per far girare process() in un thread separato (test di stress)
+    void setInlineProcessing(bool enabled) { inlineProcessing = enabled; }
+
+    // Comandi: non bloccanti, da qualsiasi task; false se la coda è piena (comando perso)
+    // Luminosità percepita 0-100, convertita in duty dalla tabella percettiva
+    bool setLevel(uint8_t level);
+    // scaleQ8 riduce il duty del livello, non il livello: gli stati della lampada (1/2, 1/8)
+    // emettono quella frazione della luce del livello impostato
+    bool startFadeToLevel(uint8_t level, uint32_t duration, FadeCurve curve = FadeCurve::LINEAR,
+                          uint16_t scaleQ8 = SCALE_ONE);
+    // Per le scritture a raffica (slider di HomeKit): la prima parte subito, quelle che arrivano
+    // durante il suo fade si fondono nell'ultima, che parte quando il fade finisce
+    bool requestLevel(uint8_t level, uint32_t duration);
+    // Duty grezzo del LEDC, per il lampeggio di setup
+    bool setBrightness(uint16_t brightness);
+    bool startFadeIn(uint32_t duration);
+    bool startFadeOut(uint32_t duration);
+    bool startFadeTo(uint16_t targetBrightness, uint32_t duration, FadeCurve curve = FadeCurve::LINEAR);
+    bool cancelFade();
+    // Ripartizione del livello tra i canali; il fade verso il nuovo mix parte dal duty reale
+    bool setColorTemperature(uint16_t mired, uint32_t duration = 0);
+    bool setChannelMix(const uint16_t* weights, uint32_t duration = 0);
+    // Dithering temporale sui 4 bit frazionari del LEDC, per fade lenti a luminosità molto basse
+    bool setDithering(bool enabled);
+    bool startSetupBlink(uint32_t blinkDur);
+    bool stopSetupBlink();
+
+    // Letture dallo stato pubblicato, da qualsiasi task
+    LedState getState() const { return snapshot.read(); }
+    uint32_t getDroppedCommands() const { return droppedCommands.load(std::memory_order_relaxed); }
+    bool isStillFading() const { return getState().fading; }
+    uint32_t getFadeCount() const { return getState().fadeCount; }
+    // Luminosità reale, interpolata anche a fade in corso: il canale più acceso
+    uint16_t getCurrentBrightness() const { return getState().brightnessAt(static_cast<uint32_t>(hal::micros())); }
+    uint16_t getChannelBrightness(uint8_t index) const { return getState().channels[index]; }
+    uint16_t getTargetBrightness() const { return getState().targetBrightness; }
+    uint16_t getColorTemperature() const { return getState().colorTemperature; }
+    uint32_t levelToFineDuty(uint8_t level) const { return levels[level <= 100 ? level : 100]; }
+    // Il livello percepito più basso che arriva almeno a fineDuty: 0 solo a LED spento
+    uint8_t fineDutyToLevel(uint32_t fineDuty) const;
+    LedLayout getLayout() const { return layout; }
+    uint8_t getChannelCount() const { return channelCount; }
     ledc_timer_bit_t getResolution() const;
-    void startSetupBlink(uint32_t blinkDur);
-    void stopSetupBlink();
 
+    // Il primo LED creato: è quello che segnala lo stato di HomeSpan
     static LedController* instance;
 
-    static void statusCallback(HS_STATUS status){
-        LedController& instance = getInstance();
-        switch (status)
-        {
-        case HS_WIFI_NEEDED:
-            instance.startSetupBlink(2000);
-            break;
-        case HS_WIFI_CONNECTING:
-            instance.startSetupBlink(1000);
-            break;
-        case HS_PAIRED:
-            instance.stopSetupBlink();        
-            TimeUtils::getInstance()->syncTimeWithNTP("pool.ntp.org");
-            break;
-        case HS_PAIRING_NEEDED:
-            instance.startSetupBlink(500);
-            break;
-        default:
-            break;
-        }
-    }
     static LedController& getInstance() {
         return *instance;
     }
 
-};
\ No newline at end of file
+};
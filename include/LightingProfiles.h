@@ -0,0 +1,96 @@
+#pragma once
+#include <atomic>
+#include "Hal.h"
+#include "LampStateTable.h"
+
+// Profili di illuminazione: luminosità, fade e durata di ogni stato, uno o più profili per fascia
+// oraria, e la finestra notturna fissa. In NVS come blob versionato; le regole di transizione
+// restano in LampStateTable.
+
+struct StoredStateParams {
+    uint8_t brightnessNum;  // frazione del duty della luminosità impostata da HomeKit
+    uint8_t brightnessDen;
+    uint16_t fadeMs;
+    uint32_t durationMs;    // LampStateTable::NO_TIMEOUT se lo stato non scade
+};
+
+struct StoredProfile {
+    uint16_t startMin;  // minuto locale da cui vale il profilo, multiplo di SLOT_MIN
+    uint16_t reserved;
+    StoredStateParams states[LampStateTable::STATE_COUNT];
+};
+
+struct LightingProfileSet {
+    static const uint8_t VERSION = 1;
+    static const uint8_t MAX_PROFILES = 4;
+
+    uint8_t version;
+    uint8_t count;           // profili validi, ordinati per startMin crescente
+    uint16_t nightStartMin;  // finestra notturna senza posizione, minuti locali
+    uint16_t nightEndMin;
+    uint16_t reserved;
+    StoredProfile profiles[MAX_PROFILES];
+    uint32_t checksum;       // FNV-1a dei byte precedenti
+
+    // Un solo profilo uguale a LampStateTable, notte dalle 17:00 alle 8:00
+    static LightingProfileSet defaults();
+};
+
+// Parametri di uno stato già pronti per il percorso caldo
+struct StateParams {
+    uint16_t levelQ8;  // frazione del duty del livello in Q8
+    uint16_t fadeMs;
+    uint32_t durationMs;
+};
+
+// Forma compilata: nessun parsing né ricerca, due indicizzazioni per lettura
+struct LightingTable {
+    static const uint16_t SLOT_MIN = 15;
+    static const uint8_t SLOTS = 24 * 60 / SLOT_MIN;
+
+    StateParams params[LightingProfileSet::MAX_PROFILES][LampStateTable::STATE_COUNT];
+    uint8_t slotProfile[SLOTS];  // profilo attivo per ogni quarto d'ora
+    uint16_t nightStartMin;
+    uint16_t nightEndMin;
+    uint32_t generation;
+};
+
+// Due tabelle compilate, una attiva e una di riserva. Il task di controllo legge quella attiva
+// senza lock; chi aggiorna compila nella riserva e la rende attiva con un solo store atomico.
+// Prima di riusare la vecchia attende che nessun lettore la stia ancora copiando.
+// Gli aggiornamenti arrivano da un solo task alla volta (setup, poi la CLI di HomeSpan).
+class LightingProfiles {
+public:
+    static LightingProfiles& getInstance();
+
+    // Profili da NVS; se mancano o non sono validi restano quelli di default
+    void begin();
+    // nullptr se il set è valido ed è attivo, altrimenti il motivo dello scarto
+    const char* apply(const LightingProfileSet& set);
+    // Come apply, e in più salva in NVS
+    const char* update(const LightingProfileSet& set);
+
+    // Percorso caldo: parametri dello stato per il minuto locale, -1 se l'ora non è nota
+    StateParams params(LampState state, int32_t minuteOfDay) const;
+    uint32_t getGeneration() const;
+    // Ultimo set applicato; solo dal task che aggiorna
+    const LightingProfileSet& getSource() const { return source; }
+
+    static const char* validate(const LightingProfileSet& set);
+    static void compile(const LightingProfileSet& set, LightingTable& table);
+    static uint32_t checksum(const LightingProfileSet& set);
+
+private:
+    LightingProfiles();
+    LightingProfiles(const LightingProfiles&) = delete;
+    LightingProfiles& operator=(const LightingProfiles&) = delete;
+
+    struct Buffer {
+        LightingTable table;
+        mutable std::atomic<uint32_t> readers;
+    };
+
+    Buffer buffers[2];
+    std::atomic<Buffer*> active;
+    LightingProfileSet source;
+};
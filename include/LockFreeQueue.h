@@ -0,0 +1,153 @@
+#pragma once
+#include <atomic>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+
+// Code lock-free a dimensione fissa, senza heap, sicure tra i due core e il task esp_timer.
+// Nessuna delle due blocca: chi deve attendere si appoggia a un segnale a parte (hal::Queue).
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "servono atomici a 32 bit lock-free");
+
+// Più produttori, un consumatore. Sequenza per slot: un produttore prenota lo slot con una CAS
+// sulla posizione di scrittura e lo pubblica aggiornandone la sequenza; nessuna sezione critica.
+template <typename T, size_t N>
+class MpscQueue {
+    static_assert((N & (N - 1)) == 0, "N deve essere una potenza di 2");
+
+public:
+    MpscQueue() : enqueuePos(0), dequeuePos(0) {
+        for (size_t i = 0; i < N; ++i) {
+            slots[i].sequence.store(static_cast<uint32_t>(i), std::memory_order_relaxed);
+        }
+    }
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    // Da qualsiasi task; false se la coda è piena
+    bool push(const T& item) {
+        uint32_t pos = enqueuePos.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &slots[pos & (N - 1)];
+            uint32_t sequence = slot->sequence.load(std::memory_order_acquire);
+            int32_t diff = static_cast<int32_t>(sequence - pos);
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;  // slot ancora occupato da un giro precedente
+            } else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        slot->item = item;
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Solo dal consumatore; false se vuota o se il produttore non ha ancora finito lo slot
+    bool pop(T& item) {
+        Slot& slot = slots[dequeuePos & (N - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != dequeuePos + 1) {
+            return false;
+        }
+        item = slot.item;
+        slot.sequence.store(dequeuePos + static_cast<uint32_t>(N), std::memory_order_release);
+        ++dequeuePos;
+        return true;
+    }
+
+private:
+    struct Slot {
+        std::atomic<uint32_t> sequence;
+        T item;
+    };
+
+    Slot slots[N];
+    std::atomic<uint32_t> enqueuePos;
+    uint32_t dequeuePos;
+};
+
+// Un produttore e un consumatore: bastano due indici, ognuno scritto da un solo lato
+template <typename T, size_t N>
+class SpscQueue {
+    static_assert((N & (N - 1)) == 0, "N deve essere una potenza di 2");
+
+public:
+    SpscQueue() : head(0), tail(0) {}
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    bool push(const T& item) {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N) {
+            return false;
+        }
+        items[t & (N - 1)] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& item) {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = items[h & (N - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    T items[N];
+    std::atomic<uint32_t> head;  // scritto solo dal consumatore
+    std::atomic<uint32_t> tail;  // scritto solo dal produttore
+};
+
+// Copia di uno stato pubblicata da un solo scrittore e letta da chiunque senza lock (seqlock).
+// Il lettore riprova se la lettura si è sovrapposta a una pubblicazione.
+template <typename T>
+class Snapshot {
+    static const size_t WORDS = (sizeof(T) + 3) / 4;
+
+public:
+    Snapshot() : sequence(0) {
+        for (size_t i = 0; i < WORDS; ++i) {
+            words[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void publish(const T& value) {
+        uint32_t raw[WORDS] = {};
+        memcpy(raw, &value, sizeof(T));
+        uint32_t seq = sequence.load(std::memory_order_relaxed);
+        sequence.store(seq + 1, std::memory_order_relaxed);
+        // Ogni parola in release: chi la vede nuova vede anche la sequenza dispari
+        for (size_t i = 0; i < WORDS; ++i) {
+            words[i].store(raw[i], std::memory_order_release);
+        }
+        sequence.store(seq + 2, std::memory_order_release);
+    }
+
+    T read() const {
+        uint32_t raw[WORDS];
+        for (;;) {
+            uint32_t before = sequence.load(std::memory_order_acquire);
+            for (size_t i = 0; i < WORDS; ++i) {
+                raw[i] = words[i].load(std::memory_order_acquire);
+            }
+            if ((before & 1) == 0 && sequence.load(std::memory_order_relaxed) == before) {
+                break;
+            }
+        }
+        T value;
+        memcpy(&value, raw, sizeof(T));
+        return value;
+    }
+
+private:
+    std::atomic<uint32_t> sequence;  // dispari durante una pubblicazione
+    std::atomic<uint32_t> words[WORDS];
+};
@@ -0,0 +1,66 @@
+#pragma once
+#include <stdio.h>
+#include <type_traits>
+#include "Hal.h"
+
+// Log differito: chi chiama scrive un record binario a dimensione fissa in un ring lock-free
+// (sicuro da entrambi i core e dal task esp_timer); formattazione e Serial avvengono in un
+// task a bassa priorità. I livelli sopra LOG_LEVEL spariscono in compilazione.
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Il formato è controllato come per printf ma non valutato; il newline lo aggiunge il drain
+#define LOG_AT(level, fmt, ...)                                                 \
+    do {                                                                        \
+        if (LOG_LEVEL >= (level)) {                                             \
+            static_cast<void>(sizeof(printf(fmt, ##__VA_ARGS__)));              \
+            logRecord((level), fmt, ##__VA_ARGS__);                             \
+        }                                                                       \
+    } while (0)
+
+#define LOG_ERROR(fmt, ...) LOG_AT(LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
+#define LOG_WARN(fmt, ...) LOG_AT(LOG_LEVEL_WARN, fmt, ##__VA_ARGS__)
+#define LOG_INFO(fmt, ...) LOG_AT(LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#define LOG_DEBUG(fmt, ...) LOG_AT(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+
+struct LogRecord {
+    static const size_t MAX_ARGS = 4;
+    const char* fmt;  // letterale: viene formattato più tardi, dal task di drain
+    uint32_t timeMs;
+    uint8_t level;
+    uint8_t argCount;
+    uintptr_t args[MAX_ARGS];
+};
+
+// Accoda un record; false se il ring è pieno (il record viene contato come perso)
+bool logPush(const LogRecord& record);
+// Formatta e scrive fino a maxRecords record; ritorna quanti ne ha scritti
+size_t logDrain(size_t maxRecords = SIZE_MAX);
+uint32_t logDroppedCount();
+
+// Gli argomenti vengono salvati per valore: interi, enum, bool e stringhe letterali.
+// Un buffer locale passato come %s sarebbe già stato riusato al momento della stampa.
+template <typename T>
+inline uintptr_t logArg(T value) {
+    static_assert(std::is_integral<T>::value || std::is_enum<T>::value, "argomento di log non supportato");
+    return static_cast<uintptr_t>(value);
+}
+
+inline uintptr_t logArg(const char* literal) {
+    return reinterpret_cast<uintptr_t>(literal);
+}
+
+template <typename... Args>
+inline void logRecord(uint8_t level, const char* fmt, Args... args) {
+    static_assert(sizeof...(Args) <= LogRecord::MAX_ARGS, "troppi argomenti per un record di log");
+    LogRecord record = {fmt, hal::millis(), level, sizeof...(Args), {logArg(args)...}};
+    logPush(record);
+}
@@ -0,0 +1,92 @@
+#pragma once
+#include <atomic>
+#include <stddef.h>
+#include "Hal.h"
+
+// Metriche leggere per i percorsi caldi: istogrammi a bucket fissi (potenze di due) aggiornati
+// senza lock da qualsiasi task, tempo di CPU dei task, stack e heap minimi campionati, new per task.
+// Il dump è su richiesta: comando "@M" della CLI di HomeSpan, o Metrics::dump() nel banco host.
+class Histogram {
+public:
+    // Bucket 0: valore 0; bucket k: valori in [2^(k-1), 2^k); l'ultimo raccoglie il resto
+    static const uint8_t BUCKETS = 24;
+
+    Histogram(const char* name, const char* unit);
+    void record(uint32_t value);
+    void reset();
+
+    uint32_t count() const { return total.load(std::memory_order_relaxed); }
+    uint32_t max() const { return maxValue.load(std::memory_order_relaxed); }
+    // Limite superiore del bucket che contiene il percentile richiesto
+    uint32_t percentile(uint8_t pct) const;
+    const char* getName() const { return name; }
+    const char* getUnit() const { return unit; }
+
+private:
+    const char* name;
+    const char* unit;
+    std::atomic<uint32_t> buckets[BUCKETS];
+    std::atomic<uint32_t> total;
+    std::atomic<uint32_t> maxValue;
+};
+
+namespace Metrics {
+
+static const uint8_t MAX_TASKS = 8;
+
+extern Histogram evaluateCycles;   // LampStateMachine::evaluate
+extern Histogram sensorToFadeUs;   // frame del radar -> avvio del fade
+extern Histogram homeKitToDutyUs;  // scrittura HomeKit -> duty aggiornato
+extern Histogram fadeJitterUs;     // fine reale del fade rispetto a quella prevista
+
+// Da chiamare nel task stesso all'avvio; per i task altrui (HomeSpan) si passa l'handle. Il carico
+// dei task altrui viene dai run-time stats di FreeRTOS se attivi, altrimenti è solo il tempo
+// passato nelle nostre callback (BusyScope) e il dump lo dice.
+// stackBytes è lo stack dato alla creazione: il dump ne ricava la dimensione consigliata
+void registerTask(const char* name, uint32_t stackBytes = 0, hal::TaskHandle handle = hal::currentTask());
+// Aggiunge al task corrente il tempo di CPU dato; i task non registrati vengono ignorati
+void addBusyUs(uint32_t us);
+// Stack libero di ogni task, heap minimo e carico dall'ultimo campione; dal task di log
+void sampleSystem();
+// Scrive tutto su hal::logWrite, una riga per voce
+void dump();
+void reset();
+
+// Heap: ogni new passa da qui (sul dispositivo con l'operator new di Metrics.cpp, sull'host con
+// quello del banco) ed è attribuita al task registrato che la chiede, le altre a "altro"
+void* trackedAlloc(size_t size);  // nullptr se l'heap è esaurito
+void trackedFree(void* p);
+// Fine di setup(): da qui ogni new conta come allocazione a regime e il blocco libero più grande
+// si confronta con quello di adesso
+void sealHeap();
+uint32_t heapAllocs();
+uint32_t heapAllocsSinceSeal();
+uint32_t heapLiveBytes();  // byte ancora allocati con new
+
+// Primo istante con il LED acceso o in salita (esclusi i lampeggi di stato), in ms dall'avvio; solo la prima volta
+static const uint32_t NO_LIGHT = UINT32_MAX;
+void markFirstLight();
+uint32_t firstLightMs();  // NO_LIGHT finché il LED non si è acceso
+
+// Durata di un tratto in cicli; alla distruzione finisce nell'istogramma
+class CycleScope {
+public:
+    explicit CycleScope(Histogram& histogram) : histogram(histogram), start(hal::cycles()) {}
+    ~CycleScope() { histogram.record(hal::cycles() - start); }
+
+private:
+    Histogram& histogram;
+    uint32_t start;
+};
+
+// Tempo di CPU del task corrente speso nel tratto
+class BusyScope {
+public:
+    BusyScope() : start(hal::cycles()) {}
+    ~BusyScope() { addBusyUs((hal::cycles() - start) / hal::cyclesPerUs()); }
+
+private:
+    uint32_t start;
+};
+
+}  // namespace Metrics
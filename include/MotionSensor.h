@@ -1,21 +1,78 @@
 #pragma once
-#include <Arduino.h>
-#include <ld2410.h>
+#include <atomic>
+#include "Hal.h"
+#include "GateCalibrator.h"
+#include "LD2410Parser.h"
+#include "PresenceFilter.h"
+#include "ZoneOccupancy.h"
 
 class MotionSensor {
 private:
-    ld2410 sensor;
+    hal::Uart uart;
+    int rxPin;
+    int txPin;
+    LD2410Parser parser;
+    PresenceFilter filter;
+    ZoneOccupancy zones;
+    GateCalibrator calibrator;
+    char calibrationKey[12];  // una calibrazione per UART
+    std::atomic<uint32_t> calibrationRequestMs;
+    std::atomic<bool> backgroundLearning;
+    LD2410Frame lastFrame;
+    uint32_t lastFrameTime;
+    uint32_t lastEngineeringTime;
+    uint32_t lastOverruns;
+    uint8_t lastRawTarget;
     bool presenceDetected;
     bool movementDetected;
     uint16_t movementDistance;
     uint16_t stationaryDistance;
 
+    bool applyFrame(const LD2410Frame& frame);
+    void sendCommand(uint16_t command, const uint8_t* value, size_t valueLen);
+    void writeThresholds(const GateThresholds& thresholds);
+
 public:
-    MotionSensor();
+    static const uint32_t CONNECTION_TIMEOUT_MS = 1000;
+    static const uint8_t DEFAULT_UART_PORT = 2;
+    static const int DEFAULT_RX_PIN = 16;
+    static const int DEFAULT_TX_PIN = 17;
+
+    // Un radar per UART: con più lampade ognuna può averne uno suo (UART1 e UART2, la 0 è la console)
+    explicit MotionSensor(uint8_t uartPort = DEFAULT_UART_PORT, int rxPin = DEFAULT_RX_PIN, int txPin = DEFAULT_TX_PIN);
     void begin();
-    void update();
+    bool update();  // true se presenza o movimento filtrati sono cambiati
+    void setFilterConfig(const PresenceFilterConfig& config) { filter.setConfig(config); }
+    // Energie per gate nei frame: servono alle zone. Il radar risponde con un ack, scartato dal parser
+    void setEngineeringMode(bool enabled);
+    void setZones(const ZoneConfig* config, uint8_t count) { zones.setZones(config, count); }
+    void setZoneThresholds(const uint8_t* moving, const uint8_t* stationary) { zones.setThresholds(moving, stationary); }
+    // Calibrazione dei gate a stanza vuota; da qualsiasi task, parte al prossimo update()
+    void requestCalibration(uint32_t durationMs) { calibrationRequestMs.store(durationMs); }
+    // Dal task di controllo: lampada spenta di notte, il fondo dei gate può seguire la stanza
+    void setBackgroundLearning(bool enabled) { backgroundLearning.store(enabled, std::memory_order_relaxed); }
+    const GateCalibrator& getCalibrator() const { return calibrator; }
+    // Blocca finché il driver UART non segnala nuovi byte; false al timeout
+    bool waitForData(uint32_t timeoutMs) { return uart.waitForData(timeoutMs); }
+    // Sospesa, la UART scarta i frame senza interrupt: chi attende in waitForData dorme
+    void setSuspended(bool suspended) { uart.setRxEnabled(!suspended); }
+    bool isConnected() const;
     bool isPresenceDetected() const { return presenceDetected; }
     bool isMovementDetected() const { return movementDetected; }
     uint16_t getMovementDistance() const { return movementDistance; }
     uint16_t getStationaryDistance() const { return stationaryDistance; }
-};
\ No newline at end of file
+    // Bitmap delle zone occupate; valida solo se arrivano frame engineering
+    uint8_t getOccupiedZones() const { return zones.getOccupied(); }
+    bool hasZones() const;
+    const ZoneOccupancy& getZoneOccupancy() const { return zones; }
+    const LD2410Frame& getLastFrame() const { return lastFrame; }
+    const LD2410Stats& getStats() const { return parser.getStats(); }
+#ifdef SMARTLAMP_NATIVE
+    // Su host non c'è il radar: la lettura viene imposta dal chiamante, senza filtro
+    void injectReading(bool presence, bool movement, uint16_t movingDistance, uint16_t stillDistance);
+    // Oppure arriva come byte grezzi sulla UART simulata
+    size_t injectBytes(const uint8_t* data, size_t len) { return uart.inject(data, len); }
+    // Oppure come frame già decodificato, che passa dal filtro
+    bool injectFrame(const LD2410Frame& frame) { return applyFrame(frame); }
+#endif
+};
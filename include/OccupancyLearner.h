@@ -0,0 +1,76 @@
+#pragma once
+#include "Hal.h"
+
+// Storico per quarto d'ora della settimana, in NVS come blob versionato
+struct OccupancyHistory {
+    static const uint8_t VERSION = 2;  // 1: occupazione imparata dalla lampada accesa
+    static const uint16_t SLOT_MIN = 15;
+    static const uint16_t SLOTS_PER_DAY = 24 * 60 / SLOT_MIN;
+    static const uint16_t SLOTS = 7 * SLOTS_PER_DAY;
+
+    uint8_t version;
+    uint8_t reserved[3];
+    uint8_t arrivalQ8[SLOTS];    // probabilità di un arrivo nel quarto d'ora, in Q8
+    uint8_t occupancyQ8[SLOTS];  // frazione del quarto d'ora con la stanza occupata, in Q8
+};
+
+// Apprendimento dell'occupazione per ora del giorno e giorno della settimana. Ogni quarto d'ora
+// osservato aggiorna il suo contatore con una media esponenziale sulle settimane: memoria fissa,
+// lavoro costante per transizione. Serve a preaccendere la lampada poco prima di un arrivo
+// probabile e ad allungare o accorciare i timeout di RELAXATION e SLEEP.
+// Da un solo task: quello di controllo della lampada.
+class OccupancyLearner {
+public:
+    static const uint8_t LEARN_SHIFT = 2;              // peso 1/4 all'ultima settimana
+    static const uint8_t NEUTRAL_OCCUPANCY_Q8 = 128;   // timeout invariati finché non si impara
+    static const uint8_t ARRIVAL_THRESHOLD_Q8 = 96;    // arrivo atteso almeno 3 volte su 8
+    static const uint16_t PREWARM_LEAD_MIN = 10;
+    static const uint16_t PREWARM_QUIET_MIN = 60;      // niente preaccensione subito dopo un arrivo
+    static const uint16_t PREWARM_LEVEL_Q8 = 64;       // frazione della luminosità di FULL_ON
+    static const uint16_t PREWARM_FADE_MS = 20000;
+    static const uint16_t SAVE_BATCH_SLOTS = 16;       // un salvataggio in NVS ogni 4 ore osservate
+
+    static OccupancyLearner& getInstance();
+
+    // Storico da NVS; se manca o è di un'altra versione si riparte da zero
+    void begin();
+    void reset();
+
+    // Dopo ogni valutazione della macchina a stati: stanza occupata (movimento o presenza) e
+    // arrivo (uscita da OFF).
+    // Chiude il quarto d'ora precedente quando weekMinute passa al successivo
+    void observe(int32_t weekMinute, bool occupied, bool arrival);
+
+    // true se conviene preaccendere: un arrivo è probabile ora o entro PREWARM_LEAD_MIN
+    bool shouldPrewarm(int32_t weekMinute) const;
+    // Il prossimo minuto dopo weekMinute in cui inizia una preaccensione, PREWARM_LEAD_MIN prima
+    // di un quarto d'ora con un arrivo probabile; può superare la fine della settimana, -1 se nessuno
+    int32_t nextPrewarmMinute(int32_t weekMinute) const;
+    // Timeout scalato tra 0,5x e 2x secondo l'occupazione abituale a quando scadrebbe
+    uint32_t scaleTimeout(uint32_t durationMs, int32_t weekMinute) const;
+
+    // Salva se ci sono almeno SAVE_BATCH_SLOTS quarti d'ora nuovi; true se ha scritto
+    bool persistIfDue();
+    void persist();
+
+    uint8_t getArrival(uint16_t slot) const { return history.arrivalQ8[slot]; }
+    uint8_t getOccupancy(uint16_t slot) const { return history.occupancyQ8[slot]; }
+    static uint16_t slotOf(int32_t weekMinute) { return static_cast<uint16_t>(weekMinute / OccupancyHistory::SLOT_MIN); }
+
+private:
+    OccupancyLearner();
+    OccupancyLearner(const OccupancyLearner&) = delete;
+    OccupancyLearner& operator=(const OccupancyLearner&) = delete;
+
+    static uint8_t learn(uint8_t average, uint8_t sample);
+    void closeSlot();
+
+    OccupancyHistory history;
+    int32_t lastMinute;      // ultima osservazione, -1 se nessuna
+    int32_t lastArrival;     // minuto della settimana dell'ultimo arrivo, -1 se nessuno
+    uint16_t currentSlot;
+    uint8_t occupiedMin;     // minuti occupati nel quarto d'ora corrente
+    bool lastOccupied;
+    bool slotArrival;
+    uint16_t dirtySlots;
+};
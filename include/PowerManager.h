@@ -0,0 +1,67 @@
+#pragma once
+#include <atomic>
+#include "Hal.h"
+#include "LedController.h"
+#include "MotionSensor.h"
+
+// Indicatori del consumo a riposo: quanto a lungo il controllo è rimasto parcheggiato (CPU libera
+// di scendere di frequenza e di andare in light sleep) e quante volte è stato svegliato nel frattempo
+struct PowerStats {
+    uint32_t parks;
+    uint32_t pinWakes;        // risvegli dal pin OUT del radar
+    uint32_t parkedWakeups;   // passi del task di controllo mentre era parcheggiato
+    uint64_t parkedMs;
+};
+
+// Parcheggia il percorso di controllo di giorno e nelle pause lunghe in OFF: rilascia i lock di
+// energia (frequenza dinamica fino a MIN_MHZ e light sleep automatico), sospende la UART del radar
+// e di notte arma il pin OUT, che va alto appena il radar vede qualcuno. Si riparte al fronte del
+// pin, a un evento HomeKit, al prossimo cambio giorno/notte o quando una preaccensione accende il
+// LED; il task di controllo intanto si sveglia a ogni quarto d'ora per il learner e resta parcheggiato.
+// Si parcheggia solo a LED spento e fermo: il LEDC va col clock APB, che in light sleep si ferma.
+class PowerManager {
+public:
+    static const uint32_t MAX_MHZ = 240;
+    static const uint32_t MIN_MHZ = 80;            // sotto, l'APB cambierebbe e con lui il PWM
+    static const uint32_t IDLE_PARK_MS = 60000;    // più del fade più lungo ammesso dai profili
+
+    static PowerManager& getInstance();
+
+    // Configura la gestione dell'energia e il pin di risveglio; si parte attivi
+    void begin(LedController& led, MotionSensor& sensor, uint8_t wakePin);
+
+    // Dal task di controllo dopo ogni passo: night = lampada attiva, lampIdle = in OFF senza preaccensione
+    void update(bool night, bool lampIdle);
+    // Prossimo passo necessario: da parcheggiati il cambio giorno/notte, prima il momento di parcheggiare
+    uint32_t msUntilNextCheck() const;
+    // Conta un risveglio del task di controllo, se arriva mentre è parcheggiato
+    void noteWakeup();
+
+    bool isParked() const { return parked.load(std::memory_order_relaxed); }
+    bool isLightSleepEnabled() const { return lightSleep; }
+    // parkedMs comprende il parcheggio in corso
+    PowerStats getStats() const;
+    void resetStats();
+
+private:
+    PowerManager();
+    PowerManager(const PowerManager&) = delete;
+    PowerManager& operator=(const PowerManager&) = delete;
+
+    static void onWakePin();
+    void park(bool night);
+    void resume();
+
+    LedController* led;
+    MotionSensor* sensor;
+    hal::PowerLock cpuLock;
+    hal::PowerLock sleepLock;
+    std::atomic<bool> parked;
+    std::atomic<bool> wakeRequested;  // dall'interrupt del pin
+    bool pinArmed;
+    bool lightSleep;
+    bool idle;
+    uint32_t idleSince;
+    uint32_t parkedAt;
+    PowerStats stats;
+};
@@ -0,0 +1,54 @@
+#pragma once
+#include "Hal.h"
+
+struct PresenceFilterConfig {
+    // Tempi di conferma asimmetrici: accendere deve essere rapido, spegnere prudente
+    uint16_t movementOnMs;
+    uint16_t movementOffMs;
+    uint16_t presenceOnMs;
+    uint16_t presenceOffMs;
+    uint16_t maxDistance;    // cm; bersagli oltre questa distanza sono ignorati, 0 = nessun limite
+    uint8_t smoothingShift;  // EMA sulle distanze con alpha = 1 / 2^shift, 0 = nessuno smoothing
+
+    static PresenceFilterConfig defaults() { return {100, 2000, 200, 5000, 0, 2}; }
+    static PresenceFilterConfig passthrough() { return {0, 0, 0, 0, 0, 0}; }
+};
+
+// Booleano con isteresi temporale: cambia solo se il valore grezzo resta diverso per il tempo di hold
+class HysteresisFlag {
+public:
+    HysteresisFlag() : state(false), pending(false), since(0) {}
+    bool update(bool raw, uint32_t nowMs, uint16_t onMs, uint16_t offMs);
+    bool get() const { return state; }
+
+private:
+    bool state;
+    bool pending;
+    uint32_t since;
+};
+
+// Filtro O(1) per campione sulle letture del radar: gate di distanza, isteresi e EMA in virgola fissa
+class PresenceFilter {
+public:
+    explicit PresenceFilter(const PresenceFilterConfig& config = PresenceFilterConfig::defaults());
+
+    void setConfig(const PresenceFilterConfig& newConfig) { config = newConfig; }
+    const PresenceFilterConfig& getConfig() const { return config; }
+
+    // Restituisce true se movimento o presenza filtrati sono cambiati
+    bool update(bool movement, bool presence, uint16_t movingDistance, uint16_t stationaryDistance, uint32_t nowMs);
+
+    bool isMovement() const { return movement.get(); }
+    bool isPresence() const { return presence.get(); }
+    uint16_t getMovementDistance() const { return static_cast<uint16_t>(movingDistanceQ8 >> 8); }
+    uint16_t getStationaryDistance() const { return static_cast<uint16_t>(stationaryDistanceQ8 >> 8); }
+
+private:
+    uint32_t smooth(uint32_t averageQ8, uint16_t sample) const;
+
+    PresenceFilterConfig config;
+    HysteresisFlag movement;
+    HysteresisFlag presence;
+    uint32_t movingDistanceQ8;  // Q24.8
+    uint32_t stationaryDistanceQ8;
+};
@@ -0,0 +1,63 @@
+#pragma once
+#include "Hal.h"
+#include "LampStateTable.h"
+
+// Ultimo stato della lampada, per ripartire subito dopo un reset invece di restare al buio
+struct ResumeRecord {
+    static const uint8_t VERSION = 1;
+
+    uint8_t version;
+    LampState state;
+    uint8_t brightness;  // luminosità impostata da HomeKit
+    bool autoMode;
+    uint32_t epoch;      // orologio al salvataggio
+    uint32_t checksum;   // FNV-1a dei byte precedenti
+};
+static_assert(sizeof(ResumeRecord) <= hal::RETAINED_SIZE, "ResumeRecord deve stare nella memoria RTC");
+
+// Copia in RTC slow memory a ogni cambio (sopravvive a brown-out, watchdog e riavvii dopo un OTA)
+// e in NVS a intervalli (sopravvive allo spegnimento). Al boot vince la copia in RTC; da quella in
+// NVS si riprendono sempre luminosità e modalità, lo stato solo se l'orologio dice che è recente.
+class ResumeState {
+public:
+    static const uint32_t MAX_AGE_S = 600;             // stato da NVS più vecchio: si riparte da OFF
+    static const uint32_t PERSIST_INTERVAL_MS = 60000;  // scritture in NVS al massimo una al minuto
+    static const uint8_t DEFAULT_BRIGHTNESS = 100;
+
+    enum class Source : uint8_t {
+        NONE,
+        RTC,
+        NVS,
+    };
+
+    static ResumeState& getInstance();
+
+    // Al boot, prima di tutto il resto: legge le copie e se serve rimette l'orologio
+    void begin();
+    Source getSource() const { return source; }
+    // true se lo stato della lampada va ripreso subito, non solo le impostazioni
+    bool hasLampState() const { return lampState; }
+    const ResumeRecord& get() const { return record; }
+
+    // Dal task di controllo dopo ogni passo: la copia in RTC segue subito, quella in NVS solo se è cambiato qualcosa
+    void update(LampState state, uint8_t brightness, bool autoMode);
+    bool persistIfDue();
+    // Millisecondi al prossimo salvataggio in NVS, UINT32_MAX se non c'è niente da salvare
+    uint32_t msUntilPersist() const;
+
+    static uint32_t checksum(const ResumeRecord& record);
+
+private:
+    ResumeState();
+    ResumeState(const ResumeState&) = delete;
+    ResumeState& operator=(const ResumeState&) = delete;
+
+    static bool isValid(const ResumeRecord& record);
+    void seal();
+
+    ResumeRecord record;
+    Source source;
+    bool lampState;
+    bool dirty;
+    uint32_t lastPersistMs;
+};
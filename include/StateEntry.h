@@ -0,0 +1,20 @@
+#pragma once
+#include "Hal.h"
+#include "LedController.h"
+#include "LampStateTable.h"
+#include "LightingProfiles.h"
+
+// Azione di ingresso in uno stato, la stessa per la lampada singola e per ogni lampada di LampBank:
+// parametri dal profilo attivo per l'ora locale, fade verso la frazione del duty del livello
+// impostato, livello a HomeKit e transizione nella trace
+namespace StateEntry {
+
+// from == to: ripresa al boot, nessuna transizione da registrare. Restituisce i parametri usati,
+// per il timeout dello stato
+StateParams apply(LedController& led, uint8_t lamp, LampState from, LampState to, uint8_t maxBrightness, int32_t minute);
+
+// Fade verso la frazione levelQ8 del duty di maxBrightness (0 = spento) e livello percepito
+// equivalente a HomeKit; usato anche dalla preaccensione
+void fadeTo(LedController& led, uint8_t lamp, uint8_t maxBrightness, uint16_t levelQ8, uint32_t fadeMs);
+
+}
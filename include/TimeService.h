@@ -0,0 +1,73 @@
+#pragma once
+#include <atomic>
+#include "Hal.h"
+#include "DaySchedule.h"
+
+// Servizio dell'ora in background: SNTP, lookup del fuso (salvato in NVS) e calcolo del
+// prossimo cambio giorno/notte. Senza rete continua a usare l'RTC e le ultime impostazioni.
+class TimeService {
+public:
+    static const uint32_t MIN_VALID_EPOCH = 1704067200;      // 2024-01-01: prima l'RTC non è impostato
+    static const uint32_t LOOKUP_INTERVAL_MS = 24 * 3600000;  // rilegge il fuso per l'ora legale
+    static const uint32_t LOOKUP_RETRY_MS = 10 * 60000;
+    static const uint32_t HTTP_TIMEOUT_MS = 3000;
+    static const uint32_t MAX_POLL_MS = 3600000;  // ricalcolo periodico contro i salti dell'orologio
+    static const int32_t MINUTES_PER_DAY = 24 * 60;
+    static const int32_t MINUTES_PER_WEEK = 7 * MINUTES_PER_DAY;
+
+    static TimeService& getInstance();
+
+    // Carica le impostazioni salvate; non usa la rete
+    void begin(const char* ntpServer = "pool.ntp.org");
+    // Chiamabile da qualsiasi task, ad esempio dal callback WiFi di HomeSpan
+    void onNetworkUp();
+
+    // Un passo del servizio, dal suo task: ritorna i ms fino al prossimo passo necessario
+    uint32_t poll();
+    // Attende fino a timeoutMs o finché qualcuno non sveglia il servizio
+    void waitForWork(uint32_t timeoutMs);
+
+    bool isValid() const;
+    // O(1): confronto con l'istante del prossimo cambio già calcolato
+    bool isNightTime() const;
+    uint32_t getNextChange() const;
+    // Minuto locale dalla mezzanotte, -1 finché l'ora non è nota
+    int32_t localMinute() const;
+    // Minuto locale dal lunedì alle 00:00, -1 finché l'ora non è nota
+    int32_t localWeekMinute() const;
+    // Minuti locali dal 1970, -1 finché l'ora non è nota: la scala dello storico d'uso
+    int32_t localEpochMinute() const;
+    // Finestra notturna senza posizione; da qualsiasi task, la applica il servizio al prossimo passo
+    void setNightWindow(uint16_t startMin, uint16_t endMin);
+    const TimeSettings& getSettings() const { return settings; }
+    uint32_t getLookups() const { return lookups; }
+
+private:
+    TimeService();
+    TimeService(const TimeService&) = delete;
+    TimeService& operator=(const TimeService&) = delete;
+
+    static const uint32_t NO_WINDOW = UINT32_MAX;
+
+    static void wake();
+    void applyPendingWindow();
+    bool lookupTimeZone();
+    void updateSchedule(uint32_t now);
+
+    const char* ntpServer;
+    TimeSettings settings;
+    hal::Queue<uint8_t, 1> wakeups;
+    mutable hal::SpinLock lock;
+    DayNight schedule;       // protetto da lock: lo legge il task di controllo
+    int32_t offsetSec;       // protetto da lock: copia di settings.utcOffsetSec per localMinute
+    std::atomic<uint32_t> pendingWindow;  // inizio << 16 | fine, NO_WINDOW se nessuna
+    bool scheduleValid;
+    bool scheduleDirty;
+    bool publishedNight;
+    uint32_t computedAt;
+    volatile bool networkUp;
+    bool sntpStarted;
+    bool lookupDone;
+    uint32_t nextLookupMs;
+    uint32_t lookups;
+};
@@ -0,0 +1,130 @@
+#pragma once
+#include "Hal.h"
+#include "LampStateTable.h"
+#include "FadeEngine.h"
+
+// Registro binario compatto degli eventi della lampada, scritto nella partizione "spiffs"
+// (usata grezza, senza filesystem) a pagine intere per limitare usura e blocchi in scrittura.
+//
+// Pagina: TracePageHeader + record. Record: [tipo | flag<<4] [delta ms varint] [payload].
+// Il delta è rispetto al record precedente della stessa pagina, o a baseMs per il primo.
+
+enum class TraceType : uint8_t {
+    SENSOR = 1,   // flag: bit0 movimento, bit1 presenza; payload: distanze varint
+    BRIGHTNESS,   // payload: luminosità 0-100
+    AUTO_MODE,    // flag: bit0 modalità auto
+    STATE,        // flag: lampada (0 la singola); payload: stato precedente << 4 | nuovo stato
+    FADE,         // flag: curva; payload: duty varint, durata varint
+};
+
+struct TraceRecord {
+    TraceType type;
+    uint32_t timeMs;
+    union {
+        struct {
+            bool movement;
+            bool presence;
+            uint16_t movingDistance;
+            uint16_t stationaryDistance;
+        } sensor;
+        uint8_t brightness;
+        bool autoMode;
+        struct {
+            LampState from;
+            LampState to;
+            uint8_t lamp;
+        } state;
+        struct {
+            uint32_t targetDuty;
+            uint32_t durationMs;
+            FadeCurve curve;
+        } fade;
+    };
+};
+
+struct TracePageHeader {
+    static const uint16_t MAGIC = 0x5254;  // "TR"
+    uint16_t magic;
+    uint16_t length;  // byte usati, header compreso
+    uint32_t sequence;
+    uint32_t baseMs;
+};
+
+struct TraceStats {
+    uint32_t records;
+    uint32_t dropped;  // pagina piena mentre la precedente era ancora da scrivere
+    uint32_t pagesWritten;
+    uint32_t sectorsErased;
+};
+
+class TraceRecorder {
+public:
+    static const size_t PAGE_SIZE = 256;
+    static const size_t MAX_RECORD = 16;
+
+    static TraceRecorder& getInstance();
+
+    // offset e length: finestra della partizione per il ring, 0 per tutta
+    bool begin(const char* label = "spiffs", size_t offset = 0, size_t length = 0);
+    bool isReady() const { return ready; }
+
+    void recordSensor(bool movement, bool presence, uint16_t movingDistance, uint16_t stationaryDistance);
+    void recordBrightness(uint8_t brightness);
+    void recordAutoMode(bool autoMode);
+    void recordState(LampState from, LampState to, uint8_t lamp = 0);
+    void recordFade(uint32_t targetDuty, uint32_t durationMs, FadeCurve curve);
+
+    // Chiude la pagina corrente anche se non è piena
+    void flush();
+    // Scrive in flash le pagine chiuse; su ESP32 lo chiama un task a bassa priorità
+    bool pump(uint32_t timeoutMs);
+
+    const TraceStats& getStats() const { return stats; }
+    hal::Partition& getPartition() { return partition; }
+
+private:
+    TraceRecorder();
+    TraceRecorder(const TraceRecorder&) = delete;
+    TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+    void append(uint8_t typeAndFlags, const uint8_t* payload, size_t len);
+    void closePage();
+    void writePage(const uint8_t* page);
+
+    hal::Partition partition;
+    hal::SpinLock lock;
+    hal::Queue<uint8_t, 2> pendingPages;
+    uint8_t pages[2][PAGE_SIZE];
+    uint8_t activePage;
+    bool pagePending[2];
+    size_t used;
+    uint32_t lastMs;
+    uint32_t sequence;
+    size_t nextPageOffset;
+    bool ready;
+    TraceStats stats;
+};
+
+// Lettura di una partizione di trace, in ordine di scrittura dalla pagina più vecchia
+class TraceReader {
+public:
+    explicit TraceReader(const hal::Partition& partition);
+    bool next(TraceRecord& record);
+    uint32_t getPages() const { return pagesRead; }
+
+private:
+    bool loadPage();
+
+    const hal::Partition& partition;
+    uint8_t page[TraceRecorder::PAGE_SIZE];
+    size_t pageCount;
+    size_t pageIndex;
+    size_t pagesVisited;
+    size_t offset;
+    size_t length;
+    uint32_t timeMs;
+    uint32_t pagesRead;
+};
+
+size_t encodeVarint(uint32_t value, uint8_t* out);
+size_t decodeVarint(const uint8_t* in, size_t available, uint32_t& value);
@@ -0,0 +1,185 @@
+#pragma once
+#include "Hal.h"
+#include "LampStateTable.h"
+
+// Uso di una stanza in un'ora o in una giornata: minuti accesi per stato, occupati, accesi di notte
+struct UsageCounters {
+    enum Field : uint8_t { FULL_ON, RELAXATION, SLEEP, SUDDEN_MOVEMENT, OCCUPIED, NIGHT_LIT, FIELDS };
+    uint16_t minutes[FIELDS];
+    uint8_t records;  // record fusi in questo intervallo, 0 se non ci sono dati
+
+    uint16_t lit() const { return minutes[FULL_ON] + minutes[RELAXATION] + minutes[SLEEP] + minutes[SUDDEN_MOVEMENT]; }
+};
+
+struct MinuteUsage {
+    LampState state;
+    bool occupied;
+    bool night;
+    bool known;  // false: nessun dato (scheda spenta, ora non nota o dettaglio già riciclato)
+};
+
+// Header di un settore dello storico. I campi partono cancellati e si scrivono una volta sola:
+// magic, versione e cancellazioni subito dopo la cancellazione, il resto quando il settore diventa
+// un segmento, con il livello per ultimo. Un settore con il solo header e il resto cancellato è
+// libero; senza header, con un header a metà o con byte scritti oltre, va cancellato prima dell'uso
+struct HistorySegmentHeader {
+    static const uint16_t MAGIC = 0x4855;  // "UH"
+    static const uint8_t VERSION = 1;
+    static const uint8_t FREE = 0xFF;
+
+    uint16_t magic;
+    uint8_t tier;
+    uint8_t version;
+    uint32_t eraseCount;
+    uint32_t sequence;
+    int32_t base;  // tempo del primo chunk nell'unità del livello (minuto, ora, giornata)
+};
+
+struct HistoryStats {
+    uint32_t chunks;
+    uint32_t bytesWritten[3];  // per livello: minuti, ore, giornate
+    uint32_t bytesRead;        // dalle interrogazioni
+    uint32_t sectorsErased;
+    uint32_t relocations;  // segmenti freddi spostati per livellare l'usura
+    uint32_t dropped;      // chunk persi con la coda piena o senza partizione
+};
+
+// Storico d'uso per stanza, in una finestra della partizione "spiffs" a settori da 4 KB.
+// Tre livelli di segmenti append-only: i minuti come run-length di (stato, occupato, notte), e gli
+// aggregati per ora e per giornata, scritti quando l'ora o la giornata si chiude. Ogni chunk è
+// [lunghezza][stanza][delta del tempo dal chunk precedente della stanza, zigzag varint][dati]:
+// i minuti come varint (durata << 5 | flag), gli aggregati come bitmap dei campi non nulli e i
+// loro varint. Il dettaglio invecchia per primo: quando serve spazio si ricicla il segmento più
+// vecchio del livello oltre la sua quota, e ciò che conteneva è già negli aggregati. Tra i settori
+// liberi si sceglie il meno cancellato, e un segmento fermo da troppo (i giorni) viene copiato su
+// quello appena riciclato, così anche il suo settore torna in rotazione.
+// La giornata va da mezzogiorno a mezzogiorno: una notte non è mai divisa tra due giornate.
+//
+// observe dal task di controllo, pump dal task di scrittura della trace (la flash blocca per
+// qualche ms), le interrogazioni da qualsiasi task: leggono solo i segmenti del livello che
+// coprono l'intervallo chiesto, più i dati ancora in RAM.
+class UsageHistory {
+public:
+    enum Tier : uint8_t { MINUTES, HOURS, DAYS, TIERS };
+    static const uint8_t MAX_ROOMS = 8;
+    static const uint8_t MAX_SECTORS = 16;
+    static const int32_t DAY_START_MIN = 12 * 60;
+    static const int32_t MAX_FILL_MIN = 7 * 24 * 60;  // oltre, il salto dell'orologio diventa un buco
+    static const uint32_t WEAR_SPREAD = 8;            // cancellazioni di distacco prima di spostare un segmento
+    static const size_t CHUNK_MAX = 128;              // un'ora di minuti, run di al più 2 byte
+    static const size_t PENDING_BYTES = 1024;
+
+    UsageHistory();
+
+    // partition: finestra già aperta, almeno 3 settori. Ricostruisce la tabella dei segmenti; quel che
+    // un'interruzione dell'alimentazione ha lasciato a metà si cancella prima di riusarlo
+    bool begin(hal::Partition& partition);
+
+    // Lo stato della stanza al minuto locale (-1 finché l'ora non è nota). Chiamabile a ogni
+    // passo: i minuti senza chiamate prendono l'ultimo stato, l'occupazione di un minuto è l'OR
+    void observe(uint8_t room, int32_t localMinute, LampState state, bool occupied, bool night);
+    // Scrive in flash i chunk chiusi; false se non ce n'erano o se un'interrogazione è in corso
+    bool pump();
+
+    // Interrogazioni: out[i] per l'intervallo first + i; restituiscono quanti elementi hanno dati
+    size_t queryDays(uint8_t room, int32_t firstDay, size_t count, UsageCounters* out);
+    size_t queryHours(uint8_t room, int32_t firstHour, size_t count, UsageCounters* out);
+    size_t queryMinutes(uint8_t room, int32_t firstMinute, size_t count, MinuteUsage* out);
+    // Minuti accesi nelle notti delle ultime nights giornate fino a quella di localMinute, dalla più
+    // vecchia; le notti con dati si contano sulle prime 128
+    size_t litPerNight(uint8_t room, int32_t localMinute, uint16_t* out, size_t nights);
+
+    static int32_t dayOf(int32_t minute) { return floorDiv(minute - DAY_START_MIN, 24 * 60); }
+    static int32_t hourOf(int32_t minute) { return floorDiv(minute, 60); }
+
+    const HistoryStats& getStats() const { return stats; }
+    uint8_t segmentCount(Tier tier) const;
+    // Il dato più vecchio ancora in flash per il livello, in minuti locali; -1 se vuoto
+    int32_t oldestMinute(Tier tier) const;
+    uint32_t maxEraseCount() const;
+    uint32_t minEraseCount() const;
+
+private:
+    struct Segment {
+        uint8_t tier;  // Tier, FREE, o DIRTY se va cancellato prima dell'uso
+        uint32_t eraseCount;
+        uint32_t sequence;
+        int32_t base;
+        int32_t firstTime;  // intervallo coperto dai chunk, per saltare i segmenti fuori richiesta
+        int32_t lastTime;
+        uint16_t used;      // byte occupati, header compreso
+        bool sealed;        // scrittura interrotta: niente più chunk in questo segmento
+    };
+
+    struct RoomCursor {
+        int32_t next;  // minuto aperto, -1 finché la stanza non è osservata
+        uint8_t flags;
+        uint8_t levelFlags;  // ultimo stato osservato, per i minuti senza chiamate
+        uint8_t runFlags;
+        uint16_t runLength;
+        int32_t chunkStart;
+        uint8_t chunkLength;
+        uint8_t chunk[CHUNK_MAX];
+        UsageCounters hour;
+        UsageCounters day;
+        int32_t restoredDay;  // giornata ripresa dalle ore in flash al boot, NO_DAY se nessuna
+    };
+
+    // Voce della coda verso la flash: tempo assoluto, il delta lo calcola pump sul segmento di arrivo
+    struct PendingHeader {
+        uint8_t tier;
+        uint8_t room;
+        uint8_t length;
+        int32_t start;  // nell'unità del livello
+        int32_t end;    // fine esclusa per i minuti, uguale a start per gli aggregati
+    };
+
+    static const uint8_t DIRTY = 0xFE;
+    static const int32_t NO_DAY = INT32_MIN;
+    static const size_t HEADER_SIZE = sizeof(HistorySegmentHeader);
+
+    static int32_t floorDiv(int32_t a, int32_t b) { return a / b - ((a % b) != 0 && ((a < 0) != (b < 0))); }
+    static uint8_t packFlags(LampState state, bool occupied, bool night);
+    static size_t encodeCounters(const UsageCounters& counters, uint8_t* out);
+    static bool mergeCounters(const uint8_t* in, size_t length, UsageCounters& counters);
+
+    // Con il lock preso, dal task di controllo
+    void closeMinutes(uint8_t room, uint8_t flags, int32_t count);
+    void closeHour(uint8_t room, bool closeDay);
+    void emitRun(RoomCursor& cursor);
+    void enqueue(Tier tier, uint8_t room, int32_t start, int32_t end, const uint8_t* payload, size_t length);
+    void enqueueCounters(Tier tier, uint8_t room, int32_t time, const UsageCounters& counters);
+
+    // Dal task di scrittura, o da begin
+    void scanSegment(uint8_t index);
+    bool isErased(size_t offset, size_t length) const;
+    void restoreDay(uint8_t room);
+    int allocate(Tier tier, int32_t base);
+    int reclaim(Tier tier);
+    void eraseSector(uint8_t index);
+    void relocate(uint8_t from, uint8_t to);
+    bool append(const PendingHeader& header, const uint8_t* payload);
+
+    // fn(start, end, dati dopo il delta, lunghezza) per ogni chunk della stanza nel livello che
+    // tocca [from, to]: prima la flash, poi la coda con il lock preso
+    template <typename Fn>
+    void visit(Tier tier, uint8_t room, int32_t from, int32_t to, Fn fn);
+    void beginRead();
+    void endRead();
+
+    hal::Partition* partition;
+    uint8_t sectorCount;
+    uint8_t quota[TIERS];
+    Segment segments[MAX_SECTORS];
+    int8_t active[TIERS];
+    int32_t lastTime[TIERS][MAX_ROOMS];  // del segmento attivo, per i delta
+    uint32_t nextSequence;
+    RoomCursor rooms[MAX_ROOMS];
+
+    hal::SpinLock lock;
+    uint8_t pending[PENDING_BYTES];  // voci PendingHeader + dati, in ordine di arrivo
+    size_t pendingUsed;
+    uint8_t readers;
+    bool writing;
+    HistoryStats stats;
+};
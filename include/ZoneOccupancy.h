@@ -0,0 +1,63 @@
+#pragma once
+#include "Hal.h"
+#include "LD2410Parser.h"
+
+// Zona definita dall'utente: un intervallo di gate del radar (0,75 m ciascuno) e le soglie
+// sull'energia in eccesso rispetto al fondo, sommata sui gate della zona
+struct ZoneConfig {
+    uint8_t firstGate;
+    uint8_t lastGate;     // incluso
+    uint16_t enterScore;  // media dell'eccesso oltre cui la zona diventa occupata
+    uint16_t exitScore;   // media sotto cui inizia il conteggio per liberarla
+    uint8_t holdFrames;   // frame consecutivi sotto exitScore prima di liberarla
+};
+
+// Occupazione per zona dalle energie per gate della modalità engineering del LD2410.
+// Le 9 energie in movimento e le 9 da fermo (0-100) sono impacchettate 4 per parola e
+// confrontate con le soglie di fondo in SWAR: lavoro fisso per frame, senza rami per gate.
+class ZoneOccupancy {
+public:
+    static const uint8_t GATES = LD2410Frame::GATES;
+    static const uint8_t MAX_ZONES = 8;
+    static const uint16_t GATE_CM = 75;
+    static const uint8_t SMOOTHING_SHIFT = 2;  // media esponenziale con alpha = 1/4
+
+    // Soglie di fabbrica del LD2410 per gate; da fermo i gate 0 e 1 non sono regolabili
+    // sul radar, qui partono dalla soglia del gate 2
+    static const uint8_t DEFAULT_MOVING_THRESHOLDS[GATES];
+    static const uint8_t DEFAULT_STATIONARY_THRESHOLDS[GATES];
+
+    ZoneOccupancy();
+
+    // Le zone oltre MAX_ZONES sono ignorate; l'occupazione riparte da zero
+    void setZones(const ZoneConfig* zones, uint8_t count);
+    // Energia di fondo per gate (stanza vuota) più il margine: sotto non conta nulla
+    void setThresholds(const uint8_t* moving, const uint8_t* stationary);
+
+    // Un frame engineering; true se la bitmap delle zone occupate è cambiata
+    bool update(const LD2410Frame& frame);
+    void reset();
+
+    // Bit i: zona i occupata
+    uint8_t getOccupied() const { return occupied; }
+    uint8_t getZoneCount() const { return zoneCount; }
+    // Ultimo eccesso di energia della zona, prima della media
+    uint16_t getScore(uint8_t zone) const { return lastScore[zone]; }
+    static uint8_t gateForDistance(uint16_t cm) { return cm / GATE_CM < GATES ? cm / GATE_CM : GATES - 1; }
+
+private:
+    static const uint8_t WORDS = (GATES + 3) / 4;
+
+    static void pack(const uint8_t* bytes, uint32_t* words);
+    static void excess(const uint32_t* energy, const uint32_t* threshold, uint32_t* out);
+
+    ZoneConfig zones[MAX_ZONES];
+    uint32_t zoneMasks[MAX_ZONES][WORDS];  // 0xFF sui byte dei gate della zona
+    uint32_t movingThresholds[WORDS];
+    uint32_t stationaryThresholds[WORDS];
+    uint16_t averageQ4[MAX_ZONES];
+    uint16_t lastScore[MAX_ZONES];
+    uint8_t quietFrames[MAX_ZONES];
+    uint8_t zoneCount;
+    uint8_t occupied;
+};
@@ -0,0 +1,4 @@
+# I build_flags arrivano solo al compilatore: anche il link deve usare il runtime di ThreadSanitizer
+Import("env")
+
+env.Append(LINKFLAGS=["-fsanitize=thread", "-pthread"])
@@ -0,0 +1,129 @@
+#include "DaySchedule.h"
+#include <math.h>
+
+static const int32_t SECONDS_PER_DAY = 86400;
+static const float DEG = 0.017453293f;
+static const float ZENITH = 90.833f * DEG;  // rifrazione e raggio del disco solare
+
+TimeSettings TimeSettings::defaults() {
+    TimeSettings settings = {};
+    settings.version = VERSION;
+    settings.hasLocation = false;
+    settings.nightStartMin = 17 * 60;
+    settings.nightEndMin = 8 * 60;
+    settings.utcOffsetSec = 3600;  // come il vecchio configTime(3600, 0, ...)
+    return settings;
+}
+
+// Conversioni data civile <-> giorni dal 1970 (algoritmi di H. Hinnant)
+int32_t daysFromCivil(int32_t year, uint32_t month, uint32_t day) {
+    year -= month <= 2;
+    int32_t era = (year >= 0 ? year : year - 399) / 400;
+    uint32_t yoe = static_cast<uint32_t>(year - era * 400);
+    uint32_t doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + static_cast<int32_t>(doe) - 719468;
+}
+
+void civilFromDays(int32_t days, int32_t& year, uint32_t& month, uint32_t& day) {
+    days += 719468;
+    int32_t era = (days >= 0 ? days : days - 146096) / 146097;
+    uint32_t doe = static_cast<uint32_t>(days - era * 146097);
+    uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    uint32_t mp = (5 * doy + 2) / 153;
+    day = doy - (153 * mp + 2) / 5 + 1;
+    month = mp < 10 ? mp + 3 : mp - 9;
+    year = static_cast<int32_t>(yoe) + era * 400 + (month <= 2);
+}
+
+SunTimes sunTimes(int32_t days, float latitude, float longitude) {
+    int32_t year;
+    uint32_t month, day;
+    civilFromDays(days, year, month, day);
+    float gamma = 2.0f * static_cast<float>(M_PI) / 365.0f * static_cast<float>(days - daysFromCivil(year, 1, 1));
+
+    float eqTime = 229.18f * (0.000075f + 0.001868f * cosf(gamma) - 0.032077f * sinf(gamma) -
+                              0.014615f * cosf(2 * gamma) - 0.040849f * sinf(2 * gamma));
+    float decl = 0.006918f - 0.399912f * cosf(gamma) + 0.070257f * sinf(gamma) - 0.006758f * cosf(2 * gamma) +
+                 0.000907f * sinf(2 * gamma) - 0.002697f * cosf(3 * gamma) + 0.00148f * sinf(3 * gamma);
+
+    float lat = latitude * DEG;
+    float cosHourAngle = cosf(ZENITH) / (cosf(lat) * cosf(decl)) - tanf(lat) * tanf(decl);
+    if (cosHourAngle > 1.0f || cosHourAngle < -1.0f) {
+        return SunTimes{false, 0, 0};
+    }
+    float hourAngle = acosf(cosHourAngle) / DEG;
+    SunTimes times;
+    times.valid = true;
+    times.sunriseMin = static_cast<int32_t>(lroundf(720.0f - 4.0f * (longitude + hourAngle) - eqTime));
+    times.sunsetMin = static_cast<int32_t>(lroundf(720.0f - 4.0f * (longitude - hourAngle) - eqTime));
+    return times;
+}
+
+namespace {
+
+struct Change {
+    int64_t at;  // epoch UTC
+    bool night;  // stato che inizia in quell'istante
+};
+
+// Cambi di ieri, oggi e domani (giorno locale), ordinati nel tempo
+int collectChanges(int32_t localDay, const TimeSettings& settings, bool solar, Change* changes) {
+    int count = 0;
+    for (int32_t d = localDay - 1; d <= localDay + 1; ++d) {
+        int64_t midnight = static_cast<int64_t>(d) * SECONDS_PER_DAY;
+        if (solar) {
+            SunTimes sun = sunTimes(d, settings.latitude, settings.longitude);
+            if (!sun.valid) {
+                continue;
+            }
+            changes[count++] = {midnight + sun.sunriseMin * 60, false};
+            changes[count++] = {midnight + sun.sunsetMin * 60, true};
+        } else {
+            midnight -= settings.utcOffsetSec;
+            changes[count++] = {midnight + settings.nightEndMin * 60, false};
+            changes[count++] = {midnight + settings.nightStartMin * 60, true};
+        }
+    }
+    for (int i = 1; i < count; ++i) {
+        for (int j = i; j > 0 && changes[j].at < changes[j - 1].at; --j) {
+            Change swap = changes[j];
+            changes[j] = changes[j - 1];
+            changes[j - 1] = swap;
+        }
+    }
+    return count;
+}
+
+bool findDayNight(uint32_t utcNow, const TimeSettings& settings, bool solar, DayNight& result) {
+    int64_t local = static_cast<int64_t>(utcNow) + settings.utcOffsetSec;
+    int32_t localDay = static_cast<int32_t>(local >= 0 ? local / SECONDS_PER_DAY : (local + 1) / SECONDS_PER_DAY - 1);
+    Change changes[6];
+    int count = collectChanges(localDay, settings, solar, changes);
+    int previous = -1;
+    for (int i = 0; i < count; ++i) {
+        if (changes[i].at > utcNow) {
+            if (previous < 0) {
+                return false;
+            }
+            result.night = changes[previous].night;
+            result.nextChange = static_cast<uint32_t>(changes[i].at);
+            return true;
+        }
+        previous = i;
+    }
+    return false;
+}
+
+}  // namespace
+
+DayNight computeDayNight(uint32_t utcNow, const TimeSettings& settings) {
+    DayNight result = {false, utcNow + SECONDS_PER_DAY};
+    // Nei giorni polari senza alba o tramonto si torna agli orari fissi
+    if (settings.hasLocation && findDayNight(utcNow, settings, true, result)) {
+        return result;
+    }
+    findDayNight(utcNow, settings, false, result);
+    return result;
+}
@@ -0,0 +1,227 @@
+#include "FadeEngine.h"
+#include "Metrics.h"
+
+// Punti della curva in Q12 a intervalli di tempo uguali
+static const uint16_t linearKnots[] = {0, FadeEngine::KNOT_ONE};
+// (16^x - 1) / 15: percettivamente uniforme sulle basse luminosità
+static const uint16_t exponentialKnots[] = {0, 113, 273, 499, 819, 1272, 1911, 2816, FadeEngine::KNOT_ONE};
+// Smoothstep 3x^2 - 2x^3
+static const uint16_t easeInOutKnots[] = {0, 176, 640, 1296, 2048, 2800, 3456, 3920, FadeEngine::KNOT_ONE};
+
+FadeEngine::FadeEngine(ledc_channel_t channel) : FadeEngine(&channel, 1) {}
+
+FadeEngine::FadeEngine(const ledc_channel_t* channelList, uint8_t channelCount)
+    : count(channelCount < MAX_CHANNELS ? channelCount : MAX_CHANNELS), onComplete(nullptr), onCompleteArg(nullptr),
+      timerHook(nullptr), generation(0), startUs(0), segmentMs(0), curve(FadeCurve::LINEAR), segments(1), segment(0), stepped(false), dithering(false),
+      active(false), starts(0) {
+    for (uint8_t i = 0; i < MAX_CHANNELS; ++i) {
+        channels[i] = i < count ? channelList[i] : channelList[0];
+        fromDuty[i] = toDuty[i] = 0;
+    }
+}
+
+void FadeEngine::begin(Callback callback, void* arg, TimerHook hook) {
+    onComplete = callback;
+    onCompleteArg = arg;
+    timerHook = hook;
+    timer.create(&FadeEngine::onTimer, this, "fade_timer");
+}
+
+void FadeEngine::start(const uint32_t* targetDuties, uint32_t durationMs, FadeCurve curve) {
+    uint32_t knot = currentKnot();
+    uint32_t duties[MAX_CHANNELS];
+    bool moving = false;
+    for (uint8_t i = 0; i < count; ++i) {
+        duties[i] = dutyAtKnot(i, knot);
+        moving = moving || duties[i] != targetDuties[i];
+    }
+    if (durationMs == 0 || !moving) {
+        set(targetDuties);
+        return;
+    }
+
+    this->curve = curve;
+    knotsOf(curve, segments);
+    if (durationMs / segments < MIN_SEGMENT_MS) {
+        this->curve = FadeCurve::LINEAR;
+        segments = 1;
+    }
+
+    uint32_t lower = UINT32_MAX;
+    for (uint8_t i = 0; i < count; ++i) {
+        fromDuty[i] = duties[i];
+        toDuty[i] = targetDuties[i];
+        uint32_t low = duties[i] < targetDuties[i] ? duties[i] : targetDuties[i];
+        lower = low < lower ? low : lower;
+    }
+    segmentMs = durationMs / segments;
+    segment = 0;
+    startUs = hal::micros();
+    active = true;
+    ++starts;
+    generation.fetch_add(1, std::memory_order_relaxed);
+    // Il fade hardware parte canale per canale e arrotonda per conto suo: con più canali
+    // si usano sempre i frame, che li tengono in fase
+    stepped = count > 1 || (dithering && lower < (DITHER_BELOW_DUTY << FRACTION_BITS));
+    if (stepped) {
+        timer.startPeriodic(static_cast<uint64_t>(FRAME_MS) * 1000);
+    } else {
+        startSegment();
+    }
+}
+
+void FadeEngine::set(const uint32_t* duties) {
+    timer.stop();
+    active = false;
+    generation.fetch_add(1, std::memory_order_relaxed);
+    for (uint8_t i = 0; i < count; ++i) {
+        fromDuty[i] = toDuty[i] = duties[i];
+    }
+    output(duties);
+}
+
+void FadeEngine::start(uint32_t targetDuty, uint32_t durationMs, FadeCurve curve) {
+    uint32_t duties[MAX_CHANNELS];
+    for (uint8_t i = 0; i < MAX_CHANNELS; ++i) {
+        duties[i] = targetDuty;
+    }
+    start(duties, durationMs, curve);
+}
+
+void FadeEngine::set(uint32_t duty) {
+    uint32_t duties[MAX_CHANNELS];
+    for (uint8_t i = 0; i < MAX_CHANNELS; ++i) {
+        duties[i] = duty;
+    }
+    set(duties);
+}
+
+void FadeEngine::cancel() {
+    if (active) {
+        uint32_t knot = currentKnot();
+        uint32_t duties[MAX_CHANNELS];
+        for (uint8_t i = 0; i < count; ++i) {
+            duties[i] = dutyAtKnot(i, knot);
+        }
+        set(duties);
+    }
+}
+
+// Con il dithering i bit frazionari vanno al LEDC, altrimenti si arrotonda all'intero
+void FadeEngine::output(const uint32_t* fineDuties) {
+    uint32_t duties[MAX_CHANNELS];
+    for (uint8_t i = 0; i < count; ++i) {
+        duties[i] = dithering ? fineDuties[i] : (fineDuties[i] + (1 << (FRACTION_BITS - 1))) & ~((1u << FRACTION_BITS) - 1);
+    }
+    hal::pwmSetDutiesFine(channels, duties, count);
+}
+
+void FadeEngine::renderFrame() {
+    uint32_t knot = currentKnot();
+    uint32_t duties[MAX_CHANNELS];
+    for (uint8_t i = 0; i < count; ++i) {
+        duties[i] = dutyAtKnot(i, knot);
+    }
+    output(duties);
+}
+
+uint32_t FadeEngine::currentFineDuty(uint8_t index) const {
+    return dutyAtKnot(index, currentKnot());
+}
+
+// Posizione sulla curva, comune a tutti i canali
+uint32_t FadeEngine::currentKnot() const {
+    if (!active) {
+        return KNOT_ONE;
+    }
+    return knotAt(curve, segmentMs, hal::micros() - startUs);
+}
+
+const uint16_t* FadeEngine::knotsOf(FadeCurve curve, uint8_t& segmentCount) {
+    switch (curve) {
+    case FadeCurve::EXPONENTIAL:
+        segmentCount = MAX_SEGMENTS;
+        return exponentialKnots;
+    case FadeCurve::EASE_IN_OUT:
+        segmentCount = MAX_SEGMENTS;
+        return easeInOutKnots;
+    default:
+        segmentCount = 1;
+        return linearKnots;
+    }
+}
+
+uint32_t FadeEngine::knotAt(FadeCurve curve, uint32_t segmentMs, uint64_t elapsedUs) {
+    uint8_t segmentCount;
+    const uint16_t* knots = knotsOf(curve, segmentCount);
+    uint64_t segmentUs = static_cast<uint64_t>(segmentMs) * 1000;
+    if (segmentUs == 0) {
+        return KNOT_ONE;
+    }
+    uint64_t index = elapsedUs / segmentUs;
+    if (index >= segmentCount) {
+        return KNOT_ONE;
+    }
+    uint32_t within = static_cast<uint32_t>(elapsedUs - index * segmentUs);
+    int32_t k0 = knots[index];
+    int32_t k1 = knots[index + 1];
+    return k0 + static_cast<int32_t>(static_cast<int64_t>(k1 - k0) * within / segmentUs);
+}
+
+uint32_t FadeEngine::dutyAtKnot(uint8_t index, uint32_t knot) const {
+    int64_t delta = static_cast<int64_t>(toDuty[index]) - static_cast<int64_t>(fromDuty[index]);
+    return static_cast<uint32_t>(fromDuty[index] + delta * knot / KNOT_ONE);
+}
+
+void FadeEngine::startSegment() {
+    uint8_t segmentCount;
+    uint32_t target = dutyAtKnot(0, knotsOf(curve, segmentCount)[segment + 1]);
+    hal::pwmFadeTo(channels[0], (target + (1 << (FRACTION_BITS - 1))) >> FRACTION_BITS, segmentMs);
+    timer.startOnce(static_cast<uint64_t>(segmentMs) * 1000);
+}
+
+void FadeEngine::finish() {
+    timer.stop();
+    active = false;
+    // Il fade hardware arriva solo all'intero: la parte frazionaria si imposta alla fine
+    if (stepped || dithering) {
+        output(toDuty);
+    }
+    if (onComplete != nullptr) {
+        onComplete(onCompleteArg);
+    }
+}
+
+void FadeEngine::onTimer(void* arg) {
+    FadeEngine* engine = static_cast<FadeEngine*>(arg);
+    uint32_t current = engine->generation.load(std::memory_order_relaxed);
+    if (engine->timerHook != nullptr) {
+        engine->timerHook(engine->onCompleteArg, current);
+        return;
+    }
+    engine->handleTimer(current);
+}
+
+void FadeEngine::handleTimer(uint32_t timerGeneration) {
+    if (!active || timerGeneration != generation.load(std::memory_order_relaxed)) {
+        return;
+    }
+    uint64_t totalUs = static_cast<uint64_t>(segmentMs) * segments * 1000;
+    uint64_t elapsedUs = hal::micros() - startUs;
+    if (stepped) {
+        if (elapsedUs >= totalUs) {
+            Metrics::fadeJitterUs.record(static_cast<uint32_t>(elapsedUs - totalUs));
+            finish();
+        } else {
+            renderFrame();
+        }
+        return;
+    }
+    if (++segment < segments) {
+        startSegment();
+        return;
+    }
+    // Ogni segmento parte dal timer del precedente: i ritardi si sommano fino alla fine
+    Metrics::fadeJitterUs.record(static_cast<uint32_t>(elapsedUs > totalUs ? elapsedUs - totalUs : 0));
+    finish();
+}
@@ -0,0 +1,158 @@
+#include "GateCalibrator.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Log.h"
+#include "ZoneOccupancy.h"
+
+void RunningStats::reset() {
+    count = 0;
+    mean = 0.0f;
+    m2 = 0.0f;
+    max = 0;
+}
+
+void RunningStats::add(uint8_t sample) {
+    ++count;
+    float delta = sample - mean;
+    mean += delta / count;
+    m2 += delta * (sample - mean);
+    max = sample > max ? sample : max;
+}
+
+void RunningStats::track(uint8_t sample, uint8_t limit, uint8_t shift) {
+    if (sample < limit) {
+        max = sample > max ? sample : max;
+    } else {
+        sample = limit;
+    }
+    // Media e varianza esponenziali; m2 resta riferita al count della calibrazione
+    float weight = 1.0f / (1u << shift);
+    float delta = sample - mean;
+    float step = delta * weight;
+    mean += step;
+    float variance = (1.0f - weight) * (this->variance() + delta * step);
+    m2 = count > 1 ? variance * (count - 1) : 0.0f;
+}
+
+GateCalibrator::GateCalibrator()
+    : settingsKey(nullptr), startMs(0), durationMs(0), trackedFrames(0), calibrating(false), calibrated(false),
+      pending(false) {
+    memset(&data, 0, sizeof(data));
+    data.version = GateCalibration::VERSION;
+    memcpy(data.thresholds.moving, ZoneOccupancy::DEFAULT_MOVING_THRESHOLDS, GATES);
+    memcpy(data.thresholds.stationary, ZoneOccupancy::DEFAULT_STATIONARY_THRESHOLDS, GATES);
+}
+
+bool GateCalibrator::begin(const char* key) {
+    settingsKey = key;
+    GateCalibration stored;
+    if (!hal::settingsRead(settingsKey, &stored, sizeof(stored)) || stored.version != GateCalibration::VERSION) {
+        return false;
+    }
+    data = stored;
+    calibrated = true;
+    pending = true;  // il radar potrebbe essere stato sostituito: le soglie si riscrivono comunque
+    return true;
+}
+
+void GateCalibrator::start(uint32_t duration) {
+    for (uint8_t gate = 0; gate < GATES; ++gate) {
+        data.moving[gate].reset();
+        data.stationary[gate].reset();
+    }
+    startMs = hal::millis();
+    durationMs = duration;
+    trackedFrames = 0;
+    calibrating = true;
+    calibrated = false;
+    LOG_INFO("Gates: calibrazione per %lu s, la stanza deve restare vuota", static_cast<unsigned long>(duration / 1000));
+}
+
+uint8_t GateCalibrator::thresholdFor(const RunningStats& stats) {
+    // La finestra è a stanza vuota: il massimo è il bordo del fondo, anche per le sorgenti rare
+    // (la tenda). Una soglia solo statistica, media più k sigma, sarebbe troppo bassa per queste
+    // e troppo alta per i fondi a due livelli come il climatizzatore a cicli
+    uint32_t level = stats.max + MARGIN + static_cast<uint32_t>(ceilf(SIGMAS * sqrtf(stats.variance())));
+    level = level > MIN_THRESHOLD ? level : MIN_THRESHOLD;
+    return static_cast<uint8_t>(level < MAX_THRESHOLD ? level : MAX_THRESHOLD);
+}
+
+void GateCalibrator::derive(GateThresholds& out) const {
+    for (uint8_t gate = 0; gate < GATES; ++gate) {
+        out.moving[gate] = thresholdFor(data.moving[gate]);
+        out.stationary[gate] = thresholdFor(data.stationary[gate]);
+    }
+}
+
+void GateCalibrator::update(const LD2410Frame& frame, bool background, uint32_t nowMs) {
+    if (!frame.engineering) {
+        return;
+    }
+    if (calibrating) {
+        for (uint8_t gate = 0; gate < GATES; ++gate) {
+            data.moving[gate].add(frame.movingGateEnergy[gate]);
+            data.stationary[gate].add(frame.stationaryGateEnergy[gate]);
+        }
+        if (nowMs - startMs < durationMs) {
+            return;
+        }
+        calibrating = false;
+        if (data.moving[0].count < MIN_FRAMES) {
+            LOG_WARN("Gates: calibrazione scartata, solo %lu frame engineering", static_cast<unsigned long>(data.moving[0].count));
+            return;
+        }
+        derive(data.thresholds);
+        calibrated = true;
+        pending = true;
+        persist();
+        LOG_INFO("Gates: calibrati su %lu frame", static_cast<unsigned long>(data.moving[0].count));
+        return;
+    }
+    if (!calibrated || !background) {
+        return;
+    }
+    for (uint8_t gate = 0; gate < GATES; ++gate) {
+        data.moving[gate].track(frame.movingGateEnergy[gate], data.thresholds.moving[gate], TRACK_SHIFT);
+        data.stationary[gate].track(frame.stationaryGateEnergy[gate], data.thresholds.stationary[gate], TRACK_SHIFT);
+    }
+    ++trackedFrames;
+    if ((trackedFrames & ((1u << TRACK_SHIFT) - 1)) == 0) {
+        // Il massimo dimentica lentamente le sorgenti che non si ripresentano
+        for (uint8_t gate = 0; gate < GATES; ++gate) {
+            data.moving[gate].max -= data.moving[gate].max > 0;
+            data.stationary[gate].max -= data.stationary[gate].max > 0;
+        }
+    }
+    if (trackedFrames % TRACK_CHECK_FRAMES != 0) {
+        return;
+    }
+    GateThresholds next;
+    derive(next);
+    bool changed = false;
+    for (uint8_t gate = 0; gate < GATES; ++gate) {
+        changed = changed || abs(next.moving[gate] - data.thresholds.moving[gate]) >= TRACK_MIN_STEP ||
+                  abs(next.stationary[gate] - data.thresholds.stationary[gate]) >= TRACK_MIN_STEP;
+    }
+    if (changed) {
+        data.thresholds = next;
+        pending = true;
+        persist();
+        LOG_INFO("Gates: soglie aggiornate dal fondo");
+    }
+}
+
+bool GateCalibrator::takeThresholds(GateThresholds& out) {
+    if (!pending) {
+        return false;
+    }
+    pending = false;
+    out = data.thresholds;
+    return true;
+}
+
+void GateCalibrator::persist() {
+    if (settingsKey != nullptr) {
+        hal::settingsWrite(settingsKey, &data, sizeof(data));
+    }
+}
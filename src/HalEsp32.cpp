@@ -0,0 +1,503 @@
+#include "Hal.h"
+#include "driver/uart.h"
+#include "driver/gpio.h"
+#include "esp_sleep.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include <sys/time.h>
+#include <HTTPClient.h>
+#include "esp_sntp.h"
+#include "nvs.h"
+#include "soc/ledc_struct.h"
+
+namespace hal {
+
+uint32_t millis() {
+    return ::millis();
+}
+
+uint64_t micros() {
+    return esp_timer_get_time();
+}
+
+void delay(uint32_t ms) {
+    ::delay(ms);
+}
+
+uint32_t cycles() {
+    return ESP.getCycleCount();
+}
+
+uint32_t cyclesPerUs() {
+    return getCpuFrequencyMhz();
+}
+
+TaskHandle currentTask() {
+    return xTaskGetCurrentTaskHandle();
+}
+
+uint32_t taskStackFree(TaskHandle task) {
+    // In ESP-IDF lo stack è in byte, non in parole come nel FreeRTOS standard
+    return task != nullptr ? uxTaskGetStackHighWaterMark(static_cast<TaskHandle_t>(task)) : 0;
+}
+
+bool taskRunTimeUs(TaskHandle task, uint32_t& us) {
+#if configGENERATE_RUN_TIME_STATS && configUSE_TRACE_FACILITY
+    if (task == nullptr) {
+        return false;
+    }
+    TaskStatus_t status;
+    // Lo stato passato evita di ricalcolarlo: qui serve solo il contatore
+    vTaskGetInfo(static_cast<TaskHandle_t>(task), &status, pdFALSE, eRunning);
+#ifdef CONFIG_FREERTOS_RUN_TIME_STATS_USING_CPU_CLK
+    us = status.ulRunTimeCounter / cyclesPerUs();
+#else
+    us = status.ulRunTimeCounter;  // contatore da esp_timer, già in µs
+#endif
+    return true;
+#else
+    (void)task;
+    (void)us;
+    return false;
+#endif
+}
+
+uint32_t heapFree() {
+    return esp_get_free_heap_size();
+}
+
+uint32_t heapMinFree() {
+    return esp_get_minimum_free_heap_size();
+}
+
+uint32_t heapLargestFree() {
+    return heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+}
+
+void pwmBegin(uint8_t pin, ledc_channel_t channel, ledc_timer_t timer, uint32_t freq, ledc_timer_bit_t resolution,
+              uint32_t hpoint) {
+    ledc_timer_config_t ledc_timer = {
+        .speed_mode = LEDC_HIGH_SPEED_MODE,
+        .duty_resolution = resolution,
+        .timer_num = timer,
+        .freq_hz = freq,
+        .clk_cfg = LEDC_AUTO_CLK
+    };
+    ledc_timer_config(&ledc_timer);
+
+    ledc_channel_config_t ledc_channel = {
+        .gpio_num = pin,
+        .speed_mode = LEDC_HIGH_SPEED_MODE,
+        .channel = channel,
+        .timer_sel = timer,
+        .duty = 0,
+        .hpoint = static_cast<int>(hpoint)
+    };
+    ledc_channel_config(&ledc_channel);
+
+    // Il servizio di fade va installato una sola volta per tutti i canali
+    static bool fadeInstalled = false;
+    if (!fadeInstalled) {
+        ledc_fade_func_install(0);
+        fadeInstalled = true;
+    }
+}
+
+void pwmSetDuty(ledc_channel_t channel, uint32_t duty) {
+    ledc_set_duty(LEDC_HIGH_SPEED_MODE, channel, duty);
+    ledc_update_duty(LEDC_HIGH_SPEED_MODE, channel);
+}
+
+void pwmFadeTo(ledc_channel_t channel, uint32_t duty, uint32_t durationMs) {
+    ledc_set_fade_with_time(LEDC_HIGH_SPEED_MODE, channel, duty, durationMs);
+    ledc_fade_start(LEDC_HIGH_SPEED_MODE, channel, LEDC_FADE_NO_WAIT);
+}
+
+void pwmSetDutyFine(ledc_channel_t channel, uint32_t fineDuty) {
+    // Il driver scrive solo la parte intera (duty << 4): si prepara l'aggiornamento con
+    // ledc_set_duty e si completa il registro con i 4 bit frazionari prima di applicarlo
+    ledc_set_duty(LEDC_HIGH_SPEED_MODE, channel, fineDuty >> 4);
+    LEDC.channel_group[LEDC_HIGH_SPEED_MODE].channel[channel].duty.duty = fineDuty;
+    ledc_update_duty(LEDC_HIGH_SPEED_MODE, channel);
+}
+
+void pwmSetDutiesFine(const ledc_channel_t* channels, const uint32_t* fineDuties, uint8_t count) {
+    // ledc_update_duty è la parte lenta (lock e registri di conferma): la si fa per ultima,
+    // così tra il primo e l'ultimo canale passano pochi µs e cambiano nello stesso periodo
+    for (uint8_t i = 0; i < count; ++i) {
+        ledc_set_duty(LEDC_HIGH_SPEED_MODE, channels[i], fineDuties[i] >> 4);
+        LEDC.channel_group[LEDC_HIGH_SPEED_MODE].channel[channels[i]].duty.duty = fineDuties[i];
+    }
+    for (uint8_t i = 0; i < count; ++i) {
+        ledc_update_duty(LEDC_HIGH_SPEED_MODE, channels[i]);
+    }
+}
+
+uint32_t pwmGetDuty(ledc_channel_t channel) {
+    return ledc_get_duty(LEDC_HIGH_SPEED_MODE, channel);
+}
+
+Timer::Timer() : handle(nullptr) {}
+
+Timer::~Timer() {
+    if (handle != nullptr) {
+        esp_timer_stop(handle);
+        esp_timer_delete(handle);
+    }
+}
+
+bool Timer::create(Callback callback, void* arg, const char* name) {
+    if (handle != nullptr) {
+        return true;
+    }
+    esp_timer_create_args_t timerArgs = {
+        .callback = callback,
+        .arg = arg,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = name
+    };
+    return esp_timer_create(&timerArgs, &handle) == ESP_OK;
+}
+
+void Timer::startOnce(uint64_t timeoutUs) {
+    esp_timer_stop(handle);  // Ignora l'errore se non era attivo
+    esp_timer_start_once(handle, timeoutUs);
+}
+
+void Timer::startPeriodic(uint64_t periodUs) {
+    esp_timer_stop(handle);
+    esp_timer_start_periodic(handle, periodUs);
+}
+
+void Timer::stop() {
+    esp_timer_stop(handle);
+}
+
+bool Timer::isActive() const {
+    return handle != nullptr && esp_timer_is_active(handle);
+}
+
+static const int UART_RX_BUFFER = 1024;
+static const int UART_EVENT_QUEUE = 8;
+static const uint8_t UART_RX_FULL_THRESHOLD = 64;  // byte nel FIFO prima dell'interrupt
+static const uint8_t UART_RX_IDLE_SYMBOLS = 3;     // linea inattiva per 3 caratteri = fine frame
+
+Uart::Uart(uint8_t port) : port(port), overruns(0), eventQueue(nullptr) {}
+
+void Uart::begin(uint32_t baud, int rxPin, int txPin) {
+    uart_port_t uart = static_cast<uart_port_t>(port);
+    uart_config_t config = {};
+    config.baud_rate = static_cast<int>(baud);
+    config.data_bits = UART_DATA_8_BITS;
+    config.parity = UART_PARITY_DISABLE;
+    config.stop_bits = UART_STOP_BITS_1;
+    config.flow_ctrl = UART_HW_FLOWCTRL_DISABLE;
+    config.source_clk = UART_SCLK_APB;
+    uart_driver_install(uart, UART_RX_BUFFER, 0, UART_EVENT_QUEUE, &eventQueue, 0);
+    uart_param_config(uart, &config);
+    uart_set_pin(uart, txPin, rxPin, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    uart_set_rx_full_threshold(uart, UART_RX_FULL_THRESHOLD);
+    uart_set_rx_timeout(uart, UART_RX_IDLE_SYMBOLS);
+}
+
+size_t Uart::available() {
+    size_t buffered = 0;
+    uart_get_buffered_data_len(static_cast<uart_port_t>(port), &buffered);
+    return buffered;
+}
+
+int Uart::read() {
+    uint8_t byte;
+    return uart_read_bytes(static_cast<uart_port_t>(port), &byte, 1, 0) == 1 ? byte : -1;
+}
+
+size_t Uart::read(uint8_t* dst, size_t len) {
+    int count = uart_read_bytes(static_cast<uart_port_t>(port), dst, len, 0);
+    return count > 0 ? count : 0;
+}
+
+size_t Uart::write(const uint8_t* data, size_t len) {
+    int count = uart_write_bytes(static_cast<uart_port_t>(port), data, len);
+    return count > 0 ? count : 0;
+}
+
+bool Uart::waitForData(uint32_t timeoutMs) {
+    uart_event_t event;
+    TickType_t ticks = timeoutMs == UINT32_MAX ? portMAX_DELAY : pdMS_TO_TICKS(timeoutMs);
+    if (xQueueReceive(eventQueue, &event, ticks) != pdTRUE) {
+        return false;
+    }
+    if (event.type == UART_FIFO_OVF || event.type == UART_BUFFER_FULL) {
+        // Dati persi: si riparte puliti, il parser si risincronizza sull'header
+        ++overruns;
+        uart_flush_input(static_cast<uart_port_t>(port));
+        xQueueReset(eventQueue);
+    }
+    return true;
+}
+
+void Uart::setRxEnabled(bool enabled) {
+    uart_port_t uart = static_cast<uart_port_t>(port);
+    if (enabled) {
+        // Quello che c'era nel FIFO è vecchio: si riparte dal prossimo frame
+        uart_flush_input(uart);
+        xQueueReset(eventQueue);
+        uart_enable_rx_intr(uart);
+    } else {
+        uart_disable_rx_intr(uart);
+    }
+}
+
+SpinLock::SpinLock() : mux(portMUX_INITIALIZER_UNLOCKED) {}
+
+void SpinLock::lock() {
+    portENTER_CRITICAL_SAFE(&mux);
+}
+
+void SpinLock::unlock() {
+    portEXIT_CRITICAL_SAFE(&mux);
+}
+
+Partition::Partition() : base(0), length(0), partition(nullptr) {}
+
+bool Partition::open(const char* label, size_t offset, size_t windowLength) {
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+    if (partition == nullptr || offset % SECTOR_SIZE != 0 || offset >= partition->size) {
+        partition = nullptr;
+        return false;
+    }
+    base = offset;
+    length = windowLength == 0 || offset + windowLength > partition->size ? partition->size - offset : windowLength;
+    return true;
+}
+
+size_t Partition::size() const {
+    return partition != nullptr ? length : 0;
+}
+
+bool Partition::read(size_t offset, void* dst, size_t len) const {
+    return partition != nullptr && offset + len <= length && esp_partition_read(partition, base + offset, dst, len) == ESP_OK;
+}
+
+bool Partition::write(size_t offset, const void* src, size_t len) {
+    return partition != nullptr && offset + len <= length &&
+           esp_partition_write(partition, base + offset, src, len) == ESP_OK;
+}
+
+bool Partition::eraseSector(size_t offset) {
+    return partition != nullptr && offset + SECTOR_SIZE <= length &&
+           esp_partition_erase_range(partition, base + offset, SECTOR_SIZE) == ESP_OK;
+}
+
+bool powerConfigure(uint32_t maxMhz, uint32_t minMhz, bool lightSleep, bool& lightSleepEnabled) {
+    esp_pm_config_esp32_t config = {};
+    config.max_freq_mhz = static_cast<int>(maxMhz);
+    config.min_freq_mhz = static_cast<int>(minMhz);
+    config.light_sleep_enable = lightSleep;
+    esp_err_t err = esp_pm_configure(&config);
+    if (err == ESP_ERR_NOT_SUPPORTED && lightSleep) {
+        // Senza tickless idle il light sleep automatico non c'è: resta la frequenza dinamica
+        config.light_sleep_enable = false;
+        err = esp_pm_configure(&config);
+    }
+    lightSleepEnabled = err == ESP_OK && config.light_sleep_enable;
+    return err == ESP_OK;
+}
+
+PowerLock::PowerLock() : held(false), handle(nullptr) {}
+
+PowerLock::~PowerLock() {
+    release();
+    if (handle != nullptr) {
+        esp_pm_lock_delete(handle);
+    }
+}
+
+bool PowerLock::create(Type type, const char* name) {
+    esp_pm_lock_type_t lockType = type == CPU_MAX ? ESP_PM_CPU_FREQ_MAX : ESP_PM_NO_LIGHT_SLEEP;
+    return handle != nullptr || esp_pm_lock_create(lockType, 0, name, &handle) == ESP_OK;
+}
+
+void PowerLock::acquire() {
+    if (!held && handle != nullptr) {
+        esp_pm_lock_acquire(handle);
+        held = true;
+    }
+}
+
+void PowerLock::release() {
+    if (held) {
+        esp_pm_lock_release(handle);
+        held = false;
+    }
+}
+
+static gpio_num_t wakePin = GPIO_NUM_NC;
+static void (*wakeCallback)() = nullptr;
+
+// Interrupt a livello: si disarma da solo, altrimenti continuerebbe a scattare finché il pin è alto
+static void wakePinIsr(void*) {
+    gpio_intr_disable(wakePin);
+    wakeCallback();
+}
+
+void wakePinBegin(uint8_t pin, void (*onWake)()) {
+    wakePin = static_cast<gpio_num_t>(pin);
+    wakeCallback = onWake;
+    gpio_config_t config = {};
+    config.pin_bit_mask = 1ULL << pin;
+    config.mode = GPIO_MODE_INPUT;
+    config.pull_down_en = GPIO_PULLDOWN_ENABLE;
+    config.intr_type = GPIO_INTR_DISABLE;
+    gpio_config(&config);
+    gpio_install_isr_service(0);  // Già installato da Arduino: errore ignorato
+    gpio_isr_handler_add(wakePin, wakePinIsr, nullptr);
+    // Stesso tipo di interrupt per il risveglio dal light sleep e per l'ISR
+    gpio_wakeup_enable(wakePin, GPIO_INTR_HIGH_LEVEL);
+    esp_sleep_enable_gpio_wakeup();
+    gpio_intr_disable(wakePin);
+}
+
+void wakePinArm(bool armed) {
+    if (wakePin == GPIO_NUM_NC) {
+        return;
+    }
+    if (armed) {
+        gpio_intr_enable(wakePin);
+    } else {
+        gpio_intr_disable(wakePin);
+    }
+}
+
+ResetReason resetReason() {
+    switch (esp_reset_reason()) {
+    case ESP_RST_POWERON:
+        return ResetReason::POWER_ON;
+    case ESP_RST_SW:
+        return ResetReason::SOFTWARE;
+    case ESP_RST_BROWNOUT:
+        return ResetReason::BROWNOUT;
+    case ESP_RST_INT_WDT:
+    case ESP_RST_TASK_WDT:
+    case ESP_RST_WDT:
+        return ResetReason::WATCHDOG;
+    case ESP_RST_PANIC:
+        return ResetReason::PANIC;
+    default:
+        return ResetReason::OTHER;
+    }
+}
+
+// Non inizializzata dal bootloader: dopo un reset contiene ancora i dati scritti prima
+RTC_NOINIT_ATTR static uint8_t retained[RETAINED_SIZE];
+
+bool retainedRead(void* dst, size_t len) {
+    if (resetReason() == ResetReason::POWER_ON || len > RETAINED_SIZE) {
+        return false;
+    }
+    memcpy(dst, retained, len);
+    return true;
+}
+
+void retainedWrite(const void* src, size_t len) {
+    memcpy(retained, src, len < RETAINED_SIZE ? len : RETAINED_SIZE);
+}
+
+void setEpoch(uint32_t epoch) {
+    struct timeval now = {static_cast<time_t>(epoch), 0};
+    settimeofday(&now, nullptr);
+}
+
+uint32_t epochNow() {
+    return static_cast<uint32_t>(time(nullptr));
+}
+
+static void (*sntpCallback)() = nullptr;
+
+static void onSntpSync(struct timeval*) {
+    if (sntpCallback != nullptr) {
+        sntpCallback();
+    }
+}
+
+void startSntp(const char* server, void (*onSync)()) {
+    sntpCallback = onSync;
+    sntp_set_time_sync_notification_cb(onSntpSync);
+    configTime(0, 0, server);  // Orologio in UTC: il fuso lo applica chi legge
+}
+
+// Corpo della risposta scritto direttamente nel buffer del chiamante, senza String che crescono
+// a pezzi nell'heap; oltre la capacità il corpo viene troncato ma la lettura va fino in fondo
+class BufferSink : public Stream {
+public:
+    BufferSink(char* buffer, size_t capacity) : buffer(buffer), capacity(capacity), length(0) {
+        buffer[0] = '\0';
+    }
+    size_t write(uint8_t byte) override { return write(&byte, 1); }
+    size_t write(const uint8_t* data, size_t size) override {
+        size_t room = capacity - 1 - length;
+        size_t n = size < room ? size : room;
+        memcpy(buffer + length, data, n);
+        length += n;
+        buffer[length] = '\0';
+        return size;
+    }
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+    void flush() override {}
+
+private:
+    char* buffer;
+    size_t capacity;
+    size_t length;
+};
+
+int httpGet(const char* url, char* body, size_t capacity, uint32_t timeoutMs) {
+    HTTPClient http;
+    http.setConnectTimeout(timeoutMs);
+    http.setTimeout(timeoutMs);
+    if (capacity == 0 || !http.begin(url)) {
+        return -1;
+    }
+    int status = http.GET();
+    BufferSink sink(body, capacity);
+    if (status > 0) {
+        // writeToStream decodifica anche le risposte chunked
+        http.writeToStream(&sink);
+    }
+    http.end();
+    return status;
+}
+
+static const char* SETTINGS_NAMESPACE = "smartlamp";
+
+bool settingsRead(const char* key, void* dst, size_t len) {
+    nvs_handle_t handle;
+    if (nvs_open(SETTINGS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return false;
+    }
+    size_t size = len;
+    esp_err_t err = nvs_get_blob(handle, key, dst, &size);
+    nvs_close(handle);
+    return err == ESP_OK && size == len;
+}
+
+bool settingsWrite(const char* key, const void* src, size_t len) {
+    nvs_handle_t handle;
+    if (nvs_open(SETTINGS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        return false;
+    }
+    esp_err_t err = nvs_set_blob(handle, key, src, len);
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err == ESP_OK;
+}
+
+void logWrite(const char* text, size_t len) {
+    Serial.write(reinterpret_cast<const uint8_t*>(text), len);
+}
+
+}  // namespace hal
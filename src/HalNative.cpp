@@ -0,0 +1,509 @@
+#include "Hal.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace hal {
+
+namespace {
+    uint64_t nowUs = 0;
+    bool logEnabled = true;
+    Timer* timerList = nullptr;
+
+    struct PwmChannel {
+        uint32_t startDuty;
+        uint32_t targetDuty;
+        uint64_t startUs;
+        uint64_t durationUs;
+    };
+    PwmChannel pwmChannels[LEDC_CHANNEL_MAX];
+    uint32_t pwmHpoints[LEDC_CHANNEL_MAX];
+
+    int64_t epochOffsetUs = 0;  // orologio di sistema = virtuale + offset
+    void (*sntpCallback)() = nullptr;
+    native::HttpHandler httpHandler = nullptr;
+    std::map<std::string, std::vector<uint8_t>> settingsStore;  // solo host: l'NVS finto
+    void (*wakePinCallback)() = nullptr;
+    bool wakePinArmed = false;
+    bool wakePinLevel = false;
+    uint32_t locksHeld = 0;
+    ResetReason lastReset = ResetReason::POWER_ON;
+    uint8_t retained[RETAINED_SIZE];
+}
+
+uint32_t millis() {
+    return static_cast<uint32_t>(nowUs / 1000);
+}
+
+uint64_t micros() {
+    return nowUs;
+}
+
+void delay(uint32_t ms) {
+    native::advance(static_cast<uint64_t>(ms) * 1000);
+}
+
+// Il codice sull'host non fa avanzare l'orologio virtuale: i cicli vengono dall'orologio reale,
+// scalati a 240 MHz come l'ESP32, mentre le latenze misurate con micros() restano virtuali
+uint32_t cycles() {
+    auto ns = std::chrono::steady_clock::now().time_since_epoch();
+    return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(ns).count() * 240 / 1000);
+}
+
+uint32_t cyclesPerUs() {
+    return 240;
+}
+
+// Sull'host non ci sono task né heap del dispositivo
+TaskHandle currentTask() {
+    return nullptr;
+}
+
+uint32_t taskStackFree(TaskHandle) {
+    return 0;
+}
+
+bool taskRunTimeUs(TaskHandle, uint32_t&) {
+    return false;
+}
+
+uint32_t heapFree() {
+    return 0;
+}
+
+uint32_t heapMinFree() {
+    return 0;
+}
+
+uint32_t heapLargestFree() {
+    return 0;
+}
+
+// I duty dei canali sono tenuti in forma fine, con 4 bit frazionari come il registro del LEDC
+void pwmBegin(uint8_t, ledc_channel_t channel, ledc_timer_t, uint32_t, ledc_timer_bit_t, uint32_t hpoint) {
+    pwmChannels[channel] = PwmChannel{0, 0, nowUs, 0};
+    pwmHpoints[channel] = hpoint;
+}
+
+void pwmSetDuty(ledc_channel_t channel, uint32_t duty) {
+    pwmSetDutyFine(channel, duty << 4);
+}
+
+void pwmSetDutyFine(ledc_channel_t channel, uint32_t fineDuty) {
+    pwmChannels[channel] = PwmChannel{fineDuty, fineDuty, nowUs, 0};
+}
+
+void pwmSetDutiesFine(const ledc_channel_t* channels, const uint32_t* fineDuties, uint8_t count) {
+    for (uint8_t i = 0; i < count; ++i) {
+        pwmChannels[channels[i]] = PwmChannel{fineDuties[i], fineDuties[i], nowUs, 0};
+    }
+}
+
+void pwmFadeTo(ledc_channel_t channel, uint32_t duty, uint32_t durationMs) {
+    uint32_t current = native::pwmGetDutyFine(channel);
+    pwmChannels[channel] = PwmChannel{current, duty << 4, nowUs, static_cast<uint64_t>(durationMs) * 1000};
+}
+
+uint32_t pwmGetDuty(ledc_channel_t channel) {
+    return native::pwmGetDutyFine(channel) >> 4;
+}
+
+Timer::Timer() : callback(nullptr), arg(nullptr), deadlineUs(0), periodUs(0), active(false), next(nullptr) {}
+
+Timer::~Timer() {
+    Timer** link = &timerList;
+    while (*link != nullptr) {
+        if (*link == this) {
+            *link = next;
+            break;
+        }
+        link = &(*link)->next;
+    }
+}
+
+bool Timer::create(Callback cb, void* a, const char*) {
+    if (callback == nullptr) {
+        next = timerList;
+        timerList = this;
+    }
+    callback = cb;
+    arg = a;
+    return true;
+}
+
+void Timer::startOnce(uint64_t timeoutUs) {
+    deadlineUs = nowUs + timeoutUs;
+    periodUs = 0;
+    active = true;
+}
+
+void Timer::startPeriodic(uint64_t period) {
+    deadlineUs = nowUs + period;
+    periodUs = period;
+    active = true;
+}
+
+void Timer::stop() {
+    active = false;
+}
+
+bool Timer::isActive() const {
+    return active;
+}
+
+// Esegue in ordine tutti i timer con scadenza <= untilUs, spostando l'orologio
+void fireNativeTimers(uint64_t untilUs) {
+    for (;;) {
+        Timer* due = nullptr;
+        for (Timer* t = timerList; t != nullptr; t = t->next) {
+            if (t->active && t->deadlineUs <= untilUs && (due == nullptr || t->deadlineUs < due->deadlineUs)) {
+                due = t;
+            }
+        }
+        if (due == nullptr) {
+            break;
+        }
+        if (due->deadlineUs > nowUs) {
+            nowUs = due->deadlineUs;
+        }
+        if (due->periodUs > 0) {
+            due->deadlineUs += due->periodUs;
+        } else {
+            due->active = false;
+        }
+        due->callback(due->arg);
+    }
+    nowUs = untilUs;
+}
+
+Uart::Uart(uint8_t port) : port(port), overruns(0), head(0), tail(0), rxEnabled(true) {}
+
+void Uart::begin(uint32_t, int, int) {
+    head = tail = 0;
+}
+
+void Uart::setRxEnabled(bool enabled) {
+    rxEnabled = enabled;
+    head = tail = 0;
+}
+
+size_t Uart::write(const uint8_t*, size_t len) {
+    return len;
+}
+
+bool Uart::waitForData(uint32_t) {
+    return head != tail;
+}
+
+size_t Uart::available() {
+    return (head + BUFFER_SIZE - tail) % BUFFER_SIZE;
+}
+
+int Uart::read() {
+    if (head == tail) {
+        return -1;
+    }
+    uint8_t byte = buffer[tail];
+    tail = (tail + 1) % BUFFER_SIZE;
+    return byte;
+}
+
+size_t Uart::read(uint8_t* dst, size_t len) {
+    size_t count = 0;
+    while (count < len && head != tail) {
+        dst[count++] = buffer[tail];
+        tail = (tail + 1) % BUFFER_SIZE;
+    }
+    return count;
+}
+
+size_t Uart::inject(const uint8_t* data, size_t len) {
+    if (!rxEnabled) {
+        return 0;
+    }
+    size_t count = 0;
+    while (count < len && (head + 1) % BUFFER_SIZE != tail) {
+        buffer[head] = data[count++];
+        head = (head + 1) % BUFFER_SIZE;
+    }
+    if (count < len) {
+        ++overruns;
+    }
+    return count;
+}
+
+// L'host è a singolo thread: basta marcare il lock per scoprire rientri indesiderati
+SpinLock::SpinLock() : locked(false) {}
+
+void SpinLock::lock() {
+    locked = true;
+}
+
+void SpinLock::unlock() {
+    locked = false;
+}
+
+Partition::Partition() : base(0), length(NATIVE_SIZE), operations(0), powerLeft(UINT32_MAX) {
+    memset(image, 0xFF, sizeof(image));
+}
+
+bool Partition::open(const char*, size_t offset, size_t windowLength) {
+    if (offset % SECTOR_SIZE != 0 || offset >= NATIVE_SIZE) {
+        return false;
+    }
+    base = offset;
+    length = windowLength == 0 || offset + windowLength > NATIVE_SIZE ? NATIVE_SIZE - offset : windowLength;
+    operations = 0;
+    return true;
+}
+
+bool Partition::powered() {
+    ++operations;
+    if (powerLeft == 0) {
+        return false;
+    }
+    powerLeft -= powerLeft != UINT32_MAX;
+    return true;
+}
+
+size_t Partition::size() const {
+    return length;
+}
+
+bool Partition::read(size_t offset, void* dst, size_t len) const {
+    if (offset + len > length) {
+        return false;
+    }
+    memcpy(dst, image + base + offset, len);
+    return true;
+}
+
+bool Partition::write(size_t offset, const void* src, size_t len) {
+    if (offset + len > length || !powered()) {
+        return false;
+    }
+    const uint8_t* bytes = static_cast<const uint8_t*>(src);
+    for (size_t i = 0; i < len; ++i) {
+        image[base + offset + i] &= bytes[i];
+    }
+    return true;
+}
+
+bool Partition::eraseSector(size_t offset) {
+    if (offset % SECTOR_SIZE != 0 || offset + SECTOR_SIZE > length || !powered()) {
+        return false;
+    }
+    memset(image + base + offset, 0xFF, SECTOR_SIZE);
+    return true;
+}
+
+bool Partition::loadImage(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    memset(image, 0xFF, sizeof(image));
+    size_t count = fread(image, 1, NATIVE_SIZE, file);
+    fclose(file);
+    return count > 0;
+}
+
+bool Partition::saveImage(const char* path) const {
+    FILE* file = fopen(path, "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    size_t count = fwrite(image, 1, NATIVE_SIZE, file);
+    fclose(file);
+    return count == NATIVE_SIZE;
+}
+
+bool powerConfigure(uint32_t, uint32_t, bool lightSleep, bool& lightSleepEnabled) {
+    lightSleepEnabled = lightSleep;
+    return true;
+}
+
+PowerLock::PowerLock() : held(false) {}
+
+PowerLock::~PowerLock() {
+    release();
+}
+
+bool PowerLock::create(Type, const char*) {
+    return true;
+}
+
+void PowerLock::acquire() {
+    if (!held) {
+        held = true;
+        ++locksHeld;
+    }
+}
+
+void PowerLock::release() {
+    if (held) {
+        held = false;
+        --locksHeld;
+    }
+}
+
+void wakePinBegin(uint8_t, void (*onWake)()) {
+    wakePinCallback = onWake;
+    wakePinArmed = false;
+}
+
+void wakePinArm(bool armed) {
+    wakePinArmed = armed && wakePinCallback != nullptr;
+    // Come il livello sul dispositivo: se il pin è già alto l'interrupt scatta subito
+    if (wakePinArmed && wakePinLevel) {
+        native::setWakePin(true);
+    }
+}
+
+ResetReason resetReason() {
+    return lastReset;
+}
+
+bool retainedRead(void* dst, size_t len) {
+    if (lastReset == ResetReason::POWER_ON || len > RETAINED_SIZE) {
+        return false;
+    }
+    memcpy(dst, retained, len);
+    return true;
+}
+
+void retainedWrite(const void* src, size_t len) {
+    memcpy(retained, src, len < RETAINED_SIZE ? len : RETAINED_SIZE);
+}
+
+void setEpoch(uint32_t epoch) {
+    epochOffsetUs = static_cast<int64_t>(epoch) * 1000000 - static_cast<int64_t>(nowUs);
+}
+
+uint32_t epochNow() {
+    return static_cast<uint32_t>((static_cast<int64_t>(nowUs) + epochOffsetUs) / 1000000);
+}
+
+void startSntp(const char*, void (*onSync)()) {
+    sntpCallback = onSync;
+}
+
+int httpGet(const char* url, char* body, size_t capacity, uint32_t) {
+    if (httpHandler == nullptr || capacity == 0) {
+        return -1;
+    }
+    body[0] = '\0';
+    return httpHandler(url, body, capacity);
+}
+
+bool settingsRead(const char* key, void* dst, size_t len) {
+    auto it = settingsStore.find(key);
+    if (it == settingsStore.end() || it->second.size() != len) {
+        return false;
+    }
+    memcpy(dst, it->second.data(), len);
+    return true;
+}
+
+bool settingsWrite(const char* key, const void* src, size_t len) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(src);
+    settingsStore[key].assign(bytes, bytes + len);
+    return true;
+}
+
+void logWrite(const char* text, size_t len) {
+    if (logEnabled) {
+        fwrite(text, 1, len, stderr);
+    }
+}
+
+namespace native {
+
+void setTime(uint64_t us) {
+    nowUs = us;
+}
+
+void advance(uint64_t us) {
+    fireNativeTimers(nowUs + us);
+}
+
+uint64_t nextTimerDeadline() {
+    uint64_t next = UINT64_MAX;
+    for (Timer* t = timerList; t != nullptr; t = t->next) {
+        if (t->active && t->deadlineUs < next) {
+            next = t->deadlineUs;
+        }
+    }
+    return next;
+}
+
+void setLogEnabled(bool enabled) {
+    logEnabled = enabled;
+}
+
+// Interpolazione lineare, come il fade hardware del LEDC
+uint32_t pwmGetDutyFine(ledc_channel_t channel) {
+    const PwmChannel& ch = pwmChannels[channel];
+    uint64_t elapsed = nowUs - ch.startUs;
+    if (elapsed >= ch.durationUs) {
+        return ch.targetDuty;
+    }
+    int64_t delta = static_cast<int64_t>(ch.targetDuty) - static_cast<int64_t>(ch.startDuty);
+    return static_cast<uint32_t>(ch.startDuty + delta * static_cast<int64_t>(elapsed) / static_cast<int64_t>(ch.durationUs));
+}
+
+uint32_t pwmGetHpoint(ledc_channel_t channel) {
+    return pwmHpoints[channel];
+}
+
+void setEpoch(uint32_t epoch) {
+    hal::setEpoch(epoch);
+}
+
+void syncSntp(uint32_t epoch) {
+    setEpoch(epoch);
+    if (sntpCallback != nullptr) {
+        sntpCallback();
+    }
+}
+
+void setHttpHandler(HttpHandler handler) {
+    httpHandler = handler;
+}
+
+void clearSettings() {
+    settingsStore.clear();
+}
+
+void setWakePin(bool high) {
+    wakePinLevel = high;
+    if (high && wakePinArmed) {
+        wakePinArmed = false;
+        wakePinCallback();
+    }
+}
+
+bool isWakePinArmed() {
+    return wakePinArmed;
+}
+
+uint32_t powerLocksHeld() {
+    return locksHeld;
+}
+
+void simulateReset(ResetReason reason) {
+    lastReset = reason;
+    if (reason == ResetReason::POWER_ON) {
+        for (size_t i = 0; i < RETAINED_SIZE; ++i) {
+            retained[i] = static_cast<uint8_t>(i * 151 + 7);
+        }
+    }
+}
+
+}  // namespace native
+
+}  // namespace hal
@@ -0,0 +1,153 @@
+#include "HomeKitTelemetry.h"
+#include <string.h>
+
+// Acceso e occupazione prima del livello, se i gettoni non bastano per tutti
+static const uint8_t CHANNEL_ORDER[] = {HomeKitTelemetry::POWER, HomeKitTelemetry::OCCUPANCY, HomeKitTelemetry::LEVEL};
+
+HomeKitTelemetry::HomeKitTelemetry() : changes(0), tokens(BURST), refillMs(0), starvedLamps(0), lastServed(MAX_LAMPS - 1),
+      started(false), notifications(0), deferred(0) {
+    for (uint8_t i = 0; i < MAX_LAMPS; ++i) {
+        published[i].store(0, std::memory_order_relaxed);
+    }
+    memset(sent, 0, sizeof(sent));
+    memset(lastSentMs, 0, sizeof(lastSentMs));
+}
+
+uint16_t HomeKitTelemetry::fieldMask(uint8_t channel) {
+    switch (channel) {
+    case POWER:
+        return ON_BIT;
+    case LEVEL:
+        return LEVEL_MASK;
+    default:
+        return OCCUPIED_BIT;
+    }
+}
+
+void HomeKitTelemetry::store(uint8_t lamp, uint16_t word) {
+    // Un solo scrittore per lampada: basta confrontare con l'ultimo valore
+    if (published[lamp].load(std::memory_order_relaxed) != word) {
+        published[lamp].store(word, std::memory_order_release);
+        changes.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void HomeKitTelemetry::publishLevel(uint8_t lamp, uint8_t level) {
+    if (lamp >= MAX_LAMPS) {
+        return;
+    }
+    uint16_t word = published[lamp].load(std::memory_order_relaxed);
+    if (level == 0) {
+        word = static_cast<uint16_t>((word & ~ON_BIT) | (POWER << KNOWN_SHIFT));
+    } else {
+        word = static_cast<uint16_t>((word & ~(ON_BIT | LEVEL_MASK)) | ON_BIT | (level & LEVEL_MASK) |
+                                     ((POWER | LEVEL) << KNOWN_SHIFT));
+    }
+    store(lamp, word);
+}
+
+void HomeKitTelemetry::publishOccupancy(uint8_t lamp, bool occupied) {
+    if (lamp >= MAX_LAMPS) {
+        return;
+    }
+    uint16_t word = published[lamp].load(std::memory_order_relaxed);
+    word = static_cast<uint16_t>((word & ~OCCUPIED_BIT) | (occupied ? OCCUPIED_BIT : 0) | (OCCUPANCY << KNOWN_SHIFT));
+    store(lamp, word);
+}
+
+bool HomeKitTelemetry::takeToken(uint8_t lamp, uint32_t nowMs) {
+    if (!started) {
+        started = true;
+        refillMs = nowMs;
+    }
+    uint32_t earned = (nowMs - refillMs) / REFILL_MS;
+    if (earned > 0) {
+        tokens = static_cast<uint8_t>(tokens + earned < BURST ? tokens + earned : BURST);
+        refillMs = tokens == BURST ? nowMs : refillMs + earned * REFILL_MS;
+    }
+    if (tokens == 0) {
+        return false;
+    }
+    // A turno dall'ultima lampada servita: passa prima chi è in attesa e viene dopo di lei
+    for (uint8_t other = static_cast<uint8_t>((lastServed + 1) % MAX_LAMPS); other != lamp;
+         other = static_cast<uint8_t>((other + 1) % MAX_LAMPS)) {
+        if ((starvedLamps & (1u << other)) != 0) {
+            return false;
+        }
+    }
+    --tokens;
+    lastServed = lamp;
+    return true;
+}
+
+uint8_t HomeKitTelemetry::poll(uint8_t lamp, uint8_t channels, uint32_t nowMs, TelemetryValues& out) {
+    if (lamp >= MAX_LAMPS) {
+        return 0;
+    }
+    uint16_t word = published[lamp].load(std::memory_order_acquire);
+    out.on = (word & ON_BIT) != 0;
+    out.level = static_cast<uint8_t>(word & LEVEL_MASK);
+    out.occupied = (word & OCCUPIED_BIT) != 0;
+
+    uint8_t known = static_cast<uint8_t>(word >> KNOWN_SHIFT);
+    uint8_t sentKnown = static_cast<uint8_t>(sent[lamp] >> KNOWN_SHIFT);
+    uint8_t due = 0;
+    uint32_t waiting = 0;
+    bool starved = false;
+    for (uint8_t channel : CHANNEL_ORDER) {
+        uint16_t mask = fieldMask(channel);
+        if ((channels & known & channel) == 0 || ((sentKnown & channel) != 0 && ((word ^ sent[lamp]) & mask) == 0)) {
+            continue;
+        }
+        uint8_t slot = channel == POWER ? 0 : channel == LEVEL ? 1 : 2;
+        uint32_t interval = channel == OCCUPANCY ? OCCUPANCY_INTERVAL_MS : MIN_INTERVAL_MS;
+        // Il cambio resta in attesa e al prossimo poll parte con il valore di allora
+        if ((sentKnown & channel) != 0 && nowMs - lastSentMs[lamp][slot] < interval) {
+            ++waiting;
+            continue;
+        }
+        if (!takeToken(lamp, nowMs)) {
+            ++waiting;
+            starved = true;
+            continue;
+        }
+        lastSentMs[lamp][slot] = nowMs;
+        sent[lamp] = static_cast<uint16_t>((sent[lamp] & ~mask) | (word & mask) | (channel << KNOWN_SHIFT));
+        due |= channel;
+    }
+    // Una lampada che non ha più nulla in attesa non trattiene il giro
+    uint16_t bit = static_cast<uint16_t>(1u << lamp);
+    starvedLamps = static_cast<uint16_t>(starved ? starvedLamps | bit : starvedLamps & ~bit);
+    if (due != 0) {
+        notifications.fetch_add(static_cast<uint32_t>(__builtin_popcount(due)), std::memory_order_relaxed);
+    }
+    if (waiting != 0) {
+        deferred.fetch_add(waiting, std::memory_order_relaxed);
+    }
+    return due;
+}
+
+void HomeKitTelemetry::supersede(uint8_t lamp, uint8_t channels) {
+    if (lamp >= MAX_LAMPS) {
+        return;
+    }
+    uint16_t word = published[lamp].load(std::memory_order_acquire);
+    channels &= static_cast<uint8_t>(word >> KNOWN_SHIFT);
+    for (uint8_t channel : CHANNEL_ORDER) {
+        if ((channels & channel) != 0) {
+            uint16_t mask = fieldMask(channel);
+            sent[lamp] = static_cast<uint16_t>((sent[lamp] & ~mask) | (word & mask) | (channel << KNOWN_SHIFT));
+        }
+    }
+}
+
+TelemetryStats HomeKitTelemetry::getStats() const {
+    return {changes.load(std::memory_order_relaxed), notifications.load(std::memory_order_relaxed),
+            deferred.load(std::memory_order_relaxed)};
+}
+
+void HomeKitTelemetry::resetStats() {
+    changes.store(0, std::memory_order_relaxed);
+    notifications.store(0, std::memory_order_relaxed);
+    deferred.store(0, std::memory_order_relaxed);
+}
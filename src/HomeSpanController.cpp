@@ -1,8 +1,141 @@
 #include "HomeSpanController.h"
+#include "TimeService.h"
+#include "LampEvents.h"
+#include "TraceRecorder.h"
+#include "Metrics.h"
+#include "LightingProfiles.h"
+#include "Log.h"
+#include "HomeKitTelemetry.h"
 
-SmartLamp::SmartLamp(LedController& controller) : Service::LightBulb(), ledController(controller) {
+// Dopo un reset con la lampada accesa la riconnessione al WiFi non lampeggia: la luce resta quella di prima
+static bool quietReconnect = false;
+
+// Segnala lo stato di HomeSpan con il LED
+static void statusCallback(HS_STATUS status) {
+    LedController& instance = LedController::getInstance();
+    switch (status)
+    {
+    case HS_WIFI_NEEDED:
+        instance.startSetupBlink(2000);
+        break;
+    case HS_WIFI_CONNECTING:
+        if (!quietReconnect) {
+            instance.startSetupBlink(1000);
+        }
+        break;
+    case HS_PAIRED:
+        instance.stopSetupBlink();
+        break;
+    case HS_PAIRING_NEEDED:
+        instance.startSetupBlink(500);
+        break;
+    default:
+        break;
+    }
+}
+
+// Comando "@M" della CLI seriale di HomeSpan
+static void metricsCommand(const char*) {
+    Metrics::dump();
+    TelemetryStats stats = HomeKitTelemetry::getInstance().getStats();
+    char line[96];
+    int len = snprintf(line, sizeof(line), "homekit: %lu cambi, %lu notifiche, %lu poll in attesa\n",
+                       static_cast<unsigned long>(stats.changes), static_cast<unsigned long>(stats.notifications),
+                       static_cast<unsigned long>(stats.deferred));
+    hal::logWrite(line, static_cast<size_t>(len));
+}
+
+static void printProfiles(const LightingProfileSet& set) {
+    char line[96];
+    int len = snprintf(line, sizeof(line), "profiles: generazione %lu, notte %02u:%02u-%02u:%02u\n",
+                       static_cast<unsigned long>(LightingProfiles::getInstance().getGeneration()), set.nightStartMin / 60,
+                       set.nightStartMin % 60, set.nightEndMin / 60, set.nightEndMin % 60);
+    hal::logWrite(line, static_cast<size_t>(len));
+    for (uint8_t p = 0; p < set.count; ++p) {
+        for (size_t s = 0; s < LampStateTable::STATE_COUNT; ++s) {
+            const StoredStateParams& state = set.profiles[p].states[s];
+            len = snprintf(line, sizeof(line), "profiles: %02u:%02u stato %u luminosita %u/%u fade %u ms durata %ld s\n",
+                           set.profiles[p].startMin / 60, set.profiles[p].startMin % 60, static_cast<unsigned>(s),
+                           state.brightnessNum, state.brightnessDen, state.fadeMs,
+                           state.durationMs == LampStateTable::NO_TIMEOUT ? -1L : static_cast<long>(state.durationMs / 1000));
+            hal::logWrite(line, static_cast<size_t>(len));
+        }
+    }
+}
+
+// Profilo che inizia a startMin; se manca lo crea copiando quello che valeva a quell'ora
+static StoredProfile* profileAt(LightingProfileSet& set, uint16_t startMin) {
+    uint8_t index = 0;
+    while (index < set.count && set.profiles[index].startMin < startMin) {
+        ++index;
+    }
+    if (index < set.count && set.profiles[index].startMin == startMin) {
+        return &set.profiles[index];
+    }
+    if (set.count == LightingProfileSet::MAX_PROFILES) {
+        return nullptr;
+    }
+    StoredProfile copy = set.profiles[index == 0 ? set.count - 1 : index - 1];
+    for (uint8_t p = set.count; p > index; --p) {
+        set.profiles[p] = set.profiles[p - 1];
+    }
+    copy.startMin = startMin;
+    set.profiles[index] = copy;
+    ++set.count;
+    return &set.profiles[index];
+}
+
+// Comando "@P" della CLI seriale di HomeSpan, applicato subito e salvato in NVS:
+//   @P                                stampa i profili
+//   @P default                        torna ai profili di fabbrica
+//   @P night 19:00 07:00              finestra notturna senza posizione
+//   @P 22:00 1 1/2 1500 120           stato 1 del profilo delle 22:00: luminosità, fade ms, durata s (-1 nessuna)
+static void profileCommand(const char* buf) {
+    LightingProfiles& profiles = LightingProfiles::getInstance();
+    LightingProfileSet set = profiles.getSource();
+    unsigned h1, m1, h2, m2, state, num, den, fade;
+    long durationS;
+    if (sscanf(buf + 1, " night %u:%u %u:%u", &h1, &m1, &h2, &m2) == 4) {
+        set.nightStartMin = static_cast<uint16_t>(h1 * 60 + m1);
+        set.nightEndMin = static_cast<uint16_t>(h2 * 60 + m2);
+    } else if (strstr(buf + 1, "default") != nullptr) {
+        set = LightingProfileSet::defaults();
+    } else if (sscanf(buf + 1, " %u:%u %u %u/%u %u %ld", &h1, &m1, &state, &num, &den, &fade, &durationS) == 7 &&
+               state < LampStateTable::STATE_COUNT && num <= UINT8_MAX && den <= UINT8_MAX && fade <= UINT16_MAX) {
+        StoredProfile* profile = profileAt(set, static_cast<uint16_t>(h1 * 60 + m1));
+        if (profile == nullptr) {
+            LOG_WARN("Profiles: al massimo %u profili", LightingProfileSet::MAX_PROFILES);
+            return;
+        }
+        profile->states[state] = {static_cast<uint8_t>(num), static_cast<uint8_t>(den), static_cast<uint16_t>(fade),
+                                  durationS < 0 ? LampStateTable::NO_TIMEOUT : static_cast<uint32_t>(durationS) * 1000};
+    } else {
+        printProfiles(set);
+        return;
+    }
+    set.checksum = LightingProfiles::checksum(set);
+    const char* error = profiles.update(set);
+    if (error != nullptr) {
+        LOG_WARN("Profiles: comando scartato (%s)", error);
+    }
+}
+
+// Il servizio dell'ora fa SNTP e lookup del fuso nel suo task, non in quello di HomeSpan
+static void wifiCallback() {
+    // Modem sleep tra i beacon dell'access point: senza, il WiFi impedisce il light sleep
+    WiFi.setSleep(true);
+    TimeService::getInstance().onNetworkUp();
+}
+
+SmartLamp::SmartLamp(LedController& controller, uint8_t brightness, uint8_t lampIndex)
+    : Service::LightBulb(), ledController(controller), colorTemperature(nullptr), newBrightness(brightness),
+      lamp(lampIndex), lastPollMs(0) {
     power = new Characteristic::On();
-    level = new Characteristic::Brightness(100);
+    level = new Characteristic::Brightness(brightness);
+    if (controller.getLayout() == LedLayout::CCT) {
+        colorTemperature = new Characteristic::ColorTemperature(controller.getColorTemperature());
+        colorTemperature->setRange(LedController::COOL_MIRED, LedController::WARM_MIRED);
+    }
 
 }
 
@@ -10,23 +143,68 @@ boolean SmartLamp::update() {
     boolean isOn = power->getNewVal();
     int newBrightness = level->getNewVal();
     this->newBrightness = newBrightness;
-    
-    if (isOn) {
-        ledController.startFadeTo(map(newBrightness, 0, 100, 0, (1 << ledController.getResolution()) - 1), 200);  // Fade to new brightness based on resolution
-    }else{
-        ledController.startFadeOut(200);
+
+    // Cambia il mix tra caldo e freddo; il fade della luminosità qui sotto lo riprende dal duty reale
+    if (colorTemperature != nullptr && colorTemperature->updated()) {
+        ledController.setColorTemperature(colorTemperature->getNewVal(), 200);
+    }
+    // Trascinando lo slider arrivano decine di scritture al secondo: si fondono nel fade in corso
+    ledController.requestLevel(isOn ? newBrightness : 0, 200);
+    // Vince il controller: i valori dell'automazione ancora da notificare non lo smentiscono
+    HomeKitTelemetry::getInstance().supersede(lamp, HomeKitTelemetry::POWER | HomeKitTelemetry::LEVEL);
+    // Il livello mostrato può essere quello di uno stato (SLEEP): il massimo cambia solo se lo
+    // slider è stato mosso davvero, non per un tocco sull'interruttore
+    if (level->updated()) {
+        TraceRecorder::getInstance().recordBrightness(this->newBrightness);
+        postLampEvent(LampEvent::brightnessChanged(this->newBrightness, lamp));
     }
 
     return true;
 }
 
-AutoModeSwitch::AutoModeSwitch(bool initialState) : Service::Switch() {
+void SmartLamp::loop() {
+    uint32_t now = hal::millis();
+    if (now - lastPollMs < HomeKitTelemetry::POLL_MS) {
+        return;
+    }
+    lastPollMs = now;
+    Metrics::BusyScope busy;
+    TelemetryValues values;
+    uint8_t due = HomeKitTelemetry::getInstance().poll(lamp, HomeKitTelemetry::POWER | HomeKitTelemetry::LEVEL, now, values);
+    if (due & HomeKitTelemetry::POWER) {
+        power->setVal(values.on);
+    }
+    if (due & HomeKitTelemetry::LEVEL) {
+        level->setVal(values.level);
+        newBrightness = values.level;
+    }
+}
+
+LampOccupancySensor::LampOccupancySensor(uint8_t lampIndex) : Service::OccupancySensor(), lamp(lampIndex), lastPollMs(0) {
+    occupied = new Characteristic::OccupancyDetected(0);
+}
+
+void LampOccupancySensor::loop() {
+    uint32_t now = hal::millis();
+    if (now - lastPollMs < HomeKitTelemetry::POLL_MS) {
+        return;
+    }
+    lastPollMs = now;
+    TelemetryValues values;
+    if (HomeKitTelemetry::getInstance().poll(lamp, HomeKitTelemetry::OCCUPANCY, now, values) != 0) {
+        occupied->setVal(values.occupied ? 1 : 0);
+    }
+}
+
+AutoModeSwitch::AutoModeSwitch(bool initialState, uint8_t lampIndex) : Service::Switch(), lamp(lampIndex) {
     power = new Characteristic::On(initialState);
     isOnAutoMode = initialState;
 }
 
 boolean AutoModeSwitch::update() {
     isOnAutoMode = power->getNewVal();
+    TraceRecorder::getInstance().recordAutoMode(isOnAutoMode);
+    postLampEvent(LampEvent::autoModeChanged(isOnAutoMode, lamp));
     return true;
 }
 
@@ -37,8 +215,8 @@ void AutoModeSwitch::activateAutoMode() {
 
 
 
-void setupHomeSpan(LedController& ledController, SmartLamp*& smartLamp, AutoModeSwitch*& autoModeSwitch) {
-    ledController.startSetupBlink(1000);
+// Impostazioni comuni alla lampada singola e al bridge
+static void configureHomeSpan() {
     homeSpan.setControlPin(0);
     homeSpan.setStatusPin(2);
     homeSpan.enableAutoStartAP();
@@ -47,20 +225,62 @@ void setupHomeSpan(LedController& ledController, SmartLamp*& smartLamp, AutoMode
     homeSpan.setApPassword("12345678");
     homeSpan.setPairingCode("10025800");
 
-    homeSpan.setStatusCallback(LedController::statusCallback);
+    homeSpan.setStatusCallback(statusCallback);
+    homeSpan.setWifiCallback(wifiCallback);
+    new SpanUserCommand('M', "- dump delle metriche (latenze, CPU e stack dei task, heap)", metricsCommand);
+    new SpanUserCommand('P', "<hh:mm> <stato> <n/d> <fade ms> <durata s> | night <hh:mm> <hh:mm> | default - profili di luce",
+                        profileCommand);
+}
+
+// Stack del task di poll: il dump delle metriche dice quanto ne resta dopo pairing e OTA
+static const uint32_t HOMESPAN_STACK = 8192;
+
+// Gli oggetti HomeSpan (accessori, servizi, comandi) sono creati una volta qui e mai liberati:
+// le loro new stanno tutte prima di Metrics::sealHeap()
+static void startHomeSpan(Category category, const char* name) {
+    homeSpan.begin(category, name);
+    homeSpan.autoPoll(HOMESPAN_STACK, 1, 0);
+    Metrics::registerTask("HomeSpan", HOMESPAN_STACK, homeSpan.getAutoPollTask());
+}
 
+void setupHomeSpan(LedController& ledController, SmartLamp*& smartLamp, AutoModeSwitch*& autoModeSwitch,
+                   const ResumeRecord& resumed) {
+    quietReconnect = resumed.state != LampState::OFF;
+    if (!quietReconnect) {
+        ledController.startSetupBlink(1000);
+    }
+    configureHomeSpan();
 
     new SpanAccessory();
         new Service::AccessoryInformation();
             new Characteristic::Identify();
-        smartLamp = new SmartLamp(ledController);
-        autoModeSwitch = new AutoModeSwitch(true);  // Inizializza con la modalità auto attiva
-        
-    // Attiva la modalità auto
-    autoModeSwitch->activateAutoMode();
-    homeSpan.begin(Category::Lighting, "Smart Lamp");
-    homeSpan.autoPoll(8192,1,0);
+        // Le caratteristiche partono dalle impostazioni riprese, già applicate alla lampada
+        smartLamp = new SmartLamp(ledController, resumed.brightness);
+        autoModeSwitch = new AutoModeSwitch(resumed.autoMode);
+        new LampOccupancySensor();
+
+    startHomeSpan(Category::Lighting, "Smart Lamp");
 }
 
+void setupHomeSpanBridge(LedController* const* leds, uint8_t count) {
+    // Lo stato di HomeSpan lo segnala il primo LED
+    leds[0]->startSetupBlink(1000);
+    configureHomeSpan();
 
+    new SpanAccessory();
+        new Service::AccessoryInformation();
+            new Characteristic::Identify();
+    for (uint8_t i = 0; i < count; ++i) {
+        char name[16];
+        snprintf(name, sizeof(name), "Smart Lamp %u", i + 1);
+        new SpanAccessory();
+            new Service::AccessoryInformation();
+                new Characteristic::Identify();
+                new Characteristic::Name(name);
+            new SmartLamp(*leds[i], ResumeState::DEFAULT_BRIGHTNESS, i);
+            new AutoModeSwitch(true, i);
+            new LampOccupancySensor(i);
+    }
 
+    startHomeSpan(Category::Bridges, "Smart Lamp Bridge");
+}
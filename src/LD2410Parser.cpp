@@ -0,0 +1,229 @@
+#include "LD2410Parser.h"
+#include <string.h>
+
+static const uint8_t REPORT_HEADER[] = {0xF4, 0xF3, 0xF2, 0xF1};
+static const uint8_t REPORT_TAIL[] = {0xF8, 0xF7, 0xF6, 0xF5};
+static const uint8_t ACK_HEADER[] = {0xFD, 0xFC, 0xFB, 0xFA};
+static const uint8_t ACK_TAIL[] = {0x04, 0x03, 0x02, 0x01};
+
+static const uint8_t TYPE_ENGINEERING = 0x01;
+static const uint8_t TYPE_BASIC = 0x02;
+static const uint8_t DATA_HEAD = 0xAA;
+static const uint8_t DATA_TAIL = 0x55;
+static const uint8_t DATA_CHECK = 0x00;
+
+// Offset dei campi dall'inizio del frame: header(4) + lunghezza(2) + tipo + 0xAA
+static const size_t OFFSET_LENGTH = 4;
+static const size_t OFFSET_TYPE = 6;
+static const size_t OFFSET_TARGET = 8;
+static const size_t OFFSET_ENGINEERING = 17;
+static const size_t FRAME_OVERHEAD = 10;  // header + lunghezza + tail
+static const size_t BASIC_LENGTH = 13;
+
+LD2410Parser::LD2410Parser() {
+    reset();
+}
+
+void LD2410Parser::reset() {
+    head = tail = 0;
+    memset(&stats, 0, sizeof(stats));
+}
+
+uint8_t* LD2410Parser::writeSpan(size_t& len) {
+    size_t used = head - tail;
+    size_t offset = head & RING_MASK;
+    size_t contiguous = RING_SIZE - offset;
+    size_t space = RING_SIZE - used;
+    len = space < contiguous ? space : contiguous;
+    return &ring[offset];
+}
+
+void LD2410Parser::commit(size_t len) {
+    head += len;
+    stats.bytes += len;
+}
+
+size_t LD2410Parser::push(const uint8_t* data, size_t len) {
+    size_t pushed = 0;
+    while (pushed < len) {
+        size_t span;
+        uint8_t* dst = writeSpan(span);
+        if (span == 0) {
+            noteOverrun();
+            break;
+        }
+        size_t chunk = len - pushed < span ? len - pushed : span;
+        memcpy(dst, data + pushed, chunk);
+        commit(chunk);
+        pushed += chunk;
+    }
+    return pushed;
+}
+
+void LD2410Parser::noteOverrun() {
+    ++stats.overruns;
+}
+
+bool LD2410Parser::matches(const uint8_t* marker, size_t offset) const {
+    return at(offset) == marker[0] && at(offset + 1) == marker[1] &&
+           at(offset + 2) == marker[2] && at(offset + 3) == marker[3];
+}
+
+bool LD2410Parser::next(LD2410Frame& frame) {
+    for (;;) {
+        size_t available = head - tail;
+        if (available < 4) {
+            return false;
+        }
+
+        bool report = matches(REPORT_HEADER, 0);
+        bool ack = !report && matches(ACK_HEADER, 0);
+        if (!report && !ack) {
+            // Fuori sincronia: avanza di un byte fino al prossimo header
+            ++tail;
+            ++stats.skippedBytes;
+            continue;
+        }
+
+        if (available < OFFSET_TYPE) {
+            return false;
+        }
+        size_t length = le16(OFFSET_LENGTH);
+        if (length > MAX_PAYLOAD || (report && length < BASIC_LENGTH)) {
+            ++stats.lengthErrors;
+            ++tail;
+            continue;
+        }
+        size_t total = length + FRAME_OVERHEAD;
+        if (available < total) {
+            return false;
+        }
+        if (!matches(report ? REPORT_TAIL : ACK_TAIL, OFFSET_TYPE + length)) {
+            ++stats.tailErrors;
+            ++tail;
+            continue;
+        }
+
+        if (ack) {
+            ++stats.ackFrames;
+            tail += total;
+            continue;
+        }
+
+        bool valid = decodeReport(length, frame);
+        tail += total;
+        if (!valid) {
+            ++stats.tailErrors;
+            continue;
+        }
+        ++stats.frames;
+        if (frame.engineering) {
+            ++stats.engineeringFrames;
+        }
+        return true;
+    }
+}
+
+bool LD2410Parser::decodeReport(size_t length, LD2410Frame& frame) const {
+    uint8_t type = at(OFFSET_TYPE);
+    if ((type != TYPE_BASIC && type != TYPE_ENGINEERING) || at(OFFSET_TYPE + 1) != DATA_HEAD ||
+        at(OFFSET_TYPE + length - 2) != DATA_TAIL || at(OFFSET_TYPE + length - 1) != DATA_CHECK) {
+        return false;
+    }
+
+    frame.engineering = type == TYPE_ENGINEERING;
+    frame.targetState = at(OFFSET_TARGET);
+    frame.movingDistance = le16(OFFSET_TARGET + 1);
+    frame.movingEnergy = at(OFFSET_TARGET + 3);
+    frame.stationaryDistance = le16(OFFSET_TARGET + 4);
+    frame.stationaryEnergy = at(OFFSET_TARGET + 6);
+    frame.detectionDistance = le16(OFFSET_TARGET + 7);
+
+    if (!frame.engineering) {
+        return true;
+    }
+
+    // Engineering: N gate in movimento, N gate fermi, energie per gate, luce e pin OUT
+    size_t movingCount = at(OFFSET_ENGINEERING) + 1;
+    size_t stationaryCount = at(OFFSET_ENGINEERING + 1) + 1;
+    if (movingCount > LD2410Frame::GATES || stationaryCount > LD2410Frame::GATES ||
+        OFFSET_ENGINEERING + 2 + movingCount + stationaryCount + 2 + 2 > OFFSET_TYPE + length) {
+        return false;
+    }
+    frame.maxMovingGate = movingCount - 1;
+    frame.maxStationaryGate = stationaryCount - 1;
+    size_t offset = OFFSET_ENGINEERING + 2;
+    for (size_t gate = 0; gate < LD2410Frame::GATES; ++gate) {
+        frame.movingGateEnergy[gate] = gate < movingCount ? at(offset + gate) : 0;
+    }
+    offset += movingCount;
+    for (size_t gate = 0; gate < LD2410Frame::GATES; ++gate) {
+        frame.stationaryGateEnergy[gate] = gate < stationaryCount ? at(offset + gate) : 0;
+    }
+    offset += stationaryCount;
+    frame.lightLevel = at(offset);
+    frame.outPin = at(offset + 1);
+    return true;
+}
+
+size_t LD2410Parser::encode(const LD2410Frame& frame, uint8_t* out, size_t capacity) {
+    if (frame.engineering && (frame.maxMovingGate >= LD2410Frame::GATES || frame.maxStationaryGate >= LD2410Frame::GATES)) {
+        return 0;
+    }
+    uint8_t data[MAX_PAYLOAD];
+    size_t n = 0;
+    data[n++] = frame.engineering ? TYPE_ENGINEERING : TYPE_BASIC;
+    data[n++] = DATA_HEAD;
+    data[n++] = frame.targetState;
+    data[n++] = frame.movingDistance & 0xFF;
+    data[n++] = frame.movingDistance >> 8;
+    data[n++] = frame.movingEnergy;
+    data[n++] = frame.stationaryDistance & 0xFF;
+    data[n++] = frame.stationaryDistance >> 8;
+    data[n++] = frame.stationaryEnergy;
+    data[n++] = frame.detectionDistance & 0xFF;
+    data[n++] = frame.detectionDistance >> 8;
+    if (frame.engineering) {
+        data[n++] = frame.maxMovingGate;
+        data[n++] = frame.maxStationaryGate;
+        for (size_t gate = 0; gate <= frame.maxMovingGate; ++gate) {
+            data[n++] = frame.movingGateEnergy[gate];
+        }
+        for (size_t gate = 0; gate <= frame.maxStationaryGate; ++gate) {
+            data[n++] = frame.stationaryGateEnergy[gate];
+        }
+        data[n++] = frame.lightLevel;
+        data[n++] = frame.outPin;
+    }
+    data[n++] = DATA_TAIL;
+    data[n++] = DATA_CHECK;
+
+    size_t total = n + FRAME_OVERHEAD;
+    if (total > capacity) {
+        return 0;
+    }
+    memcpy(out, REPORT_HEADER, 4);
+    out[4] = n & 0xFF;
+    out[5] = n >> 8;
+    memcpy(out + OFFSET_TYPE, data, n);
+    memcpy(out + OFFSET_TYPE + n, REPORT_TAIL, 4);
+    return total;
+}
+
+size_t LD2410Parser::encodeCommand(uint16_t command, const uint8_t* value, size_t valueLen, uint8_t* out, size_t capacity) {
+    size_t length = 2 + valueLen;
+    size_t total = length + FRAME_OVERHEAD;
+    if (total > capacity) {
+        return 0;
+    }
+    memcpy(out, ACK_HEADER, 4);
+    out[4] = length & 0xFF;
+    out[5] = length >> 8;
+    out[6] = command & 0xFF;
+    out[7] = command >> 8;
+    if (valueLen > 0) {
+        memcpy(out + 8, value, valueLen);
+    }
+    memcpy(out + 8 + valueLen, ACK_TAIL, 4);
+    return total;
+}
@@ -0,0 +1,113 @@
+#include "LampBank.h"
+#include <string.h>
+#include "Log.h"
+#include "StateEntry.h"
+#include "TimeService.h"
+#include "HomeKitTelemetry.h"
+
+// La lampada va nei 4 bit di flag dei record STATE della trace
+static_assert(LampBank::MAX_LAMPS <= 16, "indice di lampada oltre i flag della trace");
+
+LampBank::LampBank() : count(0) {
+    memset(movement, 0, sizeof(movement));
+    memset(presence, 0, sizeof(presence));
+    memset(zones, 0, sizeof(zones));
+    memset(zonesValid, 0, sizeof(zonesValid));
+}
+
+int LampBank::addLamp(LedController& led, uint8_t sensor, uint8_t zoneMask) {
+    if (count == MAX_LAMPS || sensor >= MAX_SENSORS) {
+        return -1;
+    }
+    uint8_t lamp = count++;
+    state[lamp] = LampState::OFF;
+    stateStart[lamp] = hal::millis();
+    stateDuration[lamp] = UINT32_MAX;
+    maxBrightness[lamp] = 100;
+    autoMode[lamp] = false;
+    sensorOf[lamp] = sensor;
+    presenceZones[lamp] = zoneMask;
+    leds[lamp] = &led;
+    return lamp;
+}
+
+void LampBank::applyEvent(const LampEvent& event) {
+    switch (event.type) {
+    case LampEventType::SENSOR_FRAME:
+        if (event.target < MAX_SENSORS) {
+            movement[event.target] = event.sensor.movement;
+            presence[event.target] = event.sensor.presence;
+            zones[event.target] = event.sensor.zones;
+            zonesValid[event.target] = event.sensor.zonesValid;
+            // Occupazione di ogni lampada che legge questo radar, come la vedono le regole
+            for (uint8_t i = 0; i < count; ++i) {
+                if (sensorOf[i] == event.target) {
+                    HomeKitTelemetry::getInstance().publishOccupancy(i, movement[event.target] || zonePresence(i));
+                }
+            }
+        }
+        break;
+    case LampEventType::BRIGHTNESS_CHANGED:
+        if (event.target < count) {
+            maxBrightness[event.target] = event.brightness;
+        }
+        break;
+    case LampEventType::AUTO_MODE_CHANGED:
+        if (event.target < count) {
+            autoMode[event.target] = event.autoMode;
+        }
+        break;
+    case LampEventType::NIGHT_CHANGED:
+    case LampEventType::SENSOR_WAKE:
+        break;
+    }
+}
+
+uint32_t LampBank::evaluate() {
+    uint32_t now = hal::millis();
+    LampState next[MAX_LAMPS];
+    uint32_t changed = 0;
+    // Solo letture dalle colonne e lookup nella tabella delle transizioni, senza chiamate
+    for (uint8_t i = 0; i < count; ++i) {
+        bool timedOut = now - stateStart[i] > stateDuration[i];
+        next[i] = autoMode[i] ? LampStateTable::next(state[i], movement[sensorOf[i]], zonePresence(i), timedOut)
+                              : LampState::OFF;
+        changed |= static_cast<uint32_t>(next[i] != state[i]) << i;
+    }
+    if (changed == 0) {
+        return 0;
+    }
+    // Il profilo dipende solo dall'ora: lo si cerca una volta per tutte le transizioni del passo
+    int32_t minute = TimeService::getInstance().localMinute();
+    for (uint8_t i = 0; i < count; ++i) {
+        if ((changed >> i) & 1) {
+            LOG_INFO("State: lampada %u, %d -> %d", i, static_cast<int>(state[i]), static_cast<int>(next[i]));
+            enterState(i, state[i], next[i], minute);
+            state[i] = next[i];
+            stateStart[i] = now;
+        }
+    }
+    return changed;
+}
+
+void LampBank::enterState(uint8_t lamp, LampState from, LampState to, int32_t minute) {
+    StateParams params = StateEntry::apply(*leds[lamp], lamp, from, to, maxBrightness[lamp], minute);
+    // In manuale la lampada resta in OFF senza timeout, come nella lampada singola
+    stateDuration[lamp] = autoMode[lamp] ? params.durationMs : UINT32_MAX;
+}
+
+uint32_t LampBank::msUntilTimeout() const {
+    uint32_t now = hal::millis();
+    uint32_t nearest = UINT32_MAX;
+    for (uint8_t i = 0; i < count; ++i) {
+        if (!autoMode[i] || stateDuration[i] == UINT32_MAX) {
+            continue;
+        }
+        uint32_t elapsed = now - stateStart[i];
+        // Timeout già scaduto e valutato: solo un evento può cambiare lo stato
+        if (elapsed <= stateDuration[i] && stateDuration[i] - elapsed + 1 < nearest) {
+            nearest = stateDuration[i] - elapsed + 1;
+        }
+    }
+    return nearest;
+}
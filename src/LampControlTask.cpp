@@ -0,0 +1,77 @@
+#include "LampControlTask.h"
+#include "Metrics.h"
+
+LampControlTask::LampControlTask(LampStateMachine& lamp, ActiveFn isActive)
+    : lamp(lamp), isActive(isActive), power(nullptr), resume(nullptr) {
+    resetStats();
+}
+
+void LampControlTask::resetStats() {
+    stats = LampLoopStats{};
+}
+
+uint32_t LampControlTask::nextTimeoutMs() const {
+    uint32_t timeout = lamp.msUntilTimeout();
+    // Di giorno il task non valuta: le scadenze del learner contano solo quando è attivo
+    if (isActive == nullptr || isActive()) {
+        uint32_t learner = lamp.msUntilLearnerCheck();
+        timeout = learner < timeout ? learner : timeout;
+    }
+    // Un cambio arrivato a meno di un intervallo dall'ultimo salvataggio aspetta: senza questa
+    // scadenza, a task parcheggiato, finirebbe in NVS solo al prossimo evento
+    if (resume != nullptr) {
+        uint32_t persist = resume->msUntilPersist();
+        timeout = persist < timeout ? persist : timeout;
+    }
+    uint32_t recheck = ACTIVE_RECHECK_MS;
+    if (power != nullptr) {
+        uint32_t check = power->msUntilNextCheck();
+        recheck = power->isParked() || check < recheck ? check : recheck;
+    }
+    return timeout < recheck ? timeout : recheck;
+}
+
+void LampControlTask::runOnce() {
+    LampEvent event;
+    bool received = waitLampEvent(event, nextTimeoutMs());
+
+    Metrics::BusyScope busy;
+    uint64_t wakeUs = hal::micros();
+    ++stats.wakeups;
+    if (power != nullptr) {
+        power->noteWakeup();
+    }
+
+    // Svuota tutto ciò che è arrivato nel frattempo: una sola valutazione per risveglio
+    bool sensorEvent = false;
+    uint32_t oldestSensorUs = 0;
+    while (received) {
+        ++stats.events;
+        lamp.applyEvent(event);
+        if (event.type == LampEventType::SENSOR_FRAME && !sensorEvent) {
+            sensorEvent = true;
+            oldestSensorUs = event.timestampUs;
+        }
+        received = waitLampEvent(event, 0);
+    }
+
+    bool active = isActive == nullptr || isActive();
+    if (active) {
+        if (lamp.evaluate()) {
+            ++stats.transitions;
+            if (sensorEvent) {
+                stats.lastLatencyUs = static_cast<uint32_t>(hal::micros()) - oldestSensorUs;
+                Metrics::sensorToFadeUs.record(stats.lastLatencyUs);
+                if (stats.lastLatencyUs > stats.maxLatencyUs) {
+                    stats.maxLatencyUs = stats.lastLatencyUs;
+                }
+            }
+        }
+    }
+
+    if (power != nullptr) {
+        power->update(active, lamp.getCurrentState() == LampState::OFF && !lamp.isPrewarmed());
+    }
+
+    stats.busyUs += hal::micros() - wakeUs;
+}
@@ -0,0 +1,78 @@
+#include "LampEvents.h"
+
+static hal::Queue<LampEvent, 16> lampEventQueue;
+static uint32_t droppedEvents = 0;
+
+LampEvent LampEvent::sensorFrame(bool movement, bool presence, uint16_t movementDistance, uint16_t stationaryDistance,
+                                 uint8_t zones, bool zonesValid, uint8_t sensor) {
+    LampEvent event;
+    event.type = LampEventType::SENSOR_FRAME;
+    event.target = sensor;
+    event.timestampUs = static_cast<uint32_t>(hal::micros());
+    event.sensor.movement = movement;
+    event.sensor.presence = presence;
+    event.sensor.movementDistance = movementDistance;
+    event.sensor.stationaryDistance = stationaryDistance;
+    event.sensor.zones = zones;
+    event.sensor.zonesValid = zonesValid;
+    return event;
+}
+
+LampEvent LampEvent::brightnessChanged(uint8_t brightness, uint8_t lamp) {
+    LampEvent event;
+    event.type = LampEventType::BRIGHTNESS_CHANGED;
+    event.target = lamp;
+    event.timestampUs = static_cast<uint32_t>(hal::micros());
+    event.brightness = brightness;
+    return event;
+}
+
+LampEvent LampEvent::autoModeChanged(bool autoMode, uint8_t lamp) {
+    LampEvent event;
+    event.type = LampEventType::AUTO_MODE_CHANGED;
+    event.target = lamp;
+    event.timestampUs = static_cast<uint32_t>(hal::micros());
+    event.autoMode = autoMode;
+    return event;
+}
+
+LampEvent LampEvent::nightChanged(bool night) {
+    LampEvent event;
+    event.type = LampEventType::NIGHT_CHANGED;
+    event.target = 0;
+    event.timestampUs = static_cast<uint32_t>(hal::micros());
+    event.night = night;
+    return event;
+}
+
+LampEvent LampEvent::sensorWake() {
+    LampEvent event;
+    event.type = LampEventType::SENSOR_WAKE;
+    event.target = 0;
+    event.timestampUs = static_cast<uint32_t>(hal::micros());
+    return event;
+}
+
+bool postLampEvent(const LampEvent& event) {
+    if (!lampEventQueue.send(event)) {
+        ++droppedEvents;
+        return false;
+    }
+    return true;
+}
+
+bool postLampEventFromIsr(const LampEvent& event) {
+    if (!lampEventQueue.sendFromIsr(event)) {
+        ++droppedEvents;
+        return false;
+    }
+    return true;
+}
+
+bool waitLampEvent(LampEvent& event, uint32_t timeoutMs) {
+    return lampEventQueue.receive(event, timeoutMs);
+}
+
+uint32_t droppedLampEvents() {
+    return droppedEvents;
+}
@@ -1,114 +1,168 @@
 #include "LampStateMachine.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "LightingProfiles.h"
+#include "StateEntry.h"
+#include "TimeService.h"
+#include "HomeKitTelemetry.h"
 
 LampStateMachine::LampStateMachine(LedController& led, MotionSensor& motion)
     : currentState(LampState::OFF), ledController(led), motionSensor(motion), maxBrightness(100),
-      stateStartTime(0), stateDuration(UINT32_MAX), debounceDelay(100) {
-    initializeStateTransitionRules();
+      stateStartTime(0), stateDuration(UINT32_MAX),
+      movement(false), presence(false), autoMode(false), presenceZones(0),
+      learner(nullptr), prewarmed(false) {
 }
 
-void LampStateMachine::initializeStateTransitionRules() {
-    stateTransitionRules[static_cast<size_t>(LampState::OFF)] = [](bool isMovement, bool isPresence, bool) {
-        return (isMovement || isPresence) ? LampState::FULL_ON : LampState::OFF;
-    };
-
-    stateTransitionRules[static_cast<size_t>(LampState::FULL_ON)] = [](bool isMovement, bool isPresence, bool stateTimedOut) {
-        if ((!isPresence && !isMovement) && stateTimedOut) return LampState::OFF;
-        if (!isMovement && stateTimedOut) return LampState::RELAXATION;
-        return LampState::FULL_ON;
-    };
-
-    stateTransitionRules[static_cast<size_t>(LampState::RELAXATION)] = [](bool isMovement, bool isPresence, bool stateTimedOut) {
-        if ((!isPresence && !isMovement ) && stateTimedOut) return LampState::OFF;
-        if (isMovement && stateTimedOut ) return LampState::FULL_ON;
-        if((isPresence && ! isMovement ) && stateTimedOut) return LampState::SLEEP;
-        return LampState::RELAXATION;
-    };
-
-    stateTransitionRules[static_cast<size_t>(LampState::SLEEP)] = [](bool isMovement, bool isPresence, bool) {
-        if ((!isPresence && !isMovement )) return LampState::OFF;
-        if (isMovement) return LampState::SUDDEN_MOVEMENT;
-        return LampState::SLEEP;
-    };
+void LampStateMachine::update(uint8_t maxBrightness, bool IsOnAutoMode) {
+    this->maxBrightness = maxBrightness;
+    autoMode = IsOnAutoMode;
+    if (IsOnAutoMode) {
+        motionSensor.update();
+        movement = motionSensor.isMovementDetected();
+        presence = inPresenceZones(motionSensor.isPresenceDetected(), motionSensor.getOccupiedZones(),
+                                   motionSensor.hasZones());
+        HomeKitTelemetry::getInstance().publishOccupancy(0, movement || presence);
+    }
+    evaluate();
+}
 
-    stateTransitionRules[static_cast<size_t>(LampState::SUDDEN_MOVEMENT)] = [](bool isMovement, bool isPresence, bool stateTimedOut) {
-        if ((!isPresence && !isMovement ) && stateTimedOut) return LampState::OFF;
-        if (isPresence && stateTimedOut) return LampState::SLEEP;
-        if (isMovement) return LampState::SUDDEN_MOVEMENT;
-        if (!isMovement && stateTimedOut) return LampState::RELAXATION;
-        return LampState::SLEEP;
-    };
+void LampStateMachine::resume(LampState state, uint8_t brightness, bool autoModeOn) {
+    maxBrightness = brightness;
+    autoMode = autoModeOn;
+    presence = state != LampState::OFF;
+    movement = false;
+    currentState = state;
+    prewarmed = false;
+    LOG_INFO("State: ripreso %d", static_cast<int>(state));
+    if (state != LampState::OFF) {
+        enterState(state, state);
+    }
+    stateStartTime = hal::millis();
 }
 
-void LampStateMachine::update(uint8_t maxBrightness, bool IsOnAutoMode) {
+void LampStateMachine::applyEvent(const LampEvent& event) {
+    switch (event.type) {
+    case LampEventType::SENSOR_FRAME:
+        movement = event.sensor.movement;
+        presence = inPresenceZones(event.sensor.presence, event.sensor.zones, event.sensor.zonesValid);
+        HomeKitTelemetry::getInstance().publishOccupancy(0, movement || presence);
+        break;
+    case LampEventType::BRIGHTNESS_CHANGED:
+        maxBrightness = event.brightness;
+        break;
+    case LampEventType::AUTO_MODE_CHANGED:
+        autoMode = event.autoMode;
+        break;
+    case LampEventType::NIGHT_CHANGED:
+    case LampEventType::SENSOR_WAKE:
+        // Basta il risveglio: la condizione di attivazione la rilegge il task di controllo,
+        // la presenza arriva con i frame del radar appena riprende la lettura
+        break;
+    }
+}
 
-    if (IsOnAutoMode) {
-        this->maxBrightness = maxBrightness;
-        motionSensor.update();
-        bool rawMovement = motionSensor.isMovementDetected();
-        bool rawPresence = motionSensor.isPresenceDetected();
-        
-        bool stateTimedOut = millis() - stateStartTime > stateDuration;
+bool LampStateMachine::evaluate() {
+    Metrics::CycleScope timing(Metrics::evaluateCycles);
+    LampState previousState = currentState;
+    if (autoMode) {
+        bool stateTimedOut = hal::millis() - stateStartTime > stateDuration;
 
         // Applica la regola di transizione in base allo stato attuale
-        LampState newState = stateTransitionRules[static_cast<size_t>(currentState)](rawMovement, rawPresence, stateTimedOut);
-
-        // Se lo stato cambia, aggiorna lo stato
-        setState(newState);
+        setState(LampStateTable::next(currentState, movement, presence, stateTimedOut));
     } else {
         stateDuration = UINT32_MAX;
-        stateStartTime = millis();
+        stateStartTime = hal::millis();
         setState(LampState::OFF);
     }
-}
-
-void LampStateMachine::setState(LampState newState) {
-    Serial.print("State: ");
-    Serial.println(static_cast<int>(newState));
-    if (currentState != newState) {
-        LampState oldState = currentState;
-        currentState = newState;
-
-        static const std::array<void (LampStateMachine::*)(), static_cast<size_t>(LampState::STATE_COUNT)> transitionFunctions = {
-            &LampStateMachine::transitionToOff,
-            &LampStateMachine::transitionToFullOn,
-            &LampStateMachine::transitionToRelaxation,
-            &LampStateMachine::transitionToSleep,
-            &LampStateMachine::transitionToSuddenMovement
-        };
-
-        if (static_cast<size_t>(newState) < transitionFunctions.size()) {
-            (this->*transitionFunctions[static_cast<size_t>(newState)])();
+    if (learner != nullptr) {
+        int32_t weekMinute = TimeService::getInstance().localWeekMinute();
+        // L'occupazione dal radar, non la lampada accesa: i minuti accesi dopo un'uscita li decide
+        // il timeout stesso, e impararli lo allungherebbe a ogni settimana.
+        // In manuale lo stato è forzato: non dice nulla sugli arrivi
+        if (autoMode) {
+            learner->observe(weekMinute, movement || presence,
+                             previousState == LampState::OFF && currentState != LampState::OFF);
         }
+        updatePrewarm(weekMinute);
+    }
+    return currentState != previousState;
+}
 
-        stateStartTime = millis();
+void LampStateMachine::updatePrewarm(int32_t weekMinute) {
+    bool wanted = autoMode && currentState == LampState::OFF && learner->shouldPrewarm(weekMinute);
+    if (wanted == prewarmed) {
+        return;
+    }
+    prewarmed = wanted;
+    int32_t minute = weekMinute < 0 ? -1 : weekMinute % TimeService::MINUTES_PER_DAY;
+    if (wanted) {
+        // Una frazione del duty di FULL_ON, con un fade lungo: il movimento poi parte da qui
+        StateParams fullOn = LightingProfiles::getInstance().params(LampState::FULL_ON, minute);
+        uint32_t scale = (fullOn.levelQ8 * OccupancyLearner::PREWARM_LEVEL_Q8) >> 8;
+        LOG_INFO("State: preaccensione, arrivo previsto");
+        StateEntry::fadeTo(ledController, 0, maxBrightness, static_cast<uint16_t>(scale > 0 ? scale : 1),
+                           OccupancyLearner::PREWARM_FADE_MS);
+    } else if (currentState == LampState::OFF) {
+        StateEntry::fadeTo(ledController, 0, maxBrightness, 0,
+                           LightingProfiles::getInstance().params(LampState::OFF, minute).fadeMs);
     }
 }
 
-void LampStateMachine::transitionToOff() {
-    ledController.startFadeOut(2000);
-    stateDuration = 0;
+bool LampStateMachine::inPresenceZones(bool rawPresence, uint8_t zones, bool zonesValid) const {
+    if (presenceZones == 0 || !zonesValid) {
+        return rawPresence;
+    }
+    return rawPresence && (zones & presenceZones) != 0;
 }
 
-void LampStateMachine::transitionToFullOn() {
-    uint16_t mappedBrightness = map(maxBrightness, 0, 100, 0, (1 << ledController.getResolution()) - 1);
-    ledController.startFadeTo(mappedBrightness, 1000);
-    stateDuration = 5 * 60 * 1000; // 5 minuti
+uint32_t LampStateMachine::msUntilTimeout() const {
+    if (!autoMode || stateDuration == UINT32_MAX) {
+        return UINT32_MAX;
+    }
+    uint32_t elapsed = hal::millis() - stateStartTime;
+    // Una volta scaduto, il timeout è già stato valutato: solo un evento può cambiare lo stato
+    if (elapsed > stateDuration) {
+        return UINT32_MAX;
+    }
+    return stateDuration - elapsed + 1;
 }
 
-void LampStateMachine::transitionToRelaxation() {
-    uint16_t mappedBrightness = map(maxBrightness, 0, 100, 0, ((1 << ledController.getResolution()) - 1) / 2); // Metà del ciclo massimo
-    ledController.startFadeTo(mappedBrightness, 2000);
-    stateDuration = 15 * 60 * 1000; // 15 minuti
+uint32_t LampStateMachine::msUntilLearnerCheck() const {
+    if (learner == nullptr || !autoMode || currentState != LampState::OFF) {
+        return UINT32_MAX;
+    }
+    int32_t weekMinute = TimeService::getInstance().localWeekMinute();
+    if (weekMinute < 0) {
+        return UINT32_MAX;
+    }
+    int32_t next = (OccupancyLearner::slotOf(weekMinute) + 1) * OccupancyHistory::SLOT_MIN;
+    int32_t prewarm = learner->nextPrewarmMinute(weekMinute);
+    if (prewarm >= 0 && prewarm < next) {
+        next = prewarm;
+    }
+    // Allo scoccare del minuto: localWeekMinute ha già il valore nuovo
+    uint32_t seconds = static_cast<uint32_t>(next - weekMinute) * 60 - hal::epochNow() % 60;
+    return seconds * 1000;
 }
 
-void LampStateMachine::transitionToSleep() {
-    uint16_t mappedBrightness = map(maxBrightness, 0, 100, 0, ((1 << ledController.getResolution()) - 1) / 8); // 1/8 del ciclo massimo
-    ledController.startFadeTo(mappedBrightness, 3000);
-    stateDuration = UINT32_MAX; // Nessun timeout per lo stato SLEEP
+void LampStateMachine::setState(LampState newState) {
+    if (currentState != newState) {
+        LOG_INFO("State: %d -> %d", static_cast<int>(currentState), static_cast<int>(newState));
+        LampState oldState = currentState;
+        currentState = newState;
+
+        enterState(oldState, newState);
+        prewarmed = false;
+
+        stateStartTime = hal::millis();
+    }
 }
 
-void LampStateMachine::transitionToSuddenMovement() {
-    uint16_t mappedBrightness = map(maxBrightness, 0, 100, 0, ((1 << ledController.getResolution()) - 1) / 2); // Metà del ciclo massimo
-    ledController.startFadeTo(mappedBrightness, 1000);
-    stateDuration = 30 * 1000; // 30 secondi
-}
\ No newline at end of file
+void LampStateMachine::enterState(LampState from, LampState to) {
+    StateParams params = StateEntry::apply(ledController, 0, from, to, maxBrightness, TimeService::getInstance().localMinute());
+    stateDuration = params.durationMs;
+    // Stanza di solito occupata a quell'ora: si abbassa più tardi; di solito vuota: prima
+    if (learner != nullptr && (to == LampState::RELAXATION || to == LampState::SLEEP)) {
+        stateDuration = learner->scaleTimeout(stateDuration, TimeService::getInstance().localWeekMinute());
+    }
+}
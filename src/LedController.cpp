@@ -1,125 +1,515 @@
 #include "LedController.h"
+#include "Metrics.h"
+#include "TraceRecorder.h"
 
 LedController* LedController::instance = nullptr;
 
+namespace {
+
+uint8_t channelCountFor(LedLayout layout) {
+    switch (layout) {
+    case LedLayout::CCT: return 2;
+    case LedLayout::RGBW: return 4;
+    default: return 1;
+    }
+}
+
+struct ChannelList {
+    ledc_channel_t list[LedController::MAX_CHANNELS];
+};
+
+ChannelList consecutiveChannels(ledc_channel_t first) {
+    ChannelList channels;
+    for (uint8_t i = 0; i < LedController::MAX_CHANNELS; ++i) {
+        channels.list[i] = static_cast<ledc_channel_t>(first + i);
+    }
+    return channels;
+}
+
+}  // namespace
+
+uint16_t LedState::brightnessAt(uint32_t nowUs) const {
+    if (!fading || static_cast<int32_t>(nowUs - publishedUs) <= 0) {
+        return brightness;
+    }
+    if (static_cast<int32_t>(fadeEndUs - nowUs) <= 0) {
+        return endBrightness;
+    }
+    // Dalla posizione sulla curva alla pubblicazione a quella di adesso
+    uint32_t from = FadeEngine::knotAt(curve, segmentMs, publishedUs - fadeStartUs);
+    uint32_t to = FadeEngine::knotAt(curve, segmentMs, nowUs - fadeStartUs);
+    if (from >= FadeEngine::KNOT_ONE || to <= from) {
+        return brightness;
+    }
+    int32_t delta = static_cast<int32_t>(endBrightness) - static_cast<int32_t>(brightness);
+    int64_t done = static_cast<int64_t>(delta) * (to - from) / (FadeEngine::KNOT_ONE - from);
+    return static_cast<uint16_t>(brightness + done);
+}
+
 LedController::LedController(uint8_t pin, ledc_channel_t channel, ledc_timer_t timer, uint32_t freq, ledc_timer_bit_t resolution)
-    : pin(pin), channel(channel), timer(timer), freq(freq), resolution(resolution),
-      currentBrightness(0), targetBrightness(0), isFading(false), isBlinking(false) {
-    instance = this;
+    : LedController(LedLayout::MONO, &pin, channel, timer, freq, resolution) {}
+
+LedController::LedController(LedLayout layout, const uint8_t* pinList, ledc_channel_t firstChannel, ledc_timer_t timer,
+                             uint32_t freq, ledc_timer_bit_t resolution)
+    : layout(layout), channelCount(channelCountFor(layout)), timer(timer), freq(freq), resolution(resolution),
+      colorTemperature(DEFAULT_MIRED), targetFine(0), isBlinking(false), blinkDuration(0),
+      fade(consecutiveChannels(firstChannel).list, channelCountFor(layout)), coalescing(false), pendingLevel(-1),
+      pendingDuration(0), appliedCommands(0),
+#ifdef SMARTLAMP_NATIVE
+      inlineProcessing(true),
+#else
+      inlineProcessing(false),
+#endif
+      processing(false), wake(&wakeups), droppedCommands(0) {
+    if (instance == nullptr) {
+        instance = this;
+    }
     maxDuty = (1 << resolution) - 1;  // Calcolo del valore massimo del duty basato sulla risoluzione
+    levels = BrightnessLut::forResolution(resolution);
+    if (levels == nullptr) {
+        levels = BrightnessLut::table<LEDC_TIMER_8_BIT>.data();  // Risoluzione non supportata: curva a 8 bit
+    }
+    for (uint8_t i = 0; i < MAX_CHANNELS; ++i) {
+        pins[i] = i < channelCount ? pinList[i] : 0;
+        channels[i] = static_cast<ledc_channel_t>(firstChannel + i);
+        mix[i] = 0;
+    }
+    // Mix iniziale: tutto sul canale bianco, per le CCT la temperatura di default
+    mix[channelCount - 1] = MIX_ONE;
+    if (layout == LedLayout::CCT) {
+        updateCctMix(DEFAULT_MIRED);  // prima di begin() non si toccano i canali
+    }
 }
 
 void LedController::begin() {
-    ledc_timer_config_t ledc_timer = {
-        .speed_mode = LEDC_HIGH_SPEED_MODE,
-        .duty_resolution = resolution,
-        .timer_num = timer,
-        .freq_hz = freq,
-        .clk_cfg = LEDC_AUTO_CLK
-    };
-    ledc_timer_config(&ledc_timer);
+    // Fronti di salita sfalsati nel periodo: i canali non si accendono tutti nello stesso istante
+    for (uint8_t i = 0; i < channelCount; ++i) {
+        hal::pwmBegin(pins[i], channels[i], timer, freq, resolution, (maxDuty + 1) * i / channelCount);
+    }
+    fade.begin(&LedController::onFadeComplete, this, &LedController::onFadeTimer);
+    blinkTimer.create(&LedController::onBlinkTimer, this, "blink_timer");
+    outputLock.create(hal::PowerLock::NO_LIGHT_SLEEP, "led");
+    publish();
+}
+
+// --- Lato produttori: qualsiasi task o timer ---
+
+bool LedController::submit(LedCommand command) {
+    command.submitCycles = hal::cycles();
+    if (!commands.push(command)) {
+        droppedCommands.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    if (inlineProcessing) {
+        process(0);
+    } else {
+        wake->send(0);  // se la coda è piena il proprietario ha già un risveglio in attesa
+    }
+    return true;
+}
+
+// Produttore unico: il task esp_timer (sull'host, chi fa avanzare l'orologio)
+void LedController::postTimerEvent(const TimerEvent& event) {
+    if (!timerEvents.push(event)) {
+        droppedCommands.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    if (inlineProcessing) {
+        process(0);
+    } else {
+        wake->send(0);
+    }
+}
+
+void LedController::onFadeTimer(void* arg, uint32_t generation) {
+    static_cast<LedController*>(arg)->postTimerEvent({TimerSource::FADE, generation});
+}
+
+void LedController::onBlinkTimer(void* arg) {
+    static_cast<LedController*>(arg)->postTimerEvent({TimerSource::BLINK, 0});
+}
+
+bool LedController::setLevel(uint8_t level) {
+    LedCommand command = {};
+    command.type = LedCommandType::SET_LEVEL;
+    command.value = level;
+    return submit(command);
+}
 
-    ledc_channel_config_t ledc_channel = {
-        .gpio_num = pin,
-        .speed_mode = LEDC_HIGH_SPEED_MODE,
-        .channel = channel,
-        .timer_sel = timer,
-        .duty = 0,
-        .hpoint = 0
-    };
-    ledc_channel_config(&ledc_channel);
+bool LedController::startFadeToLevel(uint8_t level, uint32_t duration, FadeCurve curve, uint16_t scaleQ8) {
+    LedCommand command = {};
+    command.type = LedCommandType::FADE_TO_LEVEL;
+    command.curve = curve;
+    command.value = level;
+    command.scaleQ8 = scaleQ8;
+    command.duration = duration;
+    return submit(command);
+}
 
-    ledc_fade_func_install(0);
+bool LedController::requestLevel(uint8_t level, uint32_t duration) {
+    LedCommand command = {};
+    command.type = LedCommandType::REQUEST_LEVEL;
+    command.value = level;
+    command.duration = duration;
+    return submit(command);
 }
 
-uint32_t LedController::calculateDuty(uint16_t brightness) const {
-    // Il valore massimo di luminosità dipende dalla risoluzione
-    uint32_t maxBrightnessValue = (1 << resolution) - 1;
-    return (brightness * maxDuty) / maxBrightnessValue;
+bool LedController::setBrightness(uint16_t brightness) {
+    LedCommand command = {};
+    command.type = LedCommandType::SET_BRIGHTNESS;
+    command.value = brightness;
+    return submit(command);
 }
 
-void LedController::setBrightness(uint16_t brightness) {
-    currentBrightness = brightness;
-    uint32_t duty = calculateDuty(brightness);
-    ledc_set_duty(LEDC_HIGH_SPEED_MODE, channel, duty);
-    ledc_update_duty(LEDC_HIGH_SPEED_MODE, channel);
-    isFading = false;
+bool LedController::startFadeIn(uint32_t duration) {
+    return startFadeTo((1 << resolution) - 1, duration);  // Imposta il massimo valore di luminosità
 }
 
-void LedController::startFadeIn(uint32_t duration) {
-    startFadeTo((1 << resolution) - 1, duration);  // Imposta il massimo valore di luminosità
+bool LedController::startFadeOut(uint32_t duration) {
+    return startFadeTo(0, duration);  // Imposta la luminosità a 0
 }
 
-void LedController::startFadeOut(uint32_t duration) {
-    startFadeTo(0, duration);  // Imposta la luminosità a 0
+bool LedController::startFadeTo(uint16_t newTargetBrightness, uint32_t duration, FadeCurve curve) {
+    LedCommand command = {};
+    command.type = LedCommandType::FADE_TO;
+    command.curve = curve;
+    command.value = newTargetBrightness;
+    command.duration = duration;
+    return submit(command);
 }
 
-void LedController::startFadeTo(uint16_t newTargetBrightness, uint32_t duration) {
-    targetBrightness = newTargetBrightness;
-    uint32_t targetDuty = calculateDuty(targetBrightness);
+bool LedController::cancelFade() {
+    LedCommand command = {};
+    command.type = LedCommandType::CANCEL_FADE;
+    return submit(command);
+}
+
+bool LedController::setColorTemperature(uint16_t mired, uint32_t duration) {
+    if (layout != LedLayout::CCT) {
+        return true;
+    }
+    LedCommand command = {};
+    command.type = LedCommandType::COLOR_TEMPERATURE;
+    command.value = mired;
+    command.duration = duration;
+    return submit(command);
+}
 
-    if (targetDuty > maxDuty) {
-        targetDuty = maxDuty;
+bool LedController::setChannelMix(const uint16_t* weights, uint32_t duration) {
+    LedCommand command = {};
+    command.type = LedCommandType::CHANNEL_MIX;
+    command.duration = duration;
+    for (uint8_t i = 0; i < channelCount; ++i) {
+        command.mix[i] = weights[i];
     }
+    return submit(command);
+}
+
+bool LedController::setDithering(bool enabled) {
+    LedCommand command = {};
+    command.type = LedCommandType::DITHERING;
+    command.value = enabled ? 1 : 0;
+    return submit(command);
+}
+
+bool LedController::startSetupBlink(uint32_t blinkDur) {
+    LedCommand command = {};
+    command.type = LedCommandType::START_BLINK;
+    command.duration = blinkDur;
+    return submit(command);
+}
+
+bool LedController::stopSetupBlink() {
+    LedCommand command = {};
+    command.type = LedCommandType::STOP_BLINK;
+    return submit(command);
+}
 
-    ledc_set_fade_with_time(LEDC_HIGH_SPEED_MODE, channel, targetDuty, duration);
-    ledc_fade_start(LEDC_HIGH_SPEED_MODE, channel, LEDC_FADE_NO_WAIT);
+// --- Lato proprietario ---
 
-    isFading = true;
+void LedController::process(uint32_t timeoutMs) {
+    if (processing) {
+        return;
+    }
+    uint8_t token;
+    wake->receive(token, timeoutMs);
+    drain();
+}
 
-    esp_timer_create_args_t timerArgs = {
-        .callback = &LedController::onFadeEnd,
-        .arg = this,
-        .dispatch_method = ESP_TIMER_TASK,
-        .name = "fade_timer"
-    };
-    esp_timer_handle_t fadeTimer;
-    esp_timer_create(&timerArgs, &fadeTimer);
-    esp_timer_start_once(fadeTimer, duration * 1000);
+void LedController::processAll(hal::Queue<uint8_t, 1>& queue, LedController* const* leds, size_t count,
+                               uint32_t timeoutMs) {
+    // Un risveglio arrivato durante il giro resta nella coda: il giro dopo riprende tutti i LED
+    uint8_t token;
+    queue.receive(token, timeoutMs);
+    for (size_t i = 0; i < count; ++i) {
+        leds[i]->drain();
+    }
 }
 
-void IRAM_ATTR LedController::onFadeEnd(void* arg) {
+void LedController::drain() {
+    // Sull'host un comando inviato mentre si applica il precedente resta in coda per il giro in corso
+    if (processing) {
+        return;
+    }
+    processing = true;
+    Metrics::BusyScope busy;
+    // Prima gli scatti dei timer: un frame in ritardo si vede, un comando in ritardo di un frame no
+    bool changed = false;
+    for (;;) {
+        TimerEvent event;
+        LedCommand command;
+        if (timerEvents.pop(event)) {
+            handleTimerEvent(event);
+        } else if (commands.pop(command)) {
+            apply(command);
+            ++appliedCommands;
+        } else {
+            break;
+        }
+        changed = true;
+    }
+    // Senza novità lo snapshot resta valido: tra due pubblicazioni lo interpola chi legge
+    if (changed) {
+        publish();
+    }
+    processing = false;
+}
+
+void LedController::apply(const LedCommand& command) {
+    switch (command.type) {
+    case LedCommandType::SET_LEVEL:
+        endCoalescing();
+        targetFine = levelToFineDuty(static_cast<uint8_t>(command.value));
+        applyTarget(targetFine, 0, FadeCurve::LINEAR);
+        break;
+    case LedCommandType::FADE_TO_LEVEL:
+        applyLevel(static_cast<uint8_t>(command.value), command.duration, command.curve, command.scaleQ8);
+        break;
+    case LedCommandType::REQUEST_LEVEL:
+        applyRequest(static_cast<uint8_t>(command.value), command.duration);
+        Metrics::homeKitToDutyUs.record((hal::cycles() - command.submitCycles) / hal::cyclesPerUs());
+        break;
+    case LedCommandType::SET_BRIGHTNESS:
+        endCoalescing();
+        targetFine = static_cast<uint32_t>(command.value) << BrightnessLut::FRACTION_BITS;
+        applyTarget(targetFine, 0, FadeCurve::LINEAR);
+        break;
+    case LedCommandType::FADE_TO:
+        applyFadeTo(command.value, command.duration, command.curve);
+        break;
+    case LedCommandType::CANCEL_FADE:
+        applyCancel();
+        break;
+    case LedCommandType::COLOR_TEMPERATURE:
+        updateCctMix(command.value);
+        if (!isBlinking) {
+            applyTarget(targetFine, command.duration, FadeCurve::LINEAR);
+        }
+        break;
+    case LedCommandType::CHANNEL_MIX:
+        applyMix(command.mix, command.duration);
+        break;
+    case LedCommandType::DITHERING:
+        fade.setDithering(command.value != 0);
+        break;
+    case LedCommandType::START_BLINK:
+        applyStartBlink(command.duration);
+        break;
+    case LedCommandType::STOP_BLINK:
+        applyStopBlink();
+        break;
+    }
+}
+
+void LedController::handleTimerEvent(const TimerEvent& event) {
+    if (event.source == TimerSource::FADE) {
+        fade.handleTimer(event.generation);
+        return;
+    }
+    if (!isBlinking) {
+        return;  // scatto arrivato dopo lo stop
+    }
+    if (currentBrightness() == 0) {
+        applyFadeTo(((1 << resolution) - 1) / 128, blinkDuration / 2, FadeCurve::LINEAR);  // Vai al massimo
+    } else {
+        applyFadeTo(0, blinkDuration / 2, FadeCurve::LINEAR);  // Vai a zero
+    }
+}
+
+void LedController::publish() {
+    LedState state = {};
+    state.publishedUs = static_cast<uint32_t>(hal::micros());
+    state.fading = fade.isActive();
+    uint32_t brightest = 0;
+    uint32_t end = 0;
+    for (uint8_t i = 0; i < channelCount; ++i) {
+        uint32_t duty = fade.currentDuty(i);
+        uint32_t target = fade.getTargetDuty(i);
+        state.channels[i] = static_cast<uint16_t>(duty);
+        brightest = duty > brightest ? duty : brightest;
+        end = target > end ? target : end;
+    }
+    state.brightness = static_cast<uint16_t>(brightest);
+    state.endBrightness = static_cast<uint16_t>(state.fading ? end : brightest);
+    state.fadeStartUs = state.fading ? static_cast<uint32_t>(fade.getStartUs()) : state.publishedUs;
+    state.fadeEndUs = state.fading ? static_cast<uint32_t>(fade.getStartUs() + fade.getDurationMs() * 1000ULL)
+                                   : state.publishedUs;
+    state.segmentMs = fade.getSegmentMs();
+    state.curve = fade.getCurve();
+    state.targetBrightness = static_cast<uint16_t>(targetFine >> BrightnessLut::FRACTION_BITS);
+    state.colorTemperature = colorTemperature;
+    state.fadeCount = fade.getStartCount();
+    state.commands = appliedCommands;
+    state.blinking = isBlinking;
+    snapshot.publish(state);
+    // Un fade verso l'alto accende il LED già dal primo passo
+    if (state.endBrightness != 0 && !state.blinking) {
+        Metrics::markFirstLight();
+    }
+    // Il LEDC e i timer dei fade vanno col clock APB, fermo in light sleep: solo a LED spento e fermo
+    if (state.brightness != 0 || state.fading || state.blinking) {
+        outputLock.acquire();
+    } else {
+        outputLock.release();
+    }
+}
+
+// Stesso livello su tutti i canali, pesato dal mix: il flusso totale non dipende dal mix
+void LedController::mixTargets(uint32_t fineDuty, uint32_t* targets) const {
+    for (uint8_t i = 0; i < channelCount; ++i) {
+        targets[i] = static_cast<uint32_t>((static_cast<uint64_t>(fineDuty) * mix[i] + MIX_ONE / 2) / MIX_ONE);
+    }
+}
+
+void LedController::applyTarget(uint32_t fineDuty, uint32_t duration, FadeCurve curve) {
+    uint32_t targets[MAX_CHANNELS];
+    mixTargets(fineDuty, targets);
+    fade.start(targets, duration, curve);
+}
+
+void LedController::applyLevel(uint8_t level, uint32_t duration, FadeCurve curve, uint16_t scaleQ8) {
+    endCoalescing();
+    targetFine = (levelToFineDuty(level) * scaleQ8) >> 8;
+    TraceRecorder::getInstance().recordFade(targetFine >> BrightnessLut::FRACTION_BITS, duration, curve);
+    applyTarget(targetFine, duration, curve);
+}
+
+uint8_t LedController::fineDutyToLevel(uint32_t fineDuty) const {
+    // Ricerca binaria nella tabella, crescente
+    uint8_t low = 0;
+    uint8_t high = BrightnessLut::LEVELS - 1;
+    while (low < high) {
+        uint8_t mid = static_cast<uint8_t>((low + high) / 2);
+        if (levels[mid] < fineDuty) {
+            low = static_cast<uint8_t>(mid + 1);
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+void LedController::applyRequest(uint8_t level, uint32_t duration) {
+    if (coalescing && fade.isActive()) {
+        pendingLevel = level;
+        pendingDuration = duration;
+        return;
+    }
+    applyLevel(level, duration, FadeCurve::LINEAR, SCALE_ONE);
+    coalescing = true;
+}
+
+// Qualsiasi altro fade (stato, lampeggio) ha la precedenza sulla richiesta in attesa
+void LedController::endCoalescing() {
+    coalescing = false;
+    pendingLevel = -1;
+}
+
+// Dal fade appena finito, già nel task proprietario: parte la richiesta arrivata nel frattempo
+void LedController::onFadeComplete(void* arg) {
     LedController* led = static_cast<LedController*>(arg);
-    led->currentBrightness = led->targetBrightness;
-    led->isFading = false;
+    int16_t level = led->pendingLevel;
+    led->pendingLevel = -1;
+    if (level >= 0) {
+        led->applyRequest(static_cast<uint8_t>(level), led->pendingDuration);
+    }
+}
+
+void LedController::applyFadeTo(uint16_t duty, uint32_t duration, FadeCurve curve) {
+    endCoalescing();
+    uint32_t targetDuty = duty > maxDuty ? maxDuty : duty;
+
+    // I fade del lampeggio di setup non finiscono nella trace
+    if (!isBlinking) {
+        TraceRecorder::getInstance().recordFade(targetDuty, duration, curve);
+    }
+
+    // Il fade riparte dal duty reale: un fade in corso viene reindirizzato, non ricominciato
+    targetFine = targetDuty << BrightnessLut::FRACTION_BITS;
+    applyTarget(targetFine, duration, curve);
 }
 
-void LedController::startSetupBlink(uint32_t blinkDur) {
+void LedController::applyCancel() {
+    fade.cancel();
+    // Il livello si ricava dal canale con la quota maggiore
+    uint8_t strongest = 0;
+    for (uint8_t i = 1; i < channelCount; ++i) {
+        strongest = mix[i] > mix[strongest] ? i : strongest;
+    }
+    targetFine = mix[strongest] == 0 ? 0 : fade.currentFineDuty(strongest) * MIX_ONE / mix[strongest];
+    // Annullato durante un cambio di mix il canale può essere sopra la sua quota: mai oltre il fondo scala
+    uint32_t fullScale = maxDuty << BrightnessLut::FRACTION_BITS;
+    targetFine = targetFine < fullScale ? targetFine : fullScale;
+}
+
+// Interpolazione in mired, quasi uniforme per l'occhio: caldo a WARM_MIRED, freddo a COOL_MIRED
+void LedController::updateCctMix(uint16_t mired) {
+    mired = mired < COOL_MIRED ? COOL_MIRED : (mired > WARM_MIRED ? WARM_MIRED : mired);
+    colorTemperature = mired;
+    uint16_t cool = static_cast<uint16_t>(static_cast<uint32_t>(WARM_MIRED - mired) * MIX_ONE / (WARM_MIRED - COOL_MIRED));
+    mix[0] = MIX_ONE - cool;
+    mix[1] = cool;
+}
+
+void LedController::applyMix(const uint16_t* weights, uint32_t duration) {
+    for (uint8_t i = 0; i < channelCount; ++i) {
+        mix[i] = weights[i] < MIX_ONE ? weights[i] : MIX_ONE;
+    }
+    if (!isBlinking) {
+        applyTarget(targetFine, duration, FadeCurve::LINEAR);
+    }
+}
+
+uint16_t LedController::currentBrightness() const {
+    uint32_t brightest = 0;
+    for (uint8_t i = 0; i < channelCount; ++i) {
+        uint32_t duty = fade.currentDuty(i);
+        brightest = duty > brightest ? duty : brightest;
+    }
+    return static_cast<uint16_t>(brightest);
+}
+
+void LedController::applyStartBlink(uint32_t blinkDur) {
     if (isBlinking) {
-        stopSetupBlink();
+        applyStopBlink();
     }
 
     blinkDuration = blinkDur;
     isBlinking = true;
 
-    esp_timer_create_args_t timerArgs = {
-        .callback = &LedController::onBlinkTimer,
-        .arg = this,
-        .dispatch_method = ESP_TIMER_TASK,
-        .name = "blink_timer"
-    };
-    esp_timer_create(&timerArgs, &blinkTimer);
-    esp_timer_start_periodic(blinkTimer, blinkDuration * 1000);
+    blinkTimer.startPeriodic(static_cast<uint64_t>(blinkDuration) * 1000);
 
     // Start with fade in
-    startFadeTo(((1 << resolution) - 1)/128, blinkDuration / 2);  // Metti al massimo valore
+    applyFadeTo(((1 << resolution) - 1) / 128, blinkDuration / 2, FadeCurve::LINEAR);  // Metti al massimo valore
 }
 
-void LedController::stopSetupBlink() {
+void LedController::applyStopBlink() {
     if (isBlinking) {
-        esp_timer_stop(blinkTimer);
-        esp_timer_delete(blinkTimer);
+        blinkTimer.stop();
         isBlinking = false;
-        setBrightness(0);
-    }
-}
-
-void IRAM_ATTR LedController::onBlinkTimer(void* arg) {
-    LedController* led = static_cast<LedController*>(arg);
-    if (led->getCurrentBrightness() == 0) {
-        led->startFadeTo(((1 << led->resolution) - 1)/128, led->blinkDuration / 2);  // Vai al massimo
-    } else {
-        led->startFadeTo(0, led->blinkDuration / 2);  // Vai a zero
+        endCoalescing();
+        targetFine = 0;
+        applyTarget(0, 0, FadeCurve::LINEAR);
     }
 }
 
@@ -0,0 +1,158 @@
+#include "LightingProfiles.h"
+#include <stddef.h>
+#include <string.h>
+#include "Log.h"
+#include "TimeService.h"
+
+static const char* SETTINGS_KEY = "profiles";
+static const uint16_t MINUTES_PER_DAY = 24 * 60;
+static const uint16_t MAX_FADE_MS = 60000;
+
+LightingProfileSet LightingProfileSet::defaults() {
+    LightingProfileSet set;
+    memset(&set, 0, sizeof(set));
+    set.version = VERSION;
+    set.count = 1;
+    set.nightStartMin = 17 * 60;
+    set.nightEndMin = 8 * 60;
+    for (size_t s = 0; s < LampStateTable::STATE_COUNT; ++s) {
+        const LampStateTable::StateConfig& config = LampStateTable::states[s];
+        set.profiles[0].states[s] = {config.brightnessNum, config.brightnessDen, config.fadeDuration, config.duration};
+    }
+    set.checksum = LightingProfiles::checksum(set);
+    return set;
+}
+
+LightingProfiles& LightingProfiles::getInstance() {
+    static LightingProfiles instance;
+    return instance;
+}
+
+LightingProfiles::LightingProfiles() : active(&buffers[0]), source(LightingProfileSet::defaults()) {
+    buffers[0].readers.store(0);
+    buffers[1].readers.store(0);
+    compile(source, buffers[0].table);
+    buffers[1].table = buffers[0].table;
+}
+
+void LightingProfiles::begin() {
+    LightingProfileSet stored;
+    if (!hal::settingsRead(SETTINGS_KEY, &stored, sizeof(stored))) {
+        return;
+    }
+    const char* error = apply(stored);
+    if (error != nullptr) {
+        LOG_WARN("Profiles: profili in NVS scartati (%s)", error);
+    }
+}
+
+uint32_t LightingProfiles::checksum(const LightingProfileSet& set) {
+    return hal::checksum(&set, offsetof(LightingProfileSet, checksum));
+}
+
+// Tutti i controlli qui, una volta sola: la tabella compilata non ne ha bisogno
+const char* LightingProfiles::validate(const LightingProfileSet& set) {
+    if (set.version != LightingProfileSet::VERSION) {
+        return "versione";
+    }
+    if (set.checksum != checksum(set)) {
+        return "checksum";
+    }
+    if (set.count == 0 || set.count > LightingProfileSet::MAX_PROFILES) {
+        return "numero di profili";
+    }
+    if (set.nightStartMin >= MINUTES_PER_DAY || set.nightEndMin >= MINUTES_PER_DAY) {
+        return "finestra notturna";
+    }
+    for (uint8_t p = 0; p < set.count; ++p) {
+        const StoredProfile& profile = set.profiles[p];
+        if (profile.startMin >= MINUTES_PER_DAY || profile.startMin % LightingTable::SLOT_MIN != 0 ||
+            (p > 0 && profile.startMin <= set.profiles[p - 1].startMin)) {
+            return "inizio dei profili";
+        }
+        for (const StoredStateParams& state : profile.states) {
+            if (state.brightnessDen == 0 || state.brightnessNum > state.brightnessDen) {
+                return "frazione di luminosità";
+            }
+            if (state.fadeMs > MAX_FADE_MS) {
+                return "durata del fade";
+            }
+        }
+    }
+    return nullptr;
+}
+
+void LightingProfiles::compile(const LightingProfileSet& set, LightingTable& table) {
+    memset(&table, 0, sizeof(table));
+    for (uint8_t p = 0; p < set.count; ++p) {
+        for (size_t s = 0; s < LampStateTable::STATE_COUNT; ++s) {
+            const StoredStateParams& state = set.profiles[p].states[s];
+            table.params[p][s] = {static_cast<uint16_t>((state.brightnessNum << 8) / state.brightnessDen), state.fadeMs,
+                                  state.durationMs};
+        }
+    }
+    // Prima dell'inizio del primo profilo vale l'ultimo, dal giorno prima
+    for (uint8_t slot = 0; slot < LightingTable::SLOTS; ++slot) {
+        uint16_t minute = slot * LightingTable::SLOT_MIN;
+        uint8_t profile = set.count - 1;
+        for (uint8_t p = 0; p < set.count; ++p) {
+            if (set.profiles[p].startMin <= minute) {
+                profile = p;
+            }
+        }
+        table.slotProfile[slot] = profile;
+    }
+    table.nightStartMin = set.nightStartMin;
+    table.nightEndMin = set.nightEndMin;
+}
+
+const char* LightingProfiles::apply(const LightingProfileSet& set) {
+    const char* error = validate(set);
+    if (error != nullptr) {
+        return error;
+    }
+    Buffer* current = active.load();
+    Buffer* spare = current == &buffers[0] ? &buffers[1] : &buffers[0];
+    // Un lettore può aver preso la riserva prima dello swap precedente: copia 8 byte, si aspetta poco
+    while (spare->readers.load() != 0) {
+    }
+    compile(set, spare->table);
+    spare->table.generation = current->table.generation + 1;
+    active.store(spare);
+
+    bool windowChanged = set.nightStartMin != source.nightStartMin || set.nightEndMin != source.nightEndMin;
+    source = set;
+    if (windowChanged) {
+        TimeService::getInstance().setNightWindow(set.nightStartMin, set.nightEndMin);
+    }
+    return nullptr;
+}
+
+const char* LightingProfiles::update(const LightingProfileSet& set) {
+    const char* error = apply(set);
+    if (error == nullptr) {
+        hal::settingsWrite(SETTINGS_KEY, &set, sizeof(set));
+        LOG_INFO("Profiles: %u profili attivi, generazione %lu", set.count, static_cast<unsigned long>(getGeneration()));
+    }
+    return error;
+}
+
+StateParams LightingProfiles::params(LampState state, int32_t minuteOfDay) const {
+    for (;;) {
+        const Buffer* buffer = active.load();
+        buffer->readers.fetch_add(1);
+        // Se nel frattempo c'è stato uno swap la tabella potrebbe essere già in riscrittura
+        if (active.load() == buffer) {
+            const LightingTable& table = buffer->table;
+            uint8_t profile = minuteOfDay < 0 ? 0 : table.slotProfile[minuteOfDay / LightingTable::SLOT_MIN];
+            StateParams result = table.params[profile][static_cast<size_t>(state)];
+            buffer->readers.fetch_sub(1, std::memory_order_release);
+            return result;
+        }
+        buffer->readers.fetch_sub(1, std::memory_order_release);
+    }
+}
+
+uint32_t LightingProfiles::getGeneration() const {
+    return active.load()->table.generation;
+}
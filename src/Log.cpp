@@ -0,0 +1,65 @@
+#include "Log.h"
+#include <atomic>
+#include "LockFreeQueue.h"
+
+static const size_t RING_SIZE = 64;
+static const size_t LINE_SIZE = 160;
+
+namespace {
+
+MpscQueue<LogRecord, RING_SIZE> ring;
+std::atomic<uint32_t> dropped(0);
+uint32_t reportedDrops = 0;  // solo il task di drain
+
+const char LEVEL_TAGS[] = {'-', 'E', 'W', 'I', 'D'};
+
+}  // namespace
+
+bool logPush(const LogRecord& record) {
+    if (!ring.push(record)) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+static void writeLine(const LogRecord& record) {
+    char line[LINE_SIZE];
+    unsigned long ms = record.timeMs;
+    char tag = record.level < sizeof(LEVEL_TAGS) ? LEVEL_TAGS[record.level] : '?';
+    int n = snprintf(line, sizeof(line), "%6lu.%03lu %c ", ms / 1000, ms % 1000, tag);
+    const uintptr_t* a = record.args;
+    // Gli argomenti mancanti valgono 0 e vengono ignorati dal formato
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+    int m = snprintf(line + n, sizeof(line) - n, record.fmt, a[0], a[1], a[2], a[3]);
+#pragma GCC diagnostic pop
+    size_t len = m < 0 ? n : n + m;
+    if (len > sizeof(line) - 2) {
+        len = sizeof(line) - 2;
+    }
+    line[len++] = '\n';
+    hal::logWrite(line, len);
+}
+
+size_t logDrain(size_t maxRecords) {
+    size_t written = 0;
+    LogRecord record;
+    while (written < maxRecords && ring.pop(record)) {
+        writeLine(record);
+        ++written;
+    }
+
+    uint32_t droppedNow = dropped.load(std::memory_order_relaxed);
+    if (droppedNow != reportedDrops) {
+        LogRecord note = {"log: %lu record persi", hal::millis(), LOG_LEVEL_WARN, 1,
+                          {static_cast<uintptr_t>(droppedNow - reportedDrops)}};
+        reportedDrops = droppedNow;
+        writeLine(note);
+    }
+    return written;
+}
+
+uint32_t logDroppedCount() {
+    return dropped.load(std::memory_order_relaxed);
+}
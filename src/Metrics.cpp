@@ -0,0 +1,335 @@
+#include "Metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "Log.h"
+
+static const uint32_t LOW_STACK_BYTES = 512;
+static const uint32_t STACK_ROUND_BYTES = 256;
+static const uint32_t HEAP_DRIFT_BYTES = 4096;  // calo del blocco più grande oltre il quale si avvisa
+// Prima di ogni blocco di new la sua dimensione, per i byte vivi; mantiene l'allineamento di malloc
+static const size_t ALLOC_HEADER = alignof(max_align_t);
+
+Histogram::Histogram(const char* name, const char* unit) : name(name), unit(unit) {
+    reset();
+}
+
+void Histogram::reset() {
+    for (uint8_t i = 0; i < BUCKETS; ++i) {
+        buckets[i].store(0, std::memory_order_relaxed);
+    }
+    total.store(0, std::memory_order_relaxed);
+    maxValue.store(0, std::memory_order_relaxed);
+}
+
+void Histogram::record(uint32_t value) {
+    uint8_t bucket = value == 0 ? 0 : static_cast<uint8_t>(32 - __builtin_clz(value));
+    bucket = bucket < BUCKETS ? bucket : BUCKETS - 1;
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+    uint32_t seen = maxValue.load(std::memory_order_relaxed);
+    while (value > seen && !maxValue.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+    }
+}
+
+uint32_t Histogram::percentile(uint8_t pct) const {
+    uint32_t n = count();
+    if (n == 0) {
+        return 0;
+    }
+    uint32_t rank = static_cast<uint32_t>((static_cast<uint64_t>(n) * pct + 99) / 100);
+    uint32_t seen = 0;
+    for (uint8_t i = 0; i < BUCKETS - 1; ++i) {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            uint32_t upper = i == 0 ? 0 : (1u << i) - 1;
+            return upper < max() ? upper : max();
+        }
+    }
+    return max();
+}
+
+namespace Metrics {
+
+Histogram evaluateCycles("evaluate", "cyc");
+Histogram sensorToFadeUs("sensor->fade", "us");
+Histogram homeKitToDutyUs("homekit->duty", "us");
+Histogram fadeJitterUs("fade jitter", "us");
+
+namespace {
+
+Histogram* const histograms[] = {&evaluateCycles, &sensorToFadeUs, &homeKitToDutyUs, &fadeJitterUs};
+
+struct TaskSlot {
+    std::atomic<const char*> name;  // pubblicato per ultimo: finché è nullptr lo slot non è pronto
+    hal::TaskHandle handle;
+    std::atomic<uint32_t> busyUs;
+    std::atomic<uint32_t> loadPermille;
+    std::atomic<uint32_t> stackFree;
+    uint32_t stackBytes;
+    std::atomic<uint32_t> allocs;
+    uint32_t sealAllocs;
+    bool foreign;  // task non nostro: BusyScope vede solo le nostre callback
+    std::atomic<bool> callbacksOnly;  // task altrui senza run-time stats
+    uint32_t lastBusyUs;  // solo sampleSystem
+};
+
+TaskSlot tasks[MAX_TASKS];
+std::atomic<uint8_t> reservedTasks(0);
+std::atomic<uint32_t> heapFreeBytes(0);
+std::atomic<uint32_t> heapMinBytes(0);
+std::atomic<uint32_t> heapLargestBytes(0);
+std::atomic<uint32_t> firstLight(NO_LIGHT);
+uint32_t lastSampleMs = 0;
+
+std::atomic<uint32_t> allocCount(0);
+std::atomic<uint32_t> liveBytes(0);
+std::atomic<bool> sealed(false);
+uint32_t sealAllocs = 0;
+uint32_t sealLargest = 0;
+uint32_t largestMin = 0;  // solo sampleSystem
+
+uint8_t taskCount() {
+    uint8_t count = reservedTasks.load(std::memory_order_acquire);
+    return count < MAX_TASKS ? count : MAX_TASKS;
+}
+
+}  // namespace
+
+void registerTask(const char* name, uint32_t stackBytes, hal::TaskHandle handle) {
+    uint8_t index = reservedTasks.fetch_add(1, std::memory_order_acq_rel);
+    if (index >= MAX_TASKS) {
+        return;
+    }
+    TaskSlot& slot = tasks[index];
+    slot.handle = handle;
+    slot.busyUs.store(0, std::memory_order_relaxed);
+    slot.stackFree.store(UINT32_MAX, std::memory_order_relaxed);
+    slot.stackBytes = stackBytes;
+    slot.allocs.store(0, std::memory_order_relaxed);
+    slot.sealAllocs = 0;
+    slot.foreign = handle != hal::currentTask();
+    slot.callbacksOnly.store(slot.foreign, std::memory_order_relaxed);
+    slot.lastBusyUs = 0;
+    slot.name.store(name, std::memory_order_release);
+}
+
+static TaskSlot* currentSlot() {
+    hal::TaskHandle current = hal::currentTask();
+    uint8_t count = taskCount();
+    for (uint8_t i = 0; i < count; ++i) {
+        if (tasks[i].name.load(std::memory_order_acquire) != nullptr && tasks[i].handle == current) {
+            return &tasks[i];
+        }
+    }
+    return nullptr;
+}
+
+void addBusyUs(uint32_t us) {
+    TaskSlot* slot = currentSlot();
+    if (slot != nullptr) {
+        slot->busyUs.fetch_add(us, std::memory_order_relaxed);
+    }
+}
+
+void* trackedAlloc(size_t size) {
+    uint8_t* block = static_cast<uint8_t*>(malloc(size + ALLOC_HEADER));
+    if (block == nullptr) {
+        return nullptr;
+    }
+    *reinterpret_cast<size_t*>(block) = size;
+    allocCount.fetch_add(1, std::memory_order_relaxed);
+    liveBytes.fetch_add(static_cast<uint32_t>(size), std::memory_order_relaxed);
+    TaskSlot* slot = currentSlot();
+    if (slot != nullptr) {
+        slot->allocs.fetch_add(1, std::memory_order_relaxed);
+    }
+    return block + ALLOC_HEADER;
+}
+
+void trackedFree(void* p) {
+    if (p == nullptr) {
+        return;
+    }
+    uint8_t* block = static_cast<uint8_t*>(p) - ALLOC_HEADER;
+    liveBytes.fetch_sub(static_cast<uint32_t>(*reinterpret_cast<size_t*>(block)), std::memory_order_relaxed);
+    free(block);
+}
+
+void sealHeap() {
+    sealAllocs = allocCount.load(std::memory_order_relaxed);
+    uint8_t count = taskCount();
+    for (uint8_t i = 0; i < count; ++i) {
+        tasks[i].sealAllocs = tasks[i].allocs.load(std::memory_order_relaxed);
+    }
+    sealLargest = hal::heapLargestFree();
+    largestMin = sealLargest;
+    heapLargestBytes.store(sealLargest, std::memory_order_relaxed);
+    sealed.store(true, std::memory_order_release);
+}
+
+uint32_t heapAllocs() {
+    return allocCount.load(std::memory_order_relaxed);
+}
+
+uint32_t heapAllocsSinceSeal() {
+    return sealed.load(std::memory_order_acquire) ? heapAllocs() - sealAllocs : 0;
+}
+
+uint32_t heapLiveBytes() {
+    return liveBytes.load(std::memory_order_relaxed);
+}
+
+void sampleSystem() {
+    uint32_t now = hal::millis();
+    uint32_t elapsedMs = now - lastSampleMs;
+    lastSampleMs = now;
+    uint8_t count = taskCount();
+    for (uint8_t i = 0; i < count; ++i) {
+        TaskSlot& slot = tasks[i];
+        const char* name = slot.name.load(std::memory_order_acquire);
+        if (name == nullptr) {
+            continue;
+        }
+        uint32_t busy = slot.busyUs.load(std::memory_order_relaxed);
+        uint32_t runUs;
+        if (slot.foreign && hal::taskRunTimeUs(slot.handle, runUs)) {
+            busy = runUs;
+            slot.callbacksOnly.store(false, std::memory_order_relaxed);
+        }
+        // µs di CPU per ms di tempo reale = millesimi di carico
+        slot.loadPermille.store(elapsedMs == 0 ? 0 : (busy - slot.lastBusyUs) / elapsedMs, std::memory_order_relaxed);
+        slot.lastBusyUs = busy;
+        uint32_t stackFree = hal::taskStackFree(slot.handle);
+        if (slot.handle != nullptr && stackFree < LOW_STACK_BYTES && stackFree < slot.stackFree.load()) {
+            LOG_WARN("Metrics: stack di %s quasi esaurito (%lu B liberi)", name, static_cast<unsigned long>(stackFree));
+        }
+        slot.stackFree.store(stackFree, std::memory_order_relaxed);
+    }
+    heapFreeBytes.store(hal::heapFree(), std::memory_order_relaxed);
+    heapMinBytes.store(hal::heapMinFree(), std::memory_order_relaxed);
+    // A regime il blocco più grande non deve scendere: se succede qualcuno frammenta l'heap
+    uint32_t largest = hal::heapLargestFree();
+    heapLargestBytes.store(largest, std::memory_order_relaxed);
+    if (sealed.load(std::memory_order_acquire) && largest < largestMin) {
+        largestMin = largest;
+        if (largest + HEAP_DRIFT_BYTES < sealLargest) {
+            LOG_WARN("Metrics: blocco libero più grande %lu B (%lu B a fine setup)", static_cast<unsigned long>(largest),
+                     static_cast<unsigned long>(sealLargest));
+        }
+    }
+}
+
+// Stack usato più un margine doppio della soglia di avviso, arrotondato: vale dopo una lunga
+// corsa che abbia toccato i percorsi più profondi (lookup HTTP, salvataggi in NVS)
+static uint32_t suggestedStack(uint32_t stackBytes, uint32_t stackFree) {
+    uint32_t used = stackBytes - stackFree;
+    return (used + 2 * LOW_STACK_BYTES + STACK_ROUND_BYTES - 1) / STACK_ROUND_BYTES * STACK_ROUND_BYTES;
+}
+
+void dump() {
+    char line[160];
+    for (const Histogram* h : histograms) {
+        int len = snprintf(line, sizeof(line), "metrics: %-14s n %lu p50 %lu p90 %lu p99 %lu max %lu %s\n", h->getName(),
+                           static_cast<unsigned long>(h->count()), static_cast<unsigned long>(h->percentile(50)),
+                           static_cast<unsigned long>(h->percentile(90)), static_cast<unsigned long>(h->percentile(99)),
+                           static_cast<unsigned long>(h->max()), h->getUnit());
+        hal::logWrite(line, static_cast<size_t>(len));
+    }
+    uint8_t count = taskCount();
+    uint32_t taskAllocs = 0;
+    uint32_t taskSealAllocs = 0;
+    for (uint8_t i = 0; i < count; ++i) {
+        const TaskSlot& slot = tasks[i];
+        const char* name = slot.name.load(std::memory_order_acquire);
+        if (name == nullptr) {
+            continue;
+        }
+        uint32_t load = slot.loadPermille.load(std::memory_order_relaxed);
+        uint32_t stackFree = slot.stackFree.load(std::memory_order_relaxed);
+        uint32_t allocs = slot.allocs.load(std::memory_order_relaxed);
+        uint32_t steady = sealed.load(std::memory_order_acquire) ? allocs - slot.sealAllocs : 0;
+        taskAllocs += allocs;
+        taskSealAllocs += slot.sealAllocs;
+        int len = snprintf(line, sizeof(line), "metrics: task %-12s cpu %lu.%lu%%%s stack free %lu B new %lu (+%lu a regime)",
+                           name, static_cast<unsigned long>(load / 10), static_cast<unsigned long>(load % 10),
+                           slot.callbacksOnly.load(std::memory_order_relaxed) ? " (solo callback)" : "",
+                           static_cast<unsigned long>(stackFree), static_cast<unsigned long>(allocs),
+                           static_cast<unsigned long>(steady));
+        if (slot.stackBytes != 0 && stackFree <= slot.stackBytes) {
+            len += snprintf(line + len, sizeof(line) - len, ", stack %lu B, consigliato %lu B",
+                            static_cast<unsigned long>(slot.stackBytes),
+                            static_cast<unsigned long>(suggestedStack(slot.stackBytes, stackFree)));
+        }
+        len += snprintf(line + len, sizeof(line) - len, "\n");
+        hal::logWrite(line, static_cast<size_t>(len));
+    }
+    uint32_t light = firstLight.load(std::memory_order_relaxed);
+    if (light != NO_LIGHT) {
+        int len = snprintf(line, sizeof(line), "metrics: boot->light    %lu ms\n", static_cast<unsigned long>(light));
+        hal::logWrite(line, static_cast<size_t>(len));
+    }
+    int len = snprintf(line, sizeof(line), "metrics: heap free %lu B, min %lu B, largest %lu B (%lu B a fine setup)\n",
+                       static_cast<unsigned long>(heapFreeBytes.load(std::memory_order_relaxed)),
+                       static_cast<unsigned long>(heapMinBytes.load(std::memory_order_relaxed)),
+                       static_cast<unsigned long>(heapLargestBytes.load(std::memory_order_relaxed)),
+                       static_cast<unsigned long>(sealLargest));
+    hal::logWrite(line, static_cast<size_t>(len));
+    // Le new fuori dai task registrati: setup() e le librerie nei loro task
+    uint32_t total = heapAllocs();
+    uint32_t steady = heapAllocsSinceSeal();
+    uint32_t taskSteady = sealed.load(std::memory_order_acquire) ? taskAllocs - taskSealAllocs : 0;
+    uint32_t otherSteady = steady > taskSteady ? steady - taskSteady : 0;
+    len = snprintf(line, sizeof(line), "metrics: heap new %lu (+%lu a regime), altro %lu (+%lu), %lu B vivi\n",
+                   static_cast<unsigned long>(total), static_cast<unsigned long>(steady),
+                   static_cast<unsigned long>(total - taskAllocs), static_cast<unsigned long>(otherSteady),
+                   static_cast<unsigned long>(heapLiveBytes()));
+    hal::logWrite(line, static_cast<size_t>(len));
+}
+
+void reset() {
+    for (Histogram* h : histograms) {
+        h->reset();
+    }
+    firstLight.store(NO_LIGHT, std::memory_order_relaxed);
+}
+
+void markFirstLight() {
+    // Chiamata a ogni pubblicazione del LED: dopo la prima volta basta una lettura
+    if (firstLight.load(std::memory_order_relaxed) != NO_LIGHT) {
+        return;
+    }
+    uint32_t expected = NO_LIGHT;
+    firstLight.compare_exchange_strong(expected, hal::millis(), std::memory_order_relaxed);
+}
+
+uint32_t firstLightMs() {
+    return firstLight.load(std::memory_order_relaxed);
+}
+
+}  // namespace Metrics
+
+#ifndef SMARTLAMP_NATIVE
+#include <new>
+
+// Sul dispositivo ogni new del firmware e delle librerie C++ passa dalla contabilità; new[] e
+// delete[] della libreria standard ricadono su queste. Sull'host le definisce il banco
+void* operator new(size_t size) {
+    void* p = Metrics::trackedAlloc(size);
+    if (p == nullptr) {
+        abort();  // come la new di ESP-IDF senza eccezioni
+    }
+    return p;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return Metrics::trackedAlloc(size);
+}
+
+void operator delete(void* p) noexcept {
+    Metrics::trackedFree(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    Metrics::trackedFree(p);
+}
+#endif
@@ -1,19 +1,130 @@
 #include "MotionSensor.h"
+#include <stdio.h>
+#include <string.h>
+#include "TraceRecorder.h"
 
-MotionSensor::MotionSensor() : presenceDetected(false), movementDistance(0), stationaryDistance(0) {}
+#define SENSOR_BAUD 256000
+
+MotionSensor::MotionSensor(uint8_t uartPort, int rx, int tx)
+    : uart(uartPort), rxPin(rx), txPin(tx), calibrationRequestMs(0), backgroundLearning(false), lastFrameTime(0), lastEngineeringTime(0), lastOverruns(0), lastRawTarget(0), presenceDetected(false), movementDetected(false),
+      movementDistance(0), stationaryDistance(0) {
+    memset(&lastFrame, 0, sizeof(lastFrame));
+    snprintf(calibrationKey, sizeof(calibrationKey), "gates%u", uartPort);
+}
 
 void MotionSensor::begin() {
-    sensor.begin(Serial2);  // Assumiamo che il sensore sia collegato a Serial2
-    delay(500);  // Attesa per l'inizializzazione del sensore
+    uart.begin(SENSOR_BAUD, rxPin, txPin);
+    hal::delay(500);  // Attesa per l'inizializzazione del sensore
+    setEngineeringMode(true);
+    // Le soglie calibrate si riscrivono al primo update()
+    calibrator.begin(calibrationKey);
 }
 
-void MotionSensor::update() {
-    if (sensor.isConnected()) {
-        presenceDetected = sensor.presenceDetected();
-        movementDetected = sensor.movingTargetDetected();
-        movementDistance = sensor.movingTargetDistance();
-        stationaryDistance = sensor.stationaryTargetDistance();
+void MotionSensor::sendCommand(uint16_t command, const uint8_t* value, size_t valueLen) {
+    uint8_t frame[LD2410Parser::MAX_PAYLOAD];
+    size_t len = LD2410Parser::encodeCommand(command, value, valueLen, frame, sizeof(frame));
+    uart.write(frame, len);
+}
 
+void MotionSensor::setEngineeringMode(bool enabled) {
+    static const uint8_t protocolVersion[] = {0x01, 0x00};
+    // I comandi sono accettati solo tra l'apertura e la chiusura della configurazione
+    sendCommand(LD2410Parser::CMD_ENABLE_CONFIG, protocolVersion, sizeof(protocolVersion));
+    sendCommand(enabled ? LD2410Parser::CMD_ENGINEERING_ON : LD2410Parser::CMD_ENGINEERING_OFF, nullptr, 0);
+    sendCommand(LD2410Parser::CMD_END_CONFIG, nullptr, 0);
+}
+
+void MotionSensor::writeThresholds(const GateThresholds& thresholds) {
+    static const uint8_t protocolVersion[] = {0x01, 0x00};
+    sendCommand(LD2410Parser::CMD_ENABLE_CONFIG, protocolVersion, sizeof(protocolVersion));
+    for (uint8_t gate = 0; gate < LD2410Frame::GATES; ++gate) {
+        // Sul radar le soglie da fermo dei gate 0 e 1 non cambiano: valgono solo per le zone
+        uint8_t value[18] = {0x00, 0x00, gate, 0, 0, 0, 0x01, 0x00, thresholds.moving[gate], 0, 0, 0,
+                             0x02, 0x00, thresholds.stationary[gate], 0, 0, 0};
+        sendCommand(LD2410Parser::CMD_SET_GATE_SENSITIVITY, value, sizeof(value));
     }
+    sendCommand(LD2410Parser::CMD_END_CONFIG, nullptr, 0);
+    zones.setThresholds(thresholds.moving, thresholds.stationary);
 }
 
+bool MotionSensor::update() {
+    uint32_t calibrationMs = calibrationRequestMs.exchange(0);
+    if (calibrationMs != 0) {
+        calibrator.start(calibrationMs);
+    }
+
+    // Gli overrun del driver vengono riportati nelle statistiche del parser
+    uint32_t overruns = uart.getOverruns();
+    while (lastOverruns != overruns) {
+        parser.noteOverrun();
+        ++lastOverruns;
+    }
+
+    // I byte vanno direttamente nel ring del parser, senza buffer intermedi
+    for (;;) {
+        size_t span;
+        uint8_t* dst = parser.writeSpan(span);
+        if (span == 0) {
+            break;
+        }
+        size_t count = uart.read(dst, span);
+        if (count == 0) {
+            break;
+        }
+        parser.commit(count);
+    }
+
+    // Ogni frame è un campione del filtro, non solo l'ultimo
+    bool changed = false;
+    LD2410Frame frame;
+    while (parser.next(frame)) {
+        changed = applyFrame(frame) || changed;
+    }
+
+    GateThresholds thresholds;
+    if (calibrator.takeThresholds(thresholds)) {
+        writeThresholds(thresholds);
+    }
+    return changed;
+}
+
+bool MotionSensor::applyFrame(const LD2410Frame& frame) {
+    lastFrame = frame;
+    lastFrameTime = hal::millis();
+    bool presence = frame.targetState != 0;
+    bool movement = (frame.targetState & 0x01) != 0;
+    // Nella trace finiscono solo i cambi del campione grezzo: a 10 frame/s i ripetuti riempirebbero la flash
+    if (frame.targetState != lastRawTarget) {
+        lastRawTarget = frame.targetState;
+        TraceRecorder::getInstance().recordSensor(movement, presence, frame.movingDistance, frame.stationaryDistance);
+    }
+    bool changed = filter.update(movement, presence, frame.movingDistance, frame.stationaryDistance, lastFrameTime);
+    if (frame.engineering) {
+        lastEngineeringTime = lastFrameTime;
+        changed = zones.update(frame) || changed;
+        calibrator.update(frame, backgroundLearning.load(std::memory_order_relaxed), lastFrameTime);
+    }
+    presenceDetected = filter.isPresence();
+    movementDetected = filter.isMovement();
+    movementDistance = filter.getMovementDistance();
+    stationaryDistance = filter.getStationaryDistance();
+    return changed;
+}
+
+bool MotionSensor::isConnected() const {
+    return lastFrameTime != 0 && hal::millis() - lastFrameTime < CONNECTION_TIMEOUT_MS;
+}
+
+bool MotionSensor::hasZones() const {
+    return zones.getZoneCount() > 0 && lastEngineeringTime != 0 &&
+           hal::millis() - lastEngineeringTime < CONNECTION_TIMEOUT_MS;
+}
+
+#ifdef SMARTLAMP_NATIVE
+void MotionSensor::injectReading(bool presence, bool movement, uint16_t movingDistance, uint16_t stillDistance) {
+    presenceDetected = presence;
+    movementDetected = movement;
+    movementDistance = movingDistance;
+    stationaryDistance = stillDistance;
+}
+#endif
@@ -0,0 +1,138 @@
+#include "OccupancyLearner.h"
+#include <string.h>
+#include "Log.h"
+#include "LampStateTable.h"
+
+static const char* SETTINGS_KEY = "occupancy";
+static const int32_t MINUTES_PER_WEEK = OccupancyHistory::SLOTS * OccupancyHistory::SLOT_MIN;
+
+OccupancyLearner& OccupancyLearner::getInstance() {
+    static OccupancyLearner instance;
+    return instance;
+}
+
+OccupancyLearner::OccupancyLearner() {
+    reset();
+}
+
+void OccupancyLearner::begin() {
+    OccupancyHistory stored;
+    if (hal::settingsRead(SETTINGS_KEY, &stored, sizeof(stored)) && stored.version == OccupancyHistory::VERSION) {
+        history = stored;
+    }
+}
+
+void OccupancyLearner::reset() {
+    memset(&history, 0, sizeof(history));
+    history.version = OccupancyHistory::VERSION;
+    memset(history.occupancyQ8, NEUTRAL_OCCUPANCY_Q8, sizeof(history.occupancyQ8));
+    lastMinute = -1;
+    lastArrival = -1;
+    currentSlot = 0;
+    occupiedMin = 0;
+    lastOccupied = false;
+    slotArrival = false;
+    dirtySlots = 0;
+}
+
+// avg += (sample - avg) / 2^LEARN_SHIFT; lo shift aritmetico porta comunque a 0 i residui
+uint8_t OccupancyLearner::learn(uint8_t average, uint8_t sample) {
+    int32_t delta = static_cast<int32_t>(sample) - average;
+    return static_cast<uint8_t>(average + (delta >> LEARN_SHIFT));
+}
+
+void OccupancyLearner::closeSlot() {
+    uint8_t minutes = occupiedMin < OccupancyHistory::SLOT_MIN ? occupiedMin : OccupancyHistory::SLOT_MIN;
+    history.arrivalQ8[currentSlot] = learn(history.arrivalQ8[currentSlot], slotArrival ? 255 : 0);
+    history.occupancyQ8[currentSlot] = learn(history.occupancyQ8[currentSlot], minutes * 255 / OccupancyHistory::SLOT_MIN);
+    ++dirtySlots;
+}
+
+void OccupancyLearner::observe(int32_t weekMinute, bool occupied, bool arrival) {
+    if (weekMinute < 0) {
+        return;
+    }
+    uint16_t slot = slotOf(weekMinute);
+    if (lastMinute < 0) {
+        currentSlot = slot;
+        occupiedMin = 0;
+        slotArrival = false;
+    } else if (slot == currentSlot) {
+        // Il tempo dall'ultima osservazione è passato nello stato di allora
+        if (lastOccupied && weekMinute > lastMinute) {
+            occupiedMin += static_cast<uint8_t>(weekMinute - lastMinute);
+        }
+    } else {
+        // Il quarto d'ora finisce qui; se ne sono passati altri senza osservazioni (lampada
+        // inattiva di giorno) restano come sono: nessuna informazione
+        bool contiguous = slot == (currentSlot + 1) % OccupancyHistory::SLOTS;
+        if (lastOccupied) {
+            occupiedMin += static_cast<uint8_t>((currentSlot + 1) * OccupancyHistory::SLOT_MIN - lastMinute);
+        }
+        closeSlot();
+        currentSlot = slot;
+        slotArrival = false;
+        occupiedMin = (contiguous && lastOccupied) ? static_cast<uint8_t>(weekMinute % OccupancyHistory::SLOT_MIN) : 0;
+    }
+    if (arrival) {
+        slotArrival = true;
+        lastArrival = weekMinute;
+    }
+    lastMinute = weekMinute;
+    lastOccupied = occupied;
+}
+
+bool OccupancyLearner::shouldPrewarm(int32_t weekMinute) const {
+    if (weekMinute < 0) {
+        return false;
+    }
+    if (lastArrival >= 0 && (weekMinute - lastArrival + MINUTES_PER_WEEK) % MINUTES_PER_WEEK < PREWARM_QUIET_MIN) {
+        return false;
+    }
+    uint8_t now = history.arrivalQ8[slotOf(weekMinute)];
+    uint8_t soon = history.arrivalQ8[slotOf((weekMinute + PREWARM_LEAD_MIN) % MINUTES_PER_WEEK)];
+    return (now > soon ? now : soon) >= ARRIVAL_THRESHOLD_Q8;
+}
+
+int32_t OccupancyLearner::nextPrewarmMinute(int32_t weekMinute) const {
+    if (weekMinute < 0) {
+        return -1;
+    }
+    // Al più una settimana di quarti d'ora: 672 letture, solo quando il task va a dormire
+    uint16_t first = slotOf(weekMinute);
+    for (uint16_t k = 0; k <= OccupancyHistory::SLOTS; ++k) {
+        if (history.arrivalQ8[(first + k) % OccupancyHistory::SLOTS] < ARRIVAL_THRESHOLD_Q8) {
+            continue;
+        }
+        int32_t start = static_cast<int32_t>(first + k) * OccupancyHistory::SLOT_MIN - PREWARM_LEAD_MIN;
+        if (start > weekMinute) {
+            return start;
+        }
+    }
+    return -1;
+}
+
+uint32_t OccupancyLearner::scaleTimeout(uint32_t durationMs, int32_t weekMinute) const {
+    if (weekMinute < 0 || durationMs == LampStateTable::NO_TIMEOUT) {
+        return durationMs;
+    }
+    int32_t expiry = static_cast<int32_t>((weekMinute + durationMs / 60000) % MINUTES_PER_WEEK);
+    uint32_t occupancy = history.occupancyQ8[slotOf(expiry)];
+    // 0 -> 0,5x, neutro -> 1x, 255 -> 2x, in Q8
+    uint32_t scaleQ8 = occupancy < NEUTRAL_OCCUPANCY_Q8 ? 128 + occupancy : 256 + 2 * (occupancy - NEUTRAL_OCCUPANCY_Q8);
+    return static_cast<uint32_t>((static_cast<uint64_t>(durationMs) * scaleQ8) >> 8);
+}
+
+bool OccupancyLearner::persistIfDue() {
+    if (dirtySlots < SAVE_BATCH_SLOTS) {
+        return false;
+    }
+    persist();
+    return true;
+}
+
+void OccupancyLearner::persist() {
+    hal::settingsWrite(SETTINGS_KEY, &history, sizeof(history));
+    LOG_INFO("Occupancy: salvati %u quarti d'ora nuovi", dirtySlots);
+    dirtySlots = 0;
+}
@@ -0,0 +1,130 @@
+#include "PowerManager.h"
+#include "LampEvents.h"
+#include "Log.h"
+#include "TimeService.h"
+
+PowerManager& PowerManager::getInstance() {
+    static PowerManager instance;
+    return instance;
+}
+
+PowerManager::PowerManager()
+    : led(nullptr), sensor(nullptr), parked(false), wakeRequested(false), pinArmed(false), lightSleep(false),
+      idle(false), idleSince(0), parkedAt(0) {
+    resetStats();
+}
+
+void PowerManager::begin(LedController& ledController, MotionSensor& motionSensor, uint8_t wakePin) {
+    led = &ledController;
+    sensor = &motionSensor;
+    if (!hal::powerConfigure(MAX_MHZ, MIN_MHZ, true, lightSleep)) {
+        LOG_WARN("Power: gestione dell'energia non disponibile, restano solo i parcheggi");
+    } else if (!lightSleep) {
+        LOG_WARN("Power: light sleep non disponibile, solo frequenza dinamica");
+    }
+    cpuLock.create(hal::PowerLock::CPU_MAX, "control");
+    sleepLock.create(hal::PowerLock::NO_LIGHT_SLEEP, "control");
+    cpuLock.acquire();
+    sleepLock.acquire();
+    hal::wakePinBegin(wakePin, onWakePin);
+}
+
+void PowerManager::onWakePin() {
+    PowerManager& instance = getInstance();
+    instance.wakeRequested.store(true);
+    postLampEventFromIsr(LampEvent::sensorWake());
+}
+
+void PowerManager::update(bool night, bool lampIdle) {
+    uint32_t now = hal::millis();
+    LedState state = led->getState();
+    bool dark = state.targetBrightness == 0 && !state.fading;
+    // Di giorno il radar non serve: basta il LED spento. Di notte serve anche nessuno in vista
+    bool nowIdle = dark && (!night || (lampIdle && !sensor->isPresenceDetected() && !sensor->isMovementDetected()));
+    if (wakeRequested.exchange(false)) {
+        pinArmed = false;
+        ++stats.pinWakes;
+        nowIdle = false;
+    }
+
+    if (!nowIdle) {
+        idle = false;
+        if (isParked()) {
+            resume();
+        }
+        return;
+    }
+    if (!idle) {
+        idle = true;
+        idleSince = now;
+    }
+    if (!isParked()) {
+        if (now - idleSince >= IDLE_PARK_MS) {
+            park(night);
+        }
+    } else if (night != pinArmed) {
+        // Cambio giorno/notte da parcheggiati: il pin serve solo di notte
+        pinArmed = night;
+        hal::wakePinArm(night);
+    }
+}
+
+void PowerManager::park(bool night) {
+    sensor->setSuspended(true);
+    pinArmed = night;
+    hal::wakePinArm(night);
+    parkedAt = hal::millis();
+    ++stats.parks;
+    parked.store(true, std::memory_order_relaxed);
+    sleepLock.release();
+    cpuLock.release();
+    LOG_INFO("Power: parcheggiato (%s)", night ? "notte, sveglia sul pin OUT" : "giorno");
+}
+
+void PowerManager::resume() {
+    cpuLock.acquire();
+    sleepLock.acquire();
+    hal::wakePinArm(false);
+    pinArmed = false;
+    sensor->setSuspended(false);
+    stats.parkedMs += hal::millis() - parkedAt;
+    parked.store(false, std::memory_order_relaxed);
+    idle = false;
+}
+
+uint32_t PowerManager::msUntilNextCheck() const {
+    if (isParked()) {
+        // TimeService sveglia comunque il task con NIGHT_CHANGED: questo è solo il paracadute
+        TimeService& time = TimeService::getInstance();
+        uint32_t now = hal::epochNow();
+        uint32_t change = time.getNextChange();
+        if (!time.isValid() || change <= now || change - now > UINT32_MAX / 1000) {
+            return UINT32_MAX;
+        }
+        return (change - now) * 1000;
+    }
+    if (!idle) {
+        return UINT32_MAX;
+    }
+    uint32_t elapsed = hal::millis() - idleSince;
+    return elapsed >= IDLE_PARK_MS ? 0 : IDLE_PARK_MS - elapsed;
+}
+
+void PowerManager::noteWakeup() {
+    if (isParked()) {
+        ++stats.parkedWakeups;
+    }
+}
+
+PowerStats PowerManager::getStats() const {
+    PowerStats current = stats;
+    if (isParked()) {
+        current.parkedMs += hal::millis() - parkedAt;
+    }
+    return current;
+}
+
+void PowerManager::resetStats() {
+    stats = PowerStats{};
+    parkedAt = hal::millis();
+}
@@ -0,0 +1,55 @@
+#include "PresenceFilter.h"
+
+bool HysteresisFlag::update(bool raw, uint32_t nowMs, uint16_t onMs, uint16_t offMs) {
+    if (raw == state) {
+        pending = false;
+        return false;
+    }
+    if (!pending) {
+        pending = true;
+        since = nowMs;
+    }
+    if (nowMs - since >= (raw ? onMs : offMs)) {
+        state = raw;
+        pending = false;
+        return true;
+    }
+    return false;
+}
+
+PresenceFilter::PresenceFilter(const PresenceFilterConfig& config)
+    : config(config), movingDistanceQ8(0), stationaryDistanceQ8(0) {}
+
+uint32_t PresenceFilter::smooth(uint32_t averageQ8, uint16_t sample) const {
+    uint32_t sampleQ8 = static_cast<uint32_t>(sample) << 8;
+    if (config.smoothingShift == 0 || averageQ8 == 0) {
+        return sampleQ8;
+    }
+    // avg += (sample - avg) / 2^shift, in aritmetica con segno
+    int32_t delta = static_cast<int32_t>(sampleQ8) - static_cast<int32_t>(averageQ8);
+    return static_cast<uint32_t>(static_cast<int32_t>(averageQ8) + (delta >> config.smoothingShift));
+}
+
+bool PresenceFilter::update(bool rawMovement, bool rawPresence, uint16_t movingDistance, uint16_t stationaryDistance, uint32_t nowMs) {
+    // Il gate agisce sulla distanza grezza: un bersaglio oltre il limite non conta
+    if (config.maxDistance != 0) {
+        if (rawMovement && movingDistance > config.maxDistance) {
+            rawMovement = false;
+        }
+        // Senza movimento valido resta solo il bersaglio fermo, se c'è ed è entro il limite
+        if (rawPresence && !rawMovement && (stationaryDistance == 0 || stationaryDistance > config.maxDistance)) {
+            rawPresence = false;
+        }
+    }
+
+    if (rawMovement) {
+        movingDistanceQ8 = smooth(movingDistanceQ8, movingDistance);
+    }
+    if (rawPresence) {
+        stationaryDistanceQ8 = smooth(stationaryDistanceQ8, stationaryDistance);
+    }
+
+    bool changed = movement.update(rawMovement, nowMs, config.movementOnMs, config.movementOffMs);
+    changed = presence.update(rawPresence, nowMs, config.presenceOnMs, config.presenceOffMs) || changed;
+    return changed;
+}
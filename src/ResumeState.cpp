@@ -0,0 +1,95 @@
+#include "ResumeState.h"
+#include <stddef.h>
+#include <string.h>
+#include "Log.h"
+#include "TimeService.h"
+
+static const char* SETTINGS_KEY = "resume";
+
+ResumeState& ResumeState::getInstance() {
+    static ResumeState instance;
+    return instance;
+}
+
+ResumeState::ResumeState() : source(Source::NONE), lampState(false), dirty(false), lastPersistMs(0) {
+    memset(&record, 0, sizeof(record));
+    record.version = ResumeRecord::VERSION;
+    record.state = LampState::OFF;
+    record.brightness = DEFAULT_BRIGHTNESS;
+    record.autoMode = true;
+    seal();
+}
+
+uint32_t ResumeState::checksum(const ResumeRecord& record) {
+    return hal::checksum(&record, offsetof(ResumeRecord, checksum));
+}
+
+bool ResumeState::isValid(const ResumeRecord& record) {
+    return record.version == ResumeRecord::VERSION && record.checksum == checksum(record) &&
+           static_cast<size_t>(record.state) < LampStateTable::STATE_COUNT;
+}
+
+void ResumeState::seal() {
+    record.checksum = checksum(record);
+}
+
+void ResumeState::begin() {
+    source = Source::NONE;
+    lampState = false;
+    ResumeRecord stored;
+    if (hal::retainedRead(&stored, sizeof(stored)) && isValid(stored)) {
+        // Reset senza perdita di alimentazione: lo stato è quello di un attimo fa
+        record = stored;
+        source = Source::RTC;
+        lampState = true;
+        // Di solito l'orologio di sistema sopravvive al reset; se no, meglio l'ultimo valore noto
+        if (hal::epochNow() < TimeService::MIN_VALID_EPOCH && stored.epoch >= TimeService::MIN_VALID_EPOCH) {
+            hal::setEpoch(stored.epoch);
+        }
+    } else if (hal::settingsRead(SETTINGS_KEY, &stored, sizeof(stored)) && isValid(stored)) {
+        record = stored;
+        source = Source::NVS;
+        // Dopo uno spegnimento lo stato vale solo se l'orologio è buono e dice che è di poco fa
+        uint32_t now = hal::epochNow();
+        lampState = now >= TimeService::MIN_VALID_EPOCH && stored.epoch <= now && now - stored.epoch <= MAX_AGE_S;
+    }
+    if (!lampState) {
+        record.state = LampState::OFF;
+        seal();
+    }
+    hal::retainedWrite(&record, sizeof(record));
+    LOG_INFO("Resume: %s, stato %d, luminosità %u, auto %d", source == Source::RTC ? "RTC" : source == Source::NVS ? "NVS" : "nessuno",
+             static_cast<int>(record.state), record.brightness, record.autoMode);
+}
+
+void ResumeState::update(LampState state, uint8_t brightness, bool autoMode) {
+    if (state != record.state || brightness != record.brightness || autoMode != record.autoMode) {
+        record.state = state;
+        record.brightness = brightness;
+        record.autoMode = autoMode;
+        dirty = true;
+    }
+    // L'orologio resta indietro al massimo dell'intervallo tra due passi del task di controllo
+    record.epoch = hal::epochNow();
+    seal();
+    hal::retainedWrite(&record, sizeof(record));
+}
+
+bool ResumeState::persistIfDue() {
+    uint32_t now = hal::millis();
+    if (!dirty || now - lastPersistMs < PERSIST_INTERVAL_MS) {
+        return false;
+    }
+    hal::settingsWrite(SETTINGS_KEY, &record, sizeof(record));
+    dirty = false;
+    lastPersistMs = now;
+    return true;
+}
+
+uint32_t ResumeState::msUntilPersist() const {
+    if (!dirty) {
+        return UINT32_MAX;
+    }
+    uint32_t elapsed = hal::millis() - lastPersistMs;
+    return elapsed < PERSIST_INTERVAL_MS ? PERSIST_INTERVAL_MS - elapsed : 0;
+}
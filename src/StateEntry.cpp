@@ -0,0 +1,31 @@
+#include "StateEntry.h"
+#include "TraceRecorder.h"
+#include "HomeKitTelemetry.h"
+
+namespace StateEntry {
+
+StateParams apply(LedController& led, uint8_t lamp, LampState from, LampState to, uint8_t maxBrightness, int32_t minute) {
+    if (from != to) {
+        TraceRecorder::getInstance().recordState(from, to, lamp);
+    }
+    // Parametri già compilati, nessuna conversione qui
+    StateParams params = LightingProfiles::getInstance().params(to, minute);
+    fadeTo(led, lamp, maxBrightness, params.levelQ8, params.fadeMs);
+    return params;
+}
+
+void fadeTo(LedController& led, uint8_t lamp, uint8_t maxBrightness, uint16_t levelQ8, uint32_t fadeMs) {
+    // HomeKit riceve la destinazione del fade, non i passi intermedi
+    if (levelQ8 == 0) {
+        led.startFadeOut(fadeMs);
+        HomeKitTelemetry::getInstance().publishLevel(lamp, 0);
+        return;
+    }
+    // La frazione si applica al duty del livello impostato, come la luce emessa;
+    // HomeKit riceve il livello percepito equivalente
+    led.startFadeToLevel(maxBrightness, fadeMs, FadeCurve::LINEAR, levelQ8);
+    uint32_t fine = (led.levelToFineDuty(maxBrightness) * levelQ8) >> 8;
+    HomeKitTelemetry::getInstance().publishLevel(lamp, led.fineDutyToLevel(fine));
+}
+
+}
@@ -0,0 +1,201 @@
+#include "TimeService.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LampEvents.h"
+#include "Log.h"
+
+static const char* SETTINGS_KEY = "time";
+static const char* LOOKUP_URL = "http://ip-api.com/json/?fields=status,offset,lat,lon";
+
+// Valore di "key" in un oggetto JSON piatto come quello di ip-api; nullptr se manca
+static const char* jsonValue(const char* body, const char* key) {
+    char pattern[24];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char* value = strstr(body, pattern);
+    if (value == nullptr) {
+        return nullptr;
+    }
+    value += strlen(pattern);
+    while (*value == ' ') {
+        ++value;
+    }
+    return value;
+}
+
+TimeService& TimeService::getInstance() {
+    static TimeService instance;
+    return instance;
+}
+
+TimeService::TimeService()
+    : ntpServer(nullptr), settings(TimeSettings::defaults()), schedule{false, 0}, offsetSec(settings.utcOffsetSec),
+      pendingWindow(NO_WINDOW), scheduleValid(false),
+      scheduleDirty(true), publishedNight(false), computedAt(0), networkUp(false), sntpStarted(false),
+      lookupDone(false), nextLookupMs(0), lookups(0) {}
+
+void TimeService::begin(const char* server) {
+    ntpServer = server;
+    if (!hal::settingsRead(SETTINGS_KEY, &settings, sizeof(settings)) || settings.version != TimeSettings::VERSION) {
+        settings = TimeSettings::defaults();
+    }
+    scheduleDirty = true;
+}
+
+void TimeService::onNetworkUp() {
+    networkUp = true;
+    wake();
+}
+
+void TimeService::wake() {
+    getInstance().wakeups.send(1);  // Se la coda è piena il servizio è già stato svegliato
+}
+
+void TimeService::waitForWork(uint32_t timeoutMs) {
+    uint8_t token;
+    wakeups.receive(token, timeoutMs);
+}
+
+uint32_t TimeService::poll() {
+    uint32_t wait = MAX_POLL_MS;
+    applyPendingWindow();
+    if (networkUp) {
+        if (!sntpStarted) {
+            hal::startSntp(ntpServer, &TimeService::wake);
+            sntpStarted = true;
+        }
+        // Lookup a ogni avvio con rete, poi una volta al giorno; in caso di errore si riprova
+        uint32_t ms = hal::millis();
+        if (!lookupDone || static_cast<int32_t>(ms - nextLookupMs) >= 0) {
+            bool ok = lookupTimeZone();
+            lookupDone = true;
+            ms = hal::millis();
+            nextLookupMs = ms + (ok ? LOOKUP_INTERVAL_MS : LOOKUP_RETRY_MS);
+        }
+        uint32_t untilLookup = nextLookupMs - ms;
+        wait = untilLookup < wait ? untilLookup : wait;
+    }
+
+    uint32_t now = hal::epochNow();
+    if (now >= MIN_VALID_EPOCH) {
+        updateSchedule(now);
+        uint64_t untilChange = static_cast<uint64_t>(schedule.nextChange - now) * 1000;
+        wait = untilChange < wait ? static_cast<uint32_t>(untilChange) : wait;
+    }
+    return wait;
+}
+
+bool TimeService::lookupTimeZone() {
+    char body[192];
+    ++lookups;
+    int status = hal::httpGet(LOOKUP_URL, body, sizeof(body), HTTP_TIMEOUT_MS);
+    const char* result = jsonValue(body, "status");
+    const char* offset = jsonValue(body, "offset");
+    const char* lat = jsonValue(body, "lat");
+    const char* lon = jsonValue(body, "lon");
+    if (status != 200 || result == nullptr || strncmp(result, "\"success\"", 9) != 0 || offset == nullptr) {
+        LOG_WARN("Time: lookup del fuso fallito (%d)", status);
+        return false;
+    }
+
+    TimeSettings updated = settings;
+    updated.utcOffsetSec = static_cast<int32_t>(strtol(offset, nullptr, 10));
+    if (lat != nullptr && lon != nullptr) {
+        updated.hasLocation = true;
+        updated.latitude = strtof(lat, nullptr);
+        updated.longitude = strtof(lon, nullptr);
+    }
+    // In NVS solo se qualcosa è cambiato, per non consumare la flash a ogni avvio
+    bool changed = updated.utcOffsetSec != settings.utcOffsetSec || updated.hasLocation != settings.hasLocation ||
+                   updated.latitude != settings.latitude || updated.longitude != settings.longitude;
+    if (changed) {
+        settings = updated;
+        hal::settingsWrite(SETTINGS_KEY, &settings, sizeof(settings));
+        scheduleDirty = true;
+        LOG_INFO("Time: offset %ld s, posizione %s", static_cast<long>(settings.utcOffsetSec),
+                 settings.hasLocation ? "nota" : "assente");
+    }
+    return true;
+}
+
+void TimeService::setNightWindow(uint16_t startMin, uint16_t endMin) {
+    pendingWindow.store(static_cast<uint32_t>(startMin) << 16 | endMin);
+    wake();
+}
+
+void TimeService::applyPendingWindow() {
+    uint32_t window = pendingWindow.exchange(NO_WINDOW);
+    if (window == NO_WINDOW) {
+        return;
+    }
+    uint16_t startMin = static_cast<uint16_t>(window >> 16);
+    uint16_t endMin = static_cast<uint16_t>(window & 0xFFFF);
+    if (startMin != settings.nightStartMin || endMin != settings.nightEndMin) {
+        settings.nightStartMin = startMin;
+        settings.nightEndMin = endMin;
+        hal::settingsWrite(SETTINGS_KEY, &settings, sizeof(settings));
+        scheduleDirty = true;
+    }
+}
+
+void TimeService::updateSchedule(uint32_t now) {
+    // Ricalcolo al cambio previsto, al cambio delle impostazioni o se l'orologio è tornato indietro
+    if (scheduleValid && !scheduleDirty && now < schedule.nextChange && now >= computedAt) {
+        return;
+    }
+    DayNight next = computeDayNight(now, settings);
+    bool firstSchedule = !scheduleValid;
+    {
+        hal::LockGuard guard(lock);
+        schedule = next;
+        offsetSec = settings.utcOffsetSec;
+        scheduleValid = true;
+    }
+    scheduleDirty = false;
+    computedAt = now;
+    if (firstSchedule || next.night != publishedNight) {
+        publishedNight = next.night;
+        postLampEvent(LampEvent::nightChanged(next.night));
+        LOG_INFO("Time: %s fino a %lu", next.night ? "notte" : "giorno", static_cast<unsigned long>(next.nextChange));
+    }
+}
+
+bool TimeService::isValid() const {
+    hal::LockGuard guard(lock);
+    return scheduleValid;
+}
+
+bool TimeService::isNightTime() const {
+    uint32_t now = hal::epochNow();
+    hal::LockGuard guard(lock);
+    if (!scheduleValid) {
+        return false;
+    }
+    // Se il servizio non ha ancora ricalcolato, il cambio previsto è comunque avvenuto
+    return now < schedule.nextChange ? schedule.night : !schedule.night;
+}
+
+int32_t TimeService::localMinute() const {
+    int32_t weekMinute = localWeekMinute();
+    return weekMinute < 0 ? -1 : weekMinute % MINUTES_PER_DAY;
+}
+
+int32_t TimeService::localWeekMinute() const {
+    int32_t minutes = localEpochMinute();
+    // Il primo gennaio 1970 era un giovedì: 3 giorni dopo il lunedì
+    return minutes < 0 ? -1 : (minutes + 3 * MINUTES_PER_DAY) % MINUTES_PER_WEEK;
+}
+
+int32_t TimeService::localEpochMinute() const {
+    uint32_t now = hal::epochNow();
+    hal::LockGuard guard(lock);
+    if (!scheduleValid) {
+        return -1;
+    }
+    return static_cast<int32_t>((static_cast<int64_t>(now) + offsetSec) / 60);
+}
+
+uint32_t TimeService::getNextChange() const {
+    hal::LockGuard guard(lock);
+    return schedule.nextChange;
+}
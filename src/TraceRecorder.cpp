@@ -0,0 +1,293 @@
+#include "TraceRecorder.h"
+#include <string.h>
+#include <stddef.h>
+
+static const size_t HEADER_SIZE = sizeof(TracePageHeader);
+
+size_t encodeVarint(uint32_t value, uint8_t* out) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = static_cast<uint8_t>(value) | 0x80;
+        value >>= 7;
+    }
+    out[n++] = static_cast<uint8_t>(value);
+    return n;
+}
+
+size_t decodeVarint(const uint8_t* in, size_t available, uint32_t& value) {
+    value = 0;
+    for (size_t n = 0; n < available && n < 5; ++n) {
+        value |= static_cast<uint32_t>(in[n] & 0x7F) << (7 * n);
+        if ((in[n] & 0x80) == 0) {
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+static bool readHeader(const hal::Partition& partition, size_t offset, TracePageHeader& header) {
+    return partition.read(offset, &header, HEADER_SIZE) && header.magic == TracePageHeader::MAGIC &&
+           header.length >= HEADER_SIZE && header.length <= TraceRecorder::PAGE_SIZE;
+}
+
+// Indice della pagina con la sequenza più alta, -1 se la partizione non contiene trace
+static long findNewestPage(const hal::Partition& partition, uint32_t& sequence) {
+    long newest = -1;
+    size_t pageCount = partition.size() / TraceRecorder::PAGE_SIZE;
+    for (size_t i = 0; i < pageCount; ++i) {
+        TracePageHeader header;
+        if (readHeader(partition, i * TraceRecorder::PAGE_SIZE, header) && (newest < 0 || header.sequence > sequence)) {
+            newest = static_cast<long>(i);
+            sequence = header.sequence;
+        }
+    }
+    return newest;
+}
+
+TraceRecorder& TraceRecorder::getInstance() {
+    static TraceRecorder instance;
+    return instance;
+}
+
+TraceRecorder::TraceRecorder()
+    : activePage(0), used(0), lastMs(0), sequence(0), nextPageOffset(0), ready(false) {
+    pagePending[0] = pagePending[1] = false;
+    memset(&stats, 0, sizeof(stats));
+}
+
+bool TraceRecorder::begin(const char* label, size_t offset, size_t length) {
+    if (!partition.open(label, offset, length) || partition.size() < hal::Partition::SECTOR_SIZE) {
+        return false;
+    }
+    // Riprende dopo l'ultima pagina scritta, così il ring resiste ai riavvii
+    uint32_t newestSequence = 0;
+    long newest = findNewestPage(partition, newestSequence);
+    if (newest >= 0) {
+        sequence = newestSequence + 1;
+        nextPageOffset = ((newest + 1) * PAGE_SIZE) % partition.size();
+    }
+    ready = true;
+    return true;
+}
+
+void TraceRecorder::recordSensor(bool movement, bool presence, uint16_t movingDistance, uint16_t stationaryDistance) {
+    uint8_t payload[6];
+    size_t n = encodeVarint(movingDistance, payload);
+    n += encodeVarint(stationaryDistance, payload + n);
+    uint8_t flags = (movement ? 1 : 0) | (presence ? 2 : 0);
+    append(static_cast<uint8_t>(TraceType::SENSOR) | (flags << 4), payload, n);
+}
+
+void TraceRecorder::recordBrightness(uint8_t brightness) {
+    append(static_cast<uint8_t>(TraceType::BRIGHTNESS), &brightness, 1);
+}
+
+void TraceRecorder::recordAutoMode(bool autoMode) {
+    append(static_cast<uint8_t>(TraceType::AUTO_MODE) | ((autoMode ? 1 : 0) << 4), nullptr, 0);
+}
+
+void TraceRecorder::recordState(LampState from, LampState to, uint8_t lamp) {
+    uint8_t payload = (static_cast<uint8_t>(from) << 4) | static_cast<uint8_t>(to);
+    append(static_cast<uint8_t>(TraceType::STATE) | ((lamp & 0x0F) << 4), &payload, 1);
+}
+
+void TraceRecorder::recordFade(uint32_t targetDuty, uint32_t durationMs, FadeCurve curve) {
+    uint8_t payload[10];
+    size_t n = encodeVarint(targetDuty, payload);
+    n += encodeVarint(durationMs, payload + n);
+    append(static_cast<uint8_t>(TraceType::FADE) | (static_cast<uint8_t>(curve) << 4), payload, n);
+}
+
+void TraceRecorder::append(uint8_t typeAndFlags, const uint8_t* payload, size_t len) {
+    uint32_t now = hal::millis();
+    int closed = -1;
+    {
+        hal::LockGuard guard(lock);
+        if (!ready) {
+            return;
+        }
+        // 1 byte di tipo + al massimo 5 di delta
+        if (used + 1 + 5 + len > PAGE_SIZE) {
+            uint8_t previous = activePage;
+            closePage();
+            if (activePage == previous) {
+                ++stats.dropped;
+                return;
+            }
+            closed = previous;
+        }
+        uint8_t* page = pages[activePage];
+        if (used == 0) {
+            TracePageHeader header = {TracePageHeader::MAGIC, 0, sequence++, now};
+            memcpy(page, &header, HEADER_SIZE);
+            used = HEADER_SIZE;
+            lastMs = now;
+        }
+        page[used++] = typeAndFlags;
+        used += encodeVarint(now - lastMs, page + used);
+        if (len > 0) {
+            memcpy(page + used, payload, len);
+            used += len;
+        }
+        lastMs = now;
+        ++stats.records;
+    }
+    // L'invio alla coda avviene fuori dalla sezione critica
+    if (closed >= 0) {
+        pendingPages.send(static_cast<uint8_t>(closed));
+    }
+}
+
+// Chiamata con il lock preso: passa all'altra pagina se è libera, altrimenti resta dov'è
+void TraceRecorder::closePage() {
+    uint8_t other = activePage ^ 1;
+    if (used <= HEADER_SIZE || pagePending[other]) {
+        return;
+    }
+    uint16_t length = static_cast<uint16_t>(used);
+    memcpy(pages[activePage] + offsetof(TracePageHeader, length), &length, sizeof(length));
+    memset(pages[activePage] + used, 0xFF, PAGE_SIZE - used);
+    pagePending[activePage] = true;
+    activePage = other;
+    used = 0;
+}
+
+void TraceRecorder::flush() {
+    int closed = -1;
+    {
+        hal::LockGuard guard(lock);
+        uint8_t previous = activePage;
+        closePage();
+        if (activePage != previous) {
+            closed = previous;
+        }
+    }
+    if (closed >= 0) {
+        pendingPages.send(static_cast<uint8_t>(closed));
+    }
+}
+
+bool TraceRecorder::pump(uint32_t timeoutMs) {
+    uint8_t index;
+    if (!pendingPages.receive(index, timeoutMs)) {
+        return false;
+    }
+    writePage(pages[index]);
+    hal::LockGuard guard(lock);
+    pagePending[index] = false;
+    return true;
+}
+
+void TraceRecorder::writePage(const uint8_t* page) {
+    size_t offset = nextPageOffset;
+    // Si cancella un settore quando ci si entra; se la pagina non è vergine (primo avvio
+    // su una partizione sporca) si cancella comunque il settore che la contiene
+    uint32_t probe = 0;
+    partition.read(offset, &probe, sizeof(probe));
+    if (offset % hal::Partition::SECTOR_SIZE == 0 || probe != UINT32_MAX) {
+        partition.eraseSector(offset - offset % hal::Partition::SECTOR_SIZE);
+        ++stats.sectorsErased;
+    }
+    partition.write(offset, page, PAGE_SIZE);
+    ++stats.pagesWritten;
+    nextPageOffset = (offset + PAGE_SIZE) % partition.size();
+}
+
+TraceReader::TraceReader(const hal::Partition& partition)
+    : partition(partition), pageCount(partition.size() / TraceRecorder::PAGE_SIZE), pageIndex(0),
+      pagesVisited(0), offset(0), length(0), timeMs(0), pagesRead(0) {
+    uint32_t newestSequence = 0;
+    long newest = findNewestPage(partition, newestSequence);
+    if (newest < 0) {
+        pagesVisited = pageCount;
+    } else {
+        pageIndex = (newest + 1) % pageCount;
+    }
+}
+
+bool TraceReader::loadPage() {
+    while (pagesVisited < pageCount) {
+        size_t index = pageIndex;
+        pageIndex = (pageIndex + 1) % pageCount;
+        ++pagesVisited;
+        TracePageHeader header;
+        if (!readHeader(partition, index * TraceRecorder::PAGE_SIZE, header) ||
+            !partition.read(index * TraceRecorder::PAGE_SIZE, page, header.length)) {
+            continue;
+        }
+        offset = HEADER_SIZE;
+        length = header.length;
+        timeMs = header.baseMs;
+        ++pagesRead;
+        return true;
+    }
+    return false;
+}
+
+bool TraceReader::next(TraceRecord& record) {
+    for (;;) {
+        if (offset >= length && !loadPage()) {
+            return false;
+        }
+        uint8_t typeAndFlags = page[offset++];
+        uint8_t flags = typeAndFlags >> 4;
+        uint32_t delta;
+        size_t n = decodeVarint(page + offset, length - offset, delta);
+        if (n == 0) {
+            offset = length;  // Pagina troncata: si passa alla successiva
+            continue;
+        }
+        offset += n;
+        timeMs += delta;
+        record.type = static_cast<TraceType>(typeAndFlags & 0x0F);
+        record.timeMs = timeMs;
+
+        bool valid = true;
+        uint32_t a = 0, b = 0;
+        switch (record.type) {
+        case TraceType::SENSOR:
+            n = decodeVarint(page + offset, length - offset, a);
+            offset += n;
+            valid = n > 0 && (n = decodeVarint(page + offset, length - offset, b)) > 0;
+            offset += n;
+            record.sensor.movement = (flags & 1) != 0;
+            record.sensor.presence = (flags & 2) != 0;
+            record.sensor.movingDistance = static_cast<uint16_t>(a);
+            record.sensor.stationaryDistance = static_cast<uint16_t>(b);
+            break;
+        case TraceType::BRIGHTNESS:
+            valid = offset < length;
+            record.brightness = valid ? page[offset++] : 0;
+            break;
+        case TraceType::AUTO_MODE:
+            record.autoMode = (flags & 1) != 0;
+            break;
+        case TraceType::STATE:
+            valid = offset < length;
+            if (valid) {
+                record.state.from = static_cast<LampState>(page[offset] >> 4);
+                record.state.to = static_cast<LampState>(page[offset] & 0x0F);
+                record.state.lamp = flags;
+                ++offset;
+            }
+            break;
+        case TraceType::FADE:
+            n = decodeVarint(page + offset, length - offset, a);
+            offset += n;
+            valid = n > 0 && (n = decodeVarint(page + offset, length - offset, b)) > 0;
+            offset += n;
+            record.fade.targetDuty = a;
+            record.fade.durationMs = b;
+            record.fade.curve = static_cast<FadeCurve>(flags);
+            break;
+        default:
+            valid = false;
+            break;
+        }
+        if (!valid) {
+            offset = length;
+            continue;
+        }
+        return true;
+    }
+}
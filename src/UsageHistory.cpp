@@ -0,0 +1,816 @@
+#include "UsageHistory.h"
+#include <stddef.h>
+#include <string.h>
+#include "TraceRecorder.h"
+
+// Flag di un minuto: stato nei bit 0-2, poi occupato e notte. Un run è varint(durata << 5 | flag)
+static const uint8_t STATE_MASK = 0x07;
+static const uint8_t OCCUPIED_FLAG = 0x08;
+static const uint8_t NIGHT_FLAG = 0x10;
+static const uint8_t FLAG_BITS = 5;
+static const int32_t MINUTES_PER_DAY = 24 * 60;
+static const size_t READ_BLOCK = 256;
+
+static uint32_t zigzag(int32_t value) {
+    return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+}
+
+static int32_t unzigzag(uint32_t value) {
+    return static_cast<int32_t>(value >> 1) ^ -static_cast<int32_t>(value & 1);
+}
+
+// Somma delle durate dei run di un chunk di minuti
+static int32_t runsLength(const uint8_t* data, size_t length) {
+    int32_t total = 0;
+    size_t pos = 0;
+    while (pos < length) {
+        uint32_t run;
+        size_t n = decodeVarint(data + pos, length - pos, run);
+        if (n == 0) {
+            break;
+        }
+        total += static_cast<int32_t>(run >> FLAG_BITS);
+        pos += n;
+    }
+    return total;
+}
+
+// Scrive i run di un chunk che cade in [first, first + count)
+static void fillMinutes(const uint8_t* data, size_t length, int32_t start, int32_t first, size_t count,
+                        MinuteUsage* out) {
+    size_t pos = 0;
+    int32_t minute = start;
+    while (pos < length) {
+        uint32_t run;
+        size_t n = decodeVarint(data + pos, length - pos, run);
+        if (n == 0) {
+            break;
+        }
+        pos += n;
+        uint8_t flags = static_cast<uint8_t>(run & ((1 << FLAG_BITS) - 1));
+        int32_t end = minute + static_cast<int32_t>(run >> FLAG_BITS);
+        int32_t from = minute > first ? minute : first;
+        int32_t to = end < first + static_cast<int32_t>(count) ? end : first + static_cast<int32_t>(count);
+        for (int32_t m = from; m < to; ++m) {
+            MinuteUsage& usage = out[m - first];
+            usage.state = static_cast<LampState>(flags & STATE_MASK);
+            usage.occupied = (flags & OCCUPIED_FLAG) != 0;
+            usage.night = (flags & NIGHT_FLAG) != 0;
+            usage.known = true;
+        }
+        minute = end;
+    }
+}
+
+static void addMinutes(UsageCounters& counters, uint8_t flags, uint16_t count) {
+    uint8_t state = flags & STATE_MASK;
+    if (state != static_cast<uint8_t>(LampState::OFF)) {
+        counters.minutes[state - 1] += count;
+        if (flags & NIGHT_FLAG) {
+            counters.minutes[UsageCounters::NIGHT_LIT] += count;
+        }
+    }
+    if (flags & OCCUPIED_FLAG) {
+        counters.minutes[UsageCounters::OCCUPIED] += count;
+    }
+}
+
+static bool isEmpty(const UsageCounters& counters) {
+    for (uint8_t i = 0; i < UsageCounters::FIELDS; ++i) {
+        if (counters.minutes[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+UsageHistory::UsageHistory()
+    : partition(nullptr), sectorCount(0), nextSequence(0), pendingUsed(0), readers(0), writing(false) {
+    memset(quota, 0, sizeof(quota));
+    memset(segments, 0, sizeof(segments));
+    memset(active, -1, sizeof(active));
+    memset(lastTime, 0, sizeof(lastTime));
+    memset(rooms, 0, sizeof(rooms));
+    for (uint8_t i = 0; i < MAX_ROOMS; ++i) {
+        rooms[i].next = -1;
+        rooms[i].restoredDay = NO_DAY;
+    }
+    memset(&stats, 0, sizeof(stats));
+}
+
+uint8_t UsageHistory::packFlags(LampState state, bool occupied, bool night) {
+    return static_cast<uint8_t>((static_cast<uint8_t>(state) & STATE_MASK) | (occupied ? OCCUPIED_FLAG : 0) |
+                                (night ? NIGHT_FLAG : 0));
+}
+
+size_t UsageHistory::encodeCounters(const UsageCounters& counters, uint8_t* out) {
+    uint8_t mask = 0;
+    size_t n = 1;
+    for (uint8_t i = 0; i < UsageCounters::FIELDS; ++i) {
+        if (counters.minutes[i] != 0) {
+            mask |= 1 << i;
+            n += encodeVarint(counters.minutes[i], out + n);
+        }
+    }
+    out[0] = mask;
+    return n;
+}
+
+bool UsageHistory::mergeCounters(const uint8_t* in, size_t length, UsageCounters& counters) {
+    if (length == 0) {
+        return false;
+    }
+    uint8_t mask = in[0];
+    size_t pos = 1;
+    for (uint8_t i = 0; i < UsageCounters::FIELDS; ++i) {
+        if (mask & (1 << i)) {
+            uint32_t value;
+            size_t n = decodeVarint(in + pos, length - pos, value);
+            if (n == 0) {
+                return false;
+            }
+            counters.minutes[i] = static_cast<uint16_t>(counters.minutes[i] + value);
+            pos += n;
+        }
+    }
+    ++counters.records;
+    return true;
+}
+
+bool UsageHistory::begin(hal::Partition& target) {
+    partition = &target;
+    size_t sectors = target.size() / hal::Partition::SECTOR_SIZE;
+    sectorCount = static_cast<uint8_t>(sectors < MAX_SECTORS ? sectors : MAX_SECTORS);
+    if (sectorCount < TIERS) {
+        partition = nullptr;
+        return false;
+    }
+    // Un quarto ai giorni, tre ottavi alle ore, il resto ai minuti; un livello sotto quota può
+    // usare i settori liberi degli altri finché servono
+    quota[DAYS] = sectorCount / 4 > 0 ? sectorCount / 4 : 1;
+    quota[HOURS] = sectorCount * 3 / 8 > 0 ? sectorCount * 3 / 8 : 1;
+    quota[MINUTES] = sectorCount - quota[DAYS] - quota[HOURS];
+
+    for (uint8_t i = 0; i < sectorCount; ++i) {
+        HistorySegmentHeader header;
+        Segment& segment = segments[i];
+        size_t offset = i * hal::Partition::SECTOR_SIZE;
+        memset(&segment, 0, sizeof(segment));
+        segment.tier = DIRTY;
+        if (!partition->read(offset, &header, sizeof(header)) || header.magic != HistorySegmentHeader::MAGIC ||
+            header.version != HistorySegmentHeader::VERSION) {
+            continue;  // cancellazioni sconosciute: si riparte da zero per questo settore
+        }
+        segment.eraseCount = header.eraseCount;
+        if (header.tier == HistorySegmentHeader::FREE && header.sequence == UINT32_MAX && header.base == -1) {
+            // Libero solo se il resto è cancellato: una copia interrotta lascia chunk senza header
+            if (isErased(offset + HEADER_SIZE, hal::Partition::SECTOR_SIZE - HEADER_SIZE)) {
+                segment.tier = HistorySegmentHeader::FREE;
+                segment.used = HEADER_SIZE;
+            }
+        } else if (header.tier < TIERS && header.sequence != UINT32_MAX) {
+            // Il livello si scrive per ultimo: senza sequenza è un header di vecchio formato rimasto a metà
+            segment.tier = header.tier;
+            segment.sequence = header.sequence;
+            segment.base = header.base;
+        }
+    }
+    // Un livellamento interrotto prima di cancellare l'originale lascia due segmenti con la stessa
+    // sequenza: resta la copia, completa perché ha già il livello, che sta sul settore più cancellato
+    for (uint8_t i = 0; i < sectorCount; ++i) {
+        for (uint8_t j = i + 1; j < sectorCount && segments[i].tier < TIERS; ++j) {
+            if (segments[j].tier < TIERS && segments[j].sequence == segments[i].sequence) {
+                segments[segments[i].eraseCount > segments[j].eraseCount ? j : i].tier = DIRTY;
+            }
+        }
+    }
+    uint32_t newest[TIERS] = {};
+    for (uint8_t i = 0; i < sectorCount; ++i) {
+        const Segment& segment = segments[i];
+        if (segment.tier >= TIERS) {
+            continue;
+        }
+        nextSequence = segment.sequence + 1 > nextSequence ? segment.sequence + 1 : nextSequence;
+        if (active[segment.tier] < 0 || segment.sequence > newest[segment.tier]) {
+            active[segment.tier] = static_cast<int8_t>(i);
+            newest[segment.tier] = segment.sequence;
+        }
+    }
+    for (uint8_t i = 0; i < sectorCount; ++i) {
+        if (segments[i].tier < TIERS) {
+            scanSegment(i);
+        }
+    }
+    for (uint8_t room = 0; room < MAX_ROOMS; ++room) {
+        restoreDay(room);
+    }
+    return true;
+}
+
+// Ricostruisce intervallo e byte usati di un segmento; per quello attivo anche l'ultimo tempo di
+// ogni stanza. Una scrittura interrotta lascia byte non cancellati dopo la fine: il segmento si
+// chiude e i chunk successivi vanno in uno nuovo
+void UsageHistory::scanSegment(uint8_t index) {
+    Segment& segment = segments[index];
+    size_t offset = index * hal::Partition::SECTOR_SIZE;
+    int32_t last[MAX_ROOMS];
+    for (uint8_t room = 0; room < MAX_ROOMS; ++room) {
+        last[room] = segment.base;
+    }
+    segment.firstTime = INT32_MAX;
+    segment.lastTime = INT32_MIN;
+    uint8_t chunk[2 + 5 + CHUNK_MAX];
+    size_t pos = HEADER_SIZE;
+    bool sealed = false;
+    while (pos + 2 <= hal::Partition::SECTOR_SIZE) {
+        partition->read(offset + pos, chunk, 2);
+        if (chunk[0] == 0xFF) {
+            break;
+        }
+        if (chunk[0] > 5 + CHUNK_MAX || chunk[1] >= MAX_ROOMS || pos + 2 + chunk[0] > hal::Partition::SECTOR_SIZE ||
+            !partition->read(offset + pos + 2, chunk + 2, chunk[0])) {
+            sealed = true;
+            break;
+        }
+        uint32_t delta;
+        size_t n = decodeVarint(chunk + 2, chunk[0], delta);
+        if (n == 0) {
+            sealed = true;
+            break;
+        }
+        int32_t start = last[chunk[1]] + unzigzag(delta);
+        int32_t end = segment.tier == MINUTES ? start + runsLength(chunk + 2 + n, chunk[0] - n) : start;
+        last[chunk[1]] = end;
+        segment.firstTime = start < segment.firstTime ? start : segment.firstTime;
+        segment.lastTime = end > segment.lastTime ? end : segment.lastTime;
+        pos += 2 + chunk[0];
+    }
+    // Dopo la fine tutto deve essere cancellato
+    sealed = sealed || !isErased(offset + pos, hal::Partition::SECTOR_SIZE - pos);
+    segment.used = static_cast<uint16_t>(pos);
+    segment.sealed = sealed;
+    if (active[segment.tier] == index) {
+        memcpy(lastTime[segment.tier], last, sizeof(last));
+    }
+}
+
+bool UsageHistory::isErased(size_t offset, size_t length) const {
+    uint8_t block[READ_BLOCK];
+    for (size_t check = 0; check < length; check += READ_BLOCK) {
+        size_t len = length - check < READ_BLOCK ? length - check : READ_BLOCK;
+        if (!partition->read(offset + check, block, len)) {
+            return false;
+        }
+        for (size_t i = 0; i < len; ++i) {
+            if (block[i] != 0xFF) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Al boot la giornata in corso riparte dalle ore già scritte, se non è stata ancora chiusa
+void UsageHistory::restoreDay(uint8_t room) {
+    int32_t lastHour = INT32_MIN;
+    visit(HOURS, room, INT32_MIN, INT32_MAX, [&](int32_t hour, int32_t, const uint8_t*, size_t) {
+        lastHour = hour > lastHour ? hour : lastHour;
+    });
+    if (lastHour == INT32_MIN) {
+        return;
+    }
+    int32_t day = dayOf(lastHour * 60);
+    bool closed = false;
+    visit(DAYS, room, day, day, [&](int32_t, int32_t, const uint8_t*, size_t) { closed = true; });
+    if (closed) {
+        return;
+    }
+    RoomCursor& cursor = rooms[room];
+    int32_t firstHour = hourOf(day * MINUTES_PER_DAY + DAY_START_MIN);
+    visit(HOURS, room, firstHour, firstHour + 23, [&](int32_t, int32_t, const uint8_t* data, size_t length) {
+        mergeCounters(data, length, cursor.day);
+    });
+    cursor.day.records = 0;
+    cursor.restoredDay = day;
+}
+
+void UsageHistory::observe(uint8_t room, int32_t minute, LampState state, bool occupied, bool night) {
+    if (room >= MAX_ROOMS || minute < 0) {
+        return;
+    }
+    uint8_t flags = packFlags(state, occupied, night);
+    hal::LockGuard guard(lock);
+    RoomCursor& cursor = rooms[room];
+    if (cursor.next < 0) {
+        // Prima osservazione dal boot: la giornata ripresa continua solo se è ancora la stessa
+        if (cursor.restoredDay != NO_DAY && cursor.restoredDay != dayOf(minute)) {
+            enqueueCounters(DAYS, room, cursor.restoredDay, cursor.day);
+            memset(&cursor.day, 0, sizeof(cursor.day));
+        }
+        cursor.restoredDay = NO_DAY;
+        cursor.next = minute;
+        cursor.flags = flags;
+        cursor.levelFlags = flags;
+        return;
+    }
+    if (minute <= cursor.next) {
+        // Stesso minuto, o l'orologio è tornato indietro (ora legale): resta il minuto aperto
+        cursor.flags = static_cast<uint8_t>((flags & ~OCCUPIED_FLAG) | ((cursor.flags | flags) & OCCUPIED_FLAG));
+        cursor.levelFlags = flags;
+        return;
+    }
+    closeMinutes(room, cursor.flags, 1);
+    if (minute - cursor.next > MAX_FILL_MIN) {
+        closeHour(room, true);
+        cursor.next = minute;
+    } else {
+        closeMinutes(room, cursor.levelFlags, minute - cursor.next);
+    }
+    cursor.flags = flags;
+    cursor.levelFlags = flags;
+}
+
+void UsageHistory::closeMinutes(uint8_t room, uint8_t flags, int32_t count) {
+    RoomCursor& cursor = rooms[room];
+    while (count > 0) {
+        int32_t left = 60 - (cursor.next - hourOf(cursor.next) * 60);
+        uint16_t n = static_cast<uint16_t>(count < left ? count : left);
+        if (cursor.runLength == 0 || cursor.runFlags != flags) {
+            emitRun(cursor);
+            cursor.runFlags = flags;
+        }
+        cursor.runLength += n;
+        addMinutes(cursor.hour, flags, n);
+        addMinutes(cursor.day, flags, n);
+        cursor.next += n;
+        count -= n;
+        if (cursor.next % 60 == 0) {
+            closeHour(room, (cursor.next - DAY_START_MIN) % MINUTES_PER_DAY == 0);
+        }
+    }
+}
+
+void UsageHistory::emitRun(RoomCursor& cursor) {
+    if (cursor.runLength == 0) {
+        return;
+    }
+    if (cursor.chunkLength == 0) {
+        cursor.chunkStart = cursor.next - cursor.runLength;
+    }
+    uint32_t run = (static_cast<uint32_t>(cursor.runLength) << FLAG_BITS) | cursor.runFlags;
+    cursor.chunkLength = static_cast<uint8_t>(cursor.chunkLength + encodeVarint(run, cursor.chunk + cursor.chunkLength));
+    cursor.runLength = 0;
+}
+
+// Chiude l'ora (e la giornata) che finisce a cursor.next: chunk dei minuti e aggregati in coda
+void UsageHistory::closeHour(uint8_t room, bool closeDay) {
+    RoomCursor& cursor = rooms[room];
+    emitRun(cursor);
+    if (cursor.chunkLength > 0) {
+        enqueue(MINUTES, room, cursor.chunkStart, cursor.next, cursor.chunk, cursor.chunkLength);
+        cursor.chunkLength = 0;
+    }
+    // Le ore vuote non si scrivono: la giornata le conta comunque come note
+    if (!isEmpty(cursor.hour)) {
+        enqueueCounters(HOURS, room, hourOf(cursor.next - 1), cursor.hour);
+    }
+    memset(&cursor.hour, 0, sizeof(cursor.hour));
+    if (closeDay) {
+        enqueueCounters(DAYS, room, dayOf(cursor.next - 1), cursor.day);
+        memset(&cursor.day, 0, sizeof(cursor.day));
+    }
+}
+
+void UsageHistory::enqueueCounters(Tier tier, uint8_t room, int32_t time, const UsageCounters& counters) {
+    uint8_t payload[1 + UsageCounters::FIELDS * 3];
+    enqueue(tier, room, time, time, payload, encodeCounters(counters, payload));
+}
+
+void UsageHistory::enqueue(Tier tier, uint8_t room, int32_t start, int32_t end, const uint8_t* payload, size_t length) {
+    if (partition == nullptr || pendingUsed + sizeof(PendingHeader) + length > PENDING_BYTES) {
+        ++stats.dropped;
+        return;
+    }
+    PendingHeader header = {static_cast<uint8_t>(tier), room, static_cast<uint8_t>(length), start, end};
+    memcpy(pending + pendingUsed, &header, sizeof(header));
+    memcpy(pending + pendingUsed + sizeof(header), payload, length);
+    pendingUsed += sizeof(header) + length;
+}
+
+bool UsageHistory::pump() {
+    PendingHeader header;
+    uint8_t payload[CHUNK_MAX];
+    {
+        hal::LockGuard guard(lock);
+        if (readers > 0 || pendingUsed == 0) {
+            return false;
+        }
+        memcpy(&header, pending, sizeof(header));
+        memcpy(payload, pending + sizeof(header), header.length);
+        writing = true;
+    }
+    bool written = append(header, payload);
+    hal::LockGuard guard(lock);
+    size_t entry = sizeof(header) + header.length;
+    memmove(pending, pending + entry, pendingUsed - entry);
+    pendingUsed -= entry;
+    stats.dropped += written ? 0 : 1;
+    writing = false;
+    return true;
+}
+
+bool UsageHistory::append(const PendingHeader& header, const uint8_t* payload) {
+    Tier tier = static_cast<Tier>(header.tier);
+    uint8_t chunk[2 + 5 + CHUNK_MAX];
+    int index = active[tier];
+    size_t need = 2 + 5 + header.length;
+    if (index < 0 || segments[index].sealed || segments[index].used + need > hal::Partition::SECTOR_SIZE) {
+        index = allocate(tier, header.start);
+        if (index < 0) {
+            return false;
+        }
+    }
+    Segment& segment = segments[index];
+    size_t n = encodeVarint(zigzag(header.start - lastTime[tier][header.room]), chunk + 2);
+    memcpy(chunk + 2 + n, payload, header.length);
+    chunk[0] = static_cast<uint8_t>(n + header.length);
+    chunk[1] = header.room;
+    // Prima il corpo, poi la lunghezza: finché questa non c'è il chunk non esiste
+    size_t offset = index * hal::Partition::SECTOR_SIZE + segment.used;
+    if (!partition->write(offset + 1, chunk + 1, 1 + chunk[0]) || !partition->write(offset, chunk, 1)) {
+        segment.sealed = true;
+        return false;
+    }
+    segment.used = static_cast<uint16_t>(segment.used + 2 + chunk[0]);
+    segment.firstTime = header.start < segment.firstTime ? header.start : segment.firstTime;
+    segment.lastTime = header.end > segment.lastTime ? header.end : segment.lastTime;
+    lastTime[tier][header.room] = header.end;
+    ++stats.chunks;
+    stats.bytesWritten[tier] += 2 + chunk[0];
+    return true;
+}
+
+int UsageHistory::allocate(Tier tier, int32_t base) {
+    // Il settore libero meno cancellato; quelli sporchi costano una cancellazione in più
+    int index = -1;
+    for (uint8_t i = 0; i < sectorCount; ++i) {
+        if ((segments[i].tier == HistorySegmentHeader::FREE || segments[i].tier == DIRTY) &&
+            (index < 0 || segments[i].eraseCount < segments[index].eraseCount)) {
+            index = i;
+        }
+    }
+    if (index < 0) {
+        index = reclaim(tier);
+        if (index < 0) {
+            return -1;
+        }
+    }
+    if (segments[index].tier == DIRTY) {
+        eraseSector(static_cast<uint8_t>(index));
+    }
+    Segment& segment = segments[index];
+    size_t offset = index * hal::Partition::SECTOR_SIZE;
+    uint8_t tierByte = static_cast<uint8_t>(tier);
+    uint32_t sequence = nextSequence++;
+    // Il livello per ultimo: finché manca, al boot il settore non è un segmento
+    partition->write(offset + offsetof(HistorySegmentHeader, base), &base, sizeof(base));
+    partition->write(offset + offsetof(HistorySegmentHeader, sequence), &sequence, sizeof(sequence));
+    partition->write(offset + offsetof(HistorySegmentHeader, tier), &tierByte, 1);
+    segment.tier = tierByte;
+    segment.sequence = sequence;
+    segment.base = base;
+    segment.firstTime = INT32_MAX;
+    segment.lastTime = INT32_MIN;
+    segment.used = HEADER_SIZE;
+    segment.sealed = false;
+    active[tier] = static_cast<int8_t>(index);
+    for (uint8_t room = 0; room < MAX_ROOMS; ++room) {
+        lastTime[tier][room] = base;
+    }
+    return index;
+}
+
+// Nessun settore libero: si ricicla il segmento più vecchio del livello che chiede, se è già alla
+// sua quota, altrimenti di quello più oltre la sua. Il contenuto è già negli aggregati
+int UsageHistory::reclaim(Tier tier) {
+    uint8_t count[TIERS] = {};
+    for (uint8_t i = 0; i < sectorCount; ++i) {
+        if (segments[i].tier < TIERS) {
+            ++count[segments[i].tier];
+        }
+    }
+    int victimTier = tier;
+    if (count[tier] < quota[tier]) {
+        int excess = 0;
+        for (uint8_t t = 0; t < TIERS; ++t) {
+            if (count[t] - quota[t] > excess) {
+                excess = count[t] - quota[t];
+                victimTier = t;
+            }
+        }
+    }
+    int victim = -1;
+    for (uint8_t i = 0; i < sectorCount; ++i) {
+        if (segments[i].tier == victimTier && (victim < 0 || segments[i].sequence < segments[victim].sequence)) {
+            victim = i;
+        }
+    }
+    if (victim < 0) {
+        return -1;
+    }
+    if (active[victimTier] == victim) {
+        active[victimTier] = -1;
+    }
+    eraseSector(static_cast<uint8_t>(victim));
+
+    // Livellamento statico: il segmento chiuso meno cancellato, se è rimasto molto indietro,
+    // si sposta sul settore appena cancellato e libera il suo
+    int cold = -1;
+    for (uint8_t i = 0; i < sectorCount; ++i) {
+        if (segments[i].tier < TIERS && active[segments[i].tier] != i &&
+            (cold < 0 || segments[i].eraseCount < segments[cold].eraseCount)) {
+            cold = i;
+        }
+    }
+    if (cold >= 0 && segments[victim].eraseCount > segments[cold].eraseCount + WEAR_SPREAD) {
+        relocate(static_cast<uint8_t>(cold), static_cast<uint8_t>(victim));
+        eraseSector(static_cast<uint8_t>(cold));
+        return cold;
+    }
+    return victim;
+}
+
+void UsageHistory::eraseSector(uint8_t index) {
+    Segment& segment = segments[index];
+    size_t offset = index * hal::Partition::SECTOR_SIZE;
+    partition->eraseSector(offset);
+    ++segment.eraseCount;
+    HistorySegmentHeader header;
+    memset(&header, 0xFF, sizeof(header));
+    header.magic = HistorySegmentHeader::MAGIC;
+    header.version = HistorySegmentHeader::VERSION;
+    header.eraseCount = segment.eraseCount;
+    partition->write(offset, &header, sizeof(header));
+    segment.tier = HistorySegmentHeader::FREE;
+    segment.used = HEADER_SIZE;
+    segment.sealed = false;
+    ++stats.sectorsErased;
+}
+
+void UsageHistory::relocate(uint8_t from, uint8_t to) {
+    const Segment& source = segments[from];
+    size_t src = from * hal::Partition::SECTOR_SIZE;
+    size_t dst = to * hal::Partition::SECTOR_SIZE;
+    // I chunk non dipendono dalla posizione: si copiano così come sono, poi l'header con il livello
+    // per ultimo, come in allocate
+    uint8_t block[READ_BLOCK];
+    for (size_t pos = HEADER_SIZE; pos < source.used; pos += READ_BLOCK) {
+        size_t len = source.used - pos < READ_BLOCK ? source.used - pos : READ_BLOCK;
+        partition->read(src + pos, block, len);
+        partition->write(dst + pos, block, len);
+    }
+    partition->write(dst + offsetof(HistorySegmentHeader, base), &source.base, sizeof(source.base));
+    partition->write(dst + offsetof(HistorySegmentHeader, sequence), &source.sequence, sizeof(source.sequence));
+    partition->write(dst + offsetof(HistorySegmentHeader, tier), &source.tier, 1);
+    uint32_t eraseCount = segments[to].eraseCount;
+    segments[to] = source;
+    segments[to].eraseCount = eraseCount;
+    ++stats.relocations;
+}
+
+void UsageHistory::beginRead() {
+    for (;;) {
+        {
+            hal::LockGuard guard(lock);
+            if (!writing) {
+                ++readers;
+                return;
+            }
+        }
+        hal::delay(1);
+    }
+}
+
+void UsageHistory::endRead() {
+    hal::LockGuard guard(lock);
+    --readers;
+}
+
+template <typename Fn>
+void UsageHistory::visit(Tier tier, uint8_t room, int32_t from, int32_t to, Fn fn) {
+    uint8_t block[READ_BLOCK];
+    uint32_t bytesRead = 0;
+    for (uint8_t i = 0; i < sectorCount; ++i) {
+        const Segment& segment = segments[i];
+        if (segment.tier != tier || segment.lastTime < from || segment.firstTime > to) {
+            continue;
+        }
+        // Lettura a blocchi: un chunk (al più 135 byte) sta sempre in un blocco ricaricato dal suo inizio
+        size_t offset = i * hal::Partition::SECTOR_SIZE;
+        size_t blockStart = 0;
+        size_t blockLength = 0;
+        int32_t last = segment.base;
+        size_t pos = HEADER_SIZE;
+        while (pos + 2 <= segment.used) {
+            if (pos + 2 + 5 + CHUNK_MAX > blockStart + blockLength && blockStart + blockLength < segment.used) {
+                blockStart = pos;
+                blockLength = segment.used - pos < READ_BLOCK ? segment.used - pos : READ_BLOCK;
+                partition->read(offset + pos, block, blockLength);
+                bytesRead += blockLength;
+            }
+            const uint8_t* chunk = block + (pos - blockStart);
+            size_t length = chunk[0];
+            if (pos + 2 + length > blockStart + blockLength) {
+                break;
+            }
+            if (chunk[1] == room) {
+                uint32_t delta;
+                size_t n = decodeVarint(chunk + 2, length, delta);
+                int32_t start = last + unzigzag(delta);
+                int32_t end = tier == MINUTES ? start + runsLength(chunk + 2 + n, length - n) : start;
+                last = end;
+                if ((tier == MINUTES ? end > from : start >= from) && start <= to) {
+                    fn(start, end, chunk + 2 + n, length - n);
+                }
+            }
+            pos += 2 + length;
+        }
+    }
+    // Chunk chiusi non ancora scritti
+    hal::LockGuard guard(lock);
+    stats.bytesRead += bytesRead;
+    for (size_t pos = 0; pos < pendingUsed;) {
+        PendingHeader header;
+        memcpy(&header, pending + pos, sizeof(header));
+        if (header.tier == tier && header.room == room &&
+            (tier == MINUTES ? header.end > from : header.start >= from) && header.start <= to) {
+            fn(header.start, header.end, pending + pos + sizeof(header), header.length);
+        }
+        pos += sizeof(header) + header.length;
+    }
+}
+
+size_t UsageHistory::queryDays(uint8_t room, int32_t firstDay, size_t count, UsageCounters* out) {
+    memset(out, 0, count * sizeof(UsageCounters));
+    if (room >= MAX_ROOMS || count == 0) {
+        return 0;
+    }
+    int32_t lastDay = firstDay + static_cast<int32_t>(count) - 1;
+    beginRead();
+    visit(DAYS, room, firstDay, lastDay, [&](int32_t day, int32_t, const uint8_t* data, size_t length) {
+        mergeCounters(data, length, out[day - firstDay]);
+    });
+    {
+        // La giornata in corso, o quella ripresa al boot e non ancora chiusa
+        hal::LockGuard guard(lock);
+        const RoomCursor& cursor = rooms[room];
+        int32_t day = cursor.next >= 0 ? dayOf(cursor.next) : cursor.restoredDay;
+        if (day != NO_DAY && day >= firstDay && day <= lastDay) {
+            UsageCounters& target = out[day - firstDay];
+            for (uint8_t i = 0; i < UsageCounters::FIELDS; ++i) {
+                target.minutes[i] = static_cast<uint16_t>(target.minutes[i] + cursor.day.minutes[i]);
+            }
+            ++target.records;
+        }
+    }
+    endRead();
+    size_t known = 0;
+    for (size_t i = 0; i < count; ++i) {
+        known += out[i].records > 0;
+    }
+    return known;
+}
+
+size_t UsageHistory::queryHours(uint8_t room, int32_t firstHour, size_t count, UsageCounters* out) {
+    memset(out, 0, count * sizeof(UsageCounters));
+    if (room >= MAX_ROOMS || count == 0) {
+        return 0;
+    }
+    int32_t lastHour = firstHour + static_cast<int32_t>(count) - 1;
+    beginRead();
+    visit(HOURS, room, firstHour, lastHour, [&](int32_t hour, int32_t, const uint8_t* data, size_t length) {
+        mergeCounters(data, length, out[hour - firstHour]);
+    });
+    {
+        hal::LockGuard guard(lock);
+        const RoomCursor& cursor = rooms[room];
+        int32_t hour = hourOf(cursor.next);
+        if (cursor.next >= 0 && hour >= firstHour && hour <= lastHour) {
+            out[hour - firstHour] = cursor.hour;
+            out[hour - firstHour].records = 1;
+        }
+    }
+    endRead();
+    size_t known = 0;
+    for (size_t i = 0; i < count; ++i) {
+        known += out[i].records > 0;
+    }
+    return known;
+}
+
+size_t UsageHistory::queryMinutes(uint8_t room, int32_t firstMinute, size_t count, MinuteUsage* out) {
+    memset(out, 0, count * sizeof(MinuteUsage));
+    if (room >= MAX_ROOMS || count == 0) {
+        return 0;
+    }
+    int32_t lastMinute = firstMinute + static_cast<int32_t>(count) - 1;
+    beginRead();
+    visit(MINUTES, room, firstMinute, lastMinute, [&](int32_t start, int32_t, const uint8_t* data, size_t length) {
+        fillMinutes(data, length, start, firstMinute, count, out);
+    });
+    {
+        // L'ora in corso: chunk aperto, run aperto e minuto aperto
+        hal::LockGuard guard(lock);
+        const RoomCursor& cursor = rooms[room];
+        if (cursor.next >= 0) {
+            fillMinutes(cursor.chunk, cursor.chunkLength, cursor.chunkStart, firstMinute, count, out);
+            uint8_t open[10];
+            size_t n = encodeVarint((static_cast<uint32_t>(cursor.runLength) << FLAG_BITS) | cursor.runFlags, open);
+            n += encodeVarint((1u << FLAG_BITS) | cursor.flags, open + n);
+            fillMinutes(open, n, cursor.next - cursor.runLength, firstMinute, count, out);
+        }
+    }
+    endRead();
+    size_t known = 0;
+    for (size_t i = 0; i < count; ++i) {
+        known += out[i].known;
+    }
+    return known;
+}
+
+size_t UsageHistory::litPerNight(uint8_t room, int32_t localMinute, uint16_t* out, size_t nights) {
+    memset(out, 0, nights * sizeof(uint16_t));
+    if (room >= MAX_ROOMS || nights == 0) {
+        return 0;
+    }
+    // Come queryDays, ma una sola passata sui segmenti e un campo solo per notte
+    static const size_t WORDS = 4;  // fino a 128 notti nella bitmap dei giorni con dati
+    uint32_t seen[WORDS] = {};
+    int32_t lastDay = dayOf(localMinute);
+    int32_t firstDay = lastDay - static_cast<int32_t>(nights) + 1;
+    auto add = [&](int32_t day, const UsageCounters& counters) {
+        size_t i = static_cast<size_t>(day - firstDay);
+        out[i] = static_cast<uint16_t>(out[i] + counters.minutes[UsageCounters::NIGHT_LIT]);
+        if (i < WORDS * 32) {
+            seen[i / 32] |= 1u << (i % 32);
+        }
+    };
+    beginRead();
+    visit(DAYS, room, firstDay, lastDay, [&](int32_t day, int32_t, const uint8_t* data, size_t length) {
+        UsageCounters counters = {};
+        if (mergeCounters(data, length, counters)) {
+            add(day, counters);
+        }
+    });
+    {
+        hal::LockGuard guard(lock);
+        const RoomCursor& cursor = rooms[room];
+        int32_t day = cursor.next >= 0 ? dayOf(cursor.next) : cursor.restoredDay;
+        if (day != NO_DAY && day >= firstDay && day <= lastDay) {
+            add(day, cursor.day);
+        }
+    }
+    endRead();
+    size_t known = 0;
+    for (size_t i = 0; i < WORDS; ++i) {
+        known += static_cast<size_t>(__builtin_popcount(seen[i]));
+    }
+    return known;
+}
+
+uint8_t UsageHistory::segmentCount(Tier tier) const {
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < sectorCount; ++i) {
+        count += segments[i].tier == tier;
+    }
+    return count;
+}
+
+int32_t UsageHistory::oldestMinute(Tier tier) const {
+    int32_t oldest = INT32_MAX;
+    for (uint8_t i = 0; i < sectorCount; ++i) {
+        if (segments[i].tier == tier && segments[i].firstTime < oldest) {
+            oldest = segments[i].firstTime;
+        }
+    }
+    if (oldest == INT32_MAX) {
+        return -1;
+    }
+    return tier == MINUTES ? oldest : tier == HOURS ? oldest * 60 : oldest * MINUTES_PER_DAY + DAY_START_MIN;
+}
+
+uint32_t UsageHistory::maxEraseCount() const {
+    uint32_t most = 0;
+    for (uint8_t i = 0; i < sectorCount; ++i) {
+        most = segments[i].eraseCount > most ? segments[i].eraseCount : most;
+    }
+    return most;
+}
+
+uint32_t UsageHistory::minEraseCount() const {
+    uint32_t least = UINT32_MAX;
+    for (uint8_t i = 0; i < sectorCount; ++i) {
+        least = segments[i].eraseCount < least ? segments[i].eraseCount : least;
+    }
+    return least;
+}
@@ -0,0 +1,111 @@
+#include "ZoneOccupancy.h"
+#include <string.h>
+
+// Le energie stanno in 7 bit: il bit alto di ogni byte resta libero per il confronto SWAR
+static const uint32_t HIGH_BITS = 0x80808080u;
+static const uint32_t LOW_BITS = 0x7F7F7F7Fu;
+static const uint8_t MAX_ENERGY = 0x7F;
+
+const uint8_t ZoneOccupancy::DEFAULT_MOVING_THRESHOLDS[GATES] = {50, 50, 40, 30, 20, 15, 15, 15, 15};
+const uint8_t ZoneOccupancy::DEFAULT_STATIONARY_THRESHOLDS[GATES] = {40, 40, 40, 40, 30, 30, 20, 20, 20};
+
+ZoneOccupancy::ZoneOccupancy() : zoneCount(0), occupied(0) {
+    memset(zones, 0, sizeof(zones));
+    memset(zoneMasks, 0, sizeof(zoneMasks));
+    setThresholds(DEFAULT_MOVING_THRESHOLDS, DEFAULT_STATIONARY_THRESHOLDS);
+    reset();
+}
+
+void ZoneOccupancy::setZones(const ZoneConfig* newZones, uint8_t count) {
+    zoneCount = count < MAX_ZONES ? count : MAX_ZONES;
+    memset(zoneMasks, 0, sizeof(zoneMasks));
+    for (uint8_t z = 0; z < zoneCount; ++z) {
+        zones[z] = newZones[z];
+        uint8_t bytes[WORDS * 4] = {};
+        for (uint8_t gate = zones[z].firstGate; gate <= zones[z].lastGate && gate < GATES; ++gate) {
+            bytes[gate] = 0xFF;
+        }
+        memcpy(zoneMasks[z], bytes, sizeof(bytes));
+    }
+    reset();
+}
+
+void ZoneOccupancy::setThresholds(const uint8_t* moving, const uint8_t* stationary) {
+    pack(moving, movingThresholds);
+    pack(stationary, stationaryThresholds);
+}
+
+void ZoneOccupancy::reset() {
+    occupied = 0;
+    for (uint8_t z = 0; z < MAX_ZONES; ++z) {
+        averageQ4[z] = 0;
+        lastScore[z] = 0;
+        quietFrames[z] = 0;
+    }
+}
+
+// 9 byte saturati a 7 bit in 3 parole, il resto a zero; stesso ordine dei byte su host e ESP32
+void ZoneOccupancy::pack(const uint8_t* bytes, uint32_t* words) {
+    uint8_t clamped[WORDS * 4] = {};
+    for (uint8_t gate = 0; gate < GATES; ++gate) {
+        clamped[gate] = bytes[gate] < MAX_ENERGY ? bytes[gate] : MAX_ENERGY;
+    }
+    memcpy(words, clamped, sizeof(clamped));
+}
+
+// Per byte: energia - soglia se positiva, altrimenti 0. Con il bit alto forzato a 1 la
+// sottrazione non chiede mai prestito al byte vicino, e il bit alto dice se energia >= soglia
+void ZoneOccupancy::excess(const uint32_t* energy, const uint32_t* threshold, uint32_t* out) {
+    for (uint8_t w = 0; w < WORDS; ++w) {
+        uint32_t diff = (energy[w] | HIGH_BITS) - threshold[w];
+        uint32_t keep = ((diff & HIGH_BITS) >> 7) * 0xFF;
+        out[w] = diff & LOW_BITS & keep;
+    }
+}
+
+bool ZoneOccupancy::update(const LD2410Frame& frame) {
+    if (!frame.engineering) {
+        return false;
+    }
+    uint32_t moving[WORDS];
+    uint32_t stationary[WORDS];
+    pack(frame.movingGateEnergy, moving);
+    pack(frame.stationaryGateEnergy, stationary);
+    excess(moving, movingThresholds, moving);
+    excess(stationary, stationaryThresholds, stationary);
+    // Due eccessi da 7 bit stanno in un byte: la somma per gate non sconfina
+    uint32_t combined[WORDS];
+    for (uint8_t w = 0; w < WORDS; ++w) {
+        combined[w] = moving[w] + stationary[w];
+    }
+
+    uint8_t previous = occupied;
+    for (uint8_t z = 0; z < zoneCount; ++z) {
+        uint32_t score = 0;
+        for (uint8_t w = 0; w < WORDS; ++w) {
+            uint32_t bytes = combined[w] & zoneMasks[z][w];
+            uint32_t pairs = (bytes & 0x00FF00FFu) + ((bytes >> 8) & 0x00FF00FFu);
+            score += (pairs & 0xFFFF) + (pairs >> 16);
+        }
+        lastScore[z] = static_cast<uint16_t>(score);
+
+        // avg += (score - avg) / 2^shift, in Q4 con segno
+        int32_t delta = static_cast<int32_t>(score << 4) - averageQ4[z];
+        averageQ4[z] = static_cast<uint16_t>(averageQ4[z] + (delta >> SMOOTHING_SHIFT));
+
+        uint8_t bit = static_cast<uint8_t>(1u << z);
+        if ((occupied & bit) == 0) {
+            if (averageQ4[z] >= static_cast<uint32_t>(zones[z].enterScore) << 4) {
+                occupied |= bit;
+                quietFrames[z] = 0;
+            }
+        } else if (averageQ4[z] < static_cast<uint32_t>(zones[z].exitScore) << 4) {
+            if (++quietFrames[z] >= zones[z].holdFrames) {
+                occupied &= static_cast<uint8_t>(~bit);
+            }
+        } else {
+            quietFrames[z] = 0;
+        }
+    }
+    return occupied != previous;
+}
@@ -0,0 +1,2543 @@
+// Micro-benchmark su host dei percorsi caldi (pio run -e native && .pio/build/native/program)
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include "Hal.h"
+#include "LedController.h"
+#include "MotionSensor.h"
+#include "LampStateMachine.h"
+#include "LampControlTask.h"
+#include "LD2410Parser.h"
+#include "ZoneOccupancy.h"
+#include "GateCalibrator.h"
+#include "TraceRecorder.h"
+#include "Log.h"
+#include "TimeService.h"
+#include "DaySchedule.h"
+#include "Metrics.h"
+#include "LightingProfiles.h"
+#include "OccupancyLearner.h"
+#include "PowerManager.h"
+#include "ResumeState.h"
+#include "LampBank.h"
+#include "HomeKitTelemetry.h"
+#include "UsageHistory.h"
+#include <cstdarg>
+#include <vector>
+
+// Conteggio delle allocazioni: ogni new passa da qui e dalla contabilità dell'heap di Metrics
+static uint64_t allocationCount = 0;
+
+void* operator new(size_t size) {
+    ++allocationCount;
+    void* p = Metrics::trackedAlloc(size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    ++allocationCount;
+    return Metrics::trackedAlloc(size);
+}
+
+void operator delete(void* p) noexcept {
+    Metrics::trackedFree(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    Metrics::trackedFree(p);
+}
+
+namespace {
+
+volatile uint32_t sink;
+
+struct Result {
+    double nsPerCall;
+    double allocsPerCall;
+};
+
+template <typename Fn>
+Result measure(uint64_t iterations, Fn fn) {
+    uint64_t allocsBefore = allocationCount;
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < iterations; ++i) {
+        fn(i);
+    }
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    return Result{ns / iterations, static_cast<double>(allocationCount - allocsBefore) / iterations};
+}
+
+void report(const char* name, const Result& r) {
+    printf("%-34s %10.1f ns/call %12.0f calls/s %8.3f alloc/call\n",
+           name, r.nsPerCall, 1e9 / r.nsPerCall, r.allocsPerCall);
+}
+
+// Copia della vecchia tabella a std::function, tenuta solo come riferimento di confronto
+struct LegacyRules {
+    using Rule = std::function<LampState(bool isMovement, bool isPresence, bool stateTimedOut)>;
+    std::array<Rule, LampStateTable::STATE_COUNT> rules;
+
+    LegacyRules() {
+        for (size_t i = 0; i < LampStateTable::STATE_COUNT; ++i) {
+            LampStateTable::Rule rule = LampStateTable::states[i].rule;
+            rules[i] = [rule](bool isMovement, bool isPresence, bool stateTimedOut) {
+                return rule(isMovement, isPresence, stateTimedOut);
+            };
+        }
+    }
+};
+
+void benchTransitionTable() {
+    LegacyRules legacy;
+    LampState state = LampState::OFF;
+    report("transition std::function (legacy)", measure(20000000, [&](uint64_t i) {
+        state = legacy.rules[static_cast<size_t>(state)]((i & 1) != 0, (i & 6) != 0, (i & 24) == 24);
+    }));
+    state = LampState::OFF;
+    report("transition LampStateTable::next", measure(20000000, [&](uint64_t i) {
+        state = LampStateTable::next(state, (i & 1) != 0, (i & 6) != 0, (i & 24) == 24);
+    }));
+    sink = sink + static_cast<uint32_t>(state);
+    printf("%-34s %zu bytes (legacy: %zu bytes + closures)\n", "transition table footprint",
+           sizeof(LampStateTable::transitions) + sizeof(LampStateTable::states), sizeof(legacy.rules));
+}
+
+// 100k fade con retarget, curve miste e blink attivo: nessuna allocazione ammessa
+bool benchFadeHeap(LedController& led) {
+    const FadeCurve curves[] = {FadeCurve::LINEAR, FadeCurve::EXPONENTIAL, FadeCurve::EASE_IN_OUT};
+    uint64_t allocsBefore = allocationCount;
+    led.startSetupBlink(500);
+    Result r = measure(100000, [&](uint64_t i) {
+        led.startFadeTo(static_cast<uint16_t>((i * 389) & 1023), 200 + (i % 5) * 100, curves[i % 3]);
+        hal::native::advance((i % 7) * 40000);  // a volte a metà fade, a volte dopo la fine
+    });
+    led.stopSetupBlink();
+    uint64_t growth = allocationCount - allocsBefore;
+    report("100k fades (retarget+blink)", r);
+    printf("%-34s %llu allocations\n", "fade heap growth", static_cast<unsigned long long>(growth));
+    return growth == 0;
+}
+
+// Sequenza deterministica di cambi del sensore (LCG), uguale per i due cicli a confronto
+struct SensorScript {
+    uint32_t seed = 12345;
+    uint64_t nextChangeUs = 0;
+    bool movement = false;
+    bool presence = false;
+
+    void step() {
+        seed = seed * 1103515245 + 12345;
+        uint32_t r = seed >> 8;
+        presence = (r & 3) != 0;
+        movement = presence && (r & 4) != 0;
+        nextChangeUs += (5 + (r >> 4) % 115) * 1000000ULL;  // da 5 s a 2 minuti
+    }
+};
+
+const uint64_t LOOP_SCENARIO_US = 2ULL * 3600 * 1000000;  // 2 ore simulate
+
+// Prima: un tick ogni ms che chiama update() a prescindere
+void benchPollingLoop(LampStateMachine& lamp, MotionSensor& motion) {
+    SensorScript script;
+    uint64_t endUs = hal::micros() + LOOP_SCENARIO_US;
+    script.nextChangeUs = hal::micros();
+    uint64_t wakeups = 0;
+    uint32_t transitions = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (hal::micros() < endUs) {
+        if (hal::micros() >= script.nextChangeUs) {
+            script.step();
+            motion.injectReading(script.presence, script.movement, 150, 120);
+        }
+        hal::native::advance(1000);
+        LampState before = lamp.getCurrentState();
+        lamp.update(100, true);
+        transitions += lamp.getCurrentState() != before;
+        ++wakeups;
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    double seconds = LOOP_SCENARIO_US / 1e6;
+    printf("%-34s %10.1f wakeups/s %9.1f host ns/sim s (%u transitions)\n", "control loop: 1-tick polling",
+           wakeups / seconds, ns / seconds, transitions);
+}
+
+// Dopo: il ciclo dorme fino al prossimo evento o timeout di stato
+void benchEventLoop(LampStateMachine& lamp) {
+    LampControlTask control(lamp, nullptr);
+    SensorScript script;
+    uint64_t endUs = hal::micros() + LOOP_SCENARIO_US;
+    script.nextChangeUs = hal::micros();
+    postLampEvent(LampEvent::brightnessChanged(100));
+    postLampEvent(LampEvent::autoModeChanged(true));
+    auto start = std::chrono::steady_clock::now();
+    while (hal::micros() < endUs) {
+        uint32_t timeoutMs = control.nextTimeoutMs();
+        uint64_t wakeUs = hal::micros() + static_cast<uint64_t>(timeoutMs) * 1000;
+        if (script.nextChangeUs < wakeUs) {
+            wakeUs = script.nextChangeUs;
+        }
+        if (wakeUs > hal::micros()) {
+            hal::native::advance(wakeUs - hal::micros());
+        }
+        if (hal::micros() >= script.nextChangeUs) {
+            script.step();
+            postLampEvent(LampEvent::sensorFrame(script.movement, script.presence, 150, 120));
+        }
+        control.runOnce();
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    double seconds = LOOP_SCENARIO_US / 1e6;
+    const LampLoopStats& stats = control.getStats();
+    printf("%-34s %10.3f wakeups/s %9.1f host ns/sim s (%u events, %u transitions)\n", "control loop: event queue",
+           stats.wakeups / seconds, ns / seconds, stats.events, stats.transitions);
+}
+
+// Porta l'orologio virtuale a untilUs servendo tutti i timeout di stato che scadono nel mezzo
+void advanceEventLoop(LampControlTask& control, uint64_t untilUs) {
+    for (;;) {
+        uint32_t timeoutMs = control.nextTimeoutMs();
+        uint64_t wakeUs = hal::micros() + static_cast<uint64_t>(timeoutMs) * 1000;
+        if (wakeUs > untilUs) {
+            break;
+        }
+        hal::native::advance(wakeUs - hal::micros());
+        control.runOnce();
+    }
+    if (untilUs > hal::micros()) {
+        hal::native::advance(untilUs - hal::micros());
+    }
+}
+
+// Metriche sull'orologio virtuale: ogni frame del radar arriva al task di controllo 2 ms dopo
+// il post, come se lo scheduler lo facesse aspettare; latenze e fine dei fade negli istogrammi
+bool benchMetrics(LampStateMachine& lamp) {
+    const uint32_t dispatchUs = 2000;
+    report("Histogram::record", measure(10000000, [&](uint64_t i) {
+        Metrics::fadeJitterUs.record(static_cast<uint32_t>(i & 4095));
+    }));
+    Metrics::reset();
+
+    LampControlTask control(lamp, nullptr);
+    SensorScript script;
+    uint64_t endUs = hal::micros() + 3600ULL * 1000000;
+    script.nextChangeUs = hal::micros();
+    postLampEvent(LampEvent::brightnessChanged(100));
+    postLampEvent(LampEvent::autoModeChanged(true));
+    uint32_t frames = 0;
+    while (hal::micros() < endUs) {
+        advanceEventLoop(control, script.nextChangeUs);
+        script.step();
+        postLampEvent(LampEvent::sensorFrame(script.movement, script.presence, 150, 120));
+        hal::native::advance(dispatchUs);
+        control.runOnce();
+        ++frames;
+    }
+    advanceEventLoop(control, hal::micros() + 60000000);  // lascia finire l'ultimo fade
+
+    hal::native::setLogEnabled(true);
+    Metrics::dump();
+    hal::native::setLogEnabled(false);
+    const Histogram& latency = Metrics::sensorToFadeUs;
+    const Histogram& jitter = Metrics::fadeJitterUs;
+    printf("%-34s %10u frames, sensor->fade p50 %u us (n %u), fade jitter max %u us (n %u)\n", "metrics, virtual clock",
+           frames, latency.percentile(50), latency.count(), jitter.max(), jitter.count());
+    return latency.count() > 0 && latency.percentile(50) == dispatchUs && latency.max() == dispatchUs &&
+           Metrics::evaluateCycles.count() == control.getStats().wakeups && jitter.count() > 0 &&
+           jitter.max() < FadeEngine::FRAME_MS * 1000;
+}
+
+// Notte registrata sintetica a 10 frame/s: arrivo, lettura, sonno con frame rumorosi
+// (presenza che sparisce per un frame, movimenti spuri), risveglio e stanza vuota con ventilatore
+struct NightFrame {
+    bool movement;
+    bool presence;
+    uint16_t distance;
+};
+
+NightFrame nightFrameAt(uint32_t frameIndex, uint32_t& seed) {
+    seed = seed * 1103515245 + 12345;
+    uint32_t r = (seed >> 8) % 1000;
+    uint32_t minute = frameIndex / 600;
+    NightFrame frame = {false, false, 0};
+    if (minute < 10) {                       // ingresso e movimento per la stanza
+        frame = {r < 900, true, 200};
+    } else if (minute < 40) {                // lettura: presenza ferma, qualche gesto
+        frame = {r < 30, r >= 15, 150};
+    } else if (minute < 450) {               // sonno: rumore del radar e giri nel letto
+        bool turning = (minute % 45) == 0 && (frameIndex % 600) < 30;
+        frame = {turning || r < 5, turning || r >= 20, 120};
+    } else {                                 // stanza vuota, ventilatore acceso
+        frame = {r < 3, r < 8, 450};
+    }
+    return frame;
+}
+
+uint32_t replayNight(LampStateMachine& lamp, MotionSensor& motion, const PresenceFilterConfig& config) {
+    const uint32_t frames = 8 * 3600 * 10;
+    LampControlTask control(lamp, nullptr);
+    motion.setFilterConfig(config);
+    postLampEvent(LampEvent::autoModeChanged(true));
+    postLampEvent(LampEvent::brightnessChanged(100));
+    control.runOnce();
+    control.resetStats();
+    uint32_t seed = 99;
+    for (uint32_t i = 0; i < frames; ++i) {
+        advanceEventLoop(control, hal::micros() + 100000);
+        NightFrame night = nightFrameAt(i, seed);
+        LD2410Frame frame = {};
+        frame.targetState = (night.movement ? 1 : 0) | (night.presence ? 2 : 0);
+        frame.movingDistance = night.movement ? night.distance : 0;
+        frame.stationaryDistance = night.presence ? night.distance : 0;
+        if (motion.injectFrame(frame)) {
+            postLampEvent(LampEvent::sensorFrame(motion.isMovementDetected(), motion.isPresenceDetected(),
+                                                 motion.getMovementDistance(), motion.getStationaryDistance()));
+            control.runOnce();
+        }
+    }
+    return control.getStats().transitions;
+}
+
+void benchPresenceFilter(LampStateMachine& lamp, MotionSensor& motion) {
+    uint32_t raw = replayNight(lamp, motion, PresenceFilterConfig::passthrough());
+    uint32_t filtered = replayNight(lamp, motion, PresenceFilterConfig::defaults());
+    PresenceFilterConfig gated = PresenceFilterConfig::defaults();
+    gated.maxDistance = 400;
+    uint32_t filteredGated = replayNight(lamp, motion, gated);
+    printf("%-34s %6u raw, %6u filtered, %6u filtered+gate 4 m (1 fade per transition)\n",
+           "night replay transitions", raw, filtered, filteredGated);
+    PresenceFilter filter;
+    report("PresenceFilter::update", measure(10000000, [&](uint64_t i) {
+        sink = sink + filter.update((i & 3) == 0, (i & 1) == 0, 150, 120, static_cast<uint32_t>(i));
+    }));
+}
+
+// Notte affollata vista da HomeKit: il task di HomeSpan passa ogni 100 ms dalla luce e dal
+// sensore di occupazione come SmartLamp::loop e LampOccupancySensor::loop
+struct TelemetryNight {
+    uint32_t changes = 0;
+    uint32_t notifications = 0;
+    uint32_t peakPerMinute = 0;
+    uint32_t minutes = 0;
+    double pollNs = 0;        // tempo totale dei passaggi del task di HomeSpan
+    uint32_t polls = 0;
+    bool consistent = false;  // a fine notte HomeKit mostra gli ultimi valori pubblicati
+};
+
+TelemetryNight replayTelemetryNight(LampStateMachine& lamp, MotionSensor& motion, const PresenceFilterConfig& config) {
+    const uint32_t frames = 8 * 3600 * 10;
+    HomeKitTelemetry& telemetry = HomeKitTelemetry::getInstance();
+    LampControlTask control(lamp, nullptr);
+    motion.setFilterConfig(config);
+    postLampEvent(LampEvent::autoModeChanged(true));
+    postLampEvent(LampEvent::brightnessChanged(100));
+    control.runOnce();
+    TelemetryValues shown = {};
+    TelemetryValues values;
+    // Da quanto lasciato dalle prove precedenti: HomeKit parte allineato
+    hal::native::advance(60000000);
+    telemetry.poll(0, HomeKitTelemetry::POWER | HomeKitTelemetry::LEVEL | HomeKitTelemetry::OCCUPANCY,
+                   static_cast<uint32_t>(hal::millis()), shown);
+    telemetry.resetStats();
+
+    TelemetryNight night;
+    uint32_t minuteCount = 0;
+    uint32_t seed = 7;
+    // Un minuto di quiete alla fine: ciò che era in attesa deve partire
+    for (uint32_t i = 0; i < frames + 600; ++i) {
+        advanceEventLoop(control, hal::micros() + 100000);
+        if (i < frames) {
+            NightFrame frame = nightFrameAt(i, seed);
+            LD2410Frame radar = {};
+            radar.targetState = (frame.movement ? 1 : 0) | (frame.presence ? 2 : 0);
+            radar.movingDistance = frame.movement ? frame.distance : 0;
+            radar.stationaryDistance = frame.presence ? frame.distance : 0;
+            if (motion.injectFrame(radar)) {
+                postLampEvent(LampEvent::sensorFrame(motion.isMovementDetected(), motion.isPresenceDetected(),
+                                                     motion.getMovementDistance(), motion.getStationaryDistance()));
+                control.runOnce();
+            }
+        }
+        uint32_t now = static_cast<uint32_t>(hal::millis());
+        auto start = std::chrono::steady_clock::now();
+        uint8_t due = telemetry.poll(0, HomeKitTelemetry::POWER | HomeKitTelemetry::LEVEL, now, values);
+        due |= telemetry.poll(0, HomeKitTelemetry::OCCUPANCY, now, values);
+        night.pollNs += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        ++night.polls;
+        shown.on = (due & HomeKitTelemetry::POWER) ? values.on : shown.on;
+        shown.level = (due & HomeKitTelemetry::LEVEL) ? values.level : shown.level;
+        shown.occupied = (due & HomeKitTelemetry::OCCUPANCY) ? values.occupied : shown.occupied;
+        minuteCount += __builtin_popcount(due);
+        if (i % 600 == 599) {
+            night.peakPerMinute = minuteCount > night.peakPerMinute ? minuteCount : night.peakPerMinute;
+            minuteCount = 0;
+        }
+    }
+    TelemetryStats stats = telemetry.getStats();
+    night.changes = stats.changes;
+    night.notifications = stats.notifications;
+    night.minutes = frames / 600;
+    night.consistent = shown.on == values.on && shown.level == values.level && shown.occupied == values.occupied;
+    return night;
+}
+
+bool benchHomeKitTelemetry(LampStateMachine& lamp, MotionSensor& motion) {
+    bool ok = true;
+    static const uint32_t MAX_PER_MINUTE = HomeKitTelemetry::BURST + 60000 / HomeKitTelemetry::REFILL_MS;
+    struct Case {
+        const char* name;
+        PresenceFilterConfig config;
+    };
+    const Case cases[] = {{"raw radar", PresenceFilterConfig::passthrough()},
+                          {"filtered radar", PresenceFilterConfig::defaults()}};
+    for (const Case& c : cases) {
+        TelemetryNight night = replayTelemetryNight(lamp, motion, c.config);
+        // Senza coalescenza né limiti ogni cambio pubblicato sarebbe una notifica
+        printf("homekit night, %-15s %6u changes -> %5u notifications, %5.1f/min avg, peak %u/min (max %u)\n",
+               c.name, night.changes, night.notifications, static_cast<double>(night.notifications) / night.minutes,
+               night.peakPerMinute, MAX_PER_MINUTE);
+        printf("homekit poll task, %-12s %8.1f ns/pass %8.1f us/min of CPU, in sync at the end: %s\n", c.name,
+               night.pollNs / night.polls, night.pollNs / 1000.0 / (night.polls / 600.0),
+               night.consistent ? "yes" : "NO");
+        if (night.peakPerMinute > MAX_PER_MINUTE || !night.consistent || night.notifications > night.changes) {
+            printf("FAIL: HomeKit notifications not limited or out of sync (%s)\n", c.name);
+            ok = false;
+        }
+    }
+
+    // Una scrittura del controller arrivata con un cambio dell'automazione ancora in attesa: vince il controller
+    HomeKitTelemetry& telemetry = HomeKitTelemetry::getInstance();
+    TelemetryValues values;
+    const uint8_t light = HomeKitTelemetry::POWER | HomeKitTelemetry::LEVEL;
+    telemetry.publishLevel(1, 60);
+    bool first = telemetry.poll(1, light, static_cast<uint32_t>(hal::millis()), values) == light;
+    telemetry.publishLevel(1, 20);
+    bool held = telemetry.poll(1, light, static_cast<uint32_t>(hal::millis()), values) == 0;
+    telemetry.supersede(1, light);
+    hal::native::advance(HomeKitTelemetry::MIN_INTERVAL_MS * 1000);
+    bool dropped = telemetry.poll(1, light, static_cast<uint32_t>(hal::millis()), values) == 0;
+    if (!first || !held || !dropped) {
+        printf("FAIL: telemetry coalescing (first %d, held %d, superseded %d)\n", first, held, dropped);
+        ok = false;
+    }
+
+    // Bridge pieno: tutte le lampade cambiano più in fretta dei gettoni, il task le interroga in ordine.
+    // I gettoni vanno divisi tra tutte e, finita la raffica, ognuna arriva all'ultimo valore
+    static const uint8_t LAMPS = HomeKitTelemetry::MAX_LAMPS;
+    static const uint32_t BUSY_PASSES = 6000;   // 10 minuti di poll
+    static const uint32_t DRAIN_PASSES = 1200;  // 2 minuti senza cambi
+    const uint8_t all = light | HomeKitTelemetry::OCCUPANCY;
+    // Vista di HomeKit: la lampada 1 parte da quanto ha scritto il controller nel caso precedente
+    TelemetryValues shown[LAMPS];
+    uint32_t served[LAMPS] = {};
+    for (uint8_t l = 0; l < LAMPS; ++l) {
+        telemetry.poll(l, 0, static_cast<uint32_t>(hal::millis()), shown[l]);
+    }
+    for (uint32_t pass = 0; pass < BUSY_PASSES + DRAIN_PASSES; ++pass) {
+        uint32_t nowMs = static_cast<uint32_t>(hal::millis());
+        for (uint8_t l = 0; l < LAMPS; ++l) {
+            if (pass < BUSY_PASSES) {
+                uint32_t period = 10 + l % 3 * 5;  // un cambio ogni 1-2 s
+                telemetry.publishLevel(l, static_cast<uint8_t>(30 + (pass / period + l) % 2 * 40));
+                telemetry.publishOccupancy(l, (pass / (period * 4)) % 2 != 0);
+            }
+            uint8_t due = telemetry.poll(l, all, nowMs, values);
+            shown[l].on = (due & HomeKitTelemetry::POWER) != 0 ? values.on : shown[l].on;
+            shown[l].level = (due & HomeKitTelemetry::LEVEL) != 0 ? values.level : shown[l].level;
+            shown[l].occupied = (due & HomeKitTelemetry::OCCUPANCY) != 0 ? values.occupied : shown[l].occupied;
+            served[l] += pass < BUSY_PASSES && due != 0;
+        }
+        hal::native::advance(HomeKitTelemetry::POLL_MS * 1000);
+    }
+    uint32_t inSync = 0;
+    uint32_t fewest = UINT32_MAX;
+    uint32_t most = 0;
+    for (uint8_t l = 0; l < LAMPS; ++l) {
+        telemetry.poll(l, 0, static_cast<uint32_t>(hal::millis()), values);
+        inSync += shown[l].on == values.on && shown[l].level == values.level && shown[l].occupied == values.occupied;
+        fewest = served[l] < fewest ? served[l] : fewest;
+        most = served[l] > most ? served[l] : most;
+    }
+    printf("%-34s %u lamps, notified polls per lamp %u-%u, in sync at the end %u/%u\n", "homekit bridge fairness",
+           LAMPS, fewest, most, inSync, LAMPS);
+    if (inSync != LAMPS || fewest * 2 < most) {
+        printf("FAIL: HomeKit tokens not shared fairly between lamps\n");
+        ok = false;
+    }
+    return ok;
+}
+
+// Flusso registrato sintetico: frame base e engineering, ACK di comando e rumore tra i frame
+struct RecordedStream {
+    std::vector<uint8_t> bytes;
+    uint32_t frames = 0;
+    uint32_t corrupted = 0;
+};
+
+RecordedStream buildSensorStream(uint32_t frameCount, bool withNoise) {
+    static const uint8_t ack[] = {0xFD, 0xFC, 0xFB, 0xFA, 0x04, 0x00, 0xFF, 0x01, 0x00, 0x00, 0x04, 0x03, 0x02, 0x01};
+    RecordedStream stream;
+    uint32_t seed = 42;
+    uint8_t buffer[96];
+    for (uint32_t i = 0; i < frameCount; ++i) {
+        seed = seed * 1103515245 + 12345;
+        LD2410Frame frame = {};
+        frame.engineering = (seed >> 9) & 1;
+        frame.targetState = (seed >> 10) & 3;
+        frame.movingDistance = (seed >> 12) % 600;
+        frame.movingEnergy = (seed >> 16) % 100;
+        frame.stationaryDistance = (seed >> 14) % 600;
+        frame.stationaryEnergy = (seed >> 18) % 100;
+        frame.detectionDistance = 600;
+        frame.maxMovingGate = frame.maxStationaryGate = 8;
+        for (uint8_t g = 0; g < LD2410Frame::GATES; ++g) {
+            frame.movingGateEnergy[g] = (seed >> g) % 100;
+            frame.stationaryGateEnergy[g] = (seed >> (g + 3)) % 100;
+        }
+        size_t len = LD2410Parser::encode(frame, buffer, sizeof(buffer));
+        if (withNoise && (seed >> 20) % 50 == 0) {
+            buffer[len - 1] ^= 0xFF;  // tail rovinato
+            ++stream.corrupted;
+        } else {
+            ++stream.frames;
+        }
+        stream.bytes.insert(stream.bytes.end(), buffer, buffer + len);
+        if (withNoise && (seed >> 24) % 20 == 0) {
+            stream.bytes.insert(stream.bytes.end(), ack, ack + sizeof(ack));
+        }
+        if (withNoise && (seed >> 26) % 30 == 0) {
+            stream.bytes.push_back(static_cast<uint8_t>(seed));  // byte spurio
+        }
+    }
+    return stream;
+}
+
+// Alimenta il parser a spezzoni di lunghezza casuale, come le letture del driver UART
+bool benchSensorParser() {
+    bool ok = true;
+    for (bool noise : {false, true}) {
+        RecordedStream stream = buildSensorStream(200000, noise);
+        LD2410Parser parser;
+        LD2410Frame frame;
+        uint32_t decoded = 0;
+        uint32_t seed = 7;
+        size_t offset = 0;
+        auto start = std::chrono::steady_clock::now();
+        while (offset < stream.bytes.size()) {
+            seed = seed * 1103515245 + 12345;
+            size_t chunk = 1 + (seed >> 16) % 120;
+            if (chunk > stream.bytes.size() - offset) {
+                chunk = stream.bytes.size() - offset;
+            }
+            offset += parser.push(&stream.bytes[offset], chunk);
+            while (parser.next(frame)) {
+                ++decoded;
+            }
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const LD2410Stats& stats = parser.getStats();
+        printf("%-34s %10.1f MB/s %9u frames (%u eng, %u ack, %u tail err, %u skipped)\n",
+               noise ? "LD2410 parser, noisy stream" : "LD2410 parser, clean stream",
+               stream.bytes.size() / seconds / 1e6, decoded, stats.engineeringFrames, stats.ackFrames,
+               stats.tailErrors, stats.skippedBytes);
+        if (decoded != stream.frames) {
+            printf("  expected %u frames\n", stream.frames);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// Zone del banco: scrivania sui gate 0-1 (fino a 1,5 m), porta sui gate 4-5 (3-4,5 m)
+const ZoneConfig benchZones[] = {
+    {0, 1, 20, 8, 50},
+    {4, 5, 30, 16, 10},
+};
+const uint8_t DESK = 0x01;
+const uint8_t DOOR = 0x02;
+
+// Registrazione sintetica di un'ora a 10 frame/s in modalità engineering, con la verità per frame:
+// qualcuno siede alla scrivania (energia da fermo sui gate 0-2, respiro), ogni tanto qualcuno passa
+// dalla porta (movimento sui gate 4-6), un ventilatore sul gate 7 e rumore di fondo su tutti i gate
+struct ZoneStream {
+    std::vector<uint8_t> bytes;
+    std::vector<uint8_t> truth;
+    std::vector<bool> rawPresence;  // bit di presenza del radar, uguale per scrivania e porta
+};
+
+ZoneStream buildZoneStream(uint32_t frameCount) {
+    ZoneStream stream;
+    uint32_t seed = 2024;
+    uint8_t buffer[96];
+    bool atDesk = false;
+    uint32_t deskUntil = 0;
+    uint32_t doorUntil = 0;
+    for (uint32_t i = 0; i < frameCount; ++i) {
+        seed = seed * 1103515245 + 12345;
+        if (i >= deskUntil) {
+            atDesk = !atDesk;
+            deskUntil = i + 600 + (seed >> 8) % 6000;  // da 1 a 11 minuti
+        }
+        if (i >= doorUntil + 300 && (seed >> 12) % 200 == 0) {
+            doorUntil = i + 20 + (seed >> 16) % 30;  // un passaggio di 2-5 s
+        }
+        bool atDoor = i < doorUntil;
+
+        LD2410Frame frame = {};
+        frame.engineering = true;
+        frame.maxMovingGate = frame.maxStationaryGate = 8;
+        frame.detectionDistance = 600;
+        for (uint8_t g = 0; g < LD2410Frame::GATES; ++g) {
+            seed = seed * 1103515245 + 12345;
+            // Fondo: metà della soglia di fabbrica, più o meno 10
+            frame.movingGateEnergy[g] = ZoneOccupancy::DEFAULT_MOVING_THRESHOLDS[g] / 2 + (seed >> 10) % 20;
+            frame.stationaryGateEnergy[g] = ZoneOccupancy::DEFAULT_STATIONARY_THRESHOLDS[g] / 2 + (seed >> 20) % 20;
+        }
+        seed = seed * 1103515245 + 12345;
+        frame.stationaryGateEnergy[7] = 25 + (seed >> 10) % 10;  // ventilatore, appena sopra soglia
+        if (atDesk) {
+            uint32_t breath = (i % 40) < 20 ? (i % 20) : 20 - (i % 20);
+            frame.stationaryGateEnergy[0] = static_cast<uint8_t>(55 + breath + (seed >> 14) % 10);
+            frame.stationaryGateEnergy[1] = static_cast<uint8_t>(60 + breath + (seed >> 18) % 15);
+            frame.stationaryGateEnergy[2] = static_cast<uint8_t>(45 + (seed >> 22) % 8);
+            frame.movingGateEnergy[1] = static_cast<uint8_t>(40 + (seed >> 24) % 20);  // mani, tastiera
+        }
+        if (atDoor) {
+            uint8_t gate = static_cast<uint8_t>(4 + (i % 3 == 0));
+            frame.movingGateEnergy[gate] = static_cast<uint8_t>(70 + (seed >> 12) % 30);
+            frame.movingGateEnergy[gate + 1] = static_cast<uint8_t>(40 + (seed >> 16) % 20);
+            frame.stationaryGateEnergy[gate] = static_cast<uint8_t>(35 + (seed >> 20) % 10);
+        }
+        // Il radar vede un bersaglio in entrambi i casi: il bit di presenza non distingue le zone
+        frame.targetState = static_cast<uint8_t>((atDoor ? 0x01 : 0) | (atDesk ? 0x02 : 0));
+        frame.movingDistance = atDoor ? 340 : 0;
+        frame.stationaryDistance = atDesk ? 90 : 0;
+
+        size_t len = LD2410Parser::encode(frame, buffer, sizeof(buffer));
+        stream.bytes.insert(stream.bytes.end(), buffer, buffer + len);
+        stream.truth.push_back(static_cast<uint8_t>((atDesk ? DESK : 0) | (atDoor ? DOOR : 0)));
+        stream.rawPresence.push_back(frame.targetState != 0);
+    }
+    return stream;
+}
+
+// Frame giusto se la bitmap coincide con la verità di uno degli ultimi `lag` frame: la media entra
+// con qualche frame di ritardo e la zona resta occupata per holdFrames dopo l'uscita
+bool matchesRecent(const std::vector<uint8_t>& truth, uint32_t i, uint8_t zone, bool value, uint32_t lag) {
+    for (uint32_t k = 0; k <= lag && k <= i; ++k) {
+        if (((truth[i - k] & zone) != 0) == value) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Costo per frame (solo zone, e parser + zone sul flusso di byte) e accuratezza sulla registrazione
+bool benchZoneOccupancy() {
+    const uint32_t frames = 36000;
+    const double budgetUs = 2.0;  // per frame sull'host; il radar ne manda uno ogni 50-100 ms
+    ZoneStream stream = buildZoneStream(frames);
+
+    std::vector<LD2410Frame> decoded;
+    LD2410Parser parser;
+    LD2410Frame frame;
+    size_t offset = 0;
+    while (offset < stream.bytes.size()) {
+        offset += parser.push(&stream.bytes[offset], stream.bytes.size() - offset);
+        while (parser.next(frame)) {
+            decoded.push_back(frame);
+        }
+    }
+    if (decoded.size() != frames) {
+        printf("  zone stream: decoded %zu of %u frames\n", decoded.size(), frames);
+        return false;
+    }
+
+    ZoneOccupancy zones;
+    zones.setZones(benchZones, 2);
+    Result update = measure(decoded.size() * 50, [&](uint64_t i) {
+        sink = sink + zones.update(decoded[i % decoded.size()]);
+    });
+    printf("%-34s %10.1f ns/frame %10.0f frames/s\n", "ZoneOccupancy::update", update.nsPerCall, 1e9 / update.nsPerCall);
+
+    auto start = std::chrono::steady_clock::now();
+    uint32_t passes = 20;
+    for (uint32_t pass = 0; pass < passes; ++pass) {
+        LD2410Parser streamParser;
+        ZoneOccupancy streamZones;
+        streamZones.setZones(benchZones, 2);
+        offset = 0;
+        while (offset < stream.bytes.size()) {
+            size_t chunk = stream.bytes.size() - offset < 64 ? stream.bytes.size() - offset : 64;
+            offset += streamParser.push(&stream.bytes[offset], chunk);
+            while (streamParser.next(frame)) {
+                sink = sink + streamZones.update(frame);
+            }
+        }
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / (frames * passes);
+    printf("%-34s %10.1f ns/frame %10.0f frames/s\n", "parser + zones, byte stream", ns, 1e9 / ns);
+
+    // Accuratezza: zone contro verità, e il solo bit di presenza usato come "c'è qualcuno alla scrivania"
+    zones.reset();
+    const uint32_t settle = 8;  // frame perché la media esponenziale attraversi la soglia
+    uint32_t deskOk = 0;
+    uint32_t doorOk = 0;
+    uint32_t rawOk = 0;
+    for (uint32_t i = 0; i < frames; ++i) {
+        zones.update(decoded[i]);
+        uint8_t occupied = zones.getOccupied();
+        deskOk += matchesRecent(stream.truth, i, DESK, (occupied & DESK) != 0, benchZones[0].holdFrames + settle);
+        doorOk += matchesRecent(stream.truth, i, DOOR, (occupied & DOOR) != 0, benchZones[1].holdFrames + settle);
+        rawOk += matchesRecent(stream.truth, i, DESK, stream.rawPresence[i], benchZones[0].holdFrames + settle);
+    }
+    double deskPct = 100.0 * deskOk / frames;
+    double doorPct = 100.0 * doorOk / frames;
+    double rawPct = 100.0 * rawOk / frames;
+    printf("%-34s %9.2f%% desk, %6.2f%% door (radar presence bit as desk: %.2f%%)\n", "zone accuracy, recorded stream",
+           deskPct, doorPct, rawPct);
+    return update.nsPerCall < budgetUs * 1000 && ns < budgetUs * 1000 && deskPct >= 99.0 && doorPct >= 99.0 &&
+           rawPct < deskPct;
+}
+
+// Stanza vuota registrata a 10 frame/s, solo energie per gate: rumore di fondo su tutti i gate, un
+// ventilatore sul gate 2 (movimento), una tenda che l'aria muove a raffiche sul gate 4 e un
+// climatizzatore a cicli sul gate 6 (da fermo). drift aggiunge sul gate 5 un deumidificatore
+// comparso dopo la calibrazione, che nelle ore cresce fino a superare la soglia calibrata.
+// Il bit di bersaglio lo decide il radar simulato alla riproduzione
+std::vector<LD2410Frame> buildEmptyRoom(uint32_t frameCount, uint32_t seed, bool drift) {
+    std::vector<LD2410Frame> frames(frameCount);
+    auto gauss = [&](uint32_t mean, uint32_t sigma) {
+        // Somma di quattro uniformi: campana con la deviazione standard richiesta
+        uint32_t sum = 0;
+        for (int k = 0; k < 4; ++k) {
+            seed = seed * 1103515245 + 12345;
+            sum += (seed >> 8) % 1000;
+        }
+        int32_t value = static_cast<int32_t>(mean) + (static_cast<int32_t>(sum) - 1998) * static_cast<int32_t>(sigma) / 577;
+        return static_cast<uint8_t>(value < 0 ? 0 : value > 100 ? 100 : value);
+    };
+    for (uint32_t i = 0; i < frameCount; ++i) {
+        LD2410Frame& frame = frames[i];
+        frame.engineering = true;
+        frame.maxMovingGate = frame.maxStationaryGate = 8;
+        for (uint8_t g = 0; g < LD2410Frame::GATES; ++g) {
+            frame.movingGateEnergy[g] = gauss(6, 2);
+            frame.stationaryGateEnergy[g] = gauss(6, 2);
+        }
+        frame.movingGateEnergy[2] = gauss(28, 5);
+        if (i % 1800 < 20) {  // tenda: 2 s ogni 3 minuti
+            frame.movingGateEnergy[4] = gauss(26, 3);
+        }
+        if (i % 9000 < 3600) {  // climatizzatore: 6 minuti ogni 15
+            frame.stationaryGateEnergy[6] = gauss(22, 2);
+        }
+        if (drift) {
+            frame.movingGateEnergy[5] = gauss(8 + 20 * i / frameCount, 2);
+        }
+    }
+    return frames;
+}
+
+// Qualcuno cammina sul gate 3 e poi si siede: deve accendere anche con le soglie calibrate
+void addPerson(std::vector<LD2410Frame>& frames, uint32_t from, uint32_t count) {
+    for (uint32_t i = from; i < from + count && i < frames.size(); ++i) {
+        bool walking = i - from < 100;
+        frames[i].movingGateEnergy[3] = static_cast<uint8_t>(walking ? 70 + i % 20 : 10);
+        frames[i].stationaryGateEnergy[3] = static_cast<uint8_t>(50 + i % 15);
+    }
+}
+
+struct ReplayResult {
+    uint32_t movementOnsets;
+    uint32_t presenceOnsets;
+    uint32_t firstMovementFrame;  // UINT32_MAX se il movimento filtrato non si è mai acceso
+    uint32_t lastHourMoving;      // frame con movimento filtrato nell'ultima ora della riproduzione
+};
+
+// Riproduce i frame sul radar simulato, che decide il bersaglio come il LD2410 (energia oltre la
+// soglia del gate, da fermo solo dal gate 2) con le soglie che il sensore gli ha scritto, e li passa
+// al MotionSensor come byte grezzi. Con learn, come il task di controllo, il fondo impara solo a
+// lampada spenta: niente bersagli filtrati da 5 minuti
+ReplayResult replayRoom(MotionSensor& sensor, const std::vector<LD2410Frame>& frames, bool learn = false) {
+    const uint32_t LAMP_HOLD_FRAMES = 3000;
+    const uint32_t HOUR_FRAMES = 36000;
+    ReplayResult result = {0, 0, UINT32_MAX, 0};
+    uint8_t bytes[96];
+    bool lastMovement = sensor.isMovementDetected();
+    bool lastPresence = sensor.isPresenceDetected();
+    uint32_t lastTarget = 0;
+    for (uint32_t i = 0; i < frames.size(); ++i) {
+        LD2410Frame frame = frames[i];
+        const GateThresholds& thresholds = sensor.getCalibrator().getThresholds();
+        bool moving = false;
+        bool stationary = false;
+        for (uint8_t g = 0; g < LD2410Frame::GATES; ++g) {
+            moving = moving || frame.movingGateEnergy[g] > thresholds.moving[g];
+            stationary = stationary || (g >= 2 && frame.stationaryGateEnergy[g] > thresholds.stationary[g]);
+        }
+        frame.targetState = static_cast<uint8_t>((moving ? 0x01 : 0) | (stationary ? 0x02 : 0));
+        frame.movingDistance = moving ? 150 : 0;
+        frame.stationaryDistance = stationary ? 150 : 0;
+        hal::native::advance(100000);
+        sensor.injectBytes(bytes, LD2410Parser::encode(frame, bytes, sizeof(bytes)));
+        sensor.update();
+        bool movement = sensor.isMovementDetected();
+        bool presence = sensor.isPresenceDetected();
+        if (movement || presence) {
+            lastTarget = i;
+        }
+        sensor.setBackgroundLearning(learn && i - lastTarget > LAMP_HOLD_FRAMES);
+        if (movement && !lastMovement) {
+            ++result.movementOnsets;
+            result.firstMovementFrame = result.firstMovementFrame == UINT32_MAX ? i : result.firstMovementFrame;
+        }
+        result.lastHourMoving += movement && i + HOUR_FRAMES >= frames.size();
+        result.presenceOnsets += presence && !lastPresence;
+        lastMovement = movement;
+        lastPresence = presence;
+    }
+    return result;
+}
+
+// Falsi risvegli su due ore di stanza vuota con le soglie di fabbrica e con quelle calibrate in
+// 10 minuti, poi otto ore con una sorgente nuova che cresce piano: un secondo radar riparte dalla
+// stessa calibrazione salvata in NVS ma non segue il fondo
+bool benchGateCalibration() {
+    const uint32_t HOUR_FRAMES = 36000;
+    const uint32_t CALIBRATION_MS = 10 * 60 * 1000;
+    MotionSensor sensor;
+    sensor.begin();
+
+    std::vector<LD2410Frame> room = buildEmptyRoom(2 * HOUR_FRAMES, 11, false);
+    ReplayResult before = replayRoom(sensor, room);
+
+    sensor.requestCalibration(CALIBRATION_MS);
+    replayRoom(sensor, buildEmptyRoom(CALIBRATION_MS / 100 + 10, 23, false));
+    bool calibrated = sensor.getCalibrator().isCalibrated();
+    ReplayResult after = replayRoom(sensor, room);
+
+    std::vector<LD2410Frame> visit = buildEmptyRoom(HOUR_FRAMES / 6, 31, false);
+    addPerson(visit, 600, 3000);
+    ReplayResult person = replayRoom(sensor, visit);
+
+    const uint32_t TRACK_HOURS = 8;
+    GateThresholds calibratedThresholds = sensor.getCalibrator().getThresholds();
+    MotionSensor frozen;
+    frozen.begin();
+    bool restored = frozen.getCalibrator().isCalibrated() &&
+                    memcmp(&frozen.getCalibrator().getThresholds(), &calibratedThresholds, sizeof(GateThresholds)) == 0;
+    std::vector<LD2410Frame> drift = buildEmptyRoom(TRACK_HOURS * HOUR_FRAMES, 47, true);
+    ReplayResult tracking = replayRoom(sensor, drift, true);
+    ReplayResult fixed = replayRoom(frozen, drift, false);
+    const GateThresholds& tracked = sensor.getCalibrator().getThresholds();
+
+    // Un passo del fondo sui 18 gate, a 10 frame/s, dopo una calibrazione lampo
+    GateCalibrator calibrator;
+    LD2410Frame frame = room[0];
+    calibrator.start(1000);
+    for (uint32_t i = 0; i < 400; ++i) {
+        calibrator.update(frame, false, hal::millis() + i * 3);
+    }
+    Result update = measure(1000000, [&](uint64_t i) {
+        frame.movingGateEnergy[i % LD2410Frame::GATES] = static_cast<uint8_t>(i & 31);
+        calibrator.update(frame, true, 0);
+    });
+    report("GateCalibrator::update (track)", update);
+
+    printf("%-34s %10.1f/h false movement before, %.1f/h after (presence %.1f/h -> %.1f/h)\n",
+           "gate calibration, empty room", before.movementOnsets / 2.0, after.movementOnsets / 2.0,
+           before.presenceOnsets / 2.0, after.presenceOnsets / 2.0);
+    printf("%-34s gate 2 moving %u -> %u, gate 6 stationary %u -> %u, person lit after %.1f s\n",
+           "gate calibration thresholds", ZoneOccupancy::DEFAULT_MOVING_THRESHOLDS[2], calibratedThresholds.moving[2],
+           ZoneOccupancy::DEFAULT_STATIONARY_THRESHOLDS[6], calibratedThresholds.stationary[6],
+           person.firstMovementFrame == UINT32_MAX ? -1.0 : (person.firstMovementFrame - 600) / 10.0);
+    printf("%-34s drifting source, %u h: tracking %u false wakes (last hour %.0f%% moving), frozen %u (%.0f%%), gate 5 %u -> %u\n",
+           "gate background tracking", TRACK_HOURS, tracking.movementOnsets, tracking.lastHourMoving / 360.0,
+           fixed.movementOnsets, fixed.lastHourMoving / 360.0, calibratedThresholds.moving[5], tracked.moving[5]);
+
+    hal::native::clearSettings();
+    return calibrated && restored && calibrator.isCalibrated() && after.movementOnsets * 10 <= before.movementOnsets &&
+           person.firstMovementFrame >= 600 && person.firstMovementFrame < 605 &&
+           tracking.movementOnsets * 10 <= fixed.movementOnsets && tracking.lastHourMoving < fixed.lastHourMoving &&
+           update.allocsPerCall == 0;
+}
+
+// Vecchio percorso: formattazione sincrona nel task chiamante e scrittura dell'uscita
+FILE* nullSink = nullptr;
+
+void syncLog(const char* fmt, ...) {
+    char buffer[128];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    fwrite(buffer, 1, n, nullSink);
+}
+
+// Costo per chiamata del log differito contro quello sincrono; il ring viene svuotato fuori
+// dalla misura ogni 32 record per misurare solo il lato produttore
+bool benchLogging() {
+    nullSink = fopen("/dev/null", "w");
+    const char* line = "State: %d -> %d\n";
+    Result sync = measure(2000000, [&](uint64_t i) {
+        syncLog(line, static_cast<int>(i & 3), static_cast<int>((i + 1) & 3));
+    });
+    report("log sync vsnprintf+write", sync);
+    // Al baud del sensore/Serial (256000, 10 bit per byte) la riga occupa la UART per:
+    printf("%-34s %10.1f us/line on the UART at 256000 baud\n", "  Serial.print (old path)", 15 * 10 / 0.256);
+
+    const uint32_t batches = 50000;
+    const uint32_t perBatch = 32;
+    double pushNs = 0;
+    logDrain();
+    uint32_t droppedBefore = logDroppedCount();
+    for (uint32_t b = 0; b < batches; ++b) {
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < perBatch; ++i) {
+            LOG_INFO("State: %d -> %d", static_cast<int>(i & 3), static_cast<int>((i + 1) & 3));
+        }
+        pushNs += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        logDrain();
+    }
+    printf("%-34s %10.1f ns/call\n", "LOG_INFO (deferred push)", pushNs / (batches * perBatch));
+
+    report("LOG_DEBUG (compiled out)", measure(10000000, [&](uint64_t i) {
+        LOG_DEBUG("State: %d -> %d", static_cast<int>(i & 3), static_cast<int>((i + 1) & 3));
+    }));
+
+    // Ring pieno: i record in eccesso vengono scartati e contati, mai bloccati
+    for (uint32_t i = 0; i < 100; ++i) {
+        LOG_WARN("flood %lu", static_cast<unsigned long>(i));
+    }
+    uint32_t dropped = logDroppedCount() - droppedBefore;
+    size_t drained = logDrain();
+    printf("%-34s %10u dropped of 100 (%zu drained)\n", "log flood", dropped, drained);
+    fclose(nullSink);
+    return dropped == 100 - drained && drained > 0;
+}
+
+// Vecchio percorso: map() lineare di SmartLamp/transitionTo* e calculateDuty, la cui
+// moltiplicazione e divisione si annullano
+volatile uint32_t legacyMaxDuty = 1023;
+
+uint32_t legacyDuty(uint8_t brightness) {
+    uint32_t maxDuty = legacyMaxDuty;
+    uint32_t mapped = static_cast<uint32_t>(brightness) * maxDuty / 100;
+    return mapped * maxDuty / maxDuty;
+}
+
+void benchBrightnessLut(LedController& led) {
+    report("brightness map()+calculateDuty", measure(10000000, [&](uint64_t i) {
+        sink = sink + legacyDuty(static_cast<uint8_t>(i & 63));
+    }));
+    report("BrightnessLut levelToFineDuty", measure(10000000, [&](uint64_t i) {
+        sink = sink + led.levelToFineDuty(static_cast<uint8_t>(i & 63));
+    }));
+}
+
+// Fade di 3 s da spento a SLEEP (1/8 del duty) con la luminosità al 40%, circa 14 LSB su 1023:
+// passi distinti visti all'uscita ogni 10 ms.
+// Senza dithering il LEDC esce solo su duty interi, con il dithering anche sui 4 bit frazionari.
+uint32_t fadeSteps(LedController& led, bool dithering, uint32_t& maxStep) {
+    led.setDithering(dithering);
+    led.setLevel(0);
+    led.startFadeToLevel(40, 3000, FadeCurve::LINEAR, LedController::SCALE_ONE / 8);
+    uint32_t steps = 0;
+    uint32_t previous = 0;
+    maxStep = 0;
+    for (int t = 0; t <= 310; ++t) {
+        uint32_t fine = hal::native::pwmGetDutyFine(LEDC_CHANNEL_0);
+        uint32_t out = dithering ? fine : (fine >> 4) << 4;
+        if (out != previous) {
+            ++steps;
+            maxStep = out - previous > maxStep ? out - previous : maxStep;
+            previous = out;
+        }
+        hal::native::advance(10000);
+    }
+    led.setDithering(false);
+    return steps;
+}
+
+bool benchDitheredFade(LedController& led) {
+    uint32_t plainMax, ditherMax;
+    uint32_t plain = fadeSteps(led, false, plainMax);
+    uint32_t dithered = fadeSteps(led, true, ditherMax);
+    printf("%-34s %10u steps (max %u/16 LSB), without dithering %u steps (max %u/16 LSB)\n",
+           "fade to SLEEP at 40%, dithered", dithered, ditherMax, plain, plainMax);
+    // Gli stati conservano la luce di prima della tabella: 1/8 e 1/2 del duty del livello
+    led.startFadeToLevel(100, 0, FadeCurve::LINEAR, LedController::SCALE_ONE / 8);
+    uint32_t sleepFine = hal::native::pwmGetDutyFine(LEDC_CHANNEL_0);
+    led.startFadeToLevel(60, 0, FadeCurve::LINEAR, LedController::SCALE_ONE / 2);
+    uint32_t relaxFine = hal::native::pwmGetDutyFine(LEDC_CHANNEL_0);
+    led.setLevel(0);
+    // Senza dithering l'uscita è arrotondata al duty intero
+    auto near = [](uint32_t fine, uint32_t expected) { return fine + 8 >= expected && fine <= expected + 8; };
+    bool kept = near(sleepFine, led.levelToFineDuty(100) / 8) && near(relaxFine, led.levelToFineDuty(60) / 2) &&
+                led.fineDutyToLevel(0) == 0 && led.fineDutyToLevel(1) == 1;
+    // Verso HomeKit: il livello più basso che arriva almeno al duty
+    uint8_t sleepLevel = led.fineDutyToLevel(led.levelToFineDuty(100) / 8);
+    kept = kept && led.levelToFineDuty(sleepLevel) >= led.levelToFineDuty(100) / 8 &&
+           led.levelToFineDuty(sleepLevel - 1) < led.levelToFineDuty(100) / 8;
+    printf("%-34s SLEEP at 100%%: duty %u/16 (level %u), RELAXATION at 60%%: %u/16\n", "state output in duty space",
+           sleepFine, sleepLevel, relaxFine);
+    return dithered > 4 * plain && ditherMax < 16 && kept;
+}
+
+// Luminosità letta da un altro task durante un fade con curva: tra due pubblicazioni lo stato va
+// interpolato lungo la stessa curva che esegue il fade hardware, non in linea retta
+bool benchBrightnessReadback(LedController& led) {
+    bool ok = true;
+    const FadeCurve curves[] = {FadeCurve::LINEAR, FadeCurve::EXPONENTIAL, FadeCurve::EASE_IN_OUT};
+    const char* names[] = {"linear", "exponential", "ease in-out"};
+    for (uint8_t c = 0; c < 3; ++c) {
+        led.setLevel(0);
+        led.startFadeToLevel(100, 1600, curves[c]);
+        uint32_t maxError = 0;
+        for (uint32_t ms = 0; ms < 1700; ms += 25) {
+            uint32_t read = led.getCurrentBrightness();
+            uint32_t out = hal::pwmGetDuty(LEDC_CHANNEL_0);
+            uint32_t error = read > out ? read - out : out - read;
+            maxError = error > maxError ? error : maxError;
+            hal::native::advance(25000);
+        }
+        printf("%-34s %-12s max error %u LSB\n", "brightness readback in fade", names[c], maxError);
+        // Il fade hardware arrotonda al duty intero a ogni segmento
+        ok = ok && maxError <= 2;
+    }
+    led.setLevel(0);
+    return ok;
+}
+
+// Slider dell'app Casa trascinato da 0 a 100 in 2 s con 50 scritture/s, uscita campionata ogni ms.
+// Glitch visibile: l'uscita torna indietro, o salta di più del 2% del fondo scala in un ms.
+struct DragResult {
+    uint32_t fades;
+    uint32_t glitches;
+    uint32_t settleMs;  // dall'ultima scrittura al duty finale
+};
+
+DragResult sliderDrag(LedController& led, bool coalesce) {
+    const uint32_t writes = 100;
+    const uint32_t writeEveryMs = 20;
+    const uint32_t jump = (1023u << 4) / 50;
+    led.setLevel(0);
+    uint32_t fadesBefore = led.getFadeCount();
+    uint32_t previous = hal::native::pwmGetDutyFine(LEDC_CHANNEL_0);
+    uint32_t finalDuty = led.levelToFineDuty(100);
+    DragResult result = {0, 0, 0};
+    for (uint32_t ms = 0; ms < writes * writeEveryMs + 1000; ++ms) {
+        if (ms % writeEveryMs == 0 && ms / writeEveryMs < writes) {
+            uint8_t level = static_cast<uint8_t>(ms / writeEveryMs + 1);
+            if (coalesce) {
+                led.requestLevel(level, 200);
+            } else {
+                led.startFadeToLevel(level, 200);
+            }
+        }
+        hal::native::advance(1000);
+        uint32_t duty = hal::native::pwmGetDutyFine(LEDC_CHANNEL_0);
+        if (duty < previous || duty - previous > jump) {
+            ++result.glitches;
+        }
+        previous = duty;
+        if (duty == finalDuty && result.settleMs == 0 && ms >= (writes - 1) * writeEveryMs) {
+            result.settleMs = ms - (writes - 1) * writeEveryMs;
+        }
+    }
+    result.fades = led.getFadeCount() - fadesBefore;
+    return result;
+}
+
+bool benchSliderDrag(LedController& led) {
+    led.setDithering(true);
+    DragResult perWrite = sliderDrag(led, false);
+    DragResult coalesced = sliderDrag(led, true);
+    led.setDithering(false);
+    printf("%-34s %10u fades, %u glitches, settle %u ms\n", "slider drag, fade per write", perWrite.fades,
+           perWrite.glitches, perWrite.settleMs);
+    printf("%-34s %10u fades, %u glitches, settle %u ms\n", "slider drag, coalesced", coalesced.fades,
+           coalesced.glitches, coalesced.settleMs);
+    return coalesced.glitches == 0 && coalesced.fades * 5 <= perWrite.fades && coalesced.settleMs > 0 &&
+           coalesced.settleMs <= 400;
+}
+
+// Invio e applicazione dal task proprietario a blocchi di 8 comandi, come quando il task LED
+// si sveglia con la coda già carica: coda MPSC, apply e pubblicazione dello stato
+bool benchCommandQueue(LedController& led) {
+    const uint64_t count = 2000000;
+    uint32_t appliedBefore = led.getState().commands;
+    uint32_t droppedBefore = led.getDroppedCommands();
+    led.setInlineProcessing(false);
+    report("LED command submit+apply", measure(count, [&](uint64_t i) {
+        led.setBrightness(static_cast<uint16_t>((i * 37) & 1023));
+        if ((i & 7) == 7) {
+            led.process(0);
+        }
+    }));
+    led.process(0);
+    led.setInlineProcessing(true);
+    uint32_t applied = led.getState().commands - appliedBefore;
+    uint32_t dropped = led.getDroppedCommands() - droppedBefore;
+    printf("%-34s %10u applied, %u dropped\n", "LED command queue", applied, dropped);
+    return applied >= count && dropped == 0;
+}
+
+// Costo di un frame di fade (duty di tutti i canali e aggiornamento in blocco) per 1, 2 e 4 canali.
+// Poi una CCT con mix 25/75 durante un fade: il rapporto tra i canali non deve mai scostarsi.
+bool benchMultiChannel() {
+    static const ledc_channel_t channels[] = {LEDC_CHANNEL_4, LEDC_CHANNEL_5, LEDC_CHANNEL_6, LEDC_CHANNEL_7};
+    static const uint8_t counts[] = {1, 2, 4};
+    static const char* names[] = {"fade frame, 1 channel", "fade frame, 2 channels", "fade frame, 4 channels"};
+    for (int i = 0; i < 3; ++i) {
+        FadeEngine engine(channels, counts[i]);
+        engine.begin();
+        engine.setDithering(true);
+        engine.start(static_cast<uint32_t>(1023 << 4), 3600000);
+        hal::native::advance(1800000000ULL);  // a metà: frame con tutti i canali in movimento
+        report(names[i], measure(5000000, [&](uint64_t) { engine.renderFrame(); }));
+        engine.cancel();
+    }
+
+    LedController* previous = LedController::instance;
+    static const uint8_t pins[] = {18, 19, 21, 22};
+    LedController cct(LedLayout::CCT, pins, LEDC_CHANNEL_2, LEDC_TIMER_0, 25000, LEDC_TIMER_10_BIT);
+    LedController rgbw(LedLayout::RGBW, pins, LEDC_CHANNEL_4, LEDC_TIMER_0, 25000, LEDC_TIMER_10_BIT);
+    cct.begin();
+    rgbw.begin();
+    cct.setDithering(true);
+    static const uint16_t quarter[] = {1024, 3072};
+    cct.setChannelMix(quarter);
+    cct.setLevel(0);
+    cct.startFadeToLevel(100, 2000, FadeCurve::EASE_IN_OUT);
+    uint32_t frames = 0;
+    uint32_t maxSkew = 0;
+    while (cct.isStillFading()) {
+        hal::native::advance(FadeEngine::FRAME_MS * 1000);
+        int64_t warm = hal::native::pwmGetDutyFine(LEDC_CHANNEL_2);
+        int64_t cool = hal::native::pwmGetDutyFine(LEDC_CHANNEL_3);
+        uint32_t skew = static_cast<uint32_t>(cool > 3 * warm ? cool - 3 * warm : 3 * warm - cool);
+        maxSkew = skew > maxSkew ? skew : maxSkew;
+        ++frames;
+    }
+    bool staggered = true;
+    for (uint8_t i = 0; i < 4; ++i) {
+        staggered = staggered && hal::native::pwmGetHpoint(static_cast<ledc_channel_t>(LEDC_CHANNEL_4 + i)) == 256u * i;
+    }
+    printf("%-34s %10u frames, max skew %u/16 LSB, hpoints %s\n", "CCT fade 25/75 in phase", frames, maxSkew,
+           staggered ? "staggered" : "NOT staggered");
+    LedController::instance = previous;
+    return frames > 100 && maxSkew <= 2 && staggered && cct.getChannelBrightness(1) == 767;
+}
+
+// Risposta di ip-api per Roma, servita dal posto del server HTTP
+int romeLookup(const char*, char* body, size_t capacity) {
+    snprintf(body, capacity, "{\"status\":\"success\",\"lat\":41.9028,\"lon\":12.4964,\"offset\":7200}");
+    return 200;
+}
+
+bool near(uint32_t actual, uint32_t expected, uint32_t toleranceS) {
+    return (actual > expected ? actual - expected : expected - actual) <= toleranceS;
+}
+
+// Conta e svuota gli eventi giorno/notte pubblicati dal servizio
+uint32_t drainNightEvents() {
+    uint32_t count = 0;
+    LampEvent event;
+    while (waitLampEvent(event, 0)) {
+        count += event.type == LampEventType::NIGHT_CHANGED;
+    }
+    return count;
+}
+
+// Orologio finto e HTTP sostituito: effemeridi, fuso salvato, riavvio senza rete, costo di isNightTime
+bool benchTimeService() {
+    bool ok = true;
+    int64_t june21 = static_cast<int64_t>(daysFromCivil(2024, 6, 21)) * 86400;
+    int64_t dec21 = static_cast<int64_t>(daysFromCivil(2024, 12, 21)) * 86400;
+
+    // Valori di riferimento (UTC) da tabelle astronomiche, tolleranza 3 minuti
+    SunTimes rome = sunTimes(static_cast<int32_t>(june21 / 86400), 41.9028f, 12.4964f);
+    SunTimes oslo = sunTimes(static_cast<int32_t>(dec21 / 86400), 59.9139f, 10.7522f);
+    SunTimes tromso = sunTimes(static_cast<int32_t>(dec21 / 86400), 69.6492f, 18.9553f);
+    ok = ok && rome.valid && near(rome.sunriseMin, 3 * 60 + 35, 3) && near(rome.sunsetMin, 18 * 60 + 48, 3);
+    ok = ok && oslo.valid && near(oslo.sunriseMin, 8 * 60 + 18, 3) && near(oslo.sunsetMin, 14 * 60 + 12, 3);
+    ok = ok && !tromso.valid;  // notte polare: si usano gli orari fissi
+
+    TimeService& time = TimeService::getInstance();
+    hal::native::clearSettings();
+    hal::native::setHttpHandler(nullptr);
+    hal::native::setEpoch(static_cast<uint32_t>(june21 + 10 * 3600));  // 12:00 a Roma
+    drainNightEvents();
+
+    // Primo avvio senza rete: orari fissi 17-8 sull'offset predefinito (+1 h)
+    time.begin();
+    time.onNetworkUp();
+    time.poll();
+    bool offlineOk = time.isValid() && !time.isNightTime() &&
+                     time.getNextChange() == static_cast<uint32_t>(june21 + 16 * 3600) && drainNightEvents() == 1;
+
+    // La rete torna: lookup del fuso, tramonto di Roma, impostazioni salvate
+    hal::native::setHttpHandler(romeLookup);
+    hal::native::advance(static_cast<uint64_t>(TimeService::LOOKUP_RETRY_MS) * 1000);
+    uint32_t wait = time.poll();
+    bool onlineOk = time.getSettings().hasLocation && time.getSettings().utcOffsetSec == 7200 &&
+                    near(time.getNextChange(), static_cast<uint32_t>(june21 + 18 * 3600 + 48 * 60), 180);
+    hal::native::advance(static_cast<uint64_t>(wait) * 1000);
+    while (hal::epochNow() < time.getNextChange()) {
+        hal::native::advance(static_cast<uint64_t>(time.poll()) * 1000);
+    }
+    time.poll();
+    onlineOk = onlineOk && time.isNightTime() && drainNightEvents() == 1;
+
+    // Riavvio senza rete con l'RTC ancora valido: stesse impostazioni lette da NVS
+    hal::native::setHttpHandler(nullptr);
+    uint32_t lookups = time.getLookups();
+    time.begin();
+    time.poll();
+    bool rebootOk = time.isNightTime() && time.getSettings().hasLocation && time.getLookups() == lookups;
+
+    Result r = measure(10000000, [&](uint64_t) {
+        sink = sink + time.isNightTime();
+    });
+    report("TimeService::isNightTime", r);
+    printf("%-34s sun %s, offline %s, online %s, reboot %s (%u lookups)\n", "time service scenario",
+           ok ? "ok" : "FAIL", offlineOk ? "ok" : "FAIL", onlineOk ? "ok" : "FAIL", rebootOk ? "ok" : "FAIL",
+           time.getLookups());
+    return ok && offlineOk && onlineOk && rebootOk;
+}
+
+// Scrittura della trace con pompa delle pagine a ogni chiusura, poi rilettura completa:
+// i record riletti devono essere identici a quelli scritti
+bool benchTraceRecorder() {
+    TraceRecorder& trace = TraceRecorder::getInstance();
+    trace.begin();
+    const uint32_t count = 15000;  // ~100 KB: resta nella partizione senza giri del ring
+    uint64_t startUs = hal::micros();
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < count; ++i) {
+        hal::native::advance(((i * 7919) % 3000 + 1) * 1000);
+        trace.recordSensor((i & 1) != 0, (i & 2) != 0, static_cast<uint16_t>(i % 600), static_cast<uint16_t>(i % 450));
+        while (trace.pump(0)) {
+        }
+    }
+    trace.flush();
+    while (trace.pump(0)) {
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    const TraceStats& stats = trace.getStats();
+    printf("%-34s %10.1f ns/rec %9.2f bytes/rec (%u pages, %u sectors erased, %u dropped)\n",
+           "TraceRecorder::recordSensor", ns / count,
+           static_cast<double>(stats.pagesWritten) * TraceRecorder::PAGE_SIZE / count, stats.pagesWritten,
+           stats.sectorsErased, stats.dropped);
+
+    TraceReader reader(trace.getPartition());
+    TraceRecord record;
+    uint32_t read = 0;
+    bool ok = stats.dropped == 0;
+    uint32_t expectedMs = static_cast<uint32_t>(startUs / 1000);
+    while (reader.next(record)) {
+        uint32_t i = read++;
+        expectedMs += (i * 7919) % 3000 + 1;
+        if (record.type != TraceType::SENSOR || record.timeMs != expectedMs || record.sensor.movement != ((i & 1) != 0) ||
+            record.sensor.presence != ((i & 2) != 0) || record.sensor.movingDistance != i % 600 ||
+            record.sensor.stationaryDistance != i % 450) {
+            ok = false;
+        }
+    }
+    if (read != count || !ok) {
+        printf("  trace roundtrip failed: %u/%u records\n", read, count);
+        return false;
+    }
+
+    // Le transizioni del bridge passano dalla stessa azione di ingresso: nella trace con la lampada
+    LedController first(18, LEDC_CHANNEL_0, LEDC_TIMER_1, 25000, LEDC_TIMER_10_BIT);
+    LedController second(19, LEDC_CHANNEL_1, LEDC_TIMER_1, 25000, LEDC_TIMER_10_BIT);
+    first.begin();
+    second.begin();
+    LampBank bank;
+    bank.addLamp(first, 0);
+    bank.addLamp(second, 1);
+    bank.applyEvent(LampEvent::autoModeChanged(true, 0));
+    bank.applyEvent(LampEvent::autoModeChanged(true, 1));
+    hal::native::advance(1000);
+    uint32_t bankStartMs = hal::millis();
+    bank.applyEvent(LampEvent::sensorFrame(true, true, 150, 120, 0, false, 1));
+    bank.evaluate();
+    bank.applyEvent(LampEvent::sensorFrame(true, true, 150, 120, 0, false, 0));
+    bank.applyEvent(LampEvent::autoModeChanged(false, 1));
+    bank.evaluate();
+    trace.flush();
+    while (trace.pump(0)) {
+    }
+    struct Expected {
+        uint8_t lamp;
+        LampState from;
+        LampState to;
+    };
+    const Expected expected[] = {
+        {1, LampState::OFF, LampState::FULL_ON},
+        {0, LampState::OFF, LampState::FULL_ON},
+        {1, LampState::FULL_ON, LampState::OFF},
+    };
+    const size_t expectedCount = sizeof(expected) / sizeof(expected[0]);
+    size_t states = 0;
+    bool bankOk = true;
+    TraceReader bankReader(trace.getPartition());
+    while (bankReader.next(record)) {
+        if (record.type != TraceType::STATE || record.timeMs < bankStartMs) {
+            continue;
+        }
+        bankOk = bankOk && states < expectedCount && record.state.lamp == expected[states].lamp &&
+                 record.state.from == expected[states].from && record.state.to == expected[states].to;
+        ++states;
+    }
+    bankOk = bankOk && states == expectedCount;
+    printf("%-34s %s (%u per-lamp transitions)\n", "lamp bank transitions in trace", bankOk ? "ok" : "FAIL",
+           static_cast<unsigned>(states));
+    return bankOk;
+}
+
+// Profilo serale dalle 22:00 più tenue e con timeout più brevi, oltre a quello di default dalle 8:00
+LightingProfileSet eveningProfiles() {
+    LightingProfileSet set = LightingProfileSet::defaults();
+    set.count = 2;
+    set.profiles[0].startMin = 8 * 60;
+    set.profiles[1] = set.profiles[0];
+    set.profiles[1].startMin = 22 * 60;
+    set.profiles[1].states[static_cast<size_t>(LampState::FULL_ON)] = {1, 2, 1500, 2 * 60 * 1000};
+    set.profiles[1].states[static_cast<size_t>(LampState::SLEEP)] = {1, 16, 4000, LampStateTable::NO_TIMEOUT};
+    set.nightStartMin = 19 * 60;
+    set.nightEndMin = 7 * 60;
+    set.checksum = LightingProfiles::checksum(set);
+    return set;
+}
+
+// Lettura dal percorso caldo contro la tabella constexpr, costo dello swap, scelta del profilo per
+// ora, scarto dei set non validi, persistenza in NVS e finestra notturna passata a TimeService
+bool benchLightingProfiles() {
+    LightingProfiles& profiles = LightingProfiles::getInstance();
+    LightingProfileSet defaults = LightingProfileSet::defaults();
+    LightingProfileSet evening = eveningProfiles();
+
+    report("LampStateTable::config (constexpr)", measure(20000000, [&](uint64_t i) {
+        sink = sink + LampStateTable::config(static_cast<LampState>(i % LampStateTable::STATE_COUNT)).duration;
+    }));
+    report("LightingProfiles::params", measure(20000000, [&](uint64_t i) {
+        sink = sink + profiles.params(static_cast<LampState>(i % LampStateTable::STATE_COUNT), (i * 7) % 1440).durationMs;
+    }));
+    Result swap = measure(200000, [&](uint64_t i) {
+        profiles.apply((i & 1) ? evening : defaults);
+    });
+    report("profile validate+compile+swap", swap);
+
+    bool ok = profiles.apply(evening) == nullptr;
+    const size_t fullOn = static_cast<size_t>(LampState::FULL_ON);
+    StateParams day = profiles.params(LampState::FULL_ON, 9 * 60);
+    StateParams late = profiles.params(LampState::FULL_ON, 23 * 60);
+    StateParams dawn = profiles.params(LampState::FULL_ON, 7 * 60 + 59);  // prima delle 8 vale ancora la sera
+    ok = ok && day.levelQ8 == 256 && day.durationMs == defaults.profiles[0].states[fullOn].durationMs;
+    ok = ok && late.levelQ8 == 128 && late.durationMs == 2 * 60 * 1000 && dawn.levelQ8 == 128;
+
+    // Set non validi: la tabella attiva non cambia
+    uint32_t generation = profiles.getGeneration();
+    LightingProfileSet corrupted = evening;
+    corrupted.profiles[1].states[fullOn].fadeMs = 1;  // checksum non più valido
+    LightingProfileSet unsorted = evening;
+    unsorted.profiles[1].startMin = 6 * 60;
+    unsorted.checksum = LightingProfiles::checksum(unsorted);
+    LightingProfileSet badFraction = evening;
+    badFraction.profiles[0].states[fullOn].brightnessDen = 0;
+    badFraction.checksum = LightingProfiles::checksum(badFraction);
+    bool rejected = profiles.apply(corrupted) != nullptr && profiles.apply(unsorted) != nullptr &&
+                    profiles.apply(badFraction) != nullptr && profiles.getGeneration() == generation;
+
+    // update salva in NVS: al riavvio begin lo ritrova; la finestra notturna arriva al servizio dell'ora
+    profiles.apply(defaults);
+    bool persisted = profiles.update(evening) == nullptr;
+    profiles.apply(defaults);
+    profiles.begin();
+    persisted = persisted && profiles.params(LampState::SLEEP, 23 * 60).levelQ8 == 16;
+    TimeService::getInstance().poll();
+    bool window = TimeService::getInstance().getSettings().nightStartMin == 19 * 60 &&
+                  TimeService::getInstance().getSettings().nightEndMin == 7 * 60;
+
+    printf("%-34s profiles %s, invalid %s, nvs %s, night window %s\n", "lighting profiles scenario",
+           ok ? "ok" : "FAIL", rejected ? "rejected" : "FAIL", persisted ? "ok" : "FAIL", window ? "ok" : "FAIL");
+    // Il resto del banco gira con i default, come la tabella constexpr
+    profiles.update(defaults);
+    TimeService::getInstance().poll();
+    return ok && rejected && persisted && window;
+}
+
+uint32_t jitter(uint32_t seed, uint32_t range) {
+    return ((seed * 2654435761u) >> 16) % range;
+}
+
+struct Visit {
+    uint32_t arriveMin;  // minuti locali dalla mezzanotte
+    uint32_t leaveMin;
+    bool regular;
+};
+
+// Occupante sintetico: nei feriali arriva tra le 19:30 e le 19:42 ed esce dopo le 22:30, nel fine
+// settimana dalle 10:00 a mezzogiorno; un giorno su tre anche una visita breve di notte a orari sparsi
+uint8_t visitsFor(uint32_t day, Visit* visits) {
+    uint8_t count = 0;
+    if (jitter(day + 2000, 3) == 0) {
+        uint32_t arrive = 60 + jitter(day + 3000, 240);
+        visits[count++] = {arrive, arrive + 3, false};
+    }
+    if (day % 7 < 5) {
+        visits[count++] = {19 * 60 + 30 + jitter(day, 12), 22 * 60 + 30 + jitter(day + 1000, 20), true};
+    } else {
+        visits[count++] = {10 * 60 + jitter(day, 12), 12 * 60, true};
+    }
+    return count;
+}
+
+// Settimane di occupante sintetico sulla macchina a stati vera, con l'orologio virtuale: dalla
+// seconda/terza settimana gli arrivi abituali trovano la luce già accesa, le visite sparse no.
+// Poi timeout adattivi e persistenza in NVS
+bool benchOccupancyLearner(LampStateMachine& lamp, LedController& led) {
+    const uint32_t WEEKS = 8;
+    OccupancyLearner& learner = OccupancyLearner::getInstance();
+    report("OccupancyLearner::observe", measure(10000000, [&](uint64_t i) {
+        learner.observe(static_cast<int32_t>((i / 4) % TimeService::MINUTES_PER_WEEK), ((i / 97) & 1) != 0, (i % 97) == 0);
+    }));
+    report("OccupancyLearner::shouldPrewarm", measure(10000000, [&](uint64_t i) {
+        sink = sink + learner.shouldPrewarm(static_cast<int32_t>(i % TimeService::MINUTES_PER_WEEK));
+    }));
+    learner.reset();
+
+    TimeService& time = TimeService::getInstance();
+    if (time.localWeekMinute() < 0) {
+        printf("%-34s FAIL: ora locale non valida\n", "occupancy learner scenario");
+        return false;
+    }
+    // Parte dal prossimo lunedì alle 00:00 locali
+    uint64_t toMonday = static_cast<uint64_t>(TimeService::MINUTES_PER_WEEK - time.localWeekMinute()) * 60 -
+                        hal::epochNow() % 60;
+    hal::native::advance(toMonday * 1000000);
+    uint64_t mondayUs = hal::micros();
+
+    lamp.setLearner(&learner);
+    LampControlTask control(lamp, nullptr);
+    uint64_t prewarmUs = 0;
+    auto run = [&](uint64_t untilUs) {
+        for (;;) {
+            uint64_t wakeUs = hal::micros() + static_cast<uint64_t>(control.nextTimeoutMs()) * 1000;
+            if (wakeUs > untilUs) {
+                wakeUs = untilUs;
+            }
+            if (lamp.isPrewarmed()) {
+                prewarmUs += wakeUs - hal::micros();
+            }
+            hal::native::advance(wakeUs - hal::micros());
+            if (wakeUs == untilUs) {
+                break;
+            }
+            control.runOnce();
+        }
+    };
+    auto sensor = [&](bool movement, bool presence) {
+        postLampEvent(LampEvent::sensorFrame(movement, presence, 150, 120));
+        control.runOnce();
+    };
+
+    uint32_t lit[WEEKS] = {};
+    uint32_t regular[WEEKS] = {};
+    uint32_t strayLit = 0;
+    uint32_t strays = 0;
+    uint32_t writes = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t day = 0; day < WEEKS * 7; ++day) {
+        uint64_t dayUs = mondayUs + static_cast<uint64_t>(day) * 86400 * 1000000;
+        Visit visits[2];
+        uint8_t count = visitsFor(day, visits);
+        for (uint8_t v = 0; v < count; ++v) {
+            run(dayUs + static_cast<uint64_t>(visits[v].arriveMin) * 60 * 1000000);
+            bool alreadyLit = led.getCurrentBrightness() > 0;
+            if (visits[v].regular) {
+                regular[day / 7] += 1;
+                lit[day / 7] += alreadyLit;
+            } else {
+                strays += 1;
+                strayLit += alreadyLit;
+            }
+            sensor(true, true);
+            run(hal::micros() + 60 * 1000000);
+            sensor(false, true);
+            run(dayUs + static_cast<uint64_t>(visits[v].leaveMin) * 60 * 1000000);
+            sensor(false, false);
+            writes += learner.persistIfDue();
+        }
+    }
+    run(mondayUs + static_cast<uint64_t>(WEEKS) * 7 * 86400 * 1000000);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    // RELAXATION da 15 minuti: lunedì alle 20:00 la stanza è occupata, alle 03:00 è vuota
+    const uint32_t relaxationMs = LampStateTable::config(LampState::RELAXATION).duration;
+    uint32_t evening = learner.scaleTimeout(relaxationMs, 20 * 60);
+    uint32_t night = learner.scaleTimeout(relaxationMs, 3 * 60);
+    bool timeouts = evening > relaxationMs && night < relaxationMs;
+
+    uint8_t arrival = learner.getArrival(OccupancyLearner::slotOf(19 * 60 + 30));
+    learner.persist();
+    learner.reset();
+    learner.begin();
+    bool persisted = learner.getArrival(OccupancyLearner::slotOf(19 * 60 + 30)) == arrival && arrival > 0;
+
+    // Uscita anticipata: ogni sera si entra alle 21:07 e si esce alle 21:13, con la lampada appena
+    // passata in RELAXATION. La luce accesa dopo l'uscita la decide il timeout, che scade nel
+    // quarto d'ora delle 21:15: se il learner imparasse la lampada accesa invece della stanza
+    // occupata, il timeout crescerebbe ogni settimana fino al doppio
+    learner.reset();
+    uint64_t scenarioPrewarmUs = prewarmUs;
+    const uint32_t EARLY_WEEKS = 6;
+    uint64_t earlyUs = mondayUs + static_cast<uint64_t>(WEEKS) * 7 * 86400 * 1000000;
+    uint32_t litAfterLeave[EARLY_WEEKS] = {};
+    for (uint32_t day = 0; day < EARLY_WEEKS * 7; ++day) {
+        uint64_t dayUs = earlyUs + static_cast<uint64_t>(day) * 86400 * 1000000;
+        run(dayUs + (21 * 60 + 7) * 60ULL * 1000000);
+        sensor(true, true);
+        run(hal::micros() + 60 * 1000000);
+        sensor(false, true);
+        run(dayUs + (21 * 60 + 13) * 60ULL * 1000000);
+        sensor(false, false);
+        uint32_t minutes = 0;
+        while (lamp.getCurrentState() != LampState::OFF && minutes < 60) {
+            run(hal::micros() + 60 * 1000000);
+            ++minutes;
+        }
+        litAfterLeave[day / 7] = minutes > litAfterLeave[day / 7] ? minutes : litAfterLeave[day / 7];
+    }
+    run(earlyUs + static_cast<uint64_t>(EARLY_WEEKS) * 7 * 86400 * 1000000);
+    uint32_t earlyRelaxation = learner.scaleTimeout(relaxationMs, 21 * 60 + 12);
+    bool noGrowth = earlyRelaxation <= relaxationMs && litAfterLeave[EARLY_WEEKS - 1] <= litAfterLeave[0] &&
+                    litAfterLeave[0] > 0;
+
+    uint32_t lateLit = 0;
+    uint32_t lateRegular = 0;
+    for (uint32_t w = WEEKS / 2; w < WEEKS; ++w) {
+        lateLit += lit[w];
+        lateRegular += regular[w];
+    }
+    double prewarmMinPerDay = scenarioPrewarmUs / 60e6 / (WEEKS * 7);
+    printf("%-34s %10.1f ms host for %u weeks, lit arrivals week 1 %u/%u, weeks %u-%u %u/%u, strays %u/%u\n",
+           "occupancy learner, virtual clock", ms, WEEKS, lit[0], regular[0], WEEKS / 2 + 1, WEEKS, lateLit,
+           lateRegular, strayLit, strays);
+    printf("%-34s prewarm %.1f min/day, relaxation 20:00 %u s 03:00 %u s, %u nvs writes, persist %s\n",
+           "occupancy learner outcome", prewarmMinPerDay, evening / 1000, night / 1000, writes,
+           persisted ? "ok" : "FAIL");
+    printf("%-34s lit after leaving week 1 %u min, week %u %u min, relaxation 21:12 %u s\n",
+           "occupancy learner, early leave", litAfterLeave[0], EARLY_WEEKS, litAfterLeave[EARLY_WEEKS - 1],
+           earlyRelaxation / 1000);
+
+    lamp.setLearner(nullptr);
+    learner.reset();
+    return lit[0] == 0 && lateLit * 10 >= lateRegular * 9 && strayLit * 4 <= strays && prewarmMinPerDay < 30 &&
+           timeouts && persisted && writes > 0 && noGrowth;
+}
+
+bool isNightNow() {
+    return TimeService::getInstance().isNightTime();
+}
+
+// Due giorni sull'orologio virtuale con il task del servizio dell'ora vero: di notte una visita
+// alle 23:00 sveglia la lampada dal pin OUT, di giorno una visita a mezzogiorno non la sveglia.
+// Misura quanto si resta parcheggiati, i risvegli nel frattempo e che il LED sia sempre spento.
+// Alla fine due cambi da HomeKit a pochi secondi: il secondo deve arrivare in NVS senza altri eventi
+bool benchPowerManager(LampStateMachine& lamp, LedController& led, MotionSensor& motion) {
+    const uint32_t DAYS = 2;
+    const uint64_t FRAME_US = 100000;  // il primo frame del radar dopo la ripresa della UART
+    TimeService& time = TimeService::getInstance();
+    PowerManager& power = PowerManager::getInstance();
+    ResumeState& resume = ResumeState::getInstance();
+    power.begin(led, motion, 4);
+    LampControlTask control(lamp, isNightNow);
+    control.setPowerManager(&power);
+    control.setResumeState(&resume);
+
+    uint64_t nextPollUs = hal::micros();
+    bool lastNight = isNightNow();
+    uint32_t litWhileParked = 0;
+    uint32_t heldWhileParked = 0;
+    auto step = [&]() {
+        control.runOnce();
+        resume.update(lamp.getCurrentState(), lamp.getMaxBrightness(), lamp.isAutoMode());
+        resume.persistIfDue();
+        if (power.isParked()) {
+            LedState state = led.getState();
+            litWhileParked += state.targetBrightness != 0 || state.fading;
+            heldWhileParked += hal::native::powerLocksHeld() != 0;
+        }
+    };
+    // Come i due task: il controllo al suo timeout o a un evento, il servizio dell'ora al suo passo
+    auto run = [&](uint64_t untilUs) {
+        for (;;) {
+            uint32_t timeoutMs = control.nextTimeoutMs();
+            uint64_t controlUs = timeoutMs == UINT32_MAX ? UINT64_MAX : hal::micros() + timeoutMs * 1000ULL;
+            uint64_t wakeUs = controlUs < nextPollUs ? controlUs : nextPollUs;
+            wakeUs = wakeUs < untilUs ? wakeUs : untilUs;
+            hal::native::advance(wakeUs - hal::micros());
+            bool event = false;
+            if (wakeUs == nextPollUs) {
+                nextPollUs = hal::micros() + time.poll() * 1000ULL;
+                event = isNightNow() != lastNight;  // il servizio ha mandato NIGHT_CHANGED
+                lastNight = isNightNow();
+            }
+            if (event || wakeUs == controlUs) {
+                step();
+            }
+            if (wakeUs == untilUs) {
+                break;
+            }
+        }
+    };
+    auto sensor = [&](bool movement, bool presence) {
+        motion.injectReading(presence, movement, 150, 120);
+        postLampEvent(LampEvent::sensorFrame(movement, presence, 150, 120));
+        step();
+    };
+
+    run(hal::micros() + 1000);
+    sensor(false, false);
+    power.resetStats();
+    uint32_t wakeupsBefore = control.getStats().wakeups;
+    uint64_t startUs = hal::micros();
+    uint32_t nightVisits = 0;
+    uint32_t litVisits = 0;
+    for (uint32_t day = 0; day < DAYS; ++day) {
+        uint64_t dayUs = startUs + day * 86400000000ULL;
+        // Mezzogiorno: il pin va alto ma di giorno non è armato, la UART resta sospesa
+        run(dayUs + 12 * 3600000000ULL);
+        hal::native::setWakePin(true);
+        run(dayUs + 12 * 3600000000ULL + 20 * 60000000ULL);
+        hal::native::setWakePin(false);
+
+        run(dayUs + 23 * 3600000000ULL);
+        ++nightVisits;
+        hal::native::setWakePin(true);
+        if (!hal::native::isWakePinArmed()) {
+            step();  // SENSOR_WAKE dall'interrupt
+        }
+        run(hal::micros() + FRAME_US);
+        sensor(true, true);
+        litVisits += lamp.getCurrentState() == LampState::FULL_ON && !power.isParked();
+        run(hal::micros() + 60000000ULL);
+        sensor(false, true);
+        run(dayUs + 23 * 3600000000ULL + 30 * 60000000ULL);
+        hal::native::setWakePin(false);
+        sensor(false, false);
+    }
+    run(startUs + DAYS * 86400000000ULL);
+
+    // Salvataggio in sospeso a task parcheggiato
+    uint8_t brightness = lamp.getMaxBrightness();
+    bool parkedBefore = power.isParked();
+    postLampEvent(LampEvent::brightnessChanged(70));
+    step();
+    run(hal::micros() + 10000000ULL);
+    postLampEvent(LampEvent::brightnessChanged(40));
+    step();
+    run(hal::micros() + ResumeState::PERSIST_INTERVAL_MS * 1000ULL);
+    ResumeRecord stored = {};
+    bool saved = hal::settingsRead("resume", &stored, sizeof(stored)) && stored.brightness == 40;
+    postLampEvent(LampEvent::brightnessChanged(brightness));
+    step();
+
+    PowerStats stats = power.getStats();
+    double hours = DAYS * 24.0;
+    double parkedHours = stats.parkedMs / 3600000.0;
+    uint32_t wakeups = control.getStats().wakeups - wakeupsBefore;
+    printf("%-34s %10.1f h parked of %.0f, %u parks, %u pin wakes, %.2f wakeups/h parked (polling: %u/h)\n",
+           "power manager, 2 virtual days", parkedHours, hours, stats.parks, stats.pinWakes,
+           parkedHours > 0 ? stats.parkedWakeups / parkedHours : 0.0, 3600000 / LampControlTask::ACTIVE_RECHECK_MS);
+    printf("%-34s %u/%u visits lit, %u control wakeups, lit while parked %u, locks held while parked %u\n",
+           "power manager outcome", litVisits, nightVisits, wakeups, litWhileParked, heldWhileParked);
+    printf("%-34s %s (brightness in NVS %u, parked %d)\n", "pending resume save while parked", saved ? "ok" : "FAIL",
+           stored.brightness, parkedBefore);
+
+    motion.setSuspended(false);
+    hal::native::setWakePin(false);
+    return parkedHours > hours * 0.9 && stats.pinWakes == nightVisits && litVisits == nightVisits &&
+           stats.parkedWakeups <= parkedHours && litWhileParked == 0 && heldWhileParked == 0 && parkedBefore && saved;
+}
+
+// Learner e power manager insieme, come sulla lampada singola: ogni sera alle 23:00 si entra per
+// mezz'ora, il resto della notte il controllo è parcheggiato. Dalla terza settimana (contatore oltre
+// la soglia) l'arrivo deve trovare la luce preaccesa; poi quattro settimane senza visite: i quarti
+// d'ora vuoti, visti solo dai risvegli da parcheggiati, devono far scendere i contatori fino a non
+// preaccendere più. Il parcheggio deve restare quasi tutto il tempo
+bool benchPrewarmWhileParked(LampStateMachine& lamp, LedController& led, MotionSensor& motion) {
+    const uint32_t VISIT_WEEKS = 4;
+    const uint32_t EMPTY_WEEKS = 4;
+    const uint64_t FRAME_US = 100000;
+    TimeService& time = TimeService::getInstance();
+    PowerManager& power = PowerManager::getInstance();
+    OccupancyLearner& learner = OccupancyLearner::getInstance();
+    learner.reset();
+    lamp.setLearner(&learner);
+    LampControlTask control(lamp, isNightNow);
+    control.setPowerManager(&power);
+
+    uint64_t nextPollUs = hal::micros();
+    bool lastNight = isNightNow();
+    uint64_t prewarmUs = 0;
+    auto run = [&](uint64_t untilUs) {
+        for (;;) {
+            uint32_t timeoutMs = control.nextTimeoutMs();
+            uint64_t controlUs = timeoutMs == UINT32_MAX ? UINT64_MAX : hal::micros() + timeoutMs * 1000ULL;
+            uint64_t wakeUs = controlUs < nextPollUs ? controlUs : nextPollUs;
+            wakeUs = wakeUs < untilUs ? wakeUs : untilUs;
+            if (lamp.isPrewarmed()) {
+                prewarmUs += wakeUs - hal::micros();
+            }
+            hal::native::advance(wakeUs - hal::micros());
+            bool event = false;
+            if (wakeUs == nextPollUs) {
+                nextPollUs = hal::micros() + time.poll() * 1000ULL;
+                event = isNightNow() != lastNight;
+                lastNight = isNightNow();
+            }
+            if (event || wakeUs == controlUs) {
+                control.runOnce();
+            }
+            if (wakeUs == untilUs) {
+                break;
+            }
+        }
+    };
+    auto sensor = [&](bool movement, bool presence) {
+        motion.injectReading(presence, movement, 150, 120);
+        postLampEvent(LampEvent::sensorFrame(movement, presence, 150, 120));
+        control.runOnce();
+    };
+
+    run(hal::micros() + 1000);
+    sensor(false, false);
+    // Parte da mezzogiorno di un giorno qualsiasi: le visite sono tutti i giorni alla stessa ora
+    uint64_t startUs = hal::micros() + (static_cast<uint64_t>((36 * 60 - time.localMinute()) % (24 * 60)) * 60 -
+                                        hal::epochNow() % 60) * 1000000;
+    run(startUs);
+    power.resetStats();
+    uint32_t wakeupsBefore = control.getStats().wakeups;
+    uint32_t lit[VISIT_WEEKS] = {};
+    uint32_t visits[VISIT_WEEKS] = {};
+    uint32_t lastWeekPrewarms = 0;
+    // Duty a fine fade di preaccensione: la frazione va applicata al duty di FULL_ON, come per gli stati
+    uint32_t prewarmFine = 0;
+    for (uint32_t day = 0; day < (VISIT_WEEKS + EMPTY_WEEKS) * 7; ++day) {
+        uint64_t eveningUs = startUs + day * 86400000000ULL + 11 * 3600000000ULL;  // le 23:00
+        if (day >= (VISIT_WEEKS + EMPTY_WEEKS - 1) * 7) {
+            run(eveningUs - 5 * 60000000ULL);
+            lastWeekPrewarms += lamp.isPrewarmed();
+        }
+        run(eveningUs);
+        if (day >= VISIT_WEEKS * 7) {
+            continue;
+        }
+        visits[day / 7] += 1;
+        lit[day / 7] += led.getCurrentBrightness() > 0;
+        if (lamp.isPrewarmed() && prewarmFine == 0) {
+            prewarmFine = hal::native::pwmGetDutyFine(LEDC_CHANNEL_0);
+        }
+        hal::native::setWakePin(true);
+        if (!hal::native::isWakePinArmed()) {
+            control.runOnce();
+        }
+        run(hal::micros() + FRAME_US);
+        sensor(true, true);
+        run(hal::micros() + 60000000ULL);
+        sensor(false, true);
+        run(eveningUs + 30 * 60000000ULL);
+        hal::native::setWakePin(false);
+        sensor(false, false);
+    }
+    run(startUs + (VISIT_WEEKS + EMPTY_WEEKS) * 7 * 86400000000ULL);
+
+    PowerStats stats = power.getStats();
+    double hours = (VISIT_WEEKS + EMPTY_WEEKS) * 7 * 24.0;
+    double parkedHours = stats.parkedMs / 3600000.0;
+    int32_t visitMinute = (time.localWeekMinute() / (24 * 60)) * 24 * 60 + 23 * 60;
+    uint8_t arrival = learner.getArrival(OccupancyLearner::slotOf(visitMinute));
+    uint32_t fullOnQ8 = LightingProfiles::getInstance().params(LampState::FULL_ON, 23 * 60).levelQ8;
+    uint32_t expectedFine = (led.levelToFineDuty(lamp.getMaxBrightness()) *
+                             ((fullOnQ8 * OccupancyLearner::PREWARM_LEVEL_Q8) >> 8)) >> 8;
+    bool prewarmDutyOk = prewarmFine + 8 >= expectedFine && prewarmFine <= expectedFine + 8;
+    uint32_t lateLit = 0;
+    uint32_t lateVisits = 0;
+    for (uint32_t w = 2; w < VISIT_WEEKS; ++w) {
+        lateLit += lit[w];
+        lateVisits += visits[w];
+    }
+    printf("%-34s %.1f h parked of %.0f, %.1f wakeups/h parked, arrivals lit week 1 %u/%u, weeks 3-%u %u/%u\n",
+           "prewarm while parked", parkedHours, hours, parkedHours > 0 ? stats.parkedWakeups / parkedHours : 0.0,
+           lit[0], visits[0], VISIT_WEEKS, lateLit, lateVisits);
+    printf("%-34s fine duty %u, expected %u\n", "prewarm while parked level", prewarmFine, expectedFine);
+    printf("%-34s %.1f prewarm min/day, arrival counter %u after %u empty weeks, %u prewarms in the last one, %u wakeups\n",
+           "prewarm while parked outcome", prewarmUs / 60e6 / ((VISIT_WEEKS + EMPTY_WEEKS) * 7), arrival, EMPTY_WEEKS,
+           lastWeekPrewarms, control.getStats().wakeups - wakeupsBefore);
+
+    lamp.setLearner(nullptr);
+    learner.reset();
+    motion.setSuspended(false);
+    hal::native::setWakePin(false);
+    return lit[0] == 0 && lateVisits > 0 && lateLit == lateVisits && prewarmDutyOk &&
+           arrival < OccupancyLearner::ARRIVAL_THRESHOLD_Q8 &&
+           lastWeekPrewarms == 0 && parkedHours > hours * 0.9 && stats.parkedWakeups <= 8 * parkedHours;
+}
+
+// Bridge con più lampade: costo di un passo del LampBank al crescere delle lampade, più un
+// controllo che radar condivisi e dedicati, zone e comandi HomeKit restino per lampada
+bool benchLampBank() {
+    // 8 canali LEDC: oltre le 8 lampade i LED si ripetono, il passo non li tocca se nessuno cambia stato
+    static const uint8_t LED_COUNT = 8;
+    LedController* leds[LED_COUNT];
+    for (uint8_t i = 0; i < LED_COUNT; ++i) {
+        leds[i] = new LedController(18 + i, static_cast<ledc_channel_t>(LEDC_CHANNEL_0 + i), LEDC_TIMER_1, 25000,
+                                    LEDC_TIMER_10_BIT);
+        leds[i]->begin();
+    }
+
+    static const uint8_t COUNTS[] = {1, 2, 4, 8, 16};
+    double nsOne = 0;
+    double nsSixteen = 0;
+    for (uint8_t n : COUNTS) {
+        LampBank bank;
+        for (uint8_t i = 0; i < n; ++i) {
+            bank.addLamp(*leds[i % LED_COUNT], i % 2);
+            bank.applyEvent(LampEvent::autoModeChanged(true, i));
+        }
+        // Un passo per ms virtuale, ingressi che cambiano ogni secondo: quasi sempre nessuna
+        // transizione, come nel task reale. L'orologio avanza a blocchi per non misurare i timer
+        uint32_t transitions = 0;
+        Result r = measure(400000, [&](uint64_t i) {
+            if (i % 1000 == 0) {
+                hal::native::advance(1000000);
+                bool on = (i / 1000) % 2 != 0;
+                bank.applyEvent(LampEvent::sensorFrame(on, on, 150, 120, 0, false, 0));
+                bank.applyEvent(LampEvent::sensorFrame(false, on, 150, 120, 0, false, 1));
+            }
+            transitions += __builtin_popcount(bank.evaluate());
+        });
+        char name[48];
+        snprintf(name, sizeof(name), "LampBank::evaluate, %u lamps", n);
+        printf("%-34s %10.1f ns/pass %8.2f ns/lamp %8.3f alloc/pass (%u transitions)\n", name, r.nsPerCall,
+               r.nsPerCall / n, r.allocsPerCall, transitions);
+        nsOne = n == 1 ? r.nsPerCall : nsOne;
+        nsSixteen = n == 16 ? r.nsPerCall : nsSixteen;
+    }
+
+    // Lampade 0 e 1 sullo stesso radar, in zone diverse; la 2 con un radar suo
+    for (uint8_t i = 0; i < LED_COUNT; ++i) {
+        leds[i]->setBrightness(0);
+    }
+    LampBank bank;
+    bank.addLamp(*leds[0], 0, 0x01);
+    bank.addLamp(*leds[1], 0, 0x02);
+    bank.addLamp(*leds[2], 1);
+    for (uint8_t i = 0; i < 3; ++i) {
+        bank.applyEvent(LampEvent::autoModeChanged(true, i));
+    }
+    bank.applyEvent(LampEvent::brightnessChanged(40, 2));
+    bank.applyEvent(LampEvent::sensorFrame(false, true, 0, 90, 0x01, true, 0));
+    uint32_t changed = bank.evaluate();
+    bool zoned = changed == 0x1 && bank.getState(0) == LampState::FULL_ON && bank.getState(1) == LampState::OFF &&
+                 bank.getState(2) == LampState::OFF && leds[0]->getTargetBrightness() != 0 &&
+                 leds[1]->getTargetBrightness() == 0;
+    bank.applyEvent(LampEvent::sensorFrame(true, true, 300, 0, 0, false, 1));
+    changed = bank.evaluate();
+    bool dedicated = changed == 0x4 && bank.getState(2) == LampState::FULL_ON && bank.getMaxBrightness(2) == 40 &&
+                     bank.getMaxBrightness(0) == 100;
+    bank.applyEvent(LampEvent::autoModeChanged(false, 0));
+    changed = bank.evaluate();
+    bool manual = changed == 0x1 && bank.getState(0) == LampState::OFF && bank.getState(2) == LampState::FULL_ON;
+    // Il timeout di FULL_ON scade per la lampada 2, rimasta con il solo movimento cessato
+    bank.applyEvent(LampEvent::sensorFrame(false, true, 0, 90, 0, false, 1));
+    uint32_t timeoutMs = bank.msUntilTimeout();
+    hal::native::advance(timeoutMs * 1000ULL);
+    changed = bank.evaluate();
+    bool timedOut = timeoutMs != UINT32_MAX && changed == 0x4 && bank.getState(2) == LampState::RELAXATION;
+    printf("%-34s %10s shared zones %d, dedicated %d, manual %d, timeout %d, 16 lamps %.1fx one\n",
+           "lamp bank outcome", "", zoned, dedicated, manual, timedOut, nsOne > 0 ? nsSixteen / nsOne : 0.0);
+
+    for (uint8_t i = 0; i < LED_COUNT; ++i) {
+        delete leds[i];
+    }
+    return zoned && dedicated && manual && timedOut;
+}
+
+// Boot dopo un reset: con lo stato ripreso la luce torna al primo frame del fade, senza aspettare
+// come prima i 5 s del task di controllo e il mezzo secondo di avvio del radar
+bool benchFastBoot(LampStateMachine& lamp, LedController& led) {
+    const uint32_t OLD_BOOT_MS = 5000 + 500;
+    const uint32_t CLOCK = 1782000000;  // giugno 2026
+    ResumeState& resume = ResumeState::getInstance();
+
+    // Riavvio: LED spento, memoria RTC secondo il tipo di reset, poi i primi passi di setup()
+    auto boot = [&](hal::ResetReason reason) -> uint32_t {
+        led.setBrightness(0);
+        hal::native::simulateReset(reason);
+        Metrics::reset();
+        uint32_t bootMs = hal::millis();
+        resume.begin();
+        const ResumeRecord& saved = resume.get();
+        lamp.resume(saved.state, saved.brightness, saved.autoMode);
+        for (uint32_t ms = 0; ms < 2000 && Metrics::firstLightMs() == Metrics::NO_LIGHT; ++ms) {
+            hal::native::advance(1000);
+        }
+        uint32_t light = Metrics::firstLightMs();
+        return light == Metrics::NO_LIGHT ? UINT32_MAX : light - bootMs;
+    };
+    auto restored = [&](ResumeState::Source source, LampState state) {
+        const ResumeRecord& saved = resume.get();
+        return resume.getSource() == source && saved.state == state && saved.brightness == 80 && !saved.autoMode &&
+               lamp.getCurrentState() == state && lamp.getMaxBrightness() == 80 && !lamp.isAutoMode();
+    };
+
+    // Reset software con la lampada accesa: tutto dalla memoria RTC
+    hal::native::setEpoch(CLOCK);
+    resume.update(LampState::FULL_ON, 80, false);
+    uint32_t softwareMs = boot(hal::ResetReason::SOFTWARE);
+    bool software = restored(ResumeState::Source::RTC, LampState::FULL_ON);
+
+    // Brown-out che ha fatto perdere l'orologio: torna anche quello, all'ultimo valore salvato
+    resume.update(LampState::RELAXATION, 80, false);
+    hal::native::setEpoch(5);
+    uint32_t brownoutMs = boot(hal::ResetReason::BROWNOUT);
+    bool brownout = restored(ResumeState::Source::RTC, LampState::RELAXATION) && hal::epochNow() >= CLOCK;
+
+    // Memoria RTC rovinata, orologio buono: da NVS, lo stato solo se il salvataggio è recente
+    hal::native::setEpoch(CLOCK);
+    resume.update(LampState::FULL_ON, 80, false);
+    hal::native::advance(ResumeState::PERSIST_INTERVAL_MS * 1000ULL);
+    bool persisted = resume.persistIfDue();
+    uint8_t junk[hal::RETAINED_SIZE] = {};
+    hal::retainedWrite(junk, sizeof(junk));
+    hal::native::setEpoch(CLOCK + 120);
+    uint32_t recentMs = boot(hal::ResetReason::WATCHDOG);
+    bool recent = restored(ResumeState::Source::NVS, LampState::FULL_ON);
+    hal::retainedWrite(junk, sizeof(junk));
+    hal::native::setEpoch(CLOCK + 20 * 60);
+    uint32_t staleMs = boot(hal::ResetReason::WATCHDOG);
+    bool stale = restored(ResumeState::Source::NVS, LampState::OFF);
+
+    // Accensione: l'orologio riparte dal 1970, da NVS si riprendono solo le impostazioni
+    hal::native::setEpoch(5);
+    uint32_t powerOnMs = boot(hal::ResetReason::POWER_ON);
+    bool powerOn = restored(ResumeState::Source::NVS, LampState::OFF) && powerOnMs == UINT32_MAX;
+
+    printf("%-34s %10u ms virtual to light (before: >= %u ms), brownout %u ms, NVS %u ms\n", "fast boot, software reset",
+           softwareMs, OLD_BOOT_MS, brownoutMs, recentMs);
+    printf("%-34s %10s RTC %d/%d, NVS recent %d, stale %d (%s), power on %d\n", "fast boot outcome", "",
+           software, brownout, recent, stale, staleMs == UINT32_MAX ? "dark" : "lit", powerOn);
+
+    hal::native::setEpoch(CLOCK);
+    hal::native::clearSettings();
+    lamp.resume(LampState::OFF, 100, true);
+    led.setBrightness(0);
+    return software && brownout && persisted && recent && stale && staleMs == UINT32_MAX && powerOn &&
+           softwareMs < 100 && brownoutMs < 100 && recentMs < 100;
+}
+
+// Una stanza sintetica al minuto: sere occupate con qualche uscita, risvegli notturni, mattine
+// brevi. La lampada segue regole semplici; la notte va dalle 20 alle 7
+struct RoomDay {
+    uint32_t seed;
+    bool occupied;
+    uint8_t lit;  // minuti da cui la lampada è accesa, 0 spenta
+    uint8_t emptyFor;
+};
+
+bool isEmptyCounters(const UsageCounters& counters) {
+    for (uint8_t i = 0; i < UsageCounters::FIELDS; ++i) {
+        if (counters.minutes[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+MinuteUsage roomMinute(RoomDay& room, int32_t minute, uint8_t profile) {
+    int32_t t = minute % (24 * 60);
+    room.seed = room.seed * 1103515245 + 12345;
+    uint32_t r = (room.seed >> 8) % 1000;
+    int32_t eveningStart = profile == 0 ? 18 * 60 + 30 : 20 * 60;
+    bool evening = t >= eveningStart && t < 23 * 60 + 30;
+    bool morning = t >= 6 * 60 + 30 && t < 7 * 60 + 15;
+    bool night = t >= 20 * 60 || t < 7 * 60;
+    if (evening || morning) {
+        // In casa: ogni tanto si esce per qualche minuto
+        room.occupied = room.occupied ? r >= 15 : r < 120;
+    } else if (night) {
+        // Risvegli: rari, brevi
+        room.occupied = room.occupied ? r >= 200 : r < 2;
+    } else {
+        room.occupied = room.occupied ? r >= 100 : r < 4;
+    }
+    room.emptyFor = room.occupied ? 0 : static_cast<uint8_t>(room.emptyFor < 255 ? room.emptyFor + 1 : 255);
+    if (room.occupied && room.lit == 0) {
+        room.lit = 1;
+    } else if (room.lit > 0 && room.emptyFor >= 5) {
+        room.lit = 0;
+    } else if (room.lit > 0 && room.lit < 255) {
+        ++room.lit;
+    }
+    MinuteUsage usage;
+    usage.occupied = room.occupied;
+    usage.night = night;
+    usage.known = true;
+    if (room.lit == 0) {
+        usage.state = LampState::OFF;
+    } else if (room.emptyFor > 0) {
+        usage.state = LampState::SLEEP;
+    } else if (t >= 23 * 60 || t < 6 * 60) {
+        usage.state = LampState::SLEEP;
+    } else {
+        usage.state = room.lit < 30 ? LampState::FULL_ON : LampState::RELAXATION;
+    }
+    return usage;
+}
+
+bool benchUsageHistory() {
+    bool ok = true;
+    static hal::Partition flash;
+    flash.open("spiffs", 0x18000);  // gli ultimi 32 KB, come sulla scheda
+    static UsageHistory history;
+    history.begin(flash);
+
+    const uint8_t ROOMS = 2;
+    const int32_t DAYS = 180;
+    const int32_t start = 20089 * 24 * 60;  // 2025-01-01 00:00, minuti locali
+    const int32_t firstDay = UsageHistory::dayOf(start);
+    static uint16_t truthNight[ROOMS][DAYS + 4];  // fino a due giornate dopo la fine, per il riavvio
+    static MinuteUsage truthMinutes[ROOMS][3 * 24 * 60];
+    memset(truthNight, 0, sizeof(truthNight));
+    RoomDay rooms[ROOMS] = {{11, false, 0, 255}, {23, false, 0, 255}};
+    MinuteUsage last[ROOMS] = {};
+    uint32_t observed = 0;
+    double encodeNs = 0;
+    double pumpNs = 0;
+    const int32_t end = start + DAYS * 24 * 60;
+    // Il task di controllo si sveglia solo ai cambi e ogni 37 minuti: gli altri minuti li riempie lo storico
+    for (int32_t minute = start; minute < end; ++minute) {
+        for (uint8_t r = 0; r < ROOMS; ++r) {
+            MinuteUsage usage = roomMinute(rooms[r], minute, r);
+            if (usage.state != LampState::OFF && usage.night) {
+                ++truthNight[r][UsageHistory::dayOf(minute) - firstDay];
+            }
+            if (minute >= end - 3 * 24 * 60) {
+                truthMinutes[r][minute - (end - 3 * 24 * 60)] = usage;
+            }
+            if (minute == start || usage.state != last[r].state || usage.occupied != last[r].occupied ||
+                usage.night != last[r].night || minute % 37 == 0) {
+                auto t0 = std::chrono::steady_clock::now();
+                history.observe(r, minute, usage.state, usage.occupied, usage.night);
+                encodeNs += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+                ++observed;
+            }
+            last[r] = usage;
+        }
+        if (minute % 60 == 5) {
+            auto t0 = std::chrono::steady_clock::now();
+            while (history.pump()) {
+            }
+            pumpNs += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+        }
+    }
+    // Chiude l'ultimo minuto
+    for (uint8_t r = 0; r < ROOMS; ++r) {
+        history.observe(r, end, LampState::OFF, false, false);
+    }
+    while (history.pump()) {
+    }
+
+    const HistoryStats& stats = history.getStats();
+    uint32_t minutes = static_cast<uint32_t>(DAYS) * 24 * 60 * ROOMS;
+    uint32_t written = stats.bytesWritten[0] + stats.bytesWritten[1] + stats.bytesWritten[2];
+    printf("UsageHistory encode %8.1f ns/observe, %.1f M minutes/s (%u calls for %u room-minutes), pump %.1f us/h\n",
+           encodeNs / observed, minutes / encodeNs * 1000.0, observed, minutes, pumpNs / 1000.0 / (DAYS * 24));
+    printf("UsageHistory bytes/room/day: minutes %.1f, hours %.1f, days %.1f; %.0fx vs 1 byte/minute\n",
+           static_cast<double>(stats.bytesWritten[0]) / DAYS / ROOMS, static_cast<double>(stats.bytesWritten[1]) / DAYS / ROOMS,
+           static_cast<double>(stats.bytesWritten[2]) / DAYS / ROOMS, static_cast<double>(minutes) / written);
+    auto retained = [&](UsageHistory::Tier tier) {
+        int32_t oldest = history.oldestMinute(tier);
+        return oldest < 0 ? 0.0 : static_cast<double>(end - oldest) / (24 * 60);
+    };
+    printf("UsageHistory 32 KB after %d days, %u rooms: minutes %.0f d (%u sectors), hours %.0f d (%u), days %.0f d (%u)\n",
+           DAYS, ROOMS, retained(UsageHistory::MINUTES), history.segmentCount(UsageHistory::MINUTES),
+           retained(UsageHistory::HOURS), history.segmentCount(UsageHistory::HOURS), retained(UsageHistory::DAYS),
+           history.segmentCount(UsageHistory::DAYS));
+    printf("UsageHistory wear: %u erases, erase count %u-%u, %u cold segments moved, %u dropped\n", stats.sectorsErased,
+           history.minEraseCount(), history.maxEraseCount(), stats.relocations, stats.dropped);
+    if (stats.dropped != 0 || retained(UsageHistory::DAYS) < DAYS || retained(UsageHistory::MINUTES) < 7 ||
+        history.maxEraseCount() - history.minEraseCount() > UsageHistory::WEAR_SPREAD + 1) {
+        printf("FAIL: history retention or wear out of bounds\n");
+        ok = false;
+    }
+
+    // Minuti accesi per notte negli ultimi 30 giorni: solo il livello delle giornate
+    const int32_t now = end;
+    uint16_t nights[30];
+    uint32_t readBefore = stats.bytesRead;
+    auto t0 = std::chrono::steady_clock::now();
+    const uint32_t queries = 1000;
+    for (uint32_t q = 0; q < queries; ++q) {
+        history.litPerNight(0, now, nights, 30);
+    }
+    double queryNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / queries;
+    uint32_t queryBytes = (stats.bytesRead - readBefore) / queries;
+    for (uint8_t r = 0; r < ROOMS; ++r) {
+        size_t known = history.litPerNight(r, now, nights, 30);
+        int32_t day = UsageHistory::dayOf(now) - 29;
+        for (uint8_t i = 0; i < 30; ++i) {
+            if (nights[i] != truthNight[r][day + i - firstDay]) {
+                printf("FAIL: room %u night %d lit %u min, expected %u\n", r, day + i, nights[i],
+                       truthNight[r][day + i - firstDay]);
+                ok = false;
+                break;
+            }
+        }
+        ok = ok && known == 30;
+    }
+    printf("UsageHistory::litPerNight 30 d %10.1f ns/query, %u bytes of flash read (room 0: %u %u %u ... min)\n", queryNs,
+           queryBytes, nights[0], nights[1], nights[2]);
+
+    // Decodifica di tutto il dettaglio al minuto ancora in flash
+    int32_t oldest = history.oldestMinute(UsageHistory::MINUTES);
+    static MinuteUsage decoded[60 * 24 * 60];
+    size_t span = static_cast<size_t>(end - oldest) < sizeof(decoded) / sizeof(decoded[0])
+                      ? static_cast<size_t>(end - oldest) : sizeof(decoded) / sizeof(decoded[0]);
+    t0 = std::chrono::steady_clock::now();
+    size_t known = history.queryMinutes(0, end - static_cast<int32_t>(span), span, decoded);
+    double decodeNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+    printf("UsageHistory decode minutes %8.1f ns/minute, %.1f M minutes/s (%zu of %zu minutes known)\n",
+           decodeNs / span, span / decodeNs * 1000.0, known, span);
+    const size_t recent = 3 * 24 * 60;
+    for (uint8_t r = 0; r < ROOMS && ok; ++r) {
+        history.queryMinutes(r, end - static_cast<int32_t>(recent), recent, decoded);
+        for (size_t i = 0; i < recent; ++i) {
+            const MinuteUsage& want = truthMinutes[r][i];
+            if (!decoded[i].known || decoded[i].state != want.state || decoded[i].occupied != want.occupied ||
+                decoded[i].night != want.night) {
+                printf("FAIL: room %u minute %zu decoded differently\n", r, i);
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    // Riavvio a metà giornata: un'altra istanza sulla stessa flash riprende le ore e prosegue
+    for (int32_t minute = end + 1; minute < end + 15 * 60; ++minute) {
+        for (uint8_t r = 0; r < ROOMS; ++r) {
+            MinuteUsage usage = roomMinute(rooms[r], minute, r);
+            history.observe(r, minute, usage.state, usage.occupied, usage.night);
+            if (usage.state != LampState::OFF && usage.night) {
+                ++truthNight[r][UsageHistory::dayOf(minute) - firstDay];
+            }
+        }
+    }
+    while (history.pump()) {
+    }
+    int32_t reboot = end + 15 * 60;  // ora piena: l'ora chiusa è in flash, il minuto aperto si ripete
+    static UsageHistory restarted;
+    restarted.begin(flash);
+    for (int32_t minute = reboot; minute < reboot + 24 * 60; ++minute) {
+        for (uint8_t r = 0; r < ROOMS; ++r) {
+            MinuteUsage usage = roomMinute(rooms[r], minute, r);
+            restarted.observe(r, minute, usage.state, usage.occupied, usage.night);
+            if (usage.state != LampState::OFF && usage.night) {
+                ++truthNight[r][UsageHistory::dayOf(minute) - firstDay];
+            }
+        }
+        while (restarted.pump()) {
+        }
+    }
+    restarted.litPerNight(0, reboot + 24 * 60, nights, 3);
+    int32_t day = UsageHistory::dayOf(reboot + 24 * 60) - 2;
+    bool resumed = true;
+    for (uint8_t i = 0; i < 3; ++i) {
+        resumed = resumed && nights[i] == truthNight[0][day + i - firstDay];
+    }
+    printf("UsageHistory reboot mid-day: last 3 nights %u %u %u min, %s\n", nights[0], nights[1], nights[2],
+           resumed ? "matching" : "MISMATCH");
+
+    return ok && resumed;
+}
+
+// Interruzioni dell'alimentazione nello storico: un giro di riferimento trova la prima allocazione
+// di un settore riciclato e il primo livellamento (settori preparati con usura sbilanciata), poi
+// per ogni operazione di flash di quei due tratti si rifà il giro tagliando la corrente lì, si
+// riavvia su quanto è rimasto in flash e si prosegue. Giornate, ore e minuti in flash devono restare
+// uguali alla verità, una volta sola, senza buchi, tranne quelli troncati dal taglio. Dopo un
+// livellamento si controlla presto, prima che il settore rovinato torni in rotazione; dopo
+// un'allocazione si va oltre un giro completo delle ore, così un segmento mai riciclato lascia un buco
+bool benchHistoryPowerLoss() {
+    const uint8_t ROOMS = 8;
+    const uint8_t SECTORS = 8;
+    const int32_t DAYS = 40;
+    const int32_t MINUTES = DAYS * 24 * 60;
+    const int32_t start = 20089 * 24 * 60;
+    // Un settore poco cancellato: il primo segmento delle ore ci resta fermo e va spostato
+    const uint32_t WEAR[SECTORS] = {30, 0, 30, 30, 30, 30, 30, 30};
+    static MinuteUsage truth[ROOMS][MINUTES];
+    for (uint8_t r = 0; r < ROOMS; ++r) {
+        RoomDay room = {static_cast<uint32_t>(101 + r * 7), false, 0, 255};
+        for (int32_t m = 0; m < MINUTES; ++m) {
+            truth[r][m] = roomMinute(room, start + m, r % 2);
+        }
+    }
+    auto truthCounters = [&](uint8_t room, int32_t from, int32_t to) {
+        UsageCounters counters = {};
+        for (int32_t minute = from < start ? start : from; minute < to && minute < start + MINUTES; ++minute) {
+            const MinuteUsage& usage = truth[room][minute - start];
+            if (usage.state != LampState::OFF) {
+                ++counters.minutes[static_cast<uint8_t>(usage.state) - 1];
+                counters.minutes[UsageCounters::NIGHT_LIT] += usage.night;
+            }
+            counters.minutes[UsageCounters::OCCUPIED] += usage.occupied;
+        }
+        return counters;
+    };
+
+    static hal::Partition flash;
+    alignas(UsageHistory) static uint8_t storage[sizeof(UsageHistory)];
+    UsageHistory* history = nullptr;
+    auto boot = [&]() {
+        if (history != nullptr) {
+            history->~UsageHistory();
+        }
+        history = new (storage) UsageHistory();
+        history->begin(flash);
+    };
+    auto format = [&]() {
+        flash.cutPowerAfter(UINT32_MAX);
+        flash.open("spiffs", 0x18000, SECTORS * hal::Partition::SECTOR_SIZE);
+        for (uint8_t i = 0; i < SECTORS; ++i) {
+            HistorySegmentHeader header;
+            memset(&header, 0xFF, sizeof(header));
+            header.magic = HistorySegmentHeader::MAGIC;
+            header.version = HistorySegmentHeader::VERSION;
+            header.eraseCount = WEAR[i];
+            flash.eraseSector(i * hal::Partition::SECTOR_SIZE);
+            flash.write(i * hal::Partition::SECTOR_SIZE, &header, sizeof(header));
+        }
+        flash.open("spiffs", 0x18000, SECTORS * hal::Partition::SECTOR_SIZE);  // conta le operazioni da qui
+        boot();
+    };
+    // Un minuto per stanza e la pompa fino in fondo, come il task di scrittura sempre in pari
+    auto step = [&](int32_t minute) {
+        for (uint8_t r = 0; r < ROOMS; ++r) {
+            const MinuteUsage& usage = truth[r][minute - start];
+            history->observe(r, minute, usage.state, usage.occupied, usage.night);
+        }
+        while (history->pump()) {
+        }
+    };
+
+    // Riferimento: le operazioni di flash del passo che alloca un settore riciclato e di quello che livella
+    format();
+    uint32_t allocFrom = 0, allocTo = 0, relocateFrom = 0, relocateTo = 0;
+    for (int32_t minute = start; minute < start + MINUTES && relocateTo == 0; ++minute) {
+        uint32_t ops = flash.getOperations();
+        HistoryStats before = history->getStats();
+        step(minute);
+        const HistoryStats& after = history->getStats();
+        if (after.relocations != before.relocations) {
+            relocateFrom = ops;
+            relocateTo = flash.getOperations();
+        } else if (allocTo == 0 && after.sectorsErased != before.sectorsErased) {
+            allocFrom = ops;
+            allocTo = flash.getOperations();
+        }
+    }
+
+    uint32_t trials = 0;
+    uint32_t failures = 0;
+    uint32_t checked = 0;
+    auto trial = [&](uint32_t cut, int32_t afterCut) {
+        format();
+        flash.cutPowerAfter(cut);
+        int32_t minute = start;
+        while (flash.getOperations() <= cut) {
+            step(minute++);
+        }
+        int32_t cutMinute = minute - 1;
+        flash.cutPowerAfter(UINT32_MAX);
+        boot();
+        int32_t end = cutMinute + afterCut;
+        for (; minute < end; ++minute) {
+            step(minute);
+        }
+        // Troncate dal taglio: la giornata che si chiudeva e quella in corso. L'ultima è ancora aperta
+        int32_t skipFrom = UsageHistory::dayOf(cutMinute) - 1;
+        int32_t skipTo = UsageHistory::dayOf(cutMinute + 1);
+        int32_t firstDay = UsageHistory::dayOf(start);
+        int32_t lastDay = UsageHistory::dayOf(end - 1);
+        int32_t lastMinute = lastDay * 24 * 60 + UsageHistory::DAY_START_MIN;
+        auto truncated = [&](int32_t minute) {
+            int32_t day = UsageHistory::dayOf(minute);
+            return (day >= skipFrom && day <= skipTo) || day >= lastDay;
+        };
+        bool ok = true;
+        for (uint8_t r = 0; r < ROOMS; ++r) {
+            static UsageCounters days[DAYS + 1];
+            history->queryDays(r, firstDay, lastDay - firstDay, days);
+            for (int32_t day = firstDay; day < lastDay; ++day) {
+                int32_t dayStart = day * 24 * 60 + UsageHistory::DAY_START_MIN;
+                if (truncated(dayStart)) {
+                    continue;
+                }
+                UsageCounters want = truthCounters(r, dayStart, dayStart + 24 * 60);
+                const UsageCounters& got = days[day - firstDay];
+                ok = ok && got.records == 1 && memcmp(got.minutes, want.minutes, sizeof(want.minutes)) == 0;
+                ++checked;
+            }
+            // La prima ora del segmento più vecchio può avere le altre stanze in quello già riciclato
+            // (l'intervallo resta nella verità anche se la flash restituisce tempi senza senso)
+            int32_t firstHour = UsageHistory::hourOf(history->oldestMinute(UsageHistory::HOURS)) + 1;
+            firstHour = firstHour > UsageHistory::hourOf(start) ? firstHour : UsageHistory::hourOf(start);
+            int32_t hourCount = UsageHistory::hourOf(lastMinute) - firstHour;
+            hourCount = hourCount > 0 ? hourCount : 0;
+            static UsageCounters hours[DAYS * 24];
+            history->queryHours(r, firstHour, hourCount, hours);
+            for (int32_t h = 0; h < hourCount; ++h) {
+                int32_t minute = (firstHour + h) * 60;
+                if (truncated(minute)) {
+                    continue;
+                }
+                // Le ore vuote non si scrivono
+                UsageCounters want = truthCounters(r, minute, minute + 60);
+                const UsageCounters& got = hours[h];
+                ok = ok && (got.records == 1 ? memcmp(got.minutes, want.minutes, sizeof(want.minutes)) == 0
+                                             : got.records == 0 && isEmptyCounters(want));
+                ++checked;
+            }
+            int32_t firstMinute = (UsageHistory::hourOf(history->oldestMinute(UsageHistory::MINUTES)) + 1) * 60;
+            firstMinute = firstMinute > start ? firstMinute : start;
+            int32_t minuteCount = lastMinute - firstMinute;
+            minuteCount = minuteCount > 0 ? minuteCount : 0;
+            static MinuteUsage minutes[DAYS * 24 * 60];
+            history->queryMinutes(r, firstMinute, minuteCount, minutes);
+            for (int32_t m = 0; m < minuteCount; ++m) {
+                if (truncated(firstMinute + m)) {
+                    continue;
+                }
+                const MinuteUsage& want = truth[r][firstMinute + m - start];
+                const MinuteUsage& got = minutes[m];
+                ok = ok && got.known && got.state == want.state && got.occupied == want.occupied && got.night == want.night;
+                ++checked;
+            }
+        }
+        ++trials;
+        failures += !ok;
+    };
+
+    bool found = allocTo > allocFrom && relocateTo > relocateFrom;
+    for (uint32_t cut = allocFrom; found && cut < allocTo; ++cut) {
+        trial(cut, 21 * 24 * 60);
+    }
+    for (uint32_t cut = relocateFrom; found && cut < relocateTo; ++cut) {
+        trial(cut, 2 * 24 * 60);
+    }
+    printf("UsageHistory power loss: %u cuts (allocation ops %u-%u, relocation ops %u-%u), %u values checked, %u %s\n",
+           trials, allocFrom, allocTo, relocateFrom, relocateTo, checked, failures, failures == 0 ? "mismatches" : "MISMATCHES");
+    history->~UsageHistory();
+    return found && failures == 0;
+}
+
+// Due giorni dello stack completo come girano i task in main.cpp: radar a 10 frame/s in byte
+// grezzi, controllo con parcheggio, LED, servizio dell'ora, trace, storico, ripresa, log e
+// metriche, più comandi HomeKit. Il primo giorno scalda (prime pagine, chiavi NVS), poi si sigilla
+// l'heap come a fine setup(): nelle 24 ore dopo non ci devono essere new né byte in più
+bool benchHeapSteadyState(LampStateMachine& lamp, LedController& led, MotionSensor& motion) {
+    const uint64_t TICK_US = 100000;
+    const uint64_t HOUR_US = 3600000000ULL;
+    const uint64_t DAY_US = 24 * HOUR_US;
+    const uint64_t METRICS_US = 10000000;
+    // Visite in ore locali: una di giorno, le altre di sera e di notte
+    struct Visit {
+        double arriveH;
+        double leaveH;
+    };
+    const Visit visits[] = {{12.0, 12.5}, {19.5, 21.0}, {22.25, 22.5}, {23.0, 23.75}, {3.0, 3.1}};
+    TimeService& time = TimeService::getInstance();
+    TraceRecorder& trace = TraceRecorder::getInstance();
+    OccupancyLearner& learner = OccupancyLearner::getInstance();
+    ResumeState& resume = ResumeState::getInstance();
+    PowerManager& power = PowerManager::getInstance();
+    power.begin(led, motion, 4);
+    lamp.setLearner(&learner);
+    LampControlTask control(lamp, isNightNow);
+    control.setPowerManager(&power);
+
+    LD2410Frame frame = {};
+    uint8_t bytes[64];
+    bool synced = false;
+    bool pin = false;
+    uint32_t litTicks = 0;
+    double lastHour = -1;
+    uint64_t nextPollUs = hal::micros();
+    uint64_t nextMetricsUs = hal::micros();
+    auto runDay = [&](uint64_t startUs) {
+        for (uint64_t now = startUs; now < startUs + DAY_US; now += TICK_US) {
+            hal::native::advance(now - hal::micros());
+            double hour = time.localMinute() / 60.0;
+            bool present = false;
+            for (const Visit& visit : visits) {
+                present = present || (hour >= visit.arriveH && hour < visit.leaveH);
+            }
+            // Si muove nei primi minuti della visita e poi ogni tanto
+            bool moving = present && ((now / TICK_US) % 600 < 30 || (now / TICK_US) % 97 == 0);
+            if (present != pin) {
+                pin = present;
+                hal::native::setWakePin(present);
+            }
+            // Task del radar: a UART sospesa i byte non arrivano
+            if (!power.isParked()) {
+                frame.targetState = (moving ? 1 : 0) | (present ? 2 : 0);
+                frame.movingDistance = moving ? 150 : 0;
+                frame.stationaryDistance = present ? 120 : 0;
+                motion.injectBytes(bytes, LD2410Parser::encode(frame, bytes, sizeof(bytes)));
+                if (motion.update() || (!synced && motion.isConnected())) {
+                    synced = true;
+                    postLampEvent(LampEvent::sensorFrame(motion.isMovementDetected(), motion.isPresenceDetected(),
+                                                         motion.getMovementDistance(), motion.getStationaryDistance(),
+                                                         motion.getOccupiedZones(), motion.hasZones()));
+                }
+            }
+            // Slider di HomeKit la sera
+            if (hour != lastHour && hour == 20.0) {
+                postLampEvent(LampEvent::brightnessChanged(60));
+            } else if (hour != lastHour && hour == 22.0) {
+                postLampEvent(LampEvent::brightnessChanged(100));
+            }
+            lastHour = hour;
+            // Task di controllo
+            control.runOnce();
+            litTicks += led.getCurrentBrightness() > 0;
+            learner.persistIfDue();
+            resume.update(lamp.getCurrentState(), lamp.getMaxBrightness(), lamp.isAutoMode());
+            resume.persistIfDue();
+            // Task dell'ora, della trace e del log
+            if (now >= nextPollUs) {
+                nextPollUs = now + time.poll() * 1000ULL;
+            }
+            trace.pump(0);
+            if (now >= nextMetricsUs) {
+                logDrain();
+                Metrics::sampleSystem();
+                nextMetricsUs = now + METRICS_US;
+            }
+        }
+    };
+
+    uint64_t startUs = hal::micros();
+    runDay(startUs);
+    Metrics::sealHeap();
+    uint32_t liveBefore = Metrics::heapLiveBytes();
+    litTicks = 0;
+    uint32_t wakeupsBefore = control.getStats().wakeups;
+    uint32_t pagesBefore = trace.getStats().pagesWritten;
+    auto start = std::chrono::steady_clock::now();
+    runDay(startUs + DAY_US);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    uint32_t allocs = Metrics::heapAllocsSinceSeal();
+    int64_t growth = static_cast<int64_t>(Metrics::heapLiveBytes()) - liveBefore;
+    uint32_t wakeups = control.getStats().wakeups - wakeupsBefore;
+    uint32_t pages = trace.getStats().pagesWritten - pagesBefore;
+
+    printf("%-34s %10.1f ms host, %u control passes, lit %.1f h, %u trace pages, %u B live\n",
+           "heap steady state, 24 virtual h", ms, wakeups, litTicks * TICK_US / 3.6e9, pages, Metrics::heapLiveBytes());
+    printf("%-34s %10u allocations after seal, live bytes %+lld\n", "heap steady state outcome", allocs,
+           static_cast<long long>(growth));
+
+    // Perdita iniettata dopo il giro pulito: una new a heap sigillato va vista da entrambi i controlli
+    const size_t LEAK_BYTES = 48;
+    char* volatile leak = new char[LEAK_BYTES];
+    uint32_t leakAllocs = Metrics::heapAllocsSinceSeal() - allocs;
+    int64_t leakGrowth = static_cast<int64_t>(Metrics::heapLiveBytes()) - liveBefore - growth;
+    delete[] leak;
+    bool leakCaught = leakAllocs == 1 && leakGrowth >= static_cast<int64_t>(LEAK_BYTES);
+    printf("%-34s %10s %u allocation, live bytes %+lld after an injected %zu B leak\n", "heap steady state leak check",
+           leakCaught ? "caught" : "MISSED", leakAllocs, static_cast<long long>(leakGrowth), LEAK_BYTES);
+
+    lamp.setLearner(nullptr);
+    motion.setSuspended(false);
+    hal::native::setWakePin(false);
+    return allocs == 0 && growth == 0 && litTicks > 0 && pages > 0 && leakCaught;
+}
+
+}  // namespace
+
+int main() {
+    hal::native::setLogEnabled(false);
+
+    LedController led(18, LEDC_CHANNEL_0, LEDC_TIMER_0, 25000, LEDC_TIMER_10_BIT);
+    led.begin();
+    MotionSensor motion;
+    motion.begin();
+    LampStateMachine& lamp = LampStateMachine::getInstance(led, motion);
+
+    // Un tick ogni ms; il pattern di presenza cambia ogni 10 s per attraversare tutti gli stati
+    report("LampStateMachine::update", measure(2000000, [&](uint64_t i) {
+        uint64_t phase = (i / 10000) % 4;
+        motion.injectReading(phase != 0, phase == 1 || phase == 3, 150, 120);
+        hal::native::advance(1000);
+        lamp.update(100, true);
+    }));
+
+    benchTransitionTable();
+    benchPollingLoop(lamp, motion);
+    benchEventLoop(lamp);
+    benchPresenceFilter(lamp, motion);
+
+    benchBrightnessLut(led);
+
+    report("LedController::startFadeTo", measure(2000000, [&](uint64_t i) {
+        led.startFadeTo(static_cast<uint16_t>((i * 37) & 1023), 200);
+    }));
+
+    report("startFadeTo EASE_IN_OUT", measure(2000000, [&](uint64_t i) {
+        led.startFadeTo(static_cast<uint16_t>((i * 37) & 1023), 800, FadeCurve::EASE_IN_OUT);
+    }));
+
+    report("getCurrentBrightness (in flight)", measure(10000000, [&](uint64_t) {
+        sink = sink + led.getCurrentBrightness();
+    }));
+
+    bool ok = benchFadeHeap(led);
+    ok = benchSensorParser() && ok;
+    ok = benchZoneOccupancy() && ok;
+    ok = benchGateCalibration() && ok;
+    ok = benchLogging() && ok;
+    ok = benchTimeService() && ok;
+    ok = benchLightingProfiles() && ok;
+    ok = benchDitheredFade(led) && ok;
+    ok = benchBrightnessReadback(led) && ok;
+    ok = benchMultiChannel() && ok;
+    ok = benchSliderDrag(led) && ok;
+    ok = benchCommandQueue(led) && ok;
+    ok = benchMetrics(lamp) && ok;
+    ok = benchOccupancyLearner(lamp, led) && ok;
+    ok = benchPowerManager(lamp, led, motion) && ok;
+    ok = benchPrewarmWhileParked(lamp, led, motion) && ok;
+    ok = benchFastBoot(lamp, led) && ok;
+    ok = benchLampBank() && ok;
+    ok = benchHomeKitTelemetry(lamp, motion) && ok;
+    ok = benchUsageHistory() && ok;
+    ok = benchHistoryPowerLoss() && ok;
+    // Per ultimo: da qui in poi anche gli hook di stato e fade scrivono nella trace
+    ok = benchTraceRecorder() && ok;
+    // Per ultimo anche questo: sigilla l'heap come a fine setup()
+    ok = benchHeapSteadyState(lamp, led, motion) && ok;
+    return ok ? 0 : 1;
+}
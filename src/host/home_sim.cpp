@@ -0,0 +1,540 @@
+// Simulatore a eventi discreti di una stanza: occupanti sintetici, radar con perdite di presenza
+// e comandi HomeKit programmati, contro LampStateMachine e LampControlTask veri su orologio virtuale.
+// L'orologio salta direttamente alla prossima scadenza (cambio di un occupante, timeout di stato,
+// fine di un fade, comando HomeKit): un mese simulato richiede pochi millisecondi.
+//
+//   pio run -e native_sim && .pio/build/native_sim/program [mesi dello sweep]
+//
+// Il radar entra già filtrato: i frame vengono pubblicati solo ai cambi, come fa il task del sensore.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include "Hal.h"
+#include "LedController.h"
+#include "MotionSensor.h"
+#include "LampStateMachine.h"
+#include "LampControlTask.h"
+
+namespace {
+
+const uint64_t SECOND_US = 1000000ULL;
+const uint64_t MINUTE_US = 60 * SECOND_US;
+const uint64_t HOUR_US = 60 * MINUTE_US;
+const uint64_t DAY_US = 24 * HOUR_US;
+const uint64_t NIGHT_START_US = 19 * HOUR_US;
+const uint64_t NIGHT_END_US = 7 * HOUR_US;
+const uint32_t MONTH_DAYS = 30;
+
+// xorshift64*: veloce e riproducibile dal seme
+class Rng {
+public:
+    explicit Rng(uint64_t seed) : state(seed * 0x9E3779B97F4A7C15ULL + 1) {}
+    uint64_t next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1DULL;
+    }
+    // Uniforme in [lo, hi)
+    uint64_t range(uint64_t lo, uint64_t hi) { return hi > lo ? lo + next() % (hi - lo) : lo; }
+    // Centrata su mean, scarto massimo spread
+    uint64_t around(uint64_t mean, uint64_t spread) { return range(mean - spread, mean + spread + 1); }
+    bool chance(uint32_t percent) { return next() % 100 < percent; }
+
+private:
+    uint64_t state;
+};
+
+// --- Modelli di occupante ---
+
+// Un occupante pianifica una notte alla volta come sequenza di cambi (presente, in movimento);
+// il simulatore chiede solo il prossimo cambio e lo applica quando scade
+class Occupant {
+public:
+    virtual ~Occupant() = default;
+    virtual const char* name() const = 0;
+    // false per gli animali: il radar li vede, ma la stanza non conta come occupata
+    virtual bool human() const { return true; }
+
+    void start(uint64_t fromUs, Rng& rng) {
+        day = fromUs / DAY_US;
+        count = 0;
+        index = 0;
+        isPresent = false;
+        isMoving = false;
+        while (count == 0 || plan[count - 1].atUs < fromUs) {
+            planNext(rng);
+        }
+        while (plan[index].atUs < fromUs) {
+            ++index;
+        }
+    }
+    uint64_t nextChangeUs() const { return plan[index].atUs; }
+    void step(Rng& rng) {
+        isPresent = plan[index].present;
+        isMoving = plan[index].moving;
+        if (++index == count) {
+            planNext(rng);
+        }
+    }
+    bool present() const { return isPresent; }
+    bool moving() const { return isMoving; }
+
+protected:
+    // Pianifica la sera e la notte che cominciano a dayUs, con cambi in ordine di tempo
+    virtual void planNight(uint64_t dayUs, Rng& rng) = 0;
+
+    void at(uint64_t atUs, bool present, bool moving) {
+        if (count < MAX_CHANGES && (count == 0 || atUs > plan[count - 1].atUs)) {
+            plan[count++] = {atUs, present, moving};
+        }
+    }
+    // Fermo in stanza da fromUs a toUs, con un movimento breve circa ogni everyUs
+    void stillWithMoves(uint64_t fromUs, uint64_t toUs, uint64_t everyUs, uint64_t moveUs, Rng& rng) {
+        at(fromUs, true, false);
+        for (uint64_t t = fromUs + rng.around(everyUs, everyUs / 2); t + moveUs < toUs;
+             t += rng.around(everyUs, everyUs / 2)) {
+            at(t, true, true);
+            at(t + moveUs, true, false);
+        }
+    }
+
+private:
+    static const size_t MAX_CHANGES = 256;
+    struct Change {
+        uint64_t atUs;
+        bool present;
+        bool moving;
+    };
+
+    void planNext(Rng& rng) {
+        count = 0;
+        index = 0;
+        while (count == 0) {
+            planNight(day++ * DAY_US, rng);
+        }
+    }
+
+    Change plan[MAX_CHANGES];
+    size_t count = 0;
+    size_t index = 0;
+    uint64_t day = 0;
+    bool isPresent = false;
+    bool isMoving = false;
+};
+
+// A letto verso le 22:30: qualche minuto di movimento, poi fermo fino al mattino con qualche
+// girata; a volte si alza nella notte per qualche minuto
+class Sleeper : public Occupant {
+public:
+    const char* name() const override { return "sleeper"; }
+
+protected:
+    void planNight(uint64_t dayUs, Rng& rng) override {
+        uint64_t bed = dayUs + rng.around(22 * HOUR_US + 30 * MINUTE_US, 30 * MINUTE_US);
+        uint64_t wake = dayUs + DAY_US + rng.around(6 * HOUR_US + 45 * MINUTE_US, 20 * MINUTE_US);
+        at(bed, true, true);
+        uint64_t asleep = bed + rng.around(15 * MINUTE_US, 5 * MINUTE_US);
+        stillWithMoves(bed + 2 * MINUTE_US, asleep, 2 * MINUTE_US, 20 * SECOND_US, rng);
+        if (rng.chance(30)) {
+            uint64_t up = dayUs + DAY_US + rng.around(3 * HOUR_US, HOUR_US);
+            stillWithMoves(asleep, up, 90 * MINUTE_US, 5 * SECOND_US, rng);
+            at(up, true, true);
+            at(up + 20 * SECOND_US, false, false);
+            uint64_t back = up + rng.around(5 * MINUTE_US, 2 * MINUTE_US);
+            at(back, true, true);
+            stillWithMoves(back + 30 * SECOND_US, wake, 90 * MINUTE_US, 5 * SECOND_US, rng);
+        } else {
+            stillWithMoves(asleep, wake, 90 * MINUTE_US, 5 * SECOND_US, rng);
+        }
+        at(wake, true, true);
+        at(wake + 3 * MINUTE_US, false, false);
+    }
+};
+
+// Metà delle sere legge in poltrona da un'ora a due e mezza: quasi fermo, gira una pagina ogni tanto
+class Reader : public Occupant {
+public:
+    const char* name() const override { return "reader"; }
+
+protected:
+    void planNight(uint64_t dayUs, Rng& rng) override {
+        if (!rng.chance(50)) {
+            return;
+        }
+        uint64_t arrive = dayUs + rng.around(20 * HOUR_US, 45 * MINUTE_US);
+        uint64_t leave = arrive + rng.range(60 * MINUTE_US, 150 * MINUTE_US);
+        at(arrive, true, true);
+        stillWithMoves(arrive + 30 * SECOND_US, leave, 5 * MINUTE_US, 3 * SECOND_US, rng);
+        at(leave, true, true);
+        at(leave + 15 * SECOND_US, false, false);
+    }
+};
+
+// Attraversa la stanza da 4 a 8 volte tra le 19 e l'una, sempre in movimento
+class PassThrough : public Occupant {
+public:
+    const char* name() const override { return "pass-through"; }
+
+protected:
+    void planNight(uint64_t dayUs, Rng& rng) override {
+        uint32_t passes = static_cast<uint32_t>(rng.range(4, 9));
+        uint64_t window = 6 * HOUR_US / passes;
+        for (uint32_t i = 0; i < passes; ++i) {
+            uint64_t enter = dayUs + NIGHT_START_US + i * window + rng.range(0, window - MINUTE_US);
+            at(enter, true, true);
+            at(enter + rng.range(15 * SECOND_US, 40 * SECOND_US), false, false);
+        }
+    }
+};
+
+// Il gatto: passa in media ogni 40 minuti per la notte, si muove e se ne va
+class Pet : public Occupant {
+public:
+    const char* name() const override { return "pet"; }
+    bool human() const override { return false; }
+
+protected:
+    void planNight(uint64_t dayUs, Rng& rng) override {
+        for (uint64_t t = dayUs + NIGHT_START_US + rng.range(0, 40 * MINUTE_US); t < dayUs + DAY_US + NIGHT_END_US;
+             t += rng.range(20 * MINUTE_US, 60 * MINUTE_US)) {
+            uint64_t stay = rng.range(MINUTE_US, 4 * MINUTE_US);
+            at(t, true, true);
+            at(t + stay, false, false);
+        }
+    }
+};
+
+// --- Radar e HomeKit ---
+
+// Perdite della presenza da fermo: di tanto in tanto il radar non vede chi non si muove,
+// per qualche decina di secondi. Il movimento si vede sempre
+class Dropouts {
+public:
+    void start(uint32_t perHour, uint64_t fromUs, Rng& rng) {
+        rate = perHour;
+        missing = false;
+        nextUs = rate == 0 ? UINT64_MAX : fromUs + gap(rng);
+    }
+    uint64_t nextChangeUs() const { return nextUs; }
+    void step(Rng& rng) {
+        missing = !missing;
+        nextUs += missing ? rng.range(20 * SECOND_US, 90 * SECOND_US) : gap(rng);
+    }
+    bool isMissing() const { return missing; }
+
+private:
+    uint64_t gap(Rng& rng) { return rng.range(HOUR_US / rate / 2, HOUR_US * 3 / rate / 2); }
+
+    uint32_t rate = 0;
+    bool missing = false;
+    uint64_t nextUs = UINT64_MAX;
+};
+
+// Comando HomeKit ripetuto ogni giorno alla stessa ora
+struct HomeKitAction {
+    uint64_t timeOfDayUs;
+    bool autoMode;       // true: interruttore della modalità auto, false: luminosità
+    uint8_t value;
+};
+
+struct HomeKitScript {
+    const char* name;
+    const HomeKitAction* actions;
+    size_t count;
+};
+
+const HomeKitAction DIM_ACTIONS[] = {
+    {21 * HOUR_US + 30 * MINUTE_US, false, 40},
+    {7 * HOUR_US, false, 100},
+};
+// Spegne l'automatico per leggere con la luce fissa, poi lo riattiva
+const HomeKitAction MANUAL_ACTIONS[] = {
+    {22 * HOUR_US, true, 0},
+    {22 * HOUR_US + 40 * MINUTE_US, true, 1},
+};
+const HomeKitScript SCRIPTS[] = {
+    {"none", nullptr, 0},
+    {"dim 21:30", DIM_ACTIONS, sizeof(DIM_ACTIONS) / sizeof(DIM_ACTIONS[0])},
+    {"manual 22:00", MANUAL_ACTIONS, sizeof(MANUAL_ACTIONS) / sizeof(MANUAL_ACTIONS[0])},
+};
+const size_t SCRIPT_COUNT = sizeof(SCRIPTS) / sizeof(SCRIPTS[0]);
+
+// --- Scenario ---
+
+const size_t MAX_OCCUPANTS = 4;
+
+struct Scenario {
+    Occupant* occupants[MAX_OCCUPANTS];
+    size_t occupantCount;
+    uint32_t dropoutsPerHour;
+    const HomeKitScript* script;
+    uint32_t days;
+    uint64_t seed;
+};
+
+struct ScenarioMetrics {
+    double litEmptyS;            // LED acceso senza nessuno in stanza (gli animali non contano)
+    double litDayS;              // LED acceso di giorno, quando il controllo non valuta le regole
+    double darkOccupiedS;        // di notte, in automatico, qualcuno in stanza e LED spento
+    uint32_t darkOccupiedEvents; // quante volte si è entrati in quella condizione
+    uint32_t fades;
+    uint32_t transitions;
+    uint32_t events;             // eventi di simulazione serviti
+    uint32_t millisWraps;
+};
+
+uint64_t simStartUs = 0;  // hal::micros() della mezzanotte del giorno 0
+
+uint64_t simNow() {
+    return hal::micros() - simStartUs;
+}
+
+bool isNightAt(uint64_t simUs) {
+    uint64_t t = simUs % DAY_US;
+    return t >= NIGHT_START_US || t < NIGHT_END_US;
+}
+
+bool isSimNight() {
+    return isNightAt(simNow());
+}
+
+uint64_t nextNightChange(uint64_t simUs) {
+    uint64_t day = simUs / DAY_US * DAY_US;
+    uint64_t t = simUs % DAY_US;
+    if (t < NIGHT_END_US) {
+        return day + NIGHT_END_US;
+    }
+    return t < NIGHT_START_US ? day + NIGHT_START_US : day + DAY_US + NIGHT_END_US;
+}
+
+uint64_t nextActionAt(const HomeKitScript& script, uint64_t simUs, size_t& which) {
+    uint64_t best = UINT64_MAX;
+    for (size_t i = 0; i < script.count; ++i) {
+        uint64_t at = simUs / DAY_US * DAY_US + script.actions[i].timeOfDayUs;
+        if (at <= simUs) {
+            at += DAY_US;
+        }
+        if (at < best) {
+            best = at;
+            which = i;
+        }
+    }
+    return best;
+}
+
+// Esegue uno scenario dalle 12:00 del giorno in cui si trova l'orologio, per scenario.days giorni
+ScenarioMetrics runScenario(const Scenario& scenario, LampStateMachine& lamp, LampControlTask& control,
+                            LedController& led) {
+    ScenarioMetrics m = {};
+    Rng rng(scenario.seed);
+
+    // Riparte da mezzogiorno, lampada spenta e ingressi a riposo
+    uint64_t now = simNow();
+    uint64_t begin = (now / DAY_US + 1) * DAY_US + 12 * HOUR_US;
+    hal::native::advance(begin - now);
+    led.setBrightness(0);
+    LampEvent stale;
+    while (waitLampEvent(stale, 0)) {
+    }
+    lamp.resume(LampState::OFF, 100, true);
+    postLampEvent(LampEvent::sensorFrame(false, false, 0, 0));
+    control.runOnce();
+
+    for (size_t i = 0; i < scenario.occupantCount; ++i) {
+        scenario.occupants[i]->start(begin, rng);
+    }
+    Dropouts dropouts;
+    dropouts.start(scenario.dropoutsPerHour, begin, rng);
+
+    uint64_t end = begin + scenario.days * DAY_US;
+    uint32_t fadesBefore = led.getFadeCount();
+    uint32_t transitionsBefore = control.getStats().transitions;
+    bool postedPresence = false;
+    bool postedMovement = false;
+    bool autoMode = true;
+    bool darkOccupied = false;
+    uint32_t lastMillis = hal::millis();
+
+    for (;;) {
+        now = simNow();
+        // Prossima scadenza: il più vicino tra occupanti, radar, HomeKit, notte e controllo
+        uint64_t next = end;
+        for (size_t i = 0; i < scenario.occupantCount; ++i) {
+            uint64_t t = scenario.occupants[i]->nextChangeUs();
+            next = t < next ? t : next;
+        }
+        next = dropouts.nextChangeUs() < next ? dropouts.nextChangeUs() : next;
+        size_t action = 0;
+        uint64_t actionAt = scenario.script->count > 0 ? nextActionAt(*scenario.script, now, action) : UINT64_MAX;
+        next = actionAt < next ? actionAt : next;
+        uint64_t nightAt = nextNightChange(now);
+        next = nightAt < next ? nightAt : next;
+        uint32_t timeoutMs = control.nextTimeoutMs();
+        uint64_t controlAt = timeoutMs == UINT32_MAX ? UINT64_MAX : now + timeoutMs * 1000ULL;
+        next = controlAt < next ? controlAt : next;
+
+        // Fino alla scadenza LED e occupanti non cambiano: si integra l'intervallo intero
+        bool lit = led.getState().targetBrightness != 0;
+        bool human = false;
+        for (size_t i = 0; i < scenario.occupantCount; ++i) {
+            human = human || (scenario.occupants[i]->human() && scenario.occupants[i]->present());
+        }
+        double spanS = static_cast<double>(next - now) / SECOND_US;
+        if (lit && !human) {
+            m.litEmptyS += spanS;
+        }
+        if (lit && !isNightAt(now)) {
+            m.litDayS += spanS;
+        }
+        bool nowDark = isNightAt(now) && autoMode && human && !lit;
+        if (nowDark) {
+            m.darkOccupiedS += spanS;
+        }
+        m.darkOccupiedEvents += nowDark && !darkOccupied;
+        darkOccupied = nowDark;
+
+        if (next >= end) {
+            hal::native::advance(end - now);
+            break;
+        }
+        hal::native::advance(next - now);
+        ++m.events;
+        m.millisWraps += hal::millis() < lastMillis;
+        lastMillis = hal::millis();
+
+        // Tutto ciò che scade in questo istante, poi un solo passo del controllo
+        for (size_t i = 0; i < scenario.occupantCount; ++i) {
+            while (scenario.occupants[i]->nextChangeUs() <= next) {
+                scenario.occupants[i]->step(rng);
+            }
+        }
+        while (dropouts.nextChangeUs() <= next) {
+            dropouts.step(rng);
+        }
+        bool presence = false;
+        bool movement = false;
+        for (size_t i = 0; i < scenario.occupantCount; ++i) {
+            Occupant& o = *scenario.occupants[i];
+            movement = movement || o.moving();
+            presence = presence || (o.present() && (o.moving() || !dropouts.isMissing()));
+        }
+        if (presence != postedPresence || movement != postedMovement) {
+            postedPresence = presence;
+            postedMovement = movement;
+            postLampEvent(LampEvent::sensorFrame(movement, presence, movement ? 150 : 0, presence ? 120 : 0));
+        }
+        if (actionAt == next) {
+            const HomeKitAction& a = scenario.script->actions[action];
+            if (a.autoMode) {
+                autoMode = a.value != 0;
+                postLampEvent(LampEvent::autoModeChanged(autoMode));
+            } else {
+                postLampEvent(LampEvent::brightnessChanged(a.value));
+            }
+        }
+        if (nightAt == next) {
+            postLampEvent(LampEvent::nightChanged(isSimNight()));
+        }
+        control.runOnce();
+    }
+
+    m.fades = led.getFadeCount() - fadesBefore;
+    m.transitions = control.getStats().transitions - transitionsBefore;
+    return m;
+}
+
+void printMetrics(const char* name, const ScenarioMetrics& m, uint32_t days) {
+    printf("%-34s lit empty %6.1f min/day (%6.1f by day), dark occupied %5.1f min/day (%3u times), %5.1f fades/day, "
+           "%5.1f transitions/day\n",
+           name, m.litEmptyS / 60 / days, m.litDayS / 60 / days, m.darkOccupiedS / 60 / days, m.darkOccupiedEvents,
+           static_cast<double>(m.fades) / days, static_cast<double>(m.transitions) / days);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    uint32_t sweepMonths = argc > 1 ? static_cast<uint32_t>(atoi(argv[1])) : 1000;
+    hal::native::setLogEnabled(false);
+    // La mezzanotte del giorno 0 cade 11 ore prima del giro di millis(): il primo scenario lo
+    // attraversa alle 23, con la lampada accesa e i timeout in corso
+    hal::native::setTime((1ULL << 32) * 1000 - 11 * HOUR_US);
+    simStartUs = hal::micros();
+
+    LedController led(18, LEDC_CHANNEL_0, LEDC_TIMER_0, 25000, LEDC_TIMER_10_BIT);
+    led.begin();
+    MotionSensor motion;
+    LampStateMachine& lamp = LampStateMachine::getInstance(led, motion);
+    LampControlTask control(lamp, isSimNight);
+
+    Sleeper sleeper;
+    Reader reader;
+    PassThrough passThrough;
+    Pet pet;
+
+    // Scenari di riferimento, un mese ciascuno
+    struct Named {
+        const char* name;
+        Scenario scenario;
+    };
+    Named named[] = {
+        {"sleeper", {{&sleeper}, 1, 0, &SCRIPTS[0], MONTH_DAYS, 1}},
+        {"sleeper, radar 2 misses/h", {{&sleeper}, 1, 2, &SCRIPTS[0], MONTH_DAYS, 1}},
+        {"reader", {{&reader}, 1, 0, &SCRIPTS[0], MONTH_DAYS, 2}},
+        {"reader, radar 4 misses/h", {{&reader}, 1, 4, &SCRIPTS[0], MONTH_DAYS, 2}},
+        {"reader + sleeper, dim 21:30", {{&reader, &sleeper}, 2, 0, &SCRIPTS[1], MONTH_DAYS, 3}},
+        {"sleeper, manual 22:00", {{&sleeper}, 1, 0, &SCRIPTS[2], MONTH_DAYS, 4}},
+        {"pass-through", {{&passThrough}, 1, 0, &SCRIPTS[0], MONTH_DAYS, 5}},
+        {"pet", {{&pet}, 1, 0, &SCRIPTS[0], MONTH_DAYS, 6}},
+        {"sleeper + pet", {{&sleeper, &pet}, 2, 0, &SCRIPTS[0], MONTH_DAYS, 7}},
+    };
+    bool ok = true;
+    uint32_t wraps = 0;
+    for (const Named& n : named) {
+        ScenarioMetrics m = runScenario(n.scenario, lamp, control, led);
+        printMetrics(n.name, m, n.scenario.days);
+        wraps += m.millisWraps;
+        // Con un radar perfetto nessuno resta al buio in automatico
+        if (n.scenario.dropoutsPerHour == 0 && n.scenario.script->count == 0 && m.darkOccupiedEvents != 0) {
+            ok = false;
+        }
+    }
+
+    // Sweep: combinazioni casuali di occupanti, qualità del radar e comandi HomeKit
+    Occupant* pool[] = {&sleeper, &reader, &passThrough, &pet};
+    const uint32_t DROPOUT_RATES[] = {0, 1, 2, 4, 8};
+    Rng pick(42);
+    ScenarioMetrics total = {};
+    uint64_t simEvents = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t s = 0; s < sweepMonths; ++s) {
+        Scenario scenario = {};
+        for (Occupant* o : pool) {
+            if (pick.chance(50)) {
+                scenario.occupants[scenario.occupantCount++] = o;
+            }
+        }
+        scenario.dropoutsPerHour = DROPOUT_RATES[pick.range(0, 5)];
+        scenario.script = &SCRIPTS[pick.range(0, SCRIPT_COUNT)];
+        scenario.days = MONTH_DAYS;
+        scenario.seed = pick.next();
+        ScenarioMetrics m = runScenario(scenario, lamp, control, led);
+        total.litEmptyS += m.litEmptyS;
+        total.litDayS += m.litDayS;
+        total.darkOccupiedS += m.darkOccupiedS;
+        total.darkOccupiedEvents += m.darkOccupiedEvents;
+        total.fades += m.fades;
+        total.transitions += m.transitions;
+        simEvents += m.events;
+        wraps += m.millisWraps;
+    }
+    double wallS = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double msPerMonth = sweepMonths > 0 ? wallS * 1000 / sweepMonths : 0;
+    if (sweepMonths > 0) {
+        printMetrics("sweep average", total, sweepMonths * MONTH_DAYS);
+    }
+    printf("%-34s %u months in %.2f s: %.2f ms per simulated month, %.0f events/month, %u millis() wraps\n",
+           "sweep", sweepMonths, wallS, msPerMonth, sweepMonths > 0 ? static_cast<double>(simEvents) / sweepMonths : 0.0,
+           wraps);
+    return ok && wraps > 0 && msPerMonth < 100 ? 0 : 1;
+}
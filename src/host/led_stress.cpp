@@ -0,0 +1,137 @@
+// Stress del LED a proprietario unico: più thread inviano comandi a caso e leggono lo stato
+// pubblicato, un thread fa da task LED e da task esp_timer (orologio virtuale).
+//
+//   pio run -e native_stress && .pio/build/native_stress/program [secondi]
+//
+// La build usa ThreadSanitizer: qualsiasi accesso concorrente allo stato del LED fuori dalle
+// code e dallo snapshot viene segnalato. Esce con codice diverso da zero se un controllo fallisce.
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include "Hal.h"
+#include "LedController.h"
+
+namespace {
+
+const int PRODUCERS = 3;
+const uint32_t MAX_DUTY = 1023;
+
+struct ProducerStats {
+    uint32_t attempted;
+    uint32_t accepted;
+    uint32_t badStates;
+};
+
+std::atomic<bool> stop(false);
+
+// xorshift32: niente rand(), che non è rientrante
+uint32_t nextRandom(uint32_t& state) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+bool submitRandom(LedController& led, uint32_t& seed) {
+    uint32_t r = nextRandom(seed);
+    uint32_t duration = (r >> 8) % 400;
+    FadeCurve curve = static_cast<FadeCurve>((r >> 16) % 3);
+    switch (r % 10) {
+    case 0: return led.setLevel(static_cast<uint8_t>((r >> 4) % 101));
+    case 1: return led.startFadeToLevel(static_cast<uint8_t>((r >> 4) % 101), duration, curve);
+    case 2:
+    case 3: return led.requestLevel(static_cast<uint8_t>((r >> 4) % 101), 200);
+    case 4: return led.startFadeTo(static_cast<uint16_t>((r >> 4) % (MAX_DUTY + 1)), duration, curve);
+    case 5: return led.cancelFade();
+    case 6: return led.setColorTemperature(static_cast<uint16_t>(140 + (r >> 4) % 240), duration);
+    case 7: return led.setDithering(((r >> 4) & 1) != 0);
+    case 8: return (r >> 4) % 8 == 0 ? led.startSetupBlink(100) : led.stopSetupBlink();
+    default: return led.setBrightness(static_cast<uint16_t>((r >> 4) % (MAX_DUTY + 1)));
+    }
+}
+
+// Lo snapshot deve essere sempre coerente: mai un duty fuori scala o un contatore che torna indietro
+bool consistent(const LedState& state, uint32_t& lastCommands) {
+    bool ok = state.brightness <= MAX_DUTY && state.endBrightness <= MAX_DUTY && state.commands >= lastCommands;
+    uint16_t brightest = 0;
+    for (uint8_t i = 0; i < 2; ++i) {
+        ok = ok && state.channels[i] <= MAX_DUTY;
+        brightest = state.channels[i] > brightest ? state.channels[i] : brightest;
+    }
+    lastCommands = state.commands;
+    return ok && brightest == state.brightness && (state.fading || state.endBrightness == state.brightness);
+}
+
+void producer(LedController& led, uint32_t seed, ProducerStats& stats) {
+    uint32_t lastCommands = 0;
+    while (!stop.load(std::memory_order_relaxed)) {
+        ++stats.attempted;
+        if (submitRandom(led, seed)) {
+            ++stats.accepted;
+        } else {
+            std::this_thread::yield();  // coda piena: il proprietario è indietro
+        }
+        if (!consistent(led.getState(), lastCommands)) {
+            ++stats.badStates;
+        }
+    }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    hal::native::setLogEnabled(false);
+    double seconds = argc > 1 ? atof(argv[1]) : 2.0;
+
+    static const uint8_t pins[] = {18, 19};
+    LedController led(LedLayout::CCT, pins, LEDC_CHANNEL_0, LEDC_TIMER_0, 25000, LEDC_TIMER_10_BIT);
+    led.begin();
+    led.setInlineProcessing(false);
+
+    ProducerStats stats[PRODUCERS] = {};
+    std::thread producers[PRODUCERS];
+    for (int i = 0; i < PRODUCERS; ++i) {
+        producers[i] = std::thread(producer, std::ref(led), 0x9E3779B9u * (i + 1), std::ref(stats[i]));
+    }
+
+    // Proprietario: applica i comandi e fa scattare i timer, 1 ms di orologio virtuale per giro
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::duration<double>(seconds);
+    uint32_t passes = 0;
+    while (std::chrono::steady_clock::now() < deadline) {
+        led.process(0);
+        hal::native::advance(1000);
+        ++passes;
+        std::this_thread::yield();  // come il task LED che torna ad attendere sulla coda
+    }
+    stop.store(true);
+    for (std::thread& t : producers) {
+        t.join();
+    }
+    led.process(0);
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    uint32_t attempted = 0;
+    uint32_t accepted = 0;
+    uint32_t badStates = 0;
+    for (const ProducerStats& s : stats) {
+        attempted += s.attempted;
+        accepted += s.accepted;
+        badStates += s.badStates;
+    }
+    LedState state = led.getState();
+    uint32_t dropped = led.getDroppedCommands();
+    printf("led stress: %d producers, %u passes, %u commands applied (%.0f commands/s)\n", PRODUCERS, passes,
+           state.commands, state.commands / elapsed);
+    printf("led stress: %u submitted, %u accepted, %u queue full, %u inconsistent snapshots\n", attempted, accepted,
+           attempted - accepted, badStates);
+
+    // Ogni comando accettato è applicato una volta sola; i rifiutati sono contati come persi
+    bool ok = state.commands == accepted && badStates == 0 && dropped >= attempted - accepted && accepted > 0;
+    if (!ok) {
+        printf("led stress: FAILED (dropped counter %u)\n", dropped);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,203 @@
+// Decodifica un dump della partizione di trace e lo riproduce in LampStateMachine su orologio virtuale.
+//
+//   esptool.py read_flash 0x3D0000 0x20000 trace.bin
+//   pio run -e native_replay && .pio/build/native_replay/program trace.bin [--print]
+//
+// Il radar nella trace compare solo quando il campione grezzo cambia: durante il replay
+// l'ultimo campione viene ripetuto a 10 frame/s, come fa l'LD2410, e passa dal filtro.
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include "Hal.h"
+#include "LedController.h"
+#include "MotionSensor.h"
+#include "LampStateMachine.h"
+#include "LampControlTask.h"
+#include "TraceRecorder.h"
+
+namespace {
+
+const uint32_t SENSOR_FRAME_MS = 100;
+const size_t MAX_TRANSITIONS = 65536;
+
+struct Transition {
+    uint32_t timeMs;
+    LampState from;
+    LampState to;
+};
+
+hal::Partition input;
+Transition recorded[MAX_TRANSITIONS];
+Transition replayed[MAX_TRANSITIONS];
+
+const char* typeName(TraceType type) {
+    switch (type) {
+    case TraceType::SENSOR: return "sensor";
+    case TraceType::BRIGHTNESS: return "brightness";
+    case TraceType::AUTO_MODE: return "auto";
+    case TraceType::STATE: return "state";
+    case TraceType::FADE: return "fade";
+    }
+    return "?";
+}
+
+void printRecord(const TraceRecord& r) {
+    printf("%10u.%03u %-10s ", r.timeMs / 1000, r.timeMs % 1000, typeName(r.type));
+    switch (r.type) {
+    case TraceType::SENSOR:
+        printf("movement=%d presence=%d moving=%ucm stationary=%ucm\n", r.sensor.movement, r.sensor.presence,
+               r.sensor.movingDistance, r.sensor.stationaryDistance);
+        break;
+    case TraceType::BRIGHTNESS:
+        printf("%u%%\n", r.brightness);
+        break;
+    case TraceType::AUTO_MODE:
+        printf("%s\n", r.autoMode ? "on" : "off");
+        break;
+    case TraceType::STATE:
+        if (r.state.lamp != 0) {
+            printf("lamp %u: ", r.state.lamp);
+        }
+        printf("%d -> %d\n", static_cast<int>(r.state.from), static_cast<int>(r.state.to));
+        break;
+    case TraceType::FADE:
+        printf("duty=%u in %ums curve=%d\n", r.fade.targetDuty, r.fade.durationMs, static_cast<int>(r.fade.curve));
+        break;
+    }
+}
+
+// Porta l'orologio a untilMs generando i frame del radar e servendo i timeout di stato
+void advanceTo(uint64_t untilUs, LampControlTask& control, MotionSensor& motion, const LD2410Frame& sample,
+               uint64_t& nextFrameUs) {
+    for (;;) {
+        uint64_t timeoutUs = hal::micros() + static_cast<uint64_t>(control.nextTimeoutMs()) * 1000;
+        uint64_t wakeUs = timeoutUs < nextFrameUs ? timeoutUs : nextFrameUs;
+        if (wakeUs > untilUs) {
+            break;
+        }
+        hal::native::advance(wakeUs - hal::micros());
+        if (hal::micros() >= nextFrameUs) {
+            nextFrameUs += SENSOR_FRAME_MS * 1000;
+            if (motion.injectFrame(sample)) {
+                postLampEvent(LampEvent::sensorFrame(motion.isMovementDetected(), motion.isPresenceDetected(),
+                                                     motion.getMovementDistance(), motion.getStationaryDistance()));
+            }
+        }
+        control.runOnce();
+    }
+    if (untilUs > hal::micros()) {
+        hal::native::advance(untilUs - hal::micros());
+    }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "uso: %s dump.bin [--print]\n", argv[0]);
+        return 2;
+    }
+    bool print = argc > 2 && strcmp(argv[2], "--print") == 0;
+    if (!input.loadImage(argv[1])) {
+        fprintf(stderr, "impossibile leggere %s\n", argv[1]);
+        return 2;
+    }
+    hal::native::setLogEnabled(false);
+
+    // Primo passaggio: decodifica e transizioni registrate sul dispositivo
+    size_t recordedCount = 0;
+    uint32_t records = 0;
+    uint32_t firstMs = 0;
+    uint32_t lastMs = 0;
+    {
+        TraceReader reader(input);
+        TraceRecord record;
+        while (reader.next(record)) {
+            if (records++ == 0) {
+                firstMs = record.timeMs;
+            }
+            lastMs = record.timeMs;
+            if (print) {
+                printRecord(record);
+            }
+            // Il replay rifà solo la lampada singola: le altre del bridge si stampano e basta
+            if (record.type == TraceType::STATE && record.state.lamp == 0 && recordedCount < MAX_TRANSITIONS) {
+                recorded[recordedCount++] = {record.timeMs, record.state.from, record.state.to};
+            }
+        }
+        printf("%u records in %u pages, %.1f h of trace\n", records, reader.getPages(), (lastMs - firstMs) / 3.6e6);
+    }
+    if (records == 0) {
+        return 1;
+    }
+
+    // Secondo passaggio: replay. Le transizioni prodotte vanno in una trace nuova, in memoria
+    TraceRecorder& output = TraceRecorder::getInstance();
+    output.begin();
+    LedController led(18, LEDC_CHANNEL_0, LEDC_TIMER_0, 25000, LEDC_TIMER_10_BIT);
+    led.begin();
+    MotionSensor motion;
+    LampStateMachine& lamp = LampStateMachine::getInstance(led, motion);
+    LampControlTask control(lamp, nullptr);
+    hal::native::setTime(static_cast<uint64_t>(firstMs) * 1000);
+
+    LD2410Frame sample = {};
+    uint64_t nextFrameUs = hal::micros();
+    auto start = std::chrono::steady_clock::now();
+    TraceReader reader(input);
+    TraceRecord record;
+    while (reader.next(record)) {
+        advanceTo(static_cast<uint64_t>(record.timeMs) * 1000, control, motion, sample, nextFrameUs);
+        switch (record.type) {
+        case TraceType::SENSOR:
+            sample.targetState = (record.sensor.movement ? 1 : 0) | (record.sensor.presence ? 2 : 0);
+            sample.movingDistance = record.sensor.movingDistance;
+            sample.stationaryDistance = record.sensor.stationaryDistance;
+            break;
+        case TraceType::BRIGHTNESS:
+            postLampEvent(LampEvent::brightnessChanged(record.brightness));
+            control.runOnce();
+            break;
+        case TraceType::AUTO_MODE:
+            postLampEvent(LampEvent::autoModeChanged(record.autoMode));
+            control.runOnce();
+            break;
+        default:
+            break;
+        }
+        // Le pagine della trace di replay vanno scritte man mano
+        while (output.pump(0)) {
+        }
+    }
+    output.flush();
+    while (output.pump(0)) {
+    }
+    double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    size_t replayedCount = 0;
+    TraceReader replayReader(output.getPartition());
+    while (replayReader.next(record)) {
+        if (record.type == TraceType::STATE && record.state.lamp == 0 && replayedCount < MAX_TRANSITIONS) {
+            replayed[replayedCount++] = {record.timeMs, record.state.from, record.state.to};
+        }
+    }
+
+    // Confronto: stessa sequenza di transizioni, scarto di tempo massimo
+    size_t matching = 0;
+    uint32_t maxSkewMs = 0;
+    while (matching < recordedCount && matching < replayedCount &&
+           recorded[matching].from == replayed[matching].from && recorded[matching].to == replayed[matching].to) {
+        uint32_t a = recorded[matching].timeMs;
+        uint32_t b = replayed[matching].timeMs;
+        uint32_t skew = a > b ? a - b : b - a;
+        maxSkewMs = skew > maxSkewMs ? skew : maxSkewMs;
+        ++matching;
+    }
+    printf("replay: %.0fx real time, transitions recorded %zu, replayed %zu, matching prefix %zu (max skew %u ms)\n",
+           (lastMs - firstMs) / 1000.0 / wallSeconds, recordedCount, replayedCount, matching, maxSkewMs);
+    if (matching < recordedCount || matching < replayedCount) {
+        printf("first divergence at transition #%zu\n", matching);
+        return 1;
+    }
+    return 0;
+}
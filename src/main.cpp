@@ -1,62 +1,400 @@
 #include "HomeSpan.h"
+#include <new>
 #include "LedController.h"
 #include "HomeSpanController.h"
 #include "MotionSensor.h"
 #include "LampStateMachine.h"
-#include "TimeUtils.h"
+#include "TimeService.h"
+#include "LampEvents.h"
+#include "LampControlTask.h"
+#include "TraceRecorder.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "LightingProfiles.h"
+#include "OccupancyLearner.h"
+#include "PowerManager.h"
+#include "ResumeState.h"
+#include "LampBank.h"
+#include "UsageHistory.h"
 
-#define LED_PIN 18
-#define LED_CHANNEL LEDC_CHANNEL_0
+#define LED_LAYOUT LedLayout::MONO  // CCT: pin caldo e freddo; RGBW: rosso, verde, blu, bianco
+#define LED_FIRST_CHANNEL LEDC_CHANNEL_0
 #define LED_TIMER LEDC_TIMER_0
 #define LED_FREQ 25000
 #define LED_RESOLUTION LEDC_TIMER_10_BIT
+#define STATS_INTERVAL_MS 60000
+#define TRACE_FLUSH_MS (5 * 60 * 1000)
+#define LOG_DRAIN_MS 50
+#define PARKED_LOG_DRAIN_MS 1000  // da parcheggiati il log non deve svegliare la CPU 20 volte al secondo
+#define METRICS_SAMPLE_MS 10000
+// La partizione "spiffs" (128 KB) è divisa: il ring della trace in testa, lo storico d'uso in coda
+#define TRACE_REGION_BYTES 0x18000
+#define HISTORY_MAX_NIGHTS 60
 
-LedController ledController(LED_PIN, LED_CHANNEL, LED_TIMER, LED_FREQ, LED_RESOLUTION);
+// Stack dei task in byte. Il dump delle metriche ("@M") riporta per ognuno il minimo di stack
+// libero e una dimensione consigliata: dopo qualche giorno di funzionamento si aggiornano da lì
+#define LED_TASK_STACK 3072
+#define LOOP_TASK_STACK 4096
+#define SENSOR_TASK_STACK 4096
+#define TRACE_TASK_STACK 3072
+#define TIME_TASK_STACK 6144  // il lookup HTTP del fuso è il percorso più profondo
+#define LOG_TASK_STACK 3072
+
+static const uint8_t LED_PINS[] = {18};  // un pin per canale del layout, es. {18, 19} per CCT
+#define SENSOR_OUT_PIN 4  // uscita OUT del LD2410: alta quando c'è un bersaglio
+// Zone del radar in gate da 0,75 m: gate, soglia di ingresso e di uscita, frame di tenuta
+static const ZoneConfig SENSOR_ZONES[] = {
+    {0, 1, 20, 8, 50},   // scrivania, entro 1,5 m
+    {4, 5, 30, 16, 10},  // porta, 3-4,5 m
+};
+#define PRESENCE_ZONES 0x01  // zone in cui la presenza da fermo tiene accesa la lampada, 0 = ovunque
+LedController ledController(LED_LAYOUT, LED_PINS, LED_FIRST_CHANNEL, LED_TIMER, LED_FREQ, LED_RESOLUTION);
 AutoModeSwitch* autoModeSwitch;
 SmartLamp* smartLamp;
 MotionSensor motionSensor;
 
-//predefine void loopTask(void * parameter) {
+// Bridge HomeKit: più lampade sulla stessa scheda, ognuna con il suo LED e la sua macchina a stati
+// in un LampBank. La prima è ledController; il LEDC ha 8 canali, quindi al massimo 8 lampade MONO.
+// Senza bridge resta la lampada singola, con preaccensione, ripresa al boot e parcheggio
+#define BRIDGE_MODE 0
+#if BRIDGE_MODE
+// Lampade oltre la prima: pin, canale LEDC, radar (indice in SENSORS) e zone di presenza
+struct BridgeLamp {
+    uint8_t pin;
+    ledc_channel_t channel;
+    uint8_t sensor;
+    uint8_t presenceZones;
+};
+static const BridgeLamp BRIDGE_LAMPS[] = {
+    {19, LEDC_CHANNEL_1, 0, 0x02},  // ingresso: stesso radar della scrivania, zona della porta
+    {21, LEDC_CHANNEL_2, 1, 0},     // altra stanza: radar suo sulla UART1
+};
+#define BRIDGE_LAMP_COUNT (1 + sizeof(BRIDGE_LAMPS) / sizeof(BRIDGE_LAMPS[0]))
+MotionSensor roomSensor(1, 25, 26);
+static MotionSensor* const SENSORS[] = {&motionSensor, &roomSensor};
+static LedController* bridgeLeds[BRIDGE_LAMP_COUNT];
+// I LED oltre il primo vivono in memoria statica, costruiti in setupBridge() dalla tabella
+alignas(LedController) static uint8_t bridgeLedStorage[BRIDGE_LAMP_COUNT - 1][sizeof(LedController)];
+static hal::Queue<uint8_t, 1> bridgeLedWakeups;
+static LampBank bridge;
+#else
+static MotionSensor* const SENSORS[] = {&motionSensor};
+#endif
+#define SENSOR_COUNT (sizeof(SENSORS) / sizeof(SENSORS[0]))
+
+static bool isNight() {
+    return TimeService::getInstance().isNightTime();
+}
+
+static hal::Partition historyPartition;
+static UsageHistory history;
+
+// Comando "@H <notti> <stanza>": minuti di luce accesa per notte, dalla più vecchia
+static void historyCommand(const char* buf) {
+    unsigned nights = 14;
+    unsigned room = 0;
+    sscanf(buf + 1, "%u %u", &nights, &room);
+    int32_t now = TimeService::getInstance().localEpochMinute();
+    if (nights == 0 || nights > HISTORY_MAX_NIGHTS || room >= UsageHistory::MAX_ROOMS || now < 0) {
+        LOG_WARN("History: %u notti, stanza %u o ora non valide", nights, room);
+        return;
+    }
+    static uint16_t lit[HISTORY_MAX_NIGHTS];
+    size_t known = history.litPerNight(static_cast<uint8_t>(room), now, lit, nights);
+    int32_t first = UsageHistory::dayOf(now) - static_cast<int32_t>(nights) + 1;
+    char line[96];
+    int len = snprintf(line, sizeof(line), "history: stanza %u, %u notti su %u con dati\n", room,
+                       static_cast<unsigned>(known), nights);
+    hal::logWrite(line, static_cast<size_t>(len));
+    for (unsigned i = 0; i < nights; ++i) {
+        // La giornata d va dal mezzogiorno del giorno d dal 1970 a quello dopo
+        len = snprintf(line, sizeof(line), "history: giornata %ld, %u minuti accesi di notte\n",
+                       static_cast<long>(first + static_cast<int32_t>(i)), lit[i]);
+        hal::logWrite(line, static_cast<size_t>(len));
+    }
+    const HistoryStats& stats = history.getStats();
+    len = snprintf(line, sizeof(line), "history: %lu chunk, %lu/%lu/%lu B minuti/ore/giorni, %lu erase, %lu persi\n",
+                   static_cast<unsigned long>(stats.chunks), static_cast<unsigned long>(stats.bytesWritten[UsageHistory::MINUTES]),
+                   static_cast<unsigned long>(stats.bytesWritten[UsageHistory::HOURS]),
+                   static_cast<unsigned long>(stats.bytesWritten[UsageHistory::DAYS]),
+                   static_cast<unsigned long>(stats.sectorsErased), static_cast<unsigned long>(stats.dropped));
+    hal::logWrite(line, static_cast<size_t>(len));
+}
+
+// Trace e storico dividono la partizione; lo storico riparte dai segmenti già in flash
+static void beginRecorders() {
+    TraceRecorder::getInstance().begin("spiffs", 0, TRACE_REGION_BYTES);
+    if (!historyPartition.open("spiffs", TRACE_REGION_BYTES) || !history.begin(historyPartition)) {
+        LOG_WARN("History: partizione non disponibile");
+    }
+    new SpanUserCommand('H', "<notti> <stanza> - minuti di luce accesa per notte dallo storico", historyCommand);
+}
+
+// Comando "@C <secondi> <radar>" della CLI di HomeSpan: calibrazione dei gate a stanza vuota
+#define CALIBRATION_DEFAULT_S 600  // abbastanza per un ciclo del climatizzatore e qualche raffica
+static void calibrateCommand(const char* buf) {
+    unsigned seconds = CALIBRATION_DEFAULT_S;
+    unsigned index = 0;
+    sscanf(buf + 1, "%u %u", &seconds, &index);
+    if (index >= SENSOR_COUNT || seconds == 0) {
+        LOG_WARN("Gates: radar %u o durata %u s non validi", index, seconds);
+        return;
+    }
+    SENSORS[index]->requestCalibration(seconds * 1000);
+}
+
+static void postSensorFrame(const MotionSensor& sensor, uint8_t index) {
+    postLampEvent(LampEvent::sensorFrame(sensor.isMovementDetected(), sensor.isPresenceDetected(),
+                                         sensor.getMovementDistance(), sensor.getStationaryDistance(),
+                                         sensor.getOccupiedZones(), sensor.hasZones(), index));
+}
+
+// Un task per radar (parametro: indice in SENSORS). Dorme finché il driver UART non consegna
+// un frame; pubblica un evento solo quando presenza o movimento cambiano.
+// L'avvio del radar (mezzo secondo) avviene qui, in parallelo al resto del boot
+void sensorTask(void * parameter) {
+    Metrics::registerTask("SensorTask", SENSOR_TASK_STACK);
+    uint8_t index = static_cast<uint8_t>(reinterpret_cast<uintptr_t>(parameter));
+    MotionSensor& sensor = *SENSORS[index];
+    sensor.begin();
+    bool synced = false;
+    for(;;) {
+        sensor.waitForData(UINT32_MAX);
+        Metrics::BusyScope busy;
+        bool changed = sensor.update();
+        // Il primo frame va pubblicato comunque: sostituisce la presenza assunta alla ripresa
+        if (changed || (!synced && sensor.isConnected())) {
+            synced = true;
+            postSensorFrame(sensor, index);
+        }
+    }
+}
+
+// Scrive in flash le pagine di trace piene; se per un po' non ne arrivano chiude quella parziale.
+// Dopo ogni pagina, o al più ogni TRACE_FLUSH_MS, scrive anche i chunk chiusi dello storico
+void traceWriterTask(void * parameter) {
+    Metrics::registerTask("TraceTask", TRACE_TASK_STACK);
+    TraceRecorder& recorder = TraceRecorder::getInstance();
+    for(;;) {
+        if (!recorder.pump(TRACE_FLUSH_MS)) {
+            recorder.flush();
+        }
+        while (history.pump()) {
+        }
+    }
+}
+
+// Unico proprietario del LED: applica i comandi degli altri task e gli scatti dei timer di fade
+void ledTask(void * parameter) {
+    Metrics::registerTask("LedTask", LED_TASK_STACK);
+    for(;;) {
+        ledController.process(hal::Queue<uint8_t, 1>::WAIT_FOREVER);
+    }
+}
+
+// Formatta e stampa i record di log accodati dagli altri task; Serial blocca solo questo task.
+// Campiona anche stack, heap e carico dei task per il dump delle metriche
+void logTask(void * parameter) {
+    Metrics::registerTask("LogTask", LOG_TASK_STACK);
+    uint32_t lastSample = hal::millis();
+    for(;;) {
+        {
+            Metrics::BusyScope busy;
+            logDrain();
+        }
+        if (hal::millis() - lastSample >= METRICS_SAMPLE_MS) {
+            Metrics::sampleSystem();
+            lastSample = hal::millis();
+        }
+        vTaskDelay(pdMS_TO_TICKS(PowerManager::getInstance().isParked() ? PARKED_LOG_DRAIN_MS : LOG_DRAIN_MS));
+    }
+}
+
+// SNTP, fuso e calcolo giorno/notte; si sveglia solo al prossimo cambio o quando torna la rete
+void timeTask(void * parameter) {
+    Metrics::registerTask("TimeTask", TIME_TASK_STACK);
+    TimeService& timeService = TimeService::getInstance();
+    for(;;) {
+        timeService.waitForWork(timeService.poll());
+    }
+}
+
 void smartLampLoopTask(void * parameter) {
-    TimeUtils* timeUtils = TimeUtils::getInstance();
-    
-    // Attendere che il tempo sia sincronizzato
-    while (!timeUtils->isTimeSynced()) {
-        vTaskDelay(1); // Attesa di 1 secondo prima di controllare nuovamente
-    }
-    vTaskDelay(5000);
-    // Una volta sincronizzato, continua con il loop principale
+    Metrics::registerTask("LoopTask", LOOP_TASK_STACK);
+    // La lampada è già stata ripresa in setup(): finché l'ora non è nota isNight() è falso e la
+    // lampada resta com'è, poi il primo calcolo giorno/notte sveglia il task con un evento
+    LampStateMachine& lamp = LampStateMachine::getInstance(ledController, motionSensor);
+    OccupancyLearner& learner = OccupancyLearner::getInstance();
+    ResumeState& resume = ResumeState::getInstance();
+    LampControlTask control(lamp, isNight);
+    PowerManager& power = PowerManager::getInstance();
+    control.setPowerManager(&power);
+    control.setResumeState(&resume);
+
+    // Stato di partenza nella trace, così il replay riparte dalle stesse impostazioni
+    TraceRecorder::getInstance().recordBrightness(lamp.getMaxBrightness());
+    TraceRecorder::getInstance().recordAutoMode(lamp.isAutoMode());
+
+    // Una volta sincronizzato, il task dorme sulla coda fino al prossimo evento o timeout
+    uint32_t lastReport = hal::millis();
     for(;;) {
-        uint8_t isNight = timeUtils->isNightTime();
-        if (isNight == 1) {  // Notte
-            LampStateMachine& lamp = LampStateMachine::getInstance(ledController, motionSensor);
-            lamp.update(smartLamp->getNewBrightness(), autoModeSwitch->getIsOnAutoMode());
+        control.runOnce();
+        // Il fondo dei gate impara solo quando nessuno dovrebbe essere nella stanza
+        motionSensor.setBackgroundLearning(isNight() && lamp.isAutoMode() && lamp.getCurrentState() == LampState::OFF);
+        // Lo storico cambia solo in questo task: lo salva qui, a blocchi di qualche ora
+        learner.persistIfDue();
+        // Lo storico d'uso riempie da sé i minuti senza risvegli: basta lo stato a ogni passo
+        history.observe(0, TimeService::getInstance().localEpochMinute(), lamp.getCurrentState(), lamp.isOccupied(), isNight());
+        resume.update(lamp.getCurrentState(), lamp.getMaxBrightness(), lamp.isAutoMode());
+        resume.persistIfDue();
+
+        uint32_t elapsed = hal::millis() - lastReport;
+        if (elapsed >= STATS_INTERVAL_MS) {
+            const LampLoopStats& stats = control.getStats();
+            LOG_INFO("Loop: %lu wakeups/min, %lu events, cpu %lu us/min",
+                     (unsigned long)(stats.wakeups * 60000ULL / elapsed), (unsigned long)stats.events,
+                     (unsigned long)(stats.busyUs * 60000ULL / elapsed));
+            LOG_INFO("Loop: latency %lu us (max %lu)", (unsigned long)stats.lastLatencyUs,
+                     (unsigned long)stats.maxLatencyUs);
+            PowerStats powerStats = power.getStats();
+            LOG_INFO("Power: parked %lu%%, %lu wakeups parked, %lu pin wakes, light sleep %s",
+                     (unsigned long)(powerStats.parkedMs * 100 / elapsed), (unsigned long)powerStats.parkedWakeups,
+                     (unsigned long)powerStats.pinWakes, power.isLightSleepEnabled() ? "on" : "off");
+            control.resetStats();
+            power.resetStats();
+            lastReport = hal::millis();
         }
-        
-        // Altre operazioni necessarie...
-        vTaskDelay(1); // Piccola pausa per evitare di sovraccaricare il core
     }
 }
 
+#if BRIDGE_MODE
+// Un solo task proprietario per tutti i LED del bridge: si sveglia sulla coda comune
+void bridgeLedTask(void * parameter) {
+    Metrics::registerTask("LedTask", LED_TASK_STACK);
+    for(;;) {
+        LedController::processAll(bridgeLedWakeups, bridgeLeds, BRIDGE_LAMP_COUNT, hal::Queue<uint8_t, 1>::WAIT_FOREVER);
+    }
+}
+
+// Come smartLampLoopTask, con un passo del LampBank per tutte le lampade a ogni risveglio
+void bridgeLoopTask(void * parameter) {
+    Metrics::registerTask("LoopTask", LOOP_TASK_STACK);
+    for(;;) {
+        uint32_t timeout = bridge.msUntilTimeout();
+        LampEvent event;
+        bool received = waitLampEvent(event, timeout < LampControlTask::ACTIVE_RECHECK_MS ? timeout
+                                                                                          : LampControlTask::ACTIVE_RECHECK_MS);
+        Metrics::BusyScope busy;
+        while (received) {
+            bridge.applyEvent(event);
+            received = waitLampEvent(event, 0);
+        }
+        bool night = isNight();
+        if (night) {
+            bridge.evaluate();
+        }
+        // Il fondo dei gate di un radar impara solo con tutte le sue lampade spente in automatico
+        uint8_t watched = 0;
+        for (uint8_t i = 0; i < bridge.size(); ++i) {
+            if (!bridge.isAutoMode(i) || bridge.getState(i) != LampState::OFF) {
+                watched |= 1 << bridge.getSensor(i);
+            }
+        }
+        for (uint8_t i = 0; i < SENSOR_COUNT; ++i) {
+            SENSORS[i]->setBackgroundLearning(night && (watched & (1 << i)) == 0);
+        }
+        // Una stanza dello storico per lampada
+        int32_t minute = TimeService::getInstance().localEpochMinute();
+        for (uint8_t i = 0; i < bridge.size() && i < UsageHistory::MAX_ROOMS; ++i) {
+            history.observe(i, minute, bridge.getState(i), bridge.isOccupied(i), night);
+        }
+    }
+}
+
+static void setupBridge() {
+    LightingProfiles::getInstance().begin();
+    bridgeLeds[0] = &ledController;
+    for (size_t i = 1; i < BRIDGE_LAMP_COUNT; ++i) {
+        const BridgeLamp& config = BRIDGE_LAMPS[i - 1];
+        bridgeLeds[i] = new (bridgeLedStorage[i - 1]) LedController(config.pin, config.channel, LED_TIMER, LED_FREQ, LED_RESOLUTION);
+    }
+    for (size_t i = 0; i < BRIDGE_LAMP_COUNT; ++i) {
+        bridgeLeds[i]->shareWakeups(bridgeLedWakeups);
+        bridgeLeds[i]->begin();
+    }
+    xTaskCreatePinnedToCore(bridgeLedTask, "LedTask", LED_TASK_STACK, NULL, 3, NULL, 1);
+
+    bridge.addLamp(ledController, 0, PRESENCE_ZONES);
+    for (size_t i = 1; i < BRIDGE_LAMP_COUNT; ++i) {
+        bridge.addLamp(*bridgeLeds[i], BRIDGE_LAMPS[i - 1].sensor, BRIDGE_LAMPS[i - 1].presenceZones);
+    }
+    // Come gli interruttori HomeKit, che partono in automatico
+    for (uint8_t i = 0; i < BRIDGE_LAMP_COUNT; ++i) {
+        bridge.applyEvent(LampEvent::autoModeChanged(true, i));
+    }
+
+    beginRecorders();
+    TimeService::getInstance().begin();
+    motionSensor.setZones(SENSOR_ZONES, sizeof(SENSOR_ZONES) / sizeof(SENSOR_ZONES[0]));
+
+    xTaskCreatePinnedToCore(bridgeLoopTask, "LoopTask", LOOP_TASK_STACK, NULL, 1, NULL, 1);
+    for (uintptr_t i = 0; i < SENSOR_COUNT; ++i) {
+        xTaskCreatePinnedToCore(sensorTask, "SensorTask", SENSOR_TASK_STACK, reinterpret_cast<void*>(i), 2, NULL, 1);
+    }
+    xTaskCreatePinnedToCore(traceWriterTask, "TraceTask", TRACE_TASK_STACK, NULL, 0, NULL, 1);
+    xTaskCreatePinnedToCore(timeTask, "TimeTask", TIME_TASK_STACK, NULL, 1, NULL, 0);
+    xTaskCreatePinnedToCore(logTask, "LogTask", LOG_TASK_STACK, NULL, 0, NULL, 1);
+    new SpanUserCommand('C', "<s> <radar> - calibrazione dei gate del radar a stanza vuota", calibrateCommand);
+    setupHomeSpanBridge(bridgeLeds, BRIDGE_LAMP_COUNT);
+    Metrics::sealHeap();
+}
+#endif
+
 void setup() {
     Serial.begin(256000);
+#if BRIDGE_MODE
+    setupBridge();
+#else
 
-    Serial2.begin(256000);  // Inizializza Serial2 per il sensore LD2410
-
+    // Prima la luce: stato salvato, profili e LED, poi tutto ciò che non serve ad accenderla
+    ResumeState& resume = ResumeState::getInstance();
+    resume.begin();
+    LightingProfiles::getInstance().begin();
     ledController.begin();
+    xTaskCreatePinnedToCore(ledTask, "LedTask", LED_TASK_STACK, NULL, 3, NULL, 1);
+    ledController.setDithering(true);
+
+    const ResumeRecord& saved = resume.get();
+    LampStateMachine& lamp = LampStateMachine::getInstance(ledController, motionSensor);
+    lamp.setPresenceZones(PRESENCE_ZONES);
+    lamp.resume(saved.state, saved.brightness, saved.autoMode);
+
+    beginRecorders();
+    TimeService::getInstance().begin();
+    OccupancyLearner::getInstance().begin();
+    lamp.setLearner(&OccupancyLearner::getInstance());
 
-    motionSensor.begin();
+    motionSensor.setZones(SENSOR_ZONES, sizeof(SENSOR_ZONES) / sizeof(SENSOR_ZONES[0]));
+    PowerManager::getInstance().begin(ledController, motionSensor, SENSOR_OUT_PIN);
 
     xTaskCreatePinnedToCore(
         smartLampLoopTask,     // Funzione da eseguire
         "LoopTask",   // Nome della task
-        4096,         // Stack size (adattare secondo necessità)
+        LOOP_TASK_STACK, // Stack size
         NULL,         // Parametri della task
         1,            // Priorità
         NULL,         // Task handle (non necessario salvarlo)
         1             // Core su cui eseguire la task (0)
     );
-    setupHomeSpan(ledController, smartLamp, autoModeSwitch);
+    xTaskCreatePinnedToCore(sensorTask, "SensorTask", SENSOR_TASK_STACK, reinterpret_cast<void*>(0), 2, NULL, 1);
+    xTaskCreatePinnedToCore(traceWriterTask, "TraceTask", TRACE_TASK_STACK, NULL, 0, NULL, 1);
+    xTaskCreatePinnedToCore(timeTask, "TimeTask", TIME_TASK_STACK, NULL, 1, NULL, 0);
+    xTaskCreatePinnedToCore(logTask, "LogTask", LOG_TASK_STACK, NULL, 0, NULL, 1);
+    new SpanUserCommand('C', "<s> - calibrazione dei gate del radar a stanza vuota", calibrateCommand);
+    setupHomeSpan(ledController, smartLamp, autoModeSwitch, saved);
+    // Da qui in poi solo memoria statica: le new a regime compaiono nel dump delle metriche
+    Metrics::sealHeap();
+#endif
 }
 
 